@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <monkey/mk_lib.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Embedded mode: the server runs on the application thread, its loop is
+ * polled together with the application descriptors (stdin here).
+ */
+
+void cb_main(mk_request_t *request, void *data)
+{
+    char *buf = "served from the application loop\n";
+    int len = 33;
+    (void) data;
+
+    mk_http_status(request, 200);
+    mk_http_send(request, buf, len, NULL);
+}
+
+int main()
+{
+    int vid;
+    int ret;
+    char line[256];
+    struct pollfd fds[2];
+    mk_ctx_t *ctx;
+
+    ctx = mk_create();
+    mk_config_set(ctx,
+                  "Listen", "2020",
+                  NULL);
+
+    vid = mk_vhost_create(ctx, NULL);
+    mk_vhost_handler(ctx, vid, "/test", cb_main, NULL);
+
+    if (mk_start_embedded(ctx) != 0) {
+        return 1;
+    }
+
+    fds[0].fd = mk_loop_fd(ctx);
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+
+    printf("press enter to quit\n");
+    while (1) {
+        ret = poll(fds, 2, -1);
+        if (ret <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            mk_run_once(ctx, 0);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if (read(STDIN_FILENO, line, sizeof(line)) >= 0) {
+                break;
+            }
+        }
+    }
+
+    mk_stop(ctx);
+
+    return 0;
+}
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 void cb_worker(void *data)
@@ -22,6 +23,30 @@ void cb_main(mk_request_t *request, void *data)
     mk_http_send(request, buf, len, NULL);
 }
 
+/* Replies with the name of the rule that routed the request */
+void cb_rule(mk_request_t *request, void *data)
+{
+    char *buf = data;
+
+    mk_http_status(request, 200);
+    mk_http_send(request, buf, strlen(buf), NULL);
+}
+
+/* Runs on a dthread, the worker serves other clients while it sleeps */
+void cb_sleep(mk_request_t *request, void *data)
+{
+    char *buf = "slept 100ms\n";
+    int len = 12;
+    (void) data;
+
+    if (mk_http_thread_sleep(request, 100) != 0) {
+        return;
+    }
+
+    mk_http_status(request, 200);
+    mk_http_send(request, buf, len, NULL);
+}
+
 int main()
 {
     int vid;
@@ -30,6 +55,7 @@ int main()
     ctx = mk_create();
     mk_config_set(ctx,
                   "Listen", "2020",
+                  "MetricsPath", "/metrics",
                   NULL);
 
     vid = mk_vhost_create(ctx, NULL);
@@ -37,6 +63,23 @@ int main()
                  "Name", "monotop",
                  NULL);
     mk_vhost_handler(ctx, vid, "/test", cb_main, NULL);
+    mk_vhost_handler_thread(ctx, vid, "/sleep", cb_sleep, NULL);
+
+    /* Routing rules for qa/vhost_match_01.htt, the first match wins */
+    mk_vhost_handler(ctx, vid, "^/rules/[0-9]+$", cb_rule,
+                     "rule: regex\n");
+    mk_vhost_handler(ctx, vid, "^/rules/.*", cb_rule,
+                     "rule: prefix\n");
+    mk_vhost_handler(ctx, vid, "\\.txt$", cb_rule,
+                     "rule: suffix\n");
+    mk_vhost_handler(ctx, vid, "/files/.*\\.dat", cb_rule,
+                     "rule: substring\n");
+    mk_vhost_handler(ctx, vid, "^/any/[a-z]+\\.bin$", cb_rule,
+                     "rule: regex-last\n");
+
+    mk_vhost_static(ctx, vid, "/health", 200, "OK\n", 3,
+                    "Content-Type", "text/plain",
+                    NULL);
 
     mk_worker_callback(ctx,
                        cb_worker,
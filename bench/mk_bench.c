@@ -0,0 +1,569 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * mk-bench: starts an in-process Monkey server through the library
+ * interface (mk_lib.h) using a generated configuration, then runs the
+ * selected workloads against it. Every scenario prints one JSON object
+ * per line on stdout so results can be stored and compared across runs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <monkey/mk_lib.h>
+
+#include "mk_bench.h"
+
+#define BENCH_LIB_BODY_SIZE  128
+#define BENCH_SHARED_SIZE    (64 * 1024)
+
+static char bench_dir[] = "/tmp/mk_bench.XXXXXX";
+static char bench_lib_body[BENCH_LIB_BODY_SIZE];
+static char bench_shared_body[BENCH_SHARED_SIZE];
+static mk_buffer_t *bench_shared;
+static FILE *bench_out;
+
+static struct mk_bench_scenario bench_scenarios[] = {
+    /* name       uri            host         ka  pipe status tls */
+    {"small",    "/small.html",  "127.0.0.1",  1,  1,  200,  0},
+    {"large",    "/large.bin",   "127.0.0.1",  1,  1,  200,  0},
+    {"close",    "/small.html",  "127.0.0.1",  0,  1,  200,  0},
+    {"pipeline", "/small.html",  "127.0.0.1",  1,  16, 200,  0},
+    {"notfound", "/missing",     "127.0.0.1",  1,  1,  404,  0},
+    {"lib",      "/bench/lib",   "127.0.0.1",  1,  1,  200,  0},
+    {"thread",   "/bench/thread","127.0.0.1",  1,  1,  200,  0},
+    {"shared",   "/bench/shared","127.0.0.1",  1,  1,  200,  0},
+    {"static",   "/bench/static","127.0.0.1",  1,  1,  200,  0},
+    {"fastcgi",  "/bench.php",   "fcgi.bench", 1,  1,  200,  0},
+    {"tls",      "/small.html",  "127.0.0.1",  1,  1,  200,  1},
+    {"tls_close","/small.html",  "127.0.0.1",  0,  1,  200,  1},
+    {NULL, NULL, NULL, 0, 0, 0, 0}
+};
+
+static void bench_help(int rc)
+{
+    struct mk_bench_scenario *sc;
+
+    printf("Usage : mk-bench [OPTION]\n\n");
+    printf("%sAvailable Options%s\n", ANSI_BOLD, ANSI_RESET);
+    printf("  -s, --scenario=NAME\tscenario to run or 'all' (default)\n");
+    printf("  -t, --threads=N\tclient threads (default: 2)\n");
+    printf("  -c, --connections=N\tconcurrent connections (default: 64)\n");
+    printf("  -d, --duration=SEC\tmeasured seconds per scenario (default: 5)\n");
+    printf("  -W, --warmup=SEC\tseconds discarded before measuring (default: 1)\n");
+    printf("  -w, --workers=N\tserver workers (default: 1)\n");
+    printf("  -p, --port=N\t\tserver TCP port (default: 2001)\n");
+    printf("  -P, --pipeline=N\trequests per batch in 'pipeline' (default: 16)\n");
+    printf("  -H, --handshake-threads=N\tTLS HandshakeThreads (default: 0)\n");
+    printf("  -o, --output=FILE\twrite results to FILE (default: stdout)\n");
+    printf("  -h, --help\t\tprint this help\n\n");
+
+    printf("%sScenarios%s\n ", ANSI_BOLD, ANSI_RESET);
+    for (sc = bench_scenarios; sc->name; sc++) {
+#ifndef MK_BENCH_TLS
+        if (sc->tls) {
+            continue;
+        }
+#endif
+        printf(" %s", sc->name);
+    }
+    printf("\n\n");
+    exit(rc);
+}
+
+static int bench_write_file(char *name, const char *fmt, ...)
+{
+    FILE *f;
+    char path[1024];
+    va_list va;
+
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, name);
+    f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    va_start(va, fmt);
+    vfprintf(f, fmt, va);
+    va_end(va);
+    fclose(f);
+
+    return 0;
+}
+
+static int bench_write_blob(char *name, size_t size, int c)
+{
+    FILE *f;
+    char *buf;
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, name);
+    f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    buf = malloc(size);
+    if (!buf) {
+        fclose(f);
+        return -1;
+    }
+    memset(buf, c, size);
+    fwrite(buf, 1, size, f);
+    free(buf);
+    fclose(f);
+
+    return 0;
+}
+
+static int bench_mkdir(char *name)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, name);
+    if (mkdir(path, 0755) == -1) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Append 'Load' entries for the dynamic plugins found in the build tree */
+static void bench_plugins_load(char *buf, size_t size)
+{
+    int i;
+    size_t len;
+    char path[1024];
+    static const char *plugins[] = {"fastcgi", "tls", NULL};
+
+    len = snprintf(buf, size, "[PLUGINS]\n");
+    for (i = 0; plugins[i]; i++) {
+        snprintf(path, sizeof(path), "%s/plugins/%s/monkey-%s.so",
+                 MK_BENCH_BUILD_DIR, plugins[i], plugins[i]);
+        if (access(path, R_OK) != 0) {
+            continue;
+        }
+        len += snprintf(buf + len, size - len, "    Load %s\n", path);
+    }
+}
+
+/* Generate the document root and configuration directory */
+static int bench_setup_tree(struct mk_bench_options *opt, int fcgi_port)
+{
+    int ret = 0;
+    char listen[128];
+    char plugins[4096];
+
+    if (!mkdtemp(bench_dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    ret |= bench_mkdir("www");
+    ret |= bench_mkdir("sites");
+    ret |= bench_mkdir("plugins");
+    ret |= bench_mkdir("plugins/fastcgi");
+    ret |= bench_mkdir("plugins/tls");
+    if (ret != 0) {
+        return -1;
+    }
+
+    ret |= bench_write_blob("www/small.html", MK_BENCH_SMALL_SIZE, 's');
+    ret |= bench_write_blob("www/large.bin", MK_BENCH_LARGE_SIZE, 'l');
+    ret |= bench_write_blob("www/bench.php", 1, '\n');
+
+#ifdef MK_BENCH_TLS
+    snprintf(listen, sizeof(listen),
+             "    Listen 127.0.0.1:%i\n"
+             "    Listen 127.0.0.1:%i tls\n",
+             opt->port, opt->tls_port);
+#else
+    snprintf(listen, sizeof(listen),
+             "    Listen 127.0.0.1:%i\n", opt->port);
+#endif
+
+    ret |= bench_write_file("monkey.conf",
+                            "[SERVER]\n"
+                            "%s"
+                            "    Workers %i\n"
+                            "    Timeout 15\n"
+                            "    Indexfile index.html\n"
+                            "    HideVersion Off\n"
+                            "    Resume On\n"
+                            "    KeepAlive On\n"
+                            "    KeepAliveTimeout 15\n"
+                            "    MaxKeepAliveRequest 1000000\n"
+                            "    MaxRequestSize 32\n"
+                            "    SymLink Off\n"
+                            "    DefaultMimeType text/plain\n"
+                            "    FDT On\n",
+                            listen, opt->workers);
+
+    ret |= bench_write_file("monkey.mime",
+                            "[MIMETYPES]\n"
+                            "    html text/html\n"
+                            "    bin application/octet-stream\n");
+
+    /* the default site only serves the FastCGI scenario */
+    ret |= bench_write_file("sites/default",
+                            "[HOST]\n"
+                            "    ServerName fcgi.bench\n"
+                            "    DocumentRoot %s/www\n"
+                            "\n"
+                            "[HANDLERS]\n"
+                            "    Match /.*\\.php fastcgi\n",
+                            bench_dir);
+
+    bench_plugins_load(plugins, sizeof(plugins));
+    ret |= bench_write_file("plugins.load", "%s", plugins);
+
+    ret |= bench_write_file("plugins/fastcgi/fastcgi.conf",
+                            "[FASTCGI_SERVER]\n"
+                            "    ServerName stub\n"
+                            "    ServerAddr 127.0.0.1:%i\n",
+                            fcgi_port);
+
+    /* missing files: the plugin falls back to its built-in test keys */
+    ret |= bench_write_file("plugins/tls/tls.conf",
+                            "[TLS]\n"
+                            "    CertificateFile srv_cert.pem\n"
+                            "    RSAKeyFile rsa_key.pem\n"
+                            "    DHParameterFile dhparam.pem\n"
+                            "    HandshakeThreads %i\n",
+                            opt->handshake_threads);
+
+    return ret == 0 ? 0 : -1;
+}
+
+static int bench_unlink_cb(const char *path, const struct stat *st,
+                           int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+
+    return remove(path);
+}
+
+static void bench_cleanup_tree()
+{
+    nftw(bench_dir, bench_unlink_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Library handler used by the 'lib' scenario */
+static void bench_cb_lib(mk_request_t *request, void *data)
+{
+    (void) data;
+
+    mk_http_status(request, 200);
+    mk_http_send(request, bench_lib_body, sizeof(bench_lib_body), NULL);
+}
+
+/* Same response from a dthread that yields once on the worker loop */
+static void bench_cb_thread(mk_request_t *request, void *data)
+{
+    (void) data;
+
+    mk_http_thread_sleep(request, 0);
+    mk_http_status(request, 200);
+    mk_http_send(request, bench_lib_body, sizeof(bench_lib_body), NULL);
+}
+
+/* Every connection references the same buffer, no per request copies */
+static void bench_cb_shared(mk_request_t *request, void *data)
+{
+    (void) data;
+
+    mk_http_status(request, 200);
+    mk_http_send_buffer(request, bench_shared);
+}
+
+static mk_ctx_t *bench_server_start()
+{
+    int vid;
+    char path[1024];
+    mk_ctx_t *ctx;
+    struct mk_server *server;
+
+    ctx = mk_create();
+    if (!ctx) {
+        return NULL;
+    }
+    server = ctx->server;
+
+    server->path_conf_root   = mk_string_dup(bench_dir);
+    server->conf_main        = "monkey.conf";
+    server->conf_mimetype    = "monkey.mime";
+    server->conf_plugin_load = "plugins.load";
+    server->conf_sites       = "sites";
+    server->conf_plugins     = "plugins";
+
+    /* registered first, so it becomes the default virtual host */
+    snprintf(path, sizeof(path), "%s/www", bench_dir);
+    vid = mk_vhost_create(ctx, NULL);
+    mk_vhost_set(ctx, vid, "DocumentRoot", path, NULL);
+    mk_vhost_handler(ctx, vid, "/bench/lib", bench_cb_lib, NULL);
+    mk_vhost_handler_thread(ctx, vid, "/bench/thread", bench_cb_thread, NULL);
+    mk_vhost_handler(ctx, vid, "/bench/shared", bench_cb_shared, NULL);
+
+    memset(bench_lib_body, 'b', sizeof(bench_lib_body));
+    memset(bench_shared_body, 's', sizeof(bench_shared_body));
+
+    /* the 'lib' response, rendered once at registration */
+    mk_vhost_static(ctx, vid, "/bench/static", 200,
+                    bench_lib_body, sizeof(bench_lib_body), NULL);
+
+    /* lives as long as the process, the reference is never returned */
+    bench_shared = mk_buffer_create(bench_shared_body, sizeof(bench_shared_body),
+                                    NULL, NULL);
+    if (!bench_shared) {
+        return NULL;
+    }
+
+    if (mk_start(ctx) != 0) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(struct mk_bench_result *res, double p)
+{
+    size_t idx;
+
+    if (res->lat_len == 0) {
+        return 0;
+    }
+
+    idx = (size_t) (p * (res->lat_len - 1));
+    return res->lat[idx] / 1000.0;
+}
+
+static void bench_report(struct mk_bench_scenario *sc,
+                         struct mk_bench_options *opt,
+                         struct mk_bench_result *res)
+{
+    double server_cpu = 0;
+    double client_cpu = 0;
+
+    qsort(res->lat, res->lat_len, sizeof(uint64_t), bench_cmp);
+
+    if (res->requests > 0) {
+        client_cpu = (double) res->client_cpu / res->requests;
+        if (res->process_cpu > res->client_cpu) {
+            server_cpu = (double) (res->process_cpu - res->client_cpu) /
+                res->requests;
+        }
+    }
+
+    fprintf(bench_out, "{\"scenario\":\"%s\",\"threads\":%i,\"connections\":%i,"
+           "\"pipeline\":%i,\"workers\":%i,\"duration\":%i,"
+           "\"requests\":%llu,\"errors\":%llu,\"rps\":%.1f,\"bytes\":%llu,"
+           "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+           "\"max\":%.1f},"
+           "\"cpu_us_per_req\":{\"server\":%.2f,\"client\":%.2f}}\n",
+           sc->name, opt->threads, opt->connections,
+           sc->pipeline, opt->workers, opt->duration,
+           (unsigned long long) res->requests,
+           (unsigned long long) res->errors,
+           res->requests / res->elapsed,
+           (unsigned long long) res->bytes,
+           bench_percentile(res, 0.50),
+           bench_percentile(res, 0.99),
+           bench_percentile(res, 0.999),
+           bench_percentile(res, 1.0),
+           server_cpu, client_cpu);
+    fflush(bench_out);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int ret;
+    int fcgi_port = 0;
+    int ran = 0;
+    char *scenario = "all";
+    char *output = NULL;
+    mk_ctx_t *ctx;
+    struct mk_bench_scenario *sc;
+    struct mk_bench_result res;
+    struct mk_bench_options options = {
+        .threads     = 2,
+        .connections = 64,
+        .duration    = 5,
+        .warmup      = 1,
+        .pipeline    = 16,
+        .port        = 2001,
+        .workers     = 1
+    };
+
+    static const struct option long_opts[] = {
+        { "scenario",    required_argument, NULL, 's' },
+        { "threads",     required_argument, NULL, 't' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "warmup",      required_argument, NULL, 'W' },
+        { "workers",     required_argument, NULL, 'w' },
+        { "port",        required_argument, NULL, 'p' },
+        { "pipeline",    required_argument, NULL, 'P' },
+        { "handshake-threads", required_argument, NULL, 'H' },
+        { "output",      required_argument, NULL, 'o' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:t:c:d:W:w:p:P:H:o:h",
+                              long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            scenario = optarg;
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'd':
+            options.duration = atoi(optarg);
+            break;
+        case 'W':
+            options.warmup = atoi(optarg);
+            break;
+        case 'w':
+            options.workers = atoi(optarg);
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'P':
+            options.pipeline = atoi(optarg);
+            break;
+        case 'H':
+            options.handshake_threads = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            bench_help(EXIT_SUCCESS);
+            break;
+        default:
+            bench_help(EXIT_FAILURE);
+        }
+    }
+
+    if (options.threads <= 0 || options.connections <= 0 ||
+        options.duration <= 0 || options.warmup < 0 ||
+        options.workers <= 0 || options.handshake_threads < 0 ||
+        options.pipeline <= 0 || options.pipeline > MK_BENCH_MAX_PIPELINE) {
+        bench_help(EXIT_FAILURE);
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+    options.tls_port = options.port + 1;
+
+    for (sc = bench_scenarios; sc->name; sc++) {
+        if (strcmp(sc->name, "pipeline") == 0) {
+            sc->pipeline = options.pipeline;
+        }
+    }
+
+    /* The server logs to stdout, results can be kept apart */
+    bench_out = stdout;
+    if (output) {
+        bench_out = fopen(output, "w");
+        if (!bench_out) {
+            perror(output);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mk_bench_fcgi_start(&fcgi_port) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* the server may exit(3) on configuration errors, always cleanup */
+    atexit(bench_cleanup_tree);
+    if (bench_setup_tree(&options, fcgi_port) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    ctx = bench_server_start();
+    if (!ctx) {
+        fprintf(stderr, "mk-bench: could not start the server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (sc = bench_scenarios; sc->name; sc++) {
+        if (strcmp(scenario, "all") != 0 && strcmp(scenario, sc->name) != 0) {
+            continue;
+        }
+#ifndef MK_BENCH_TLS
+        if (sc->tls) {
+            if (strcmp(scenario, sc->name) == 0) {
+                fprintf(stderr, "mk-bench: built without TLS support\n");
+            }
+            continue;
+        }
+#endif
+
+        ret = mk_bench_client_run(sc, &options, &res);
+        if (ret == 0) {
+            bench_report(sc, &options, &res);
+        }
+        else {
+            fprintf(stderr, "mk-bench: scenario '%s' failed\n", sc->name);
+        }
+        mk_bench_result_free(&res);
+        ran++;
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "mk-bench: unknown scenario '%s'\n", scenario);
+    }
+
+    mk_stop(ctx);
+    mk_bench_fcgi_stop();
+    if (bench_out != stdout) {
+        fclose(bench_out);
+    }
+
+    return ran > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_BENCH_H
+#define MK_BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MK_BENCH_MAX_PIPELINE   64
+
+/* Sizes of the static files generated for the run */
+#define MK_BENCH_SMALL_SIZE     512
+#define MK_BENCH_LARGE_SIZE     (1024 * 1024)
+
+/* A workload: what is requested and what we expect back */
+struct mk_bench_scenario {
+    const char *name;
+    const char *uri;
+    const char *host;         /* Host header value                  */
+    int keepalive;            /* reuse connections                  */
+    int pipeline;             /* 1 = no pipelining                  */
+    int status;               /* expected HTTP status               */
+    int tls;                  /* connect to the TLS listener        */
+};
+
+/* Command line settings shared by all scenarios */
+struct mk_bench_options {
+    int threads;
+    int connections;
+    int duration;             /* seconds measured                   */
+    int warmup;               /* seconds discarded before measuring */
+    int pipeline;
+    int workers;              /* server worker threads              */
+    int handshake_threads;    /* TLS crypto threads, 0 = inline     */
+    int port;
+    int tls_port;
+};
+
+/* Aggregated results of a scenario run */
+struct mk_bench_result {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    double   elapsed;         /* seconds                            */
+    uint64_t client_cpu;      /* microseconds used by client threads */
+    uint64_t process_cpu;     /* microseconds used by the process    */
+
+    /* latency samples in nanoseconds */
+    uint64_t *lat;
+    size_t lat_len;
+};
+
+int mk_bench_client_run(struct mk_bench_scenario *sc,
+                        struct mk_bench_options *opt,
+                        struct mk_bench_result *res);
+void mk_bench_result_free(struct mk_bench_result *res);
+
+int mk_bench_fcgi_start(int *port);
+void mk_bench_fcgi_stop();
+
+#endif
@@ -0,0 +1,1023 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Closed loop HTTP load generator: each thread owns an epoll(7) instance
+ * and a share of the connections. A connection writes a batch of
+ * 'pipeline' requests and waits for all the responses before sending the
+ * next batch, latency is measured from the moment a request is queued
+ * (or the connection started for non keep-alive workloads) until the last
+ * byte of its response is parsed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#ifdef MK_BENCH_TLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/net.h>
+#endif
+
+#include "mk_bench.h"
+
+#define BENCH_READ_SIZE     65536
+#define BENCH_HEADER_SIZE   16384
+#define BENCH_EVENTS        256
+
+/* Connection states */
+#define CONN_CONNECTING     0
+#define CONN_HANDSHAKE      1
+#define CONN_READY          2
+
+/* Response parser states */
+#define PARSE_HEADER        0
+#define PARSE_BODY          1
+#define PARSE_BODY_EOF      2
+#define PARSE_CHUNK_SIZE    3
+#define PARSE_CHUNK_DATA    4
+#define PARSE_CHUNK_END     5
+#define PARSE_TRAILER       6
+
+struct bench_thread;
+
+struct bench_conn {
+    int fd;
+    int state;
+    struct bench_thread *th;
+
+    /* requests in flight and their start timestamps */
+    int inflight;
+    unsigned int ts_head;
+    unsigned int ts_tail;
+    uint64_t ts[MK_BENCH_MAX_PIPELINE];
+    uint64_t t_connect;
+
+    /* pending write */
+    const char *wbuf;
+    size_t wlen;
+    size_t woff;
+
+    /* response parser */
+    int pstate;
+    int status;
+    int close;
+    uint64_t remaining;
+    size_t hlen;
+    char hbuf[BENCH_HEADER_SIZE];
+
+#ifdef MK_BENCH_TLS
+    mbedtls_ssl_context ssl;
+#endif
+};
+
+struct bench_thread {
+    pthread_t tid;
+    int efd;
+    int nconn;
+    struct bench_conn *conns;
+    struct mk_bench_scenario *sc;
+    struct mk_bench_options *opt;
+    struct sockaddr_in addr;
+
+    /* batch of pipelined requests */
+    char *req;
+    size_t req_len;
+
+    /* time window, nanoseconds */
+    uint64_t t_measure;
+    uint64_t t_end;
+
+    /* results */
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t cpu_start;
+    uint64_t cpu_end;
+    uint64_t *lat;
+    size_t lat_len;
+    size_t lat_size;
+
+    char rbuf[BENCH_READ_SIZE];
+
+#ifdef MK_BENCH_TLS
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_ssl_config tls_conf;
+#endif
+};
+
+static inline uint64_t bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static inline uint64_t bench_thread_cpu()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline uint64_t bench_process_cpu()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000) +
+        ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_sleep_until(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static inline int bench_measuring(struct bench_thread *th, uint64_t now)
+{
+    return (now >= th->t_measure && now < th->t_end);
+}
+
+static void bench_error(struct bench_thread *th)
+{
+    if (bench_measuring(th, bench_now())) {
+        th->errors++;
+    }
+}
+
+static int bench_latency_add(struct bench_thread *th, uint64_t ns)
+{
+    size_t size;
+    uint64_t *tmp;
+
+    if (th->lat_len == th->lat_size) {
+        size = th->lat_size ? th->lat_size * 2 : 65536;
+        tmp = realloc(th->lat, size * sizeof(uint64_t));
+        if (!tmp) {
+            return -1;
+        }
+        th->lat = tmp;
+        th->lat_size = size;
+    }
+
+    th->lat[th->lat_len++] = ns;
+    return 0;
+}
+
+#ifdef MK_BENCH_TLS
+static int bench_tls_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    ssize_t ret;
+    struct bench_conn *conn = ctx;
+
+    ret = write(conn->fd, buf, len);
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        }
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return ret;
+}
+
+static int bench_tls_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    ssize_t ret;
+    struct bench_conn *conn = ctx;
+
+    ret = read(conn->fd, buf, len);
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        }
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return ret;
+}
+
+static int bench_tls_init(struct bench_thread *th)
+{
+    int ret;
+
+    mbedtls_entropy_init(&th->entropy);
+    mbedtls_ctr_drbg_init(&th->drbg);
+    ret = mbedtls_ctr_drbg_seed(&th->drbg, mbedtls_entropy_func,
+                                &th->entropy,
+                                (const unsigned char *) "mk-bench", 8);
+    if (ret != 0) {
+        return -1;
+    }
+
+    mbedtls_ssl_config_init(&th->tls_conf);
+    ret = mbedtls_ssl_config_defaults(&th->tls_conf,
+                                      MBEDTLS_SSL_IS_CLIENT,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* We benchmark the server, not the PKI */
+    mbedtls_ssl_conf_authmode(&th->tls_conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&th->tls_conf, mbedtls_ctr_drbg_random, &th->drbg);
+    return 0;
+}
+
+static void bench_tls_exit(struct bench_thread *th)
+{
+    mbedtls_ssl_config_free(&th->tls_conf);
+    mbedtls_ctr_drbg_free(&th->drbg);
+    mbedtls_entropy_free(&th->entropy);
+}
+#endif
+
+static ssize_t conn_read(struct bench_conn *conn, char *buf, size_t len)
+{
+    ssize_t ret;
+
+#ifdef MK_BENCH_TLS
+    if (conn->th->sc->tls) {
+        ret = mbedtls_ssl_read(&conn->ssl, (unsigned char *) buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            errno = EAGAIN;
+            return -1;
+        }
+        else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            return 0;
+        }
+        else if (ret < 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        return ret;
+    }
+#endif
+
+    ret = read(conn->fd, buf, len);
+    return ret;
+}
+
+static ssize_t conn_write(struct bench_conn *conn, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+#ifdef MK_BENCH_TLS
+    if (conn->th->sc->tls) {
+        ret = mbedtls_ssl_write(&conn->ssl, (const unsigned char *) buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            errno = EAGAIN;
+            return -1;
+        }
+        else if (ret < 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        return ret;
+    }
+#endif
+
+    ret = write(conn->fd, buf, len);
+    return ret;
+}
+
+static void conn_parser_reset(struct bench_conn *conn)
+{
+    conn->pstate = PARSE_HEADER;
+    conn->status = 0;
+    conn->close = 0;
+    conn->remaining = 0;
+    conn->hlen = 0;
+}
+
+static int conn_connect(struct bench_thread *th, struct bench_conn *conn)
+{
+    int fd;
+    int ret;
+    int on = 1;
+    struct epoll_event ev;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    conn->fd = fd;
+    conn->state = CONN_CONNECTING;
+    conn->inflight = 0;
+    conn->ts_head = 0;
+    conn->ts_tail = 0;
+    conn->wbuf = NULL;
+    conn->wlen = 0;
+    conn->woff = 0;
+    conn->t_connect = bench_now();
+    conn_parser_reset(conn);
+
+    ret = connect(fd, (struct sockaddr *) &th->addr, sizeof(th->addr));
+    if (ret == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    ret = epoll_ctl(th->efd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Close the connection and start a new one, pending requests are lost */
+static int conn_reset(struct bench_thread *th, struct bench_conn *conn)
+{
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+#ifdef MK_BENCH_TLS
+    if (th->sc->tls) {
+        mbedtls_ssl_session_reset(&conn->ssl);
+    }
+#endif
+
+    if (bench_now() >= th->t_end) {
+        return 0;
+    }
+    return conn_connect(th, conn);
+}
+
+static int conn_flush(struct bench_conn *conn)
+{
+    ssize_t ret;
+
+    while (conn->woff < conn->wlen) {
+        ret = conn_write(conn, conn->wbuf + conn->woff,
+                         conn->wlen - conn->woff);
+        if (ret == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            return -1;
+        }
+        conn->woff += ret;
+    }
+
+    return 0;
+}
+
+/* Queue a new batch of requests */
+static int conn_send(struct bench_thread *th, struct bench_conn *conn)
+{
+    int i;
+    uint64_t now;
+
+    now = bench_now();
+    if (now >= th->t_end) {
+        return 0;
+    }
+
+    for (i = 0; i < th->sc->pipeline; i++) {
+        conn->ts[conn->ts_head++ % MK_BENCH_MAX_PIPELINE] =
+            th->sc->keepalive ? now : conn->t_connect;
+    }
+    conn->inflight = th->sc->pipeline;
+    conn->wbuf = th->req;
+    conn->wlen = th->req_len;
+    conn->woff = 0;
+
+    return conn_flush(conn);
+}
+
+/*
+ * A full response was parsed. Returns 1 if the connection was recycled
+ * (the caller must stop using the current read buffer), 0 to continue or
+ * -1 on error.
+ */
+static int conn_response(struct bench_thread *th, struct bench_conn *conn)
+{
+    int recycle;
+    uint64_t now;
+    uint64_t start;
+
+    now = bench_now();
+    start = conn->ts[conn->ts_tail++ % MK_BENCH_MAX_PIPELINE];
+    conn->inflight--;
+
+    if (bench_measuring(th, now)) {
+        th->requests++;
+        if (conn->status != th->sc->status) {
+            th->errors++;
+        }
+        if (bench_latency_add(th, now - start) == -1) {
+            return -1;
+        }
+    }
+
+    recycle = (conn->close || !th->sc->keepalive);
+    conn_parser_reset(conn);
+
+    if (recycle) {
+        if (conn_reset(th, conn) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (conn->inflight == 0) {
+        if (conn_send(th, conn) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Case insensitive lookup of a token in a header line value */
+static int header_has(char *line, char *end, const char *token)
+{
+    int ret;
+    char *lf;
+
+    lf = memchr(line, '\n', end - line);
+    if (!lf) {
+        return 0;
+    }
+
+    *lf = '\0';
+    ret = (strcasestr(line, token) != NULL);
+    *lf = '\n';
+
+    return ret;
+}
+
+static void conn_headers(struct bench_conn *conn)
+{
+    int chunked = 0;
+    long long clen = -1;
+    char *end;
+    char *line;
+
+    conn->status = atoi(conn->hbuf + 9);
+
+    end = conn->hbuf + conn->hlen;
+    line = memchr(conn->hbuf, '\n', conn->hlen);
+    while (line && ++line < end) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            clen = strtoll(line + 15, NULL, 10);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = header_has(line, end, "chunked");
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            conn->close = header_has(line, end, "close");
+        }
+        line = memchr(line, '\n', end - line);
+    }
+
+    if (conn->status == 204 || conn->status == 304 ||
+        (conn->status >= 100 && conn->status < 200)) {
+        conn->pstate = PARSE_BODY;
+        conn->remaining = 0;
+    }
+    else if (chunked) {
+        conn->pstate = PARSE_CHUNK_SIZE;
+        conn->hlen = 0;
+    }
+    else if (clen >= 0) {
+        conn->pstate = PARSE_BODY;
+        conn->remaining = clen;
+    }
+    else {
+        conn->pstate = PARSE_BODY_EOF;
+        conn->close = 1;
+    }
+}
+
+/*
+ * Read a line into the header buffer, used for chunk sizes and
+ * trailers. Returns the bytes consumed, the line is complete when the
+ * buffer ends with a line feed.
+ */
+static size_t conn_line(struct bench_conn *conn, char *buf, size_t len,
+                        int *complete)
+{
+    char *lf;
+    size_t n;
+
+    lf = memchr(buf, '\n', len);
+    n = lf ? (size_t) (lf - buf) + 1 : len;
+    if (conn->hlen + n >= sizeof(conn->hbuf)) {
+        n = sizeof(conn->hbuf) - conn->hlen - 1;
+    }
+    memcpy(conn->hbuf + conn->hlen, buf, n);
+    conn->hlen += n;
+    conn->hbuf[conn->hlen] = '\0';
+    *complete = (lf != NULL);
+
+    return n;
+}
+
+/* Feed received bytes to the parser */
+static int conn_parse(struct bench_thread *th, struct bench_conn *conn,
+                      char *buf, size_t len)
+{
+    int ret;
+    int complete;
+    size_t n;
+    size_t old;
+    char *p;
+
+    while (len > 0) {
+        switch (conn->pstate) {
+        case PARSE_HEADER:
+            old = conn->hlen;
+            n = len;
+            if (conn->hlen + n >= sizeof(conn->hbuf)) {
+                n = sizeof(conn->hbuf) - conn->hlen - 1;
+                if (n == 0) {
+                    return -1;
+                }
+            }
+            memcpy(conn->hbuf + conn->hlen, buf, n);
+            conn->hlen += n;
+            conn->hbuf[conn->hlen] = '\0';
+
+            p = memmem(conn->hbuf + (old > 3 ? old - 3 : 0),
+                       conn->hlen - (old > 3 ? old - 3 : 0), "\r\n\r\n", 4);
+            if (!p) {
+                buf += n;
+                len -= n;
+                break;
+            }
+
+            /* Only consume up to the end of the headers */
+            n = (p + 4 - conn->hbuf) - old;
+            conn->hlen = (p + 4) - conn->hbuf;
+            buf += n;
+            len -= n;
+
+            if (strncmp(conn->hbuf, "HTTP/1.", 7) != 0) {
+                return -1;
+            }
+            conn_headers(conn);
+            if (conn->pstate == PARSE_BODY && conn->remaining == 0) {
+                ret = conn_response(th, conn);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+            break;
+        case PARSE_BODY:
+            n = (len < conn->remaining) ? len : conn->remaining;
+            conn->remaining -= n;
+            buf += n;
+            len -= n;
+            if (conn->remaining == 0) {
+                ret = conn_response(th, conn);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+            break;
+        case PARSE_BODY_EOF:
+            /* Everything until the connection is closed */
+            return 0;
+        case PARSE_CHUNK_SIZE:
+            n = conn_line(conn, buf, len, &complete);
+            buf += n;
+            len -= n;
+            if (!complete) {
+                break;
+            }
+            conn->remaining = strtoull(conn->hbuf, NULL, 16);
+            conn->hlen = 0;
+            conn->pstate = conn->remaining ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+            break;
+        case PARSE_CHUNK_DATA:
+            n = (len < conn->remaining) ? len : conn->remaining;
+            conn->remaining -= n;
+            buf += n;
+            len -= n;
+            if (conn->remaining == 0) {
+                conn->pstate = PARSE_CHUNK_END;
+            }
+            break;
+        case PARSE_CHUNK_END:
+        case PARSE_TRAILER:
+            n = conn_line(conn, buf, len, &complete);
+            buf += n;
+            len -= n;
+            if (!complete) {
+                break;
+            }
+            if (conn->pstate == PARSE_CHUNK_END) {
+                conn->hlen = 0;
+                conn->pstate = PARSE_CHUNK_SIZE;
+                break;
+            }
+            /* an empty line ends the trailer */
+            if (conn->hlen <= 2) {
+                ret = conn_response(th, conn);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+            else {
+                conn->hlen = 0;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* The peer closed the connection */
+static int conn_eof(struct bench_thread *th, struct bench_conn *conn)
+{
+    int ret;
+
+    if (conn->pstate == PARSE_BODY_EOF && conn->inflight > 0) {
+        ret = conn_response(th, conn);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    else if (conn->inflight > 0) {
+        bench_error(th);
+    }
+
+    return conn_reset(th, conn);
+}
+
+static int conn_event(struct bench_thread *th, struct bench_conn *conn)
+{
+    int ret;
+    int err;
+    socklen_t len;
+    ssize_t bytes;
+
+    if (conn->state == CONN_CONNECTING) {
+        err = 0;
+        len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == EINPROGRESS) {
+            return 0;
+        }
+        else if (err != 0) {
+            bench_error(th);
+            return conn_reset(th, conn);
+        }
+
+        if (th->sc->tls) {
+            conn->state = CONN_HANDSHAKE;
+        }
+        else {
+            conn->state = CONN_READY;
+            if (conn_send(th, conn) == -1) {
+                bench_error(th);
+                return conn_reset(th, conn);
+            }
+        }
+    }
+
+#ifdef MK_BENCH_TLS
+    if (conn->state == CONN_HANDSHAKE) {
+        ret = mbedtls_ssl_handshake(&conn->ssl);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return 0;
+        }
+        else if (ret != 0) {
+            bench_error(th);
+            return conn_reset(th, conn);
+        }
+
+        conn->state = CONN_READY;
+        if (conn_send(th, conn) == -1) {
+            bench_error(th);
+            return conn_reset(th, conn);
+        }
+    }
+#endif
+
+    if (conn_flush(conn) == -1) {
+        bench_error(th);
+        return conn_reset(th, conn);
+    }
+
+    while (1) {
+        bytes = conn_read(conn, th->rbuf, sizeof(th->rbuf));
+        if (bytes == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            if (conn->inflight > 0) {
+                bench_error(th);
+            }
+            return conn_reset(th, conn);
+        }
+        else if (bytes == 0) {
+            return conn_eof(th, conn);
+        }
+
+        if (bench_measuring(th, bench_now())) {
+            th->bytes += bytes;
+        }
+
+        ret = conn_parse(th, conn, th->rbuf, bytes);
+        if (ret == -1) {
+            bench_error(th);
+            return conn_reset(th, conn);
+        }
+        else if (ret == 1) {
+            /* recycled, the new socket will report its own events */
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static void *bench_thread_loop(void *data)
+{
+    int i;
+    int n;
+    uint64_t now;
+    struct epoll_event events[BENCH_EVENTS];
+    struct bench_thread *th = data;
+    struct bench_conn *conn;
+
+    for (i = 0; i < th->nconn; i++) {
+        conn = &th->conns[i];
+        conn->th = th;
+        conn->fd = -1;
+#ifdef MK_BENCH_TLS
+        if (th->sc->tls) {
+            mbedtls_ssl_init(&conn->ssl);
+            mbedtls_ssl_setup(&conn->ssl, &th->tls_conf);
+            mbedtls_ssl_set_bio(&conn->ssl, conn,
+                                bench_tls_send, bench_tls_recv, NULL);
+        }
+#endif
+        if (conn_connect(th, conn) == -1) {
+            th->errors++;
+        }
+    }
+
+    while (1) {
+        now = bench_now();
+        if (th->cpu_start == 0 && now >= th->t_measure) {
+            th->cpu_start = bench_thread_cpu();
+        }
+        if (now >= th->t_end) {
+            break;
+        }
+
+        n = epoll_wait(th->efd, events, BENCH_EVENTS, 100);
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+            if (conn->fd == -1) {
+                continue;
+            }
+            if (conn_event(th, conn) == -1) {
+                th->errors++;
+            }
+        }
+    }
+    th->cpu_end = bench_thread_cpu();
+
+    for (i = 0; i < th->nconn; i++) {
+        conn = &th->conns[i];
+        if (conn->fd >= 0) {
+            close(conn->fd);
+        }
+#ifdef MK_BENCH_TLS
+        if (th->sc->tls) {
+            mbedtls_ssl_free(&conn->ssl);
+        }
+#endif
+    }
+
+    return NULL;
+}
+
+static char *bench_request(struct mk_bench_scenario *sc, size_t *len)
+{
+    int i;
+    int n;
+    char one[1024];
+    char *buf;
+
+    n = snprintf(one, sizeof(one),
+                 "GET %s HTTP/1.1\r\n"
+                 "Host: %s\r\n"
+                 "User-Agent: mk-bench\r\n"
+                 "%s"
+                 "\r\n",
+                 sc->uri, sc->host,
+                 sc->keepalive ? "" : "Connection: close\r\n");
+
+    buf = malloc(n * sc->pipeline);
+    if (!buf) {
+        return NULL;
+    }
+    for (i = 0; i < sc->pipeline; i++) {
+        memcpy(buf + (i * n), one, n);
+    }
+
+    *len = n * sc->pipeline;
+    return buf;
+}
+
+int mk_bench_client_run(struct mk_bench_scenario *sc,
+                        struct mk_bench_options *opt,
+                        struct mk_bench_result *res)
+{
+    int i;
+    int ret = 0;
+    int conns;
+    uint64_t now;
+    uint64_t t_measure;
+    uint64_t t_end;
+    uint64_t cpu_start;
+    size_t total = 0;
+    size_t req_len;
+    char *req;
+    struct bench_thread *th;
+    struct bench_thread *threads;
+
+    req = bench_request(sc, &req_len);
+    if (!req) {
+        return -1;
+    }
+
+    threads = calloc(opt->threads, sizeof(struct bench_thread));
+    if (!threads) {
+        free(req);
+        return -1;
+    }
+
+    now = bench_now();
+    t_measure = now + ((uint64_t) opt->warmup * 1000000000);
+    t_end = t_measure + ((uint64_t) opt->duration * 1000000000);
+
+    for (i = 0; i < opt->threads; i++) {
+        th = &threads[i];
+
+        /* split connections as evenly as possible */
+        conns = opt->connections / opt->threads;
+        if (i < opt->connections % opt->threads) {
+            conns++;
+        }
+        if (conns == 0) {
+            continue;
+        }
+
+        th->nconn = conns;
+        th->conns = calloc(conns, sizeof(struct bench_conn));
+        th->sc = sc;
+        th->opt = opt;
+        th->req = req;
+        th->req_len = req_len;
+        th->t_measure = t_measure;
+        th->t_end = t_end;
+        th->addr.sin_family = AF_INET;
+        th->addr.sin_port = htons(sc->tls ? opt->tls_port : opt->port);
+        th->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        th->efd = epoll_create1(EPOLL_CLOEXEC);
+        if (!th->conns || th->efd == -1) {
+            ret = -1;
+            break;
+        }
+
+#ifdef MK_BENCH_TLS
+        if (sc->tls && bench_tls_init(th) == -1) {
+            ret = -1;
+            break;
+        }
+#endif
+
+        if (pthread_create(&th->tid, NULL, bench_thread_loop, th) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    memset(res, '\0', sizeof(struct mk_bench_result));
+    res->elapsed = opt->duration;
+
+    /* CPU used by the whole process (server + client) in the window */
+    if (ret == 0) {
+        bench_sleep_until(t_measure);
+        cpu_start = bench_process_cpu();
+        bench_sleep_until(t_end);
+        res->process_cpu = bench_process_cpu() - cpu_start;
+    }
+
+    for (i = 0; i < opt->threads; i++) {
+        th = &threads[i];
+        if (th->tid) {
+            pthread_join(th->tid, NULL);
+        }
+        res->requests += th->requests;
+        res->errors += th->errors;
+        res->bytes += th->bytes;
+        if (th->cpu_start > 0) {
+            res->client_cpu += th->cpu_end - th->cpu_start;
+        }
+        total += th->lat_len;
+    }
+
+    /* Merge latency samples */
+    if (ret == 0 && total > 0) {
+        res->lat = malloc(total * sizeof(uint64_t));
+        if (!res->lat) {
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i < opt->threads; i++) {
+        th = &threads[i];
+        if (res->lat && th->lat_len > 0) {
+            memcpy(res->lat + res->lat_len, th->lat,
+                   th->lat_len * sizeof(uint64_t));
+            res->lat_len += th->lat_len;
+        }
+#ifdef MK_BENCH_TLS
+        if (sc->tls && th->nconn > 0) {
+            bench_tls_exit(th);
+        }
+#endif
+        if (th->efd > 0) {
+            close(th->efd);
+        }
+        free(th->lat);
+        free(th->conns);
+    }
+
+    free(threads);
+    free(req);
+    return ret;
+}
+
+/*
+ * The samples come from the libc allocator, release them here: callers
+ * including the Monkey headers get malloc/free mapped to jemalloc.
+ */
+void mk_bench_result_free(struct mk_bench_result *res)
+{
+    free(res->lat);
+    res->lat = NULL;
+    res->lat_len = 0;
+}
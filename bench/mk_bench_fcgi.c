@@ -0,0 +1,254 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Minimal FastCGI responder used as backend for the 'fastcgi' scenario,
+ * it answers every request with a fixed document so the numbers reflect
+ * the cost of the plugin and not the cost of an application server.
+ * Only requests without body are handled (the benchmark sends GETs).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "mk_bench.h"
+
+#define FCGI_THREADS          4
+#define FCGI_BODY_SIZE        512
+
+#define FCGI_VERSION_1        1
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST      3
+#define FCGI_PARAMS           4
+#define FCGI_STDIN            5
+#define FCGI_STDOUT           6
+
+static int fcgi_fd = -1;
+static pthread_t fcgi_tid[FCGI_THREADS];
+static char fcgi_response[1024];
+static size_t fcgi_response_len;
+
+static void fcgi_header(unsigned char *p, int type, int id, int len, int pad)
+{
+    p[0] = FCGI_VERSION_1;
+    p[1] = type;
+    p[2] = (id >> 8) & 0xff;
+    p[3] = id & 0xff;
+    p[4] = (len >> 8) & 0xff;
+    p[5] = len & 0xff;
+    p[6] = pad;
+    p[7] = 0;
+}
+
+/* Pre-compose the records sent back for every request */
+static void fcgi_response_init()
+{
+    int len;
+    int pad;
+    size_t off = 0;
+    char body[FCGI_BODY_SIZE + 64];
+    unsigned char *p = (unsigned char *) fcgi_response;
+
+    len = snprintf(body, sizeof(body),
+                   "Status: 200 OK\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "\r\n");
+    memset(body + len, 'F', FCGI_BODY_SIZE);
+    len += FCGI_BODY_SIZE;
+    pad = (8 - (len % 8)) % 8;
+
+    /* STDOUT with headers and body */
+    fcgi_header(p + off, FCGI_STDOUT, 1, len, pad);
+    off += 8;
+    memcpy(p + off, body, len);
+    off += len;
+    memset(p + off, '\0', pad);
+    off += pad;
+
+    /* empty STDOUT */
+    fcgi_header(p + off, FCGI_STDOUT, 1, 0, 0);
+    off += 8;
+
+    /* END_REQUEST: app status 0, FCGI_REQUEST_COMPLETE */
+    fcgi_header(p + off, FCGI_END_REQUEST, 1, 8, 0);
+    off += 8;
+    memset(p + off, '\0', 8);
+    off += 8;
+
+    fcgi_response_len = off;
+}
+
+/* Read records until the request is complete, returns the request id */
+static int fcgi_read_request(int fd)
+{
+    int id = 1;
+    int type;
+    size_t len = 0;
+    size_t rlen;
+    ssize_t bytes;
+    unsigned char *p;
+    unsigned char buf[16384];
+
+    while (1) {
+        bytes = read(fd, buf + len, sizeof(buf) - len);
+        if (bytes <= 0) {
+            return -1;
+        }
+        len += bytes;
+
+        /* walk complete records */
+        p = buf;
+        while (len >= 8) {
+            type = p[1];
+            rlen = 8 + ((p[4] << 8) | p[5]) + p[6];
+            if (rlen > len) {
+                break;
+            }
+
+            if (type == FCGI_BEGIN_REQUEST) {
+                id = (p[2] << 8) | p[3];
+            }
+            else if ((type == FCGI_PARAMS || type == FCGI_STDIN) &&
+                     p[4] == 0 && p[5] == 0) {
+                /* end of params or stdin: no body is expected */
+                return id;
+            }
+
+            p += rlen;
+            len -= rlen;
+        }
+
+        memmove(buf, p, len);
+        if (len == sizeof(buf)) {
+            return -1;
+        }
+    }
+}
+
+static void *fcgi_worker(void *data)
+{
+    int id;
+    int fd;
+    size_t off;
+    ssize_t bytes;
+    char out[sizeof(fcgi_response)];
+
+    (void) data;
+
+    memcpy(out, fcgi_response, fcgi_response_len);
+
+    while (1) {
+        fd = accept(fcgi_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        id = fcgi_read_request(fd);
+        if (id > 0) {
+            /* patch the request id in the three records */
+            for (off = 0; off < fcgi_response_len;
+                 off += 8 + ((out[off + 4] & 0xff) << 8) +
+                     (out[off + 5] & 0xff) + (out[off + 6] & 0xff)) {
+                out[off + 2] = (id >> 8) & 0xff;
+                out[off + 3] = id & 0xff;
+            }
+
+            off = 0;
+            while (off < fcgi_response_len) {
+                bytes = write(fd, out + off, fcgi_response_len - off);
+                if (bytes <= 0) {
+                    break;
+                }
+                off += bytes;
+            }
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/* Start the backend on a random loopback port */
+int mk_bench_fcgi_start(int *port)
+{
+    int i;
+    int on = 1;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    fcgi_response_init();
+
+    fcgi_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fcgi_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fcgi_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if (bind(fcgi_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(fcgi_fd, 1024) == -1 ||
+        getsockname(fcgi_fd, (struct sockaddr *) &addr, &len) == -1) {
+        perror("fastcgi stub");
+        close(fcgi_fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    for (i = 0; i < FCGI_THREADS; i++) {
+        if (pthread_create(&fcgi_tid[i], NULL, fcgi_worker, NULL) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void mk_bench_fcgi_stop()
+{
+    int i;
+
+    if (fcgi_fd == -1) {
+        return;
+    }
+
+    /* wake up the threads blocked in accept(2) */
+    shutdown(fcgi_fd, SHUT_RDWR);
+    for (i = 0; i < FCGI_THREADS; i++) {
+        pthread_join(fcgi_tid[i], NULL);
+    }
+    close(fcgi_fd);
+    fcgi_fd = -1;
+}
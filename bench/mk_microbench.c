@@ -0,0 +1,810 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * mk-microbench: times the hot helpers of the core one by one, out of
+ * any server context. Every benchmark is calibrated to a fixed batch
+ * duration, warmed up and then repeated; the median cost per operation
+ * and the number of allocations per operation are printed as one JSON
+ * object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_parser.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_mimetype.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_cache.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_tls.h>
+#include <monkey/mk_arena.h>
+
+#define MB_VHOSTS           16
+#define MB_IOV_ENTRIES      16
+#define MB_GMT_DATES        64
+#define MB_ARENA_ALLOCS     8
+
+/*
+ * Allocation accounting: the link step wraps the allocator entry points
+ * used by mk_mem_alloc() (see bench/CMakeLists.txt), so every allocation
+ * made by the core is seen here without touching the allocator itself.
+ */
+static uint64_t mb_allocs;
+static uint64_t mb_alloc_bytes;
+
+#ifdef MALLOC_JEMALLOC
+#define MB_ALLOCATOR "jemalloc"
+void *__real_je_malloc(size_t size);
+void *__real_je_calloc(size_t n, size_t size);
+void *__real_je_realloc(void *ptr, size_t size);
+
+void *__wrap_je_malloc(size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += size;
+    return __real_je_malloc(size);
+}
+
+void *__wrap_je_calloc(size_t n, size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += n * size;
+    return __real_je_calloc(n, size);
+}
+
+void *__wrap_je_realloc(void *ptr, size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += size;
+    return __real_je_realloc(ptr, size);
+}
+#else
+#define MB_ALLOCATOR "libc"
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    mb_allocs++;
+    mb_alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+/* A benchmark runs 'n' operations per call */
+struct mb_case {
+    const char *name;
+    void (*run) (void *data, uint64_t n);
+    void *data;
+};
+
+struct mb_options {
+    int reps;                 /* measured batches                    */
+    int warmup;               /* milliseconds discarded first        */
+    int batch;                /* target milliseconds per batch       */
+};
+
+/* Requests used by the parser benchmarks */
+struct mb_request {
+    const char *name;
+    const char *raw;
+    int len;
+    char *buf;
+};
+
+static struct mb_request mb_corpus[] = {
+    {"minimal",
+     "GET / HTTP/1.1\r\n"
+     "Host: localhost\r\n\r\n", 0, NULL},
+    {"http10",
+     "GET /index.html HTTP/1.0\r\n"
+     "Connection: keep-alive\r\n\r\n", 0, NULL},
+    {"browser",
+     "GET /static/css/main.css?v=1a2b3c HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+     "(KHTML, like Gecko) Chrome/49.0.2623.87 Safari/537.36\r\n"
+     "Accept: text/css,*/*;q=0.1\r\n"
+     "Referer: http://www.example.com/index.html\r\n"
+     "Accept-Encoding: gzip, deflate, sdch\r\n"
+     "Accept-Language: en-US,en;q=0.8,es;q=0.6\r\n"
+     "Cookie: session=7f3a9c0e21b84d55; theme=dark; tz=UTC\r\n"
+     "If-Modified-Since: Tue, 15 Nov 1994 08:12:31 GMT\r\n"
+     "Cache-Control: max-age=0\r\n\r\n", 0, NULL},
+    {"post",
+     "POST /form/submit HTTP/1.1\r\n"
+     "Host: localhost\r\n"
+     "Content-Type: application/x-www-form-urlencoded\r\n"
+     "Content-Length: 27\r\n\r\n"
+     "name=monkey&value=%2Fhttp%2", 0, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct mk_server *mb_server;
+static struct mk_channel mb_channel;
+static struct mk_http_session mb_session;
+static struct mk_http_request mb_request;
+static struct mk_event_loop *mb_evl;
+static struct mk_event mb_event;
+static int mb_pipe[2];
+static struct mk_iov *mb_iov;
+static struct mk_arena_pool mb_arena_pool;
+static char mb_iov_data[4096];
+static char mb_headers[1024];
+static int mb_headers_len;
+static char mb_gmt_buf[MB_GMT_DATES][32];
+static time_t mb_gmt_dates[MB_GMT_DATES];
+static char mb_vhost_names[MB_VHOSTS][32];
+static FILE *mb_out;
+
+/* results are folded here so the compiler can not drop the calls */
+static volatile uint64_t mb_sink;
+
+static inline uint64_t mb_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mb_help(int rc)
+{
+    printf("Usage: mk-microbench [OPTION]\n\n");
+    printf("  -b, --benchmark=NAME\trun only benchmarks starting with NAME\n");
+    printf("  -r, --reps=N\t\tmeasured repetitions (default: 15)\n");
+    printf("  -w, --warmup=MS\twarm up time per benchmark (default: 200)\n");
+    printf("  -t, --batch=MS\ttarget time per repetition (default: 20)\n");
+    printf("  -C, --cpu=N\t\tpin the process to CPU N\n");
+    printf("  -l, --list\t\tlist the available benchmarks\n");
+    printf("  -o, --output=FILE\twrite results to FILE\n");
+    printf("  -h, --help\t\tprint this help\n\n");
+    exit(rc);
+}
+
+/* HTTP request parser, one full request per operation */
+static void mb_run_parser(void *data, uint64_t n)
+{
+    int ret;
+    uint64_t i;
+    struct mb_request *r = data;
+    struct mk_http_parser p;
+
+    for (i = 0; i < n; i++) {
+        mk_http_parser_init(&p);
+        ret = mk_http_parser(&mb_request, &p, r->buf, r->len, mb_server);
+        mb_sink += ret + p.header_count;
+    }
+}
+
+/* Response headers composition for a typical static file */
+static void mb_run_header_prepare(void *data, uint64_t n)
+{
+    uint64_t i;
+    struct mk_mimetype *mime;
+    struct response_headers *sh = &mb_request.headers;
+    (void) data;
+
+    mime = mk_mimetype_lookup(mb_server, "html");
+    for (i = 0; i < n; i++) {
+        mk_header_response_reset(sh);
+        sh->status         = MK_HTTP_OK;
+        sh->content_length = 5120;
+        sh->last_modified  = mb_gmt_dates[0];
+        sh->content_type   = mime->header_type;
+        mk_header_prepare(&mb_session, &mb_request, mb_server);
+        mb_sink += sh->headers_iov.total_len;
+    }
+}
+
+/* Date formatting: the same Last-Modified value, served from the cache */
+static void mb_run_utime2gmt_hit(void *data, uint64_t n)
+{
+    uint64_t i;
+    char *buf = mb_gmt_buf[0];
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mb_sink += mk_utils_utime2gmt(&buf, mb_gmt_dates[0]);
+    }
+}
+
+/* Date formatting: more distinct dates than cache slots */
+static void mb_run_utime2gmt_miss(void *data, uint64_t n)
+{
+    uint64_t i;
+    char *buf;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        buf = mb_gmt_buf[i % MB_GMT_DATES];
+        mb_sink += mk_utils_utime2gmt(&buf, mb_gmt_dates[i % MB_GMT_DATES]);
+    }
+}
+
+static void mb_run_gmt2utime(void *data, uint64_t n)
+{
+    uint64_t i;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mb_sink += mk_utils_gmt2utime(mb_gmt_buf[i % MB_GMT_DATES]);
+    }
+}
+
+/*
+ * IOV: queue a response shaped set of buffers and consume it the way
+ * partial writes do, one operation is the full cycle.
+ */
+static void mb_run_iov(void *data, uint64_t n)
+{
+    int j;
+    uint64_t i;
+    size_t total;
+    static const int sizes[MB_IOV_ENTRIES] = {
+        17, 37, 35, 2, 29, 64, 24, 2, 256, 512, 48, 90, 11, 300, 2, 1024
+    };
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mk_iov_init(mb_iov, MB_IOV_ENTRIES, 0);
+        for (j = 0; j < MB_IOV_ENTRIES; j++) {
+            mk_iov_add(mb_iov, mb_iov_data, sizes[j], MK_FALSE);
+        }
+
+        total = mb_iov->total_len;
+        mk_iov_consume(mb_iov, 100);
+        mk_iov_consume(mb_iov, 1000);
+        mk_iov_consume(mb_iov, total - 1100);
+        mb_sink += mb_iov->iov_idx;
+    }
+}
+
+/* End of headers lookup in a request, case sensitive */
+static void mb_run_search_crlf(void *data, uint64_t n)
+{
+    uint64_t i;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mb_sink += mk_string_search_n(mb_headers, MK_CRLF MK_CRLF,
+                                      MK_STR_SENSITIVE, mb_headers_len);
+    }
+}
+
+/* Header name lookup, case insensitive */
+static void mb_run_search_header(void *data, uint64_t n)
+{
+    uint64_t i;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mb_sink += mk_string_search_n(mb_headers, "if-modified-since",
+                                      MK_STR_INSENSITIVE, mb_headers_len);
+    }
+}
+
+static void mb_run_mimetype(void *data, uint64_t n)
+{
+    uint64_t i;
+    struct mk_mimetype *mime;
+    static mk_ptr_t files[] = {
+        {"/index.html", 11},
+        {"/static/js/app.min.js", 21},
+        {"/img/logo.png", 13},
+        {"/download/archive.tar.gz", 24}
+    };
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mime = mk_mimetype_find(mb_server, &files[i & 3]);
+        mb_sink += (uintptr_t) mime;
+    }
+}
+
+/* Virtual host lookup, 'data' is the host name to match */
+static void mb_run_vhost(void *data, uint64_t n)
+{
+    uint64_t i;
+    mk_ptr_t host;
+    struct mk_vhost *vhost;
+    struct mk_vhost_alias *alias;
+
+    host.data = data;
+    host.len  = strlen(data);
+
+    for (i = 0; i < n; i++) {
+        mb_sink += mk_vhost_get(host, &vhost, &alias, mb_server);
+    }
+}
+
+static void mb_run_url_decode(void *data, uint64_t n)
+{
+    uint64_t i;
+    char *out;
+    mk_ptr_t uri = mk_ptr_init("/docs/caf%C3%A9%20menu/a%2Fb%3Fc.html");
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        out = mk_utils_url_decode(uri);
+        mb_sink += (uintptr_t) out;
+        mk_mem_free(out);
+    }
+}
+
+/*
+ * Request scoped allocations: a long real path, a redirect location and
+ * a few header rows and stream inputs, released together as the request
+ * does. With a NULL 'data' the same set goes through the heap.
+ */
+static void mb_run_arena(void *data, uint64_t n)
+{
+    int j;
+    uint64_t i;
+    void *p[MB_ARENA_ALLOCS];
+    struct mk_arena arena;
+    static const int sizes[MB_ARENA_ALLOCS] = {
+        180, 200, 40, 52, 36, 64, 64, 64
+    };
+
+    for (i = 0; i < n; i++) {
+        if (data) {
+            mk_arena_init(&arena, data);
+            for (j = 0; j < MB_ARENA_ALLOCS; j++) {
+                p[j] = mk_arena_alloc(&arena, sizes[j]);
+            }
+            mb_sink += (uintptr_t) p[j - 1];
+            mk_arena_reset(&arena);
+        }
+        else {
+            for (j = 0; j < MB_ARENA_ALLOCS; j++) {
+                p[j] = mk_mem_alloc(sizes[j]);
+            }
+            mb_sink += (uintptr_t) p[j - 1];
+            for (j = 0; j < MB_ARENA_ALLOCS; j++) {
+                mk_mem_free(p[j]);
+            }
+        }
+    }
+}
+
+/*
+ * Event loop: register a readable descriptor, wait for it and remove
+ * it again. The pipe always holds data so the wait never blocks.
+ */
+static void mb_run_event(void *data, uint64_t n)
+{
+    uint64_t i;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mk_event_add(mb_evl, mb_pipe[0], MK_EVENT_CONNECTION,
+                     MK_EVENT_READ, &mb_event);
+        mb_sink += mk_event_wait(mb_evl);
+        mk_event_del(mb_evl, &mb_event);
+    }
+}
+
+/*
+ * Dthreads: a full round trip, resume a dthread that yields right away.
+ * The spawn case creates, runs and finishes one dthread per operation.
+ */
+static void mb_thread_loop(void *data)
+{
+    (void) data;
+
+    while (1) {
+        mk_thread_yield();
+    }
+}
+
+static void mb_thread_noop(void *data)
+{
+    mb_sink += (uintptr_t) data;
+}
+
+static void mb_run_thread_switch(void *data, uint64_t n)
+{
+    uint64_t i;
+    static int id = -1;
+    (void) data;
+
+    if (id == -1) {
+        id = mk_thread_create(mb_thread_loop, NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+        mk_thread_resume(id);
+    }
+}
+
+static void mb_run_thread_spawn(void *data, uint64_t n)
+{
+    uint64_t i;
+    (void) data;
+
+    for (i = 0; i < n; i++) {
+        mk_thread_resume(mk_thread_create(mb_thread_noop, NULL));
+    }
+}
+
+static struct mb_case mb_cases[] = {
+    {"http_parser/minimal",  mb_run_parser,         &mb_corpus[0]},
+    {"http_parser/http10",   mb_run_parser,         &mb_corpus[1]},
+    {"http_parser/browser",  mb_run_parser,         &mb_corpus[2]},
+    {"http_parser/post",     mb_run_parser,         &mb_corpus[3]},
+    {"header_prepare",       mb_run_header_prepare, NULL},
+    {"utime2gmt/cached",     mb_run_utime2gmt_hit,  NULL},
+    {"utime2gmt/uncached",   mb_run_utime2gmt_miss, NULL},
+    {"gmt2utime",            mb_run_gmt2utime,      NULL},
+    {"iov/add_consume",      mb_run_iov,            NULL},
+    {"string_search/crlf",   mb_run_search_crlf,    NULL},
+    {"string_search/nocase", mb_run_search_header,  NULL},
+    {"mimetype_find",        mb_run_mimetype,       NULL},
+    {"vhost_get/first",      mb_run_vhost,          mb_vhost_names[0]},
+    {"vhost_get/last",       mb_run_vhost,          mb_vhost_names[MB_VHOSTS - 1]},
+    {"vhost_get/miss",       mb_run_vhost,          "unknown.example.com"},
+    {"url_decode",           mb_run_url_decode,     NULL},
+    {"request_alloc/arena",  mb_run_arena,          &mb_arena_pool},
+    {"request_alloc/heap",   mb_run_arena,          NULL},
+    {"event_cycle",          mb_run_event,          NULL},
+    {"thread/switch",        mb_run_thread_switch,  NULL},
+    {"thread/spawn",         mb_run_thread_spawn,   NULL},
+    {NULL, NULL, NULL}
+};
+
+static int mb_setup_vhosts()
+{
+    int i;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+
+    /* Hosts are linked directly, no configuration files involved */
+    mk_list_init(&mb_server->hosts);
+    for (i = 0; i < MB_VHOSTS; i++) {
+        host  = mk_mem_alloc_z(sizeof(struct mk_vhost));
+        alias = mk_mem_alloc_z(sizeof(struct mk_vhost_alias));
+        if (!host || !alias) {
+            return -1;
+        }
+
+        snprintf(mb_vhost_names[i], sizeof(mb_vhost_names[i]),
+                 "site%02i.example.com", i);
+        alias->name = mb_vhost_names[i];
+        alias->len  = strlen(alias->name);
+
+        mk_list_init(&host->server_names);
+        mk_list_init(&host->error_pages);
+        mk_list_init(&host->handlers);
+        mk_list_add(&alias->_head, &host->server_names);
+        mk_list_add(&host->_head, &mb_server->hosts);
+    }
+
+    return 0;
+}
+
+static int mb_setup()
+{
+    int i;
+    int ret;
+    char *p;
+    struct mb_request *r;
+
+    mb_server = mk_server_create();
+    if (!mb_server) {
+        return -1;
+    }
+
+    /* Worker context: thread keys and per thread caches */
+    MK_TLS_INIT();
+    mk_thread_keys_init();
+    mk_cache_worker_init();
+    mk_clock_sequential_init(mb_server);
+
+    /* Mime types shipped with the server */
+    mb_server->path_conf_root = MK_BENCH_BUILD_DIR "/conf";
+    mb_server->conf_mimetype  = "monkey.mime";
+    if (mk_mimetype_read_config(mb_server) != 0) {
+        return -1;
+    }
+
+    if (mb_setup_vhosts() != 0) {
+        return -1;
+    }
+
+    /* A session and request as the scheduler would prepare them */
+    mk_list_init(&mb_channel.streams);
+    mb_session.channel   = &mb_channel;
+    mb_session.close_now = MK_FALSE;
+    mk_list_init(&mb_session.request_list);
+    mk_http_request_init(&mb_session, &mb_request, mb_server);
+    mb_request.protocol       = MK_HTTP_PROTOCOL_11;
+    mb_request.connection.len = 0;
+
+    /* Parser corpus, the parser works on writable buffers */
+    for (r = mb_corpus; r->name; r++) {
+        struct mk_http_parser parser;
+
+        r->len = strlen(r->raw);
+        r->buf = mk_string_dup(r->raw);
+
+        mk_http_parser_init(&parser);
+        ret = mk_http_parser(&mb_request, &parser, r->buf, r->len, mb_server);
+        if (ret != MK_HTTP_PARSER_OK) {
+            fprintf(stderr, "mk-microbench: corpus '%s' does not parse\n",
+                    r->name);
+            return -1;
+        }
+    }
+
+    /* Distinct dates, one day apart */
+    for (i = 0; i < MB_GMT_DATES; i++) {
+        mb_gmt_dates[i] = 1456790400 + (i * 86400);
+        p = mb_gmt_buf[i];
+        mk_utils_utime2gmt(&p, mb_gmt_dates[i]);
+    }
+
+    mb_iov = mk_iov_create(MB_IOV_ENTRIES, 0);
+    if (!mb_iov) {
+        return -1;
+    }
+    memset(mb_iov_data, 'i', sizeof(mb_iov_data));
+
+    mk_arena_pool_init(&mb_arena_pool, MK_ARENA_POOL_MAX);
+
+    /* The browser request plus filler, searched end to end */
+    memset(mb_headers, 'x', sizeof(mb_headers));
+    memcpy(mb_headers, mb_corpus[2].raw, mb_corpus[2].len - 4);
+    mb_headers_len = sizeof(mb_headers) - 1;
+    memcpy(mb_headers + mb_headers_len - 4, MK_CRLF MK_CRLF, 4);
+    mb_headers[mb_headers_len] = '\0';
+
+    /* Event loop with an always readable descriptor */
+    mb_evl = mk_event_loop_create(8);
+    if (!mb_evl) {
+        return -1;
+    }
+    if (pipe(mb_pipe) != 0 || write(mb_pipe[1], "e", 1) != 1) {
+        return -1;
+    }
+    MK_EVENT_NEW(&mb_event);
+
+    return 0;
+}
+
+static int mb_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Calibrate, warm up and measure one benchmark */
+static int mb_measure(struct mb_case *c, struct mb_options *opt)
+{
+    int r;
+    uint64_t n = 1;
+    uint64_t t0;
+    uint64_t elapsed;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t batch_ns = (uint64_t) opt->batch * 1000000;
+    double *samples;
+
+    samples = mk_mem_alloc(sizeof(double) * opt->reps);
+    if (!samples) {
+        return -1;
+    }
+
+    /* Iterations needed to fill a batch */
+    while (1) {
+        t0 = mb_now();
+        c->run(c->data, n);
+        elapsed = mb_now() - t0;
+        if (elapsed >= batch_ns || n >= (1ULL << 40)) {
+            break;
+        }
+        if (elapsed < batch_ns / 16) {
+            n *= 8;
+        }
+        else {
+            n = (n * batch_ns * 11) / (elapsed * 10) + 1;
+        }
+    }
+
+    /* Warm up caches, branch predictors and the allocator */
+    t0 = mb_now();
+    while (mb_now() - t0 < (uint64_t) opt->warmup * 1000000) {
+        c->run(c->data, n);
+    }
+
+    allocs = mb_allocs;
+    bytes  = mb_alloc_bytes;
+    for (r = 0; r < opt->reps; r++) {
+        t0 = mb_now();
+        c->run(c->data, n);
+        samples[r] = (double) (mb_now() - t0) / n;
+    }
+    allocs = mb_allocs - allocs;
+    bytes  = mb_alloc_bytes - bytes;
+
+    qsort(samples, opt->reps, sizeof(double), mb_cmp);
+
+    fprintf(mb_out, "{\"benchmark\":\"%s\",\"event_backend\":\"%s\","
+            "\"allocator\":\"%s\",\"iterations\":%llu,\"reps\":%i,"
+            "\"ns_per_op\":{\"median\":%.2f,\"min\":%.2f,\"max\":%.2f},"
+            "\"allocs_per_op\":%.2f,\"alloc_bytes_per_op\":%.1f}\n",
+            c->name, mk_event_backend(), MB_ALLOCATOR,
+            (unsigned long long) n, opt->reps,
+            samples[opt->reps / 2], samples[0], samples[opt->reps - 1],
+            (double) allocs / (n * opt->reps),
+            (double) bytes / (n * opt->reps));
+    fflush(mb_out);
+
+    mk_mem_free(samples);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int cpu = -1;
+    int ran = 0;
+    int list = MK_FALSE;
+    char *filter = NULL;
+    char *output = NULL;
+    cpu_set_t set;
+    struct mb_case *c;
+    struct mb_options options = {
+        .reps   = 15,
+        .warmup = 200,
+        .batch  = 20
+    };
+
+    static const struct option long_opts[] = {
+        { "benchmark", required_argument, NULL, 'b' },
+        { "reps",      required_argument, NULL, 'r' },
+        { "warmup",    required_argument, NULL, 'w' },
+        { "batch",     required_argument, NULL, 't' },
+        { "cpu",       required_argument, NULL, 'C' },
+        { "list",      no_argument,       NULL, 'l' },
+        { "output",    required_argument, NULL, 'o' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "b:r:w:t:C:lo:h",
+                              long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            filter = optarg;
+            break;
+        case 'r':
+            options.reps = atoi(optarg);
+            break;
+        case 'w':
+            options.warmup = atoi(optarg);
+            break;
+        case 't':
+            options.batch = atoi(optarg);
+            break;
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+        case 'l':
+            list = MK_TRUE;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            mb_help(EXIT_SUCCESS);
+            break;
+        default:
+            mb_help(EXIT_FAILURE);
+        }
+    }
+
+    if (options.reps <= 0 || options.warmup < 0 || options.batch <= 0) {
+        mb_help(EXIT_FAILURE);
+    }
+
+    if (list == MK_TRUE) {
+        for (c = mb_cases; c->name; c++) {
+            printf("%s\n", c->name);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Migrations between CPUs are the main source of noise */
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mb_out = stdout;
+    if (output) {
+        mb_out = fopen(output, "w");
+        if (!mb_out) {
+            perror(output);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mb_setup() != 0) {
+        fprintf(stderr, "mk-microbench: setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (c = mb_cases; c->name; c++) {
+        if (filter && strncmp(c->name, filter, strlen(filter)) != 0) {
+            continue;
+        }
+        if (mb_measure(c, &options) != 0) {
+            fprintf(stderr, "mk-microbench: '%s' failed\n", c->name);
+        }
+        ran++;
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "mk-microbench: no benchmark matches '%s'\n", filter);
+    }
+
+    if (mb_out != stdout) {
+        fclose(mb_out);
+    }
+
+    return 0;
+}
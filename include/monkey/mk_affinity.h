@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_AFFINITY_H
+#define MK_AFFINITY_H
+
+#include <monkey/mk_config.h>
+#include <monkey/mk_scheduler.h>
+
+/* WorkerAffinity modes, any other value is a CPU list (e.g: 0-3,8) */
+#define MK_AFFINITY_OFF           "off"
+#define MK_AFFINITY_AUTO          "auto"
+
+/* Highest NUMA node id handled by the memory policy */
+#define MK_AFFINITY_MAX_NODES     64
+
+#define MK_AFFINITY_SYSFS_NODE    "/sys/devices/system/node"
+
+int mk_affinity_init(struct mk_server *server, struct mk_sched_ctx *ctx);
+int mk_affinity_worker_bind(struct mk_sched_worker *worker);
+
+#endif
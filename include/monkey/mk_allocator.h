@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_ALLOCATOR_H
+#define MK_ALLOCATOR_H
+
+#include <stddef.h>
+
+/* MemoryDecayTime not set: keep the jemalloc default */
+#define MK_ALLOCATOR_DECAY_DEFAULT   -2
+
+/* Memory used by a worker arena, in bytes */
+struct mk_allocator_stats {
+    size_t allocated;   /* requested by the application          */
+    size_t active;      /* pages backing the allocations         */
+    size_t resident;    /* active + dirty pages + arena metadata */
+    size_t fragmented;  /* active bytes not used by allocations  */
+    size_t mapped;      /* address space mapped by the arena     */
+};
+
+struct mk_server;
+struct mk_sched_worker;
+
+int mk_allocator_worker_init(struct mk_server *server,
+                             struct mk_sched_worker *worker);
+int mk_allocator_stats_refresh();
+int mk_allocator_worker_stats(struct mk_sched_worker *worker,
+                              struct mk_allocator_stats *stats);
+
+#endif
@@ -0,0 +1,101 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_ARENA_H
+#define MK_ARENA_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Request arena
+ * =============
+ * A bump allocator for memory that lives as long as a request: paths,
+ * header rows, stream inputs... Nothing is released individually, the
+ * whole arena is reset once the request is done and its chunks go back
+ * to the worker pool for the next request.
+ */
+
+/* Size of a regular chunk, bigger requests get a dedicated chunk */
+#define MK_ARENA_CHUNK_SIZE   4096
+
+/* Alignment of every allocation */
+#define MK_ARENA_ALIGN        16
+
+/* Number of idle chunks cached per worker */
+#define MK_ARENA_POOL_MAX     256
+
+struct mk_arena_chunk {
+    size_t size;                  /* usable bytes in data[]   */
+    size_t used;                  /* bytes already handed out */
+    struct mk_arena_chunk *next;
+    char data[] __attribute__ ((aligned (MK_ARENA_ALIGN)));
+};
+
+/* Per worker cache of regular chunks */
+struct mk_arena_pool {
+    int count;
+    int max;
+    struct mk_arena_chunk *chunks;
+};
+
+struct mk_arena {
+    struct mk_arena_chunk *head;  /* current chunk, others follow */
+    struct mk_arena_pool *pool;   /* optional, NULL = use the heap */
+};
+
+void mk_arena_pool_init(struct mk_arena_pool *pool, int max);
+void mk_arena_pool_destroy(struct mk_arena_pool *pool);
+
+void *mk_arena_alloc_slow(struct mk_arena *arena, size_t size);
+char *mk_arena_strndup(struct mk_arena *arena, const char *s, size_t len);
+char *mk_arena_cat(struct mk_arena *arena,
+                   const char *buf1, size_t len1,
+                   const char *buf2, size_t len2);
+char *mk_arena_printf(struct mk_arena *arena, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void mk_arena_reset(struct mk_arena *arena);
+
+static inline void mk_arena_init(struct mk_arena *arena,
+                                 struct mk_arena_pool *pool)
+{
+    arena->head = NULL;
+    arena->pool = pool;
+}
+
+static inline void *mk_arena_alloc(struct mk_arena *arena, size_t size)
+{
+    void *p;
+    struct mk_arena_chunk *c = arena->head;
+
+    size = (size + (MK_ARENA_ALIGN - 1)) & ~((size_t) MK_ARENA_ALIGN - 1);
+    if (mk_likely(c && c->size - c->used >= size)) {
+        p = c->data + c->used;
+        c->used += size;
+        return p;
+    }
+
+    return mk_arena_alloc_slow(arena, size);
+}
+
+static inline char *mk_arena_strdup(struct mk_arena *arena, const char *s)
+{
+    return mk_arena_strndup(arena, s, strlen(s));
+}
+
+#endif
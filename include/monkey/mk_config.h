@@ -64,10 +64,22 @@ struct mk_server
     short int workers;            /* number of worker threads */
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
-    int8_t fdt;                   /* is FDT enabled ? */
+    int8_t fdt;                   /* is the open file cache enabled ? */
+    int file_cache_size;          /* max cached files per worker */
+    int file_cache_valid;         /* seconds before checking a file again */
+    int file_cache_threads;       /* threads for cache misses, 0 = inline */
+    void *file_cache_pool;        /* struct mk_file_cache_pool */
+    size_t zerocopy_threshold;    /* MSG_ZEROCOPY min body size, 0 = off */
     int8_t is_daemon;
     int8_t is_seteuid;
     int8_t scheduler_mode;        /* Scheduler balancing mode */
+    int8_t reuseport_steering;    /* steer connections by receiving CPU */
+    char *workers_affinity;       /* worker CPU pinning, NULL = disabled */
+
+    /* jemalloc tuning (bundled allocator only) */
+    int8_t mem_worker_arena;      /* one allocator arena per worker */
+    int8_t mem_tcache;            /* per thread allocation cache */
+    int mem_decay_time;           /* dirty pages decay time (seconds) */
 
     /* Configuration paths (absolute paths) */
     char *path_conf_root;         /* absolute path to configuration files */
@@ -96,6 +108,16 @@ struct mk_server
     int8_t hideversion;           /* hide version of server to clients ? */
     int8_t resume;                /* Resume (on/off) */
     int8_t symlink;               /* symbolic links */
+    char *metrics_path;           /* metrics endpoint, NULL = disabled */
+
+    /* per client rate limiting */
+    int ratelimit_connections;    /* new connections per second, 0 = off */
+    int ratelimit_requests;       /* requests per second, 0 = off */
+    int ratelimit_burst;          /* seconds of tokens a client can save */
+    int ratelimit_prefix4;        /* IPv4 prefix length of a client */
+    int ratelimit_prefix6;        /* IPv6 prefix length of a client */
+    int8_t ratelimit_silent;      /* close instead of answering 429 */
+    void *ratelimit;              /* struct mk_ratelimit */
 
     /* keep alive */
     int8_t keep_alive;            /* it's a persisten connection ? */
@@ -143,6 +165,9 @@ struct mk_server
     struct mk_event_loop *lib_evl;
     int lib_ch_manager[2];
 
+    /* Lib mode: the application thread runs the only worker */
+    int lib_embedded;
+
     /* Scheduler context (struct mk_sched_ctx) */
     void *sched_ctx;
 
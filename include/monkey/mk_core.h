@@ -50,6 +50,10 @@ extern "C" {
 #include "mk_core/mk_utils.h"
 #include "mk_core/mk_unistd.h"
 
+#ifdef MK_THREADS_POSIX
+#include "mk_core/mk_thread.h"
+#endif
+
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
 }
 #endif
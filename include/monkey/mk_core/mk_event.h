@@ -119,6 +119,8 @@ int mk_event_timeout_create(struct mk_event_loop *loop,
 int mk_event_channel_create(struct mk_event_loop *loop,
                             int *r_fd, int *w_fd, void *data);
 int mk_event_wait(struct mk_event_loop *loop);
+int mk_event_wait_2(struct mk_event_loop *loop, int timeout);
+int mk_event_loop_fd(struct mk_event_loop *loop);
 int mk_event_translate(struct mk_event_loop *loop);
 char *mk_event_backend();
 struct mk_event_fdt *mk_event_get_fdt();
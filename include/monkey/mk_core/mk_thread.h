@@ -21,7 +21,7 @@
 #ifndef MK_THREAD_H
 #define MK_THREAD_H
 
-#include <mk_core/mk_pthread.h>
+#include "mk_pthread.h"
 #include "mk_thread_channel.h"
 
 #define MK_THREAD_DEAD       0
@@ -29,7 +29,7 @@
 #define MK_THREAD_RUNNING    2
 #define MK_THREAD_SUSPEND    3
 
-pthread_key_t mk_thread_scheduler;
+extern pthread_key_t mk_thread_scheduler;
 
 typedef void (*mk_thread_func)(void *data);
 
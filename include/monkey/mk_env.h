@@ -17,16 +17,10 @@
  *  limitations under the License.
  */
 
-#include <monkey/mk_info.h>
+#ifndef MK_ENV_H
+#define MK_ENV_H
 
-#ifdef MK_HAVE_C_TLS
+#define CC "/usr/bin/cc"
+#define AR "/usr/bin/ar"
 
-#ifndef MK_VHOST_TLS_H
-#define MK_VHOST_TLS_H
-
-#include <monkey/mk_core.h>
-
-__thread struct mk_list *mk_tls_vhost_fdt;
-
-#endif /* MK_VHOST_TLS_H */
-#endif /* MK_HAVE_C_TLS  */
+#endif
@@ -0,0 +1,138 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FILE_CACHE_H
+#define MK_FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Open file cache
+ * ===============
+ * Every worker keeps the stat(2) result and the open file descriptor of
+ * the recently served files. Entries survive the requests that used them
+ * so a hot file is opened once, they are revalidated against the inode,
+ * size and modification time every 'valid' seconds and the least
+ * recently used ones are closed when the cache is full.
+ *
+ * Optionally (FileCacheThreads) the lookups that miss the cache run on a
+ * small pool of threads: the request is parked, the worker keeps serving
+ * other connections and the request resumes once the result arrives.
+ */
+
+/* Default number of entries per worker */
+#define MK_FILE_CACHE_SIZE     256
+
+/* Default seconds an entry is trusted before checking it again */
+#define MK_FILE_CACHE_VALID    1
+
+/* mk_file_cache_stat(): the lookup was queued, the request is parked */
+#define MK_FILE_CACHE_PENDING  1
+
+struct mk_http_request;
+struct mk_server;
+
+struct mk_file_cache_entry {
+    unsigned int hash;
+    int fd;                       /* -1 until the file is opened      */
+    int readers;                  /* requests referencing the entry   */
+    int stale;                    /* out of the cache, last reader frees it */
+    time_t checked;               /* last validation (unix time)      */
+
+    /* Identity of the file, a change invalidates the entry */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+
+    struct file_info info;
+
+    struct mk_list _hash;         /* link to the hash bucket          */
+    struct mk_list _lru;          /* link to the LRU list             */
+
+    int len;
+    char path[];
+};
+
+/* A lookup that runs on the pool */
+struct mk_file_cache_job {
+    int done;                     /* result delivered to the worker   */
+
+    /* Result */
+    int ret;                      /* mk_file_get_info() return value  */
+    int fd;                       /* opened file, or -1               */
+    struct stat st;
+    struct file_info info;
+
+    struct mk_http_request *sr;   /* parked request, NULL if it's gone */
+    struct mk_file_cache *fc;     /* cache of the requesting worker   */
+    struct mk_list _head;         /* link to the pool or worker queue */
+
+    int len;
+    char path[];
+};
+
+/* Blocking I/O threads shared by the workers */
+struct mk_file_cache_pool {
+    int stop;
+    int threads;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;         /* pending jobs                     */
+    struct mk_server *server;
+};
+
+struct mk_file_cache {
+    int count;                    /* entries in the cache             */
+    int max;                      /* max number of entries            */
+    int valid;                    /* seconds before revalidation      */
+    unsigned int mask;            /* hash table buckets - 1           */
+    struct mk_list *table;        /* hash table                       */
+    struct mk_list lru;           /* least recently used first        */
+
+    /* Completed jobs, the pool threads wake up the worker loop */
+    struct mk_event event;
+    int ch_r;
+    int ch_w;
+    int closed;
+    pthread_mutex_t lock;
+    struct mk_list done;
+    struct mk_file_cache_pool *pool;  /* NULL = lookups are synchronous */
+};
+
+int mk_file_cache_init(struct mk_file_cache *fc, int max, int valid);
+int mk_file_cache_worker_start(struct mk_file_cache *fc,
+                               struct mk_event_loop *loop,
+                               struct mk_server *server);
+void mk_file_cache_exit(struct mk_file_cache *fc);
+
+int mk_file_cache_pool_create(struct mk_server *server);
+void mk_file_cache_pool_destroy(struct mk_server *server);
+
+int mk_file_cache_stat(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_open(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_close(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_pending(struct mk_http_request *sr);
+
+#endif
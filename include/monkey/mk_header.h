@@ -25,6 +25,8 @@
 
 #define MK_HEADER_BREAKLINE 1
 
+struct mk_vhost_static;
+
 /*
  * header response: We handle this as static global data in order
  * to save some process time when building the response header.
@@ -71,6 +73,7 @@
 #define MK_RH_CLIENT_UNSUPPORTED_MEDIA  "HTTP/1.1 415 Unsupported Media Type\r\n"
 #define MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF \
     "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+#define MK_RH_CLIENT_TOO_MANY_REQUESTS "HTTP/1.1 429 Too Many Requests\r\n"
 
 /* Server side errors */
 #define MK_RH_SERVER_INTERNAL_ERROR "HTTP/1.1 500 Internal Server Error\r\n"
@@ -105,6 +108,10 @@ extern const mk_ptr_t mk_header_last_modified;
 
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server);
+int mk_header_prepare_static(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_vhost_static *st);
+int mk_header_status_line(int status, mk_ptr_t *line);
 
 void mk_header_response_reset(struct response_headers *header);
 void mk_header_set_http_status(struct mk_http_request *sr, int status);
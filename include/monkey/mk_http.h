@@ -28,6 +28,10 @@
 
 /* Request buffer chunks = 4KB */
 #define MK_REQUEST_CHUNK (int) 4096
+
+/* Idle session buffers kept by each worker */
+#define MK_HTTP_SESSION_POOL_MAX  256
+
 #define MK_REQUEST_DEFAULT_PAGE  "<HTML><HEAD><STYLE type=\"text/css\"> body {font-size: 12px;} </STYLE></HEAD><BODY><H1>%s</H1>%s<BR><HR><ADDRESS>Powered by %s</ADDRESS></BODY></HTML>"
 
 /* Hard coded restrictions */
@@ -95,6 +99,38 @@ extern const mk_ptr_t mk_http_protocol_10_p;
 extern const mk_ptr_t mk_http_protocol_11_p;
 extern const mk_ptr_t mk_http_protocol_null_p;
 
+/*
+ * Session state only needed while a request is in progress: the initial
+ * body buffer, the request and the parser. A session takes one from the
+ * worker pool when data arrives and gives it back when the connection
+ * goes idle waiting for the next keep-alive request.
+ */
+struct mk_http_session_buf
+{
+    /* Initial fixed size buffer for small requests */
+    char body_fixed[MK_REQUEST_CHUNK];
+
+    /*
+     * FIXME: in previous versions of Monkey we used to parse the complete request
+     * for pipelined requests and generate a linked lists of request. With the new
+     * parser we are taking the approach to parse one request and process it before
+     * parsing others, from that point of view we should not need a linked list
+     * of requests.
+     *
+     * Still testing...
+     */
+    struct mk_http_request sr_fixed;
+
+    /*
+     * Parser context: we only held one parser per connection
+     * which is re-used everytime we have a new request.
+     */
+    struct mk_http_parser parser;
+
+    /* Link to the worker pool */
+    struct mk_list _head;
+};
+
 /*
  * A HTTP session represents an incoming session
  * from a client, a session can be used for pipelined or
@@ -131,28 +167,14 @@ struct mk_http_session
     /* creation time for this HTTP session */
     time_t init_time;
 
-    /* request body buffer */
+    /* request body buffer, NULL while idle */
     char *body;
 
-    /* Initial fixed size buffer for small requests */
-    char body_fixed[MK_REQUEST_CHUNK];
-
-    /*
-     * FIXME: in previous versions of Monkey we used to parse the complete request
-     * for pipelined requests and generate a linked lists of request. With the new
-     * parser we are taking the approach to parse one request and process it before
-     * parsing others, from that point of view we should not need a linked list
-     * of requests.
-     *
-     * Still testing...
-     */
-    struct mk_http_request sr_fixed;
-
-    /*
-     * Parser context: we only held one parser per connection
-     * which is re-used everytime we have a new request.
-     */
-    struct mk_http_parser parser;
+    /* Active state, they point inside 'buf' (NULL while idle) */
+    char *body_fixed;
+    struct mk_http_request *sr_fixed;
+    struct mk_http_parser *parser;
+    struct mk_http_session_buf *buf;
 };
 
 static inline int mk_http_status_completed(struct mk_http_session *cs,
@@ -193,6 +215,15 @@ int mk_http_send_file(struct mk_http_session *cs, struct mk_http_request *sr);
 /* http session */
 int mk_http_session_init(struct mk_http_session *cs,
                          struct mk_sched_conn *conn);
+void mk_http_request_resume(struct mk_http_request *sr,
+                            struct mk_server *server);
+void mk_http_request_defer(struct mk_http_request *sr);
+void mk_http_request_complete(struct mk_http_session *cs,
+                              struct mk_http_request *sr,
+                              struct mk_server *server);
+int mk_http_session_wake(struct mk_http_session *cs);
+void mk_http_session_idle(struct mk_http_session *cs);
+void mk_http_session_pool_exit(struct mk_sched_worker *worker);
 void mk_http_session_remove(struct mk_http_session *cs,
                             struct mk_server *server);
 
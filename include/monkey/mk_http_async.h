@@ -0,0 +1,88 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_ASYNC_H
+#define MK_HTTP_ASYNC_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Deferred library responses
+ * ==========================
+ * A library handler calls mk_http_defer() and returns, the request stays
+ * pending. Any thread completes it later posting the status, headers and
+ * body chunks through the handle and finally mk_http_async_done().
+ *
+ * Every post is a message pushed to a lock-free queue (multiple producers,
+ * the worker as the only consumer) owned by the worker of the connection.
+ * The first message of a batch wakes up the worker through its channel,
+ * the worker drains the queue, applies the messages to the request and
+ * flushes the response once 'done' arrives.
+ *
+ * The handle belongs to the application until mk_http_async_done(). If the
+ * client goes away first the worker drops the messages, the posts return
+ * -1 as a hint and the handle is released when 'done' arrives.
+ */
+
+#define MK_HTTP_ASYNC_STATUS   0
+#define MK_HTTP_ASYNC_HEADER   1
+#define MK_HTTP_ASYNC_BODY     2
+#define MK_HTTP_ASYNC_DONE     3
+
+struct mk_server;
+struct mk_sched_worker;
+struct mk_http_session;
+struct mk_http_request;
+struct mk_http_async_queue;
+
+struct mk_http_async_msg {
+    struct mk_http_async_msg *next;  /* queue link, keep it first      */
+    struct mk_http_async *async;
+    int type;
+    int status;
+    size_t key_len;                  /* header: key is data[0..key_len] */
+    size_t len;                      /* total bytes in data            */
+    char data[];
+};
+
+struct mk_http_async {
+    int cancelled;                   /* atomic, the client went away   */
+    struct mk_http_session *session;
+    struct mk_http_request *request; /* NULL once cancelled            */
+    struct mk_http_async_queue *queue;
+};
+
+struct mk_http_async_queue {
+    struct mk_event event;
+    int ch_r;
+    int ch_w;
+    int signaled;                    /* atomic, a wake up is pending   */
+    int count;                       /* handles not done yet           */
+
+    struct mk_server *server;
+
+    struct mk_http_async_msg *head;  /* producers push here            */
+    struct mk_http_async_msg *tail;  /* the worker pops from here      */
+    struct mk_http_async_msg stub;   /* last, it has a flexible array  */
+};
+
+void mk_http_async_cancel(struct mk_http_async *as);
+void mk_http_async_worker_exit(struct mk_sched_worker *sched);
+
+#endif
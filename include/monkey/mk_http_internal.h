@@ -21,6 +21,7 @@
 #define MK_HTTP_INTERNAL_H
 
 #include <monkey/mk_stream.h>
+#include <monkey/mk_file_cache.h>
 
 #define MK_HEADER_IOV         32
 #define MK_HEADER_ETAG_SIZE   32
@@ -160,14 +161,26 @@ struct mk_http_request
      */
     void *stage30_handler;
 
+    /*
+     * Set when the stage30 handler returned MK_PLUGIN_RET_CONTINUE: the
+     * plugin keeps feeding the channel from its own events and it ends
+     * the request through http_request_end(). The core must not end it
+     * just because the channel got drained.
+     */
+    int stage30_async;
+
+    /* Arrival time in microseconds for metrics, zero if disabled */
+    uint64_t metrics_start;
+
     /* Static file information */
     int file_fd;
     struct file_info file_info;
 
-    /* Vhost */
-    int vhost_fdt_id;
-    unsigned int vhost_fdt_hash;
-    int vhost_fdt_enabled;
+    /* Open file cache entry, NULL if the file is not cached */
+    struct mk_file_cache_entry *file_cache;
+
+    /* Lookup running on the file cache pool, the request is parked */
+    struct mk_file_cache_job *file_job;
 
     struct mk_vhost   *host_conf;      /* root vhost config */
     struct mk_vhost_alias *host_alias; /* specific vhost matched */
@@ -178,6 +191,19 @@ struct mk_http_request
      */
     void *handler_data;
 
+    /* Library handler running on a dthread (mk_http_thread.h) */
+    struct mk_http_thread *http_thread;
+
+    /* Deferred library response (mk_http_async.h) */
+    struct mk_http_async *http_async;
+
+    /*
+     * Request scoped memory: long real paths, the redirect location,
+     * extra header rows and dynamic stream inputs. It's reset when the
+     * request is released.
+     */
+    struct mk_arena arena;
+
     /* Parent Session */
     struct mk_http_session *session;
 
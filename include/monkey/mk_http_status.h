@@ -69,6 +69,7 @@
 #define MK_CLIENT_REQUEST_URI_TOO_LONG		414
 #define MK_CLIENT_UNSUPPORTED_MEDIA		415
 #define MK_CLIENT_REQUESTED_RANGE_NOT_SATISF    416
+#define MK_CLIENT_TOO_MANY_REQUESTS		429
 
 /* Server Errors */
 #define MK_SERVER_INTERNAL_ERROR		500
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_THREAD_H
+#define MK_HTTP_THREAD_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Library handlers on a dthread
+ * =============================
+ * A handler registered through mk_vhost_handler_thread() runs on a
+ * dthread (mk_thread) of the worker that owns the connection. When the
+ * handler waits for a backend socket or a timer the dthread is parked on
+ * the worker event loop, the worker keeps serving other connections and
+ * the handler continues once the event arrives. The response is flushed
+ * when the handler returns.
+ *
+ * If the client goes away while the handler is parked, the pending wait
+ * returns -1 (errno ECANCELED) and so does any further wait, the handler
+ * is expected to release its resources and return.
+ *
+ * Nothing on the dthread may block the worker: backends are connected by
+ * numeric address only, no DNS lookups are done.
+ */
+
+struct mk_server;
+struct mk_sched_worker;
+struct mk_http_session;
+struct mk_http_request;
+struct mk_vhost_handler;
+
+struct mk_http_thread {
+    /* must be the first field, released through mk_sched_event_free() */
+    struct mk_event event;
+
+    int id;                          /* dthread id                     */
+    int parked;                      /* waiting for an event           */
+    int cancelled;                   /* the session went away          */
+
+    struct mk_vhost_handler *handler;
+    struct mk_http_session *session;
+    struct mk_http_request *request;
+    struct mk_server *server;
+};
+
+int mk_http_thread_start(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_vhost_handler *handler,
+                         struct mk_server *server);
+void mk_http_thread_cancel(struct mk_http_thread *th);
+void mk_http_thread_worker_exit(struct mk_sched_worker *sched);
+
+#endif
@@ -36,10 +36,18 @@ struct mk_lib_ctx {
 typedef struct mk_lib_ctx mk_ctx_t;
 typedef struct mk_http_request mk_request_t;
 typedef struct mk_http_session mk_session_t;
+typedef struct mk_http_async mk_async_t;
+typedef struct mk_stream_buffer mk_buffer_t;
 
 MK_EXPORT int mk_start(mk_ctx_t *ctx);
 MK_EXPORT int mk_stop(mk_ctx_t *ctx);
 
+/* Embedded mode: the application thread runs the server */
+MK_EXPORT int mk_start_embedded(mk_ctx_t *ctx);
+MK_EXPORT int mk_run_once(mk_ctx_t *ctx, int timeout);
+MK_EXPORT struct mk_event_loop *mk_loop_get(mk_ctx_t *ctx);
+MK_EXPORT int mk_loop_fd(mk_ctx_t *ctx);
+
 MK_EXPORT mk_ctx_t *mk_create();
 MK_EXPORT int mk_destroy(mk_ctx_t *ctx);
 
@@ -49,14 +57,67 @@ MK_EXPORT int mk_vhost_create(mk_ctx_t *ctx, char *name);
 MK_EXPORT int mk_vhost_set(mk_ctx_t *ctx, int vid, ...);
 MK_EXPORT int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
                                void (*cb)(mk_request_t *, void *), void *data);
+MK_EXPORT int mk_vhost_handler_thread(mk_ctx_t *ctx, int vid, char *regex,
+                                      void (*cb)(mk_request_t *, void *),
+                                      void *data);
+MK_EXPORT int mk_vhost_static(mk_ctx_t *ctx, int vid, char *path, int status,
+                              char *body, size_t len, ...);
 
 MK_EXPORT int mk_http_status(mk_request_t *req, int status);
 MK_EXPORT int mk_http_header(mk_request_t *req,
                              char *key, int key_len,
                              char *val, int val_len);
+
+/*
+ * The buffer is not copied, cb_finish (optional) tells when it was written.
+ * If the client goes away before that it's not invoked, data whose life
+ * time matters should be sent as a shared buffer instead.
+ */
 MK_EXPORT int mk_http_send(mk_request_t *req, char *buf, size_t len,
                            void (*cb_finish)(mk_request_t *));
 
+/*
+ * Shared buffers: the same bytes can be sent to many requests, on any
+ * worker, without copies. Every send holds a reference until the data is on
+ * the wire or dropped, the creator owns the first one and returns it with
+ * mk_buffer_release(). The last reference invokes cb_release(context), the
+ * data must stay untouched until then.
+ */
+MK_EXPORT mk_buffer_t *mk_buffer_create(char *data, size_t size,
+                                        void (*cb_release)(void *),
+                                        void *context);
+MK_EXPORT void mk_buffer_release(mk_buffer_t *buf);
+MK_EXPORT int mk_http_send_buffer(mk_request_t *req, mk_buffer_t *buf);
+
+/*
+ * Waits available to handlers registered with mk_vhost_handler_thread(),
+ * they park the handler on the worker event loop. File descriptors must
+ * be non-blocking (mk_http_thread_connect() returns one). On error they
+ * return -1 and set errno, ECANCELED means the client went away.
+ *
+ * mk_http_thread_connect() takes a numeric IPv4 or IPv6 address, host
+ * names are not resolved: resolve them before the server starts.
+ */
+MK_EXPORT int mk_http_thread_connect(mk_request_t *req, char *host, int port);
+MK_EXPORT ssize_t mk_http_thread_read(mk_request_t *req, int fd,
+                                      void *buf, size_t count);
+MK_EXPORT ssize_t mk_http_thread_write(mk_request_t *req, int fd,
+                                       const void *buf, size_t count);
+MK_EXPORT int mk_http_thread_sleep(mk_request_t *req, int ms);
+
+/*
+ * Deferred responses: the handler calls mk_http_defer() and returns, any
+ * thread completes the request later through the handle. It's valid until
+ * mk_http_async_done(), the posts return -1 once the client went away.
+ */
+MK_EXPORT mk_async_t *mk_http_defer(mk_request_t *req);
+MK_EXPORT int mk_http_async_status(mk_async_t *as, int status);
+MK_EXPORT int mk_http_async_header(mk_async_t *as,
+                                   char *key, int key_len,
+                                   char *val, int val_len);
+MK_EXPORT int mk_http_async_send(mk_async_t *as, char *buf, size_t len);
+MK_EXPORT int mk_http_async_done(mk_async_t *as);
+
 MK_EXPORT int mk_worker_callback(mk_ctx_t *ctx,
                                  void (*cb_func) (void *),
                                  void *data);
@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_METRICS_H
+#define MK_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Plugin stages accounted, index = (stage / 10) - 1 */
+#define MK_METRICS_STAGE_10      0
+#define MK_METRICS_STAGE_20      1
+#define MK_METRICS_STAGE_30      2
+#define MK_METRICS_STAGE_40      3
+#define MK_METRICS_STAGE_50      4
+#define MK_METRICS_STAGES        5
+
+/*
+ * Latency histograms are log-linear (HDR style): values below
+ * MK_METRICS_HIST_SUB microseconds get an exact slot, then every power
+ * of two is split in MK_METRICS_HIST_SUB linear sub-buckets. With 108
+ * slots the last one goes up to ~268 seconds, bigger values are clamped.
+ */
+#define MK_METRICS_HIST_SUB      4
+#define MK_METRICS_HIST_BUCKETS  108
+
+struct mk_metrics_hist {
+    uint64_t count;
+    uint64_t sum;                              /* microseconds */
+    uint64_t buckets[MK_METRICS_HIST_BUCKETS];
+};
+
+/*
+ * Per worker counters. Each instance is only written by its owner
+ * thread (no atomics), the metrics endpoint aggregate all workers
+ * when it's scraped, so values read may be a few events behind.
+ */
+struct mk_metrics {
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t status[6];                        /* 0: unknown, 1..5: 1xx-5xx */
+    uint64_t timeouts;
+
+    /* refused by the per client rate limits, ratelimit_conns is atomic */
+    uint64_t ratelimit_conns;
+    uint64_t ratelimit_requests;
+
+    /* idle connections (in timeout queue) = idle_in - idle_out */
+    uint64_t idle_in;
+    uint64_t idle_out;
+
+    /* plugins stages */
+    uint64_t stage_calls[MK_METRICS_STAGES];
+    uint64_t stage_usec[MK_METRICS_STAGES];
+
+    struct mk_metrics_hist ttfb;               /* time to first byte */
+    struct mk_metrics_hist total;              /* total request time */
+};
+
+struct mk_server;
+struct mk_http_session;
+struct mk_http_request;
+
+/* Clock reads are only done if the metrics endpoint is enabled */
+#define mk_metrics_enabled(server)  (server->metrics_path != NULL)
+
+static inline uint64_t mk_metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline int mk_metrics_hist_index(uint64_t usec)
+{
+    int e;
+    int idx;
+
+    if (usec < MK_METRICS_HIST_SUB) {
+        return usec;
+    }
+
+    /* e = floor(log2(usec)), always >= 2 here */
+    e = 63 - __builtin_clzll(usec);
+    idx = (MK_METRICS_HIST_SUB * (e - 1)) + ((usec >> (e - 2)) & 3);
+    if (idx >= MK_METRICS_HIST_BUCKETS) {
+        return MK_METRICS_HIST_BUCKETS - 1;
+    }
+
+    return idx;
+}
+
+/* Inclusive upper bound in microseconds for a given histogram slot */
+static inline uint64_t mk_metrics_hist_bound(int idx)
+{
+    int e;
+    int sub;
+
+    if (idx < MK_METRICS_HIST_SUB) {
+        return idx;
+    }
+
+    e   = (idx / MK_METRICS_HIST_SUB) + 1;
+    sub = idx % MK_METRICS_HIST_SUB;
+
+    return (1ULL << e) + ((uint64_t) (sub + 1) << (e - 2)) - 1;
+}
+
+static inline void mk_metrics_hist_add(struct mk_metrics_hist *h,
+                                       uint64_t usec)
+{
+    h->count++;
+    h->sum += usec;
+    h->buckets[mk_metrics_hist_index(usec)]++;
+}
+
+int mk_metrics_is_path(struct mk_http_request *sr, struct mk_server *server);
+int mk_metrics_serve(struct mk_http_session *cs, struct mk_http_request *sr,
+                     struct mk_server *server);
+
+#endif
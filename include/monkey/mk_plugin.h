@@ -154,6 +154,7 @@ struct plugin_api
     int (*channel_flush) (struct mk_channel *);
     int (*channel_write) (struct mk_channel *, size_t *);
     void (*channel_append_stream) (struct mk_channel *, struct mk_stream *stream);
+    int (*stream_in_release) (struct mk_stream_input *);
     void (*stream_set) (struct mk_stream *, int, struct mk_channel *, void *, size_t,
                         void *,
                         void (*) (struct mk_stream *),
@@ -201,6 +202,7 @@ struct plugin_api
                                                   int);
     void (*sched_event_free) (struct mk_event *);
     struct mk_sched_worker *(*sched_worker_info)();
+    int (*sched_conn_resume) (int);
 
     /* worker's functions */
     int (*worker_spawn) (void (*func) (void *), void *, pthread_t *);
@@ -264,6 +266,7 @@ struct mk_plugin {
     /* Init Levels */
     int  (*master_init) (struct mk_server *);
     void (*worker_init) ();
+    void (*worker_exit) ();
 
     /* Callback references for plugin type */
     struct mk_plugin_network *network;        /* MK_NETWORK_LAYER   */
@@ -303,10 +306,10 @@ struct mk_plugin_stage {
 };
 
 
-void mk_plugin_api_init();
+void mk_plugin_api_init(struct mk_server *server);
 void mk_plugin_load_all();
 void mk_plugin_exit_all(struct mk_server *server);
-void mk_plugin_exit_worker();
+void mk_plugin_exit_worker(struct mk_server *server);
 
 void mk_plugin_event_init_list();
 
@@ -350,6 +353,7 @@ int mk_plugin_time_now_unix();
 mk_ptr_t *mk_plugin_time_now_human();
 
 int mk_plugin_sched_remove_client(int socket, struct mk_server *server);
+int mk_plugin_sched_conn_resume(int socket);
 
 
 int mk_plugin_header_prepare(struct mk_plugin *plugin,
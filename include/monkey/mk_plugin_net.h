@@ -25,6 +25,9 @@
 /*
  * Network plugin: a plugin that provides a network layer, eg: plain
  * sockets or SSL.
+ *
+ * A read() failing with EINPROGRESS suspends the connection: it's not
+ * polled anymore until the plugin calls api->sched_conn_resume(fd).
  */
 struct mk_plugin_network {
     int (*read) (int, void *, int);
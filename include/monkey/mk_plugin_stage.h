@@ -20,23 +20,64 @@
 #ifndef MK_PLUGIN_STAGE_H
 #define MK_PLUGIN_STAGE_H
 
+/*
+ * Stage timing for the metrics endpoint: the clock is only read when
+ * metrics are enabled and the stage have some handler registered, a NULL
+ * list skip that check (stage 30). Stage 10 under fair balancing runs on
+ * the balancer thread and it's not accounted.
+ */
+static inline uint64_t mk_plugin_stage_clock(struct mk_list *handlers,
+                                             struct mk_server *server)
+{
+    if (!mk_metrics_enabled(server)) {
+        return 0;
+    }
+
+    if (handlers && mk_list_is_empty(handlers) == 0) {
+        return 0;
+    }
+
+    return mk_metrics_now();
+}
+
+static inline void mk_plugin_stage_account(int stage, uint64_t start)
+{
+    struct mk_metrics *metrics;
+
+    if (start == 0) {
+        return;
+    }
+
+    metrics = mk_sched_metrics();
+    if (metrics) {
+        metrics->stage_calls[stage]++;
+        metrics->stage_usec[stage] += (mk_metrics_now() - start);
+    }
+}
+
 static inline int mk_plugin_stage_run_10(int socket, struct mk_server *server)
 {
     int ret;
+    int result = -1;
+    uint64_t start;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    start = mk_plugin_stage_clock(&server->stage10_handler, server);
     mk_list_foreach(head, &server->stage10_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage10(socket);
         switch (ret) {
         case MK_PLUGIN_RET_CLOSE_CONX:
             MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
-            return MK_PLUGIN_RET_CLOSE_CONX;
+            result = MK_PLUGIN_RET_CLOSE_CONX;
+            goto out;
         }
     }
 
-    return -1;
+ out:
+    mk_plugin_stage_account(MK_METRICS_STAGE_10, start);
+    return result;
 }
 
 static inline int mk_plugin_stage_run_20(struct mk_http_session *cs,
@@ -44,33 +85,42 @@ static inline int mk_plugin_stage_run_20(struct mk_http_session *cs,
                                          struct mk_server *server)
 {
     int ret;
+    int result = -1;
+    uint64_t start;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    start = mk_plugin_stage_clock(&server->stage20_handler, server);
     mk_list_foreach(head, &server->stage20_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage20(cs, sr);
         switch (ret) {
         case MK_PLUGIN_RET_CLOSE_CONX:
             MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
-            return MK_PLUGIN_RET_CLOSE_CONX;
+            result = MK_PLUGIN_RET_CLOSE_CONX;
+            goto out;
         }
     }
 
-    return -1;
+ out:
+    mk_plugin_stage_account(MK_METRICS_STAGE_20, start);
+    return result;
 }
 
 static inline int mk_plugin_stage_run_40(struct mk_http_session *cs,
                                          struct mk_http_request *sr,
                                          struct mk_server *server)
 {
+    uint64_t start;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    start = mk_plugin_stage_clock(&server->stage40_handler, server);
     mk_list_foreach(head, &server->stage40_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         stage->stage40(cs, sr);
     }
+    mk_plugin_stage_account(MK_METRICS_STAGE_40, start);
 
     return -1;
 }
@@ -78,10 +128,12 @@ static inline int mk_plugin_stage_run_40(struct mk_http_session *cs,
 static inline int mk_plugin_stage_run_50(int socket, struct mk_server *server)
 {
     int ret;
-
+    int result = -1;
+    uint64_t start;
     struct mk_list *head;
     struct mk_plugin_stage *stage;
 
+    start = mk_plugin_stage_clock(&server->stage50_handler, server);
     mk_list_foreach(head, &server->stage50_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
         ret = stage->stage50(socket);
@@ -89,11 +141,14 @@ static inline int mk_plugin_stage_run_50(int socket, struct mk_server *server)
         case MK_PLUGIN_RET_NOT_ME:
             break;
         case MK_PLUGIN_RET_CONTINUE:
-            return MK_PLUGIN_RET_CONTINUE;
+            result = MK_PLUGIN_RET_CONTINUE;
+            goto out;
         }
     }
 
-    return -1;
+ out:
+    mk_plugin_stage_account(MK_METRICS_STAGE_50, start);
+    return result;
 }
 
 #endif
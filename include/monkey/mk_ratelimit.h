@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_RATELIMIT_H
+#define MK_RATELIMIT_H
+
+#include <stdint.h>
+
+/*
+ * Per client rate limiting
+ * ========================
+ * Clients are grouped by address prefix (RateLimitPrefix) and each group
+ * owns a token bucket for new connections and another one for requests.
+ * Buckets live in fixed size tables shared by all workers: a table is an
+ * array of sets of MK_RATELIMIT_WAYS slots, one cache line each, a client
+ * hash picks the set and the slots are claimed and updated with atomic
+ * compare and swap, no locks are taken. When a set is full the slot used
+ * least recently is given to the new client, which starts with a full
+ * bucket, so a table overflow never blocks legitimate clients.
+ */
+
+#define MK_RATELIMIT_SLOTS     65536   /* slots per table             */
+#define MK_RATELIMIT_WAYS      4       /* slots per set (cache line)  */
+#define MK_RATELIMIT_BURST     2       /* default seconds of tokens   */
+
+struct mk_server;
+
+struct mk_ratelimit_slot {
+    uint64_t key;                      /* client hash, 0 = empty      */
+    uint64_t state;                    /* milli tokens << 32 | stamp  */
+};
+
+struct mk_ratelimit_set {
+    struct mk_ratelimit_slot slot[MK_RATELIMIT_WAYS];
+} __attribute__ ((aligned (64)));
+
+struct mk_ratelimit_table {
+    uint32_t rate;                     /* tokens per second, 0 = off  */
+    uint32_t max;                      /* bucket size in milli tokens */
+    uint32_t mask;                     /* number of sets - 1          */
+    struct mk_ratelimit_set *sets;
+    void *mem;                         /* unaligned allocation        */
+};
+
+struct mk_ratelimit {
+    int prefix4;                       /* bits compared of an IPv4    */
+    int prefix6;                       /* bits compared of an IPv6    */
+    struct mk_ratelimit_table conns;
+    struct mk_ratelimit_table requests;
+};
+
+int mk_ratelimit_create(struct mk_server *server);
+void mk_ratelimit_destroy(struct mk_server *server);
+
+uint64_t mk_ratelimit_key(int fd, struct mk_server *server);
+int mk_ratelimit_connection(uint64_t key, struct mk_server *server);
+int mk_ratelimit_request(uint64_t key, struct mk_server *server);
+void mk_ratelimit_reject(int fd);
+
+#endif
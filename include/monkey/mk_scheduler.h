@@ -25,6 +25,9 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_arena.h>
+#include <monkey/mk_file_cache.h>
 
 #ifndef MK_SCHEDULER_H
 #define MK_SCHEDULER_H
@@ -60,7 +63,7 @@ struct mk_sched_worker
 
     unsigned long long accepted_connections;
     unsigned long long closed_connections;
-    unsigned long long over_capacity;
+    unsigned long long over_capacity;         /* updated atomically */
 
     /*
      * The timeout queue represents client connections that
@@ -70,12 +73,33 @@ struct mk_sched_worker
      */
     struct mk_list timeout_queue;
 
+    /*
+     * Connections the network layer is busy with (e.g. a TLS handshake
+     * step running on another thread): they are out of the event loop
+     * until the network layer resumes them.
+     */
+    struct mk_list suspended_queue;
+
+    /*
+     * Closed connections with zero copy sends still in flight: the socket
+     * stays open until the kernel reports them completed.
+     */
+    struct mk_list zc_linger_queue;
+    time_t zc_linger_check;
+
     short int idx;
     unsigned char initialized;
 
     pthread_t tid;
     pid_t pid;
 
+    /* CPU and NUMA node assigned by WorkerAffinity, -1 = not pinned */
+    int cpu;
+    int numa_node;
+
+    /* jemalloc arena owned by this worker, -1 = shared arenas */
+    int malloc_arena;
+
     /* store the memory page size (_SC_PAGESIZE) */
     unsigned int mem_pagesize;
 
@@ -84,6 +108,14 @@ struct mk_sched_worker
 
     struct mk_list event_free_queue;
 
+    /* dthreads running library handlers, created on first use */
+    struct mk_thread_scheduler *dthreads;
+
+    /* deferred library responses completion queue (mk_http_async.h) */
+    struct mk_http_async_queue *async_queue;
+
+    struct mk_server *server;
+
     /*
      * This variable is used to signal the active workers,
      * just available because of ULONG_MAX bug described
@@ -92,8 +124,24 @@ struct mk_sched_worker
     int signal_channel_r;
     int signal_channel_w;
 
+    /* Timer checking the connections timeouts */
+    int timeout_fd;
+
     /* If using REUSEPORT, this points to the list of listeners */
     struct mk_list *listeners;
+
+    /* Counters exposed by the metrics endpoint */
+    struct mk_metrics metrics;
+
+    /* Idle chunks for the request arenas */
+    struct mk_arena_pool arena_pool;
+
+    /* Idle HTTP session buffers (struct mk_http_session_buf) */
+    struct mk_list session_pool;
+    int session_pool_count;
+
+    /* Open file descriptors and stat(2) results */
+    struct mk_file_cache file_cache;
 };
 
 
@@ -110,6 +158,8 @@ struct mk_sched_conn
     struct mk_plugin_network *net;     /* I/O network layer            */
     struct mk_channel channel;         /* stream channel               */
     struct mk_list timeout_head;       /* link to the timeout queue    */
+    struct mk_list suspend_head;       /* link to the suspended queue  */
+    uint64_t ratelimit_key;            /* client hash for rate limits  */
     void *data;                        /* optional ref for protocols   */
 };
 
@@ -206,6 +256,7 @@ pthread_mutex_t mutex_port_init;
 struct mk_sched_worker *mk_sched_next_target();
 int mk_sched_init(struct mk_server *server);
 int mk_sched_launch_thread(struct mk_server *server, pthread_t *tout);
+int mk_sched_worker_embed(struct mk_server *server);
 
 void *mk_sched_launch_epoll_loop(void *thread_conf);
 struct mk_sched_worker *mk_sched_get_handler_owner(void);
@@ -220,6 +271,29 @@ static inline struct mk_sched_worker *mk_sched_get_thread_conf()
     return MK_TLS_GET(mk_tls_sched_worker_node);
 }
 
+/* Metrics of the running worker, NULL if the caller is not a worker */
+static inline struct mk_metrics *mk_sched_metrics()
+{
+    struct mk_sched_worker *w;
+
+    w = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (mk_unlikely(!w)) {
+        return NULL;
+    }
+    return &w->metrics;
+}
+
+static inline struct mk_arena_pool *mk_sched_arena_pool()
+{
+    struct mk_sched_worker *w;
+
+    w = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (mk_unlikely(!w)) {
+        return NULL;
+    }
+    return &w->arena_pool;
+}
+
 static inline struct mk_event_loop *mk_sched_loop()
 {
     struct mk_sched_worker *w;
@@ -237,6 +311,8 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
 
 int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server);
+void mk_sched_zc_linger_check(struct mk_sched_worker *sched,
+                              struct mk_server *server, int force);
 
 
 struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
@@ -261,6 +337,8 @@ struct mk_sched_handler *mk_sched_handler_cap(char cap);
 int mk_sched_event_read(struct mk_sched_conn *conn,
                         struct mk_sched_worker *sched,
                         struct mk_server *server);
+int mk_sched_conn_resume(struct mk_sched_worker *sched, int remote_fd,
+                         struct mk_server *server);
 
 int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
@@ -293,14 +371,22 @@ static inline void mk_sched_conn_timeout_add(struct mk_sched_conn *conn,
     if (conn->is_timeout_on == MK_FALSE) {
         mk_list_add(&conn->timeout_head, &sched->timeout_queue);
         conn->is_timeout_on = MK_TRUE;
+        sched->metrics.idle_in++;
     }
 }
 
 static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn)
 {
+    struct mk_metrics *metrics;
+
     if (conn->is_timeout_on == MK_TRUE) {
         mk_list_del(&conn->timeout_head);
         conn->is_timeout_on = MK_FALSE;
+
+        metrics = mk_sched_metrics();
+        if (metrics) {
+            metrics->idle_out++;
+        }
     }
 }
 
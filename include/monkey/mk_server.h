@@ -66,6 +66,9 @@ struct mk_list *mk_server_listen_init(struct mk_server *server);
 unsigned int mk_server_capacity(struct mk_server *server);
 void mk_server_launch_workers(struct mk_server *server);
 void mk_server_worker_loop(struct mk_server *server);
+int mk_server_worker_start(struct mk_server *server);
+int mk_server_worker_run_once(struct mk_server *server, int timeout);
+void mk_server_worker_stop(struct mk_server *server);
 void mk_server_loop_balancer();
 void mk_server_worker_loop();
 void mk_server_loop(struct mk_server *server);
@@ -40,6 +40,15 @@
 #define SO_REUSEPORT  15
 #endif
 
+/* CPU steering for REUSEPORT groups: Linux >= 3.19 and >= 4.5 */
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU  49
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF  51
+#endif
+
 /*
  * TCP_FASTOPEN: as this is a very new option in the Linux Kernel, the value is
  * not yet exported and can be missing, lets make sure is available for all
@@ -61,6 +70,8 @@ int mk_socket_set_tcp_fastopen(int sockfd);
 int mk_socket_set_tcp_nodelay(int sockfd);
 int mk_socket_set_tcp_defer_accept(int sockfd);
 int mk_socket_set_tcp_reuseport(int sockfd);
+int mk_socket_set_incoming_cpu(int sockfd, int cpu);
+int mk_socket_reuseport_steer(int sockfd, int *cpus, int n);
 int mk_socket_set_nonblocking(int sockfd);
 
 int mk_socket_create(int domain, int type, int protocol);
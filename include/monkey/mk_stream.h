@@ -22,6 +22,7 @@
 
 #include <monkey/mk_core.h>
 #include <monkey/mk_plugin_net.h>
+#include <monkey/mk_arena.h>
 
 /*
  * Stream types: each stream can have a different
@@ -34,6 +35,7 @@
 #define MK_STREAM_SOCKET    3  /* socket, scared..     */
 #define MK_STREAM_COPYBUF   4  /* raw data, copy data into a dynamic buffer */
 #define MK_STREAM_EOF       5  /* end of stream, trigger callback */
+#define MK_STREAM_BUFFER    6  /* shared reference counted buffer */
 
 /* Channel return values for write event */
 #define MK_CHANNEL_DONE     1  /* channel consumed all streams */
@@ -64,6 +66,16 @@ struct mk_channel {
     int fd;
     int status;
 
+    /*
+     * Zero copy sends (MSG_ZEROCOPY): shared buffers of zc_threshold bytes
+     * or more are sent from user memory, a reference is kept until the
+     * kernel reports the send completed on the socket error queue.
+     */
+    int zerocopy;              /* 0 = not set yet, 1 = on, -1 = off */
+    uint32_t zc_seq;           /* id of the next zero copy send      */
+    size_t zc_threshold;       /* 0 = disabled                       */
+    struct mk_list zc_pending;
+
     struct mk_event *event;
     struct mk_plugin_network *io;
     struct mk_list streams;
@@ -93,6 +105,22 @@ struct mk_stream_input {
     struct mk_list _head;     /* link to inputs stream list */
 };
 
+/*
+ * Reference counted buffer: the same immutable bytes can be queued on many
+ * streams at once (any worker), each input holds a reference until its copy
+ * of the data is on the wire or the connection is dropped. When the last
+ * reference goes away cb_release() is invoked, it runs on the thread that
+ * dropped it.
+ */
+struct mk_stream_buffer {
+    int refs;
+    char *data;
+    size_t size;
+
+    void *context;
+    void (*cb_release)(void *);
+};
+
 /*
  * A stream holds a queue of components that refers to different
  * data sources such as: static file, raw buffer, etc.
@@ -111,6 +139,12 @@ struct mk_stream {
     /* Context the caller may want to reference with the stream (optional) */
     void *context;
 
+    /*
+     * Request arena (optional): dynamic inputs and copied buffers are
+     * taken from here and released all together with the request.
+     */
+    struct mk_arena *arena;
+
     /* callbacks */
     void (*cb_finished) (struct mk_stream *);
     void (*cb_bytes_consumed) (struct mk_stream *, long);
@@ -153,11 +187,20 @@ static inline int mk_stream_input(struct mk_stream *stream,
     struct mk_iov *iov;
 
     if (!in) {
-        in = mk_mem_alloc(sizeof(struct mk_stream_input));
-        if (!in) {
-            return -1;
+        if (stream->arena) {
+            in = mk_arena_alloc(stream->arena, sizeof(struct mk_stream_input));
+            if (!in) {
+                return -1;
+            }
+            in->dynamic  = MK_FALSE;
+        }
+        else {
+            in = mk_mem_alloc(sizeof(struct mk_stream_input));
+            if (!in) {
+                return -1;
+            }
+            in->dynamic  = MK_TRUE;
         }
-        in->dynamic  = MK_TRUE;
     }
     else {
         in->dynamic  = MK_FALSE;
@@ -176,7 +219,18 @@ static inline int mk_stream_input(struct mk_stream *stream,
         in->bytes_total = iov->total_len;
     }
     else if (type == MK_STREAM_COPYBUF) {
-        in->buffer = mk_mem_alloc(size);
+        if (stream->arena) {
+            in->buffer = mk_arena_alloc(stream->arena, size);
+        }
+        else {
+            in->buffer = mk_mem_alloc(size);
+        }
+        if (!in->buffer) {
+            if (in->dynamic == MK_TRUE) {
+                mk_mem_free(in);
+            }
+            return -1;
+        }
         in->bytes_total = size;
         memcpy(in->buffer, buffer, size);
     }
@@ -234,6 +288,43 @@ static inline int mk_stream_in_raw(struct mk_stream *stream,
                            cb_consumed, cb_finished);
 }
 
+static inline void mk_stream_buffer_get(struct mk_stream_buffer *buf)
+{
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Queue 'length' bytes of the shared buffer starting at 'offset' */
+static inline int mk_stream_in_buffer(struct mk_stream *stream,
+                                      struct mk_stream_input *in,
+                                      struct mk_stream_buffer *buf,
+                                      size_t offset, size_t length,
+                                      void (*cb_consumed)(struct mk_stream_input *, long),
+                                      void (*cb_finished)(struct mk_stream_input *))
+{
+    int ret;
+
+    if (offset + length > buf->size) {
+        return -1;
+    }
+
+    ret = mk_stream_input(stream,
+                          in,
+                          MK_STREAM_BUFFER,
+                          -1,
+                          buf->data + offset, length,
+                          0,
+                          cb_consumed, cb_finished);
+    if (ret != 0) {
+        return -1;
+    }
+
+    in = mk_list_entry_last(&stream->inputs, struct mk_stream_input, _head);
+    in->context = buf;
+    mk_stream_buffer_get(buf);
+
+    return 0;
+}
+
 static inline int mk_stream_in_eof(struct mk_stream *stream,
                                    struct mk_stream_input *in,
                                    void (*cb_finished)(struct mk_stream_input *))
@@ -289,7 +380,8 @@ struct mk_stream *mk_stream_set(struct mk_stream *stream,
      * stream it self and the buffer are allocated dynamically. It just
      * exists as an optional interface that do not care too much about
      * performance and aim to make things easier. The COPYBUF type is not
-     * used by Monkey core, at the moment the only caller is the CGI plugin.
+     * used by Monkey core, at the moment the only caller is the dirlisting
+     * plugin.
      */
     if (!stream) {
         stream = mk_mem_alloc(sizeof(struct mk_stream));
@@ -306,6 +398,7 @@ struct mk_stream *mk_stream_set(struct mk_stream *stream,
     stream->bytes_offset = 0;
     stream->context      = data;
     stream->preserve     = MK_FALSE;
+    stream->arena        = NULL;
 
     /* callbacks */
     stream->cb_finished       = cb_finished;
@@ -344,6 +437,9 @@ static inline void mk_stream_input_consume(struct mk_stream_input *in, long byte
     else if (in->type == MK_STREAM_COPYBUF) {
         fmt = "[INPUT_CBUF %p] bytes consumed %lu/%lu";
     }
+    else if (in->type == MK_STREAM_BUFFER) {
+        fmt = "[INPUT_SBUF %p] bytes consumed %lu/%lu";
+    }
     else {
         fmt = "[INPUT_UNKW %p] bytes consumed %lu/%lu";
     }
@@ -386,6 +482,9 @@ static inline void mk_channel_debug(struct mk_channel *channel)
             case MK_STREAM_COPYBUF:
                 printf("     in.%i] %p COPYBUF: ", i_input, in);
                 break;
+            case MK_STREAM_BUFFER:
+                printf("     in.%i] %p BUFFER : ", i_input, in);
+                break;
             case MK_STREAM_EOF:
                 printf("%i) [%p] STREAM EOF    : ", i, stream);
                 break;
@@ -411,5 +510,13 @@ struct mk_channel *mk_channel_new(int type, int fd);
 int mk_channel_flush(struct mk_channel *channel);
 int mk_channel_write(struct mk_channel *channel, size_t *count);
 int mk_channel_clean(struct mk_channel *channel);
+int mk_channel_zerocopy_reap(struct mk_channel *channel);
+void mk_channel_zerocopy_move(struct mk_channel *to, struct mk_channel *from);
+int mk_stream_in_release(struct mk_stream_input *in);
+
+struct mk_stream_buffer *mk_stream_buffer_create(char *data, size_t size,
+                                                 void (*cb_release)(void *),
+                                                 void *context);
+void mk_stream_buffer_put(struct mk_stream_buffer *buf);
 
 #endif
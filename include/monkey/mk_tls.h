@@ -31,9 +31,6 @@ extern __thread mk_ptr_t *mk_tls_cache_header_lm;
 extern __thread struct tm *mk_tls_cache_gmtime;
 extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
-/* mk_vhost.c */
-extern __thread struct mk_list *mk_tls_vhost_fdt;
-
 /* mk_scheduler.c */
 extern __thread struct rb_root *mk_tls_sched_cs;
 extern __thread struct mk_list *mk_tls_sched_cs_incomplete;
@@ -58,9 +55,6 @@ pthread_key_t mk_tls_cache_header_lm;
 pthread_key_t mk_tls_cache_gmtime;
 pthread_key_t mk_tls_cache_gmtext;
 
-/* mk_vhost.c */
-pthread_key_t mk_tls_vhost_fdt;
-
 /* mk_scheduler.c */
 pthread_key_t mk_tls_sched_cs;
 pthread_key_t mk_tls_sched_cs_incomplete;
@@ -81,9 +75,6 @@ pthread_key_t mk_tls_server_timeout;
     pthread_key_create(&mk_tls_cache_gmtime, NULL);             \
     pthread_key_create(&mk_tls_cache_gmtext, NULL);             \
                                                                 \
-    /* mk_vhost.c */                                            \
-    pthread_key_create(&mk_tls_vhost_fdt, NULL);                \
-                                                                \
     /* mk_scheduler.c */                                        \
     pthread_key_create(&mk_tls_sched_cs, NULL);                 \
     pthread_key_create(&mk_tls_sched_cs_incomplete, NULL);      \
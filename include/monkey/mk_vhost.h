@@ -26,6 +26,8 @@
 
 #include <regex.h>
 
+struct mk_vhost_matcher;
+
 /* Custom error page */
 struct mk_vhost_error_page {
     short int status;
@@ -41,18 +43,34 @@ struct mk_vhost_handler_param {
 
 struct mk_vhost_handler {
     regex_t match;                         /* regex match rule               */
+    char *pattern;                         /* source of the match rule       */
     char *name;                            /* plugin handler name            */
     int n_params;                          /* number of parameters           */
 
     /* optional callback and opaque data for lib mode */
     void (*cb) (struct mk_http_request *, void *);
     void *data;
+    int thread;                            /* run cb on a dthread            */
 
     struct mk_list params;                 /* parameters given by config     */
     struct mk_plugin *handler;             /* handler plugin                 */
     struct mk_list _head;                  /* link to vhost->handlers        */
 };
 
+/*
+ * Pre-rendered response (lib mode): status line, then the fixed headers,
+ * Content-Length and body, rendered once into buf.
+ */
+struct mk_vhost_static {
+    mk_ptr_t path;                         /* exact request path             */
+    int status;
+    char *buf;
+    size_t head_len;                       /* status line                    */
+    size_t tail_len;                       /* headers, Content-Length, body  */
+    size_t body_len;
+    struct mk_list _head;                  /* link to vhost->statics         */
+};
+
 struct mk_vhost
 {
     int id;
@@ -70,6 +88,10 @@ struct mk_vhost
 
     /* content handlers */
     struct mk_list handlers;
+    struct mk_vhost_matcher *matcher;  /* compiled handlers rules */
+
+    /* pre-rendered responses */
+    struct mk_list statics;
 
     /* link node */
     struct mk_list _head;
@@ -84,29 +106,6 @@ struct mk_vhost_alias
 };
 
 
-#define VHOST_FDT_HASHTABLE_SIZE   64
-#define VHOST_FDT_HASHTABLE_CHAINS  8
-
-struct vhost_fdt_hash_chain {
-    int fd;
-    int readers;
-    unsigned int hash;
-};
-
-struct vhost_fdt_hash_table {
-    int av_slots;
-    struct vhost_fdt_hash_chain chain[VHOST_FDT_HASHTABLE_CHAINS];
-};
-
-struct vhost_fdt_host {
-    struct mk_vhost *host;
-    struct vhost_fdt_hash_table hash_table[VHOST_FDT_HASHTABLE_SIZE];
-    struct mk_list _head;
-};
-
-//pthread_key_t mk_vhost_fdt_key;
-pthread_mutex_t mk_vhost_fdt_mutex;
-
 struct mk_vhost *mk_vhost_read(char *path);
 int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
                  mk_vhost_alias **alias,
@@ -114,15 +113,13 @@ int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
 void mk_vhost_set_single(char *path, struct mk_server *server);
 void mk_vhost_init(char *path, struct mk_server *server);
 
-int mk_vhost_fdt_worker_init(struct mk_server *server);
-int mk_vhost_fdt_worker_exit(struct mk_server *server);
-int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server);
-int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server);
 void mk_vhost_free_all(struct mk_server *server);
 int mk_vhost_map_handlers(struct mk_server *server);
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
                                                 void *data);
+struct mk_vhost_static *mk_vhost_static_lookup(struct mk_vhost *host,
+                                               char *path, int len);
 
 #endif
@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_VHOST_MATCH_H
+#define MK_VHOST_MATCH_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_vhost.h>
+
+/*
+ * Handlers matcher
+ * ================
+ * The 'Match' rules of a virtual host are compiled once when the server
+ * starts. Most rules are literals glued by '.*', optionally anchored:
+ *
+ *   ^/php/.*       prefix          \.php$         suffix
+ *   /cgi-bin/.*    substring       /.*\.php       two substrings
+ *
+ * Rules anchored at the start are indexed by their first literal in a
+ * prefix trie and rules anchored at the end by their last literal in a
+ * suffix trie, so a single walk over the URI finds every candidate. The
+ * remaining literal rules are matched with a plain substring search and
+ * anything else still goes through regexec(3), but only when it comes
+ * before the best candidate found so far: the first handler in the
+ * configuration order wins, as before.
+ */
+
+/* An alternative of a rule made of literals: 'seg0.*seg1.*...' */
+struct mk_vhost_match_rule {
+    int id;                       /* handler position, lower wins     */
+    int anchor_start;             /* rule starts with '^'             */
+    int anchor_end;               /* rule ends with '$'               */
+    int n_segs;
+    mk_ptr_t *segs;               /* lower case literals              */
+    struct mk_vhost_match_rule *next;  /* next rule in the trie node  */
+    struct mk_list _head;         /* link to matcher->rules           */
+};
+
+struct mk_vhost_match_node {
+    unsigned char c;
+    struct mk_vhost_match_rule *rules;   /* rules whose key ends here */
+    struct mk_vhost_match_node *child;
+    struct mk_vhost_match_node *sibling;
+};
+
+/* Rules checked one by one, ordered by handler position */
+struct mk_vhost_match_slow {
+    int id;
+    struct mk_vhost_match_rule *rule;    /* NULL: use the handler regex */
+};
+
+struct mk_vhost_matcher {
+    int n_handlers;
+    struct mk_vhost_handler **handlers;
+
+    struct mk_vhost_match_node prefix;   /* keys: first literal       */
+    struct mk_vhost_match_node suffix;   /* keys: last literal, reversed */
+
+    int n_slow;
+    struct mk_vhost_match_slow *slow;
+
+    struct mk_list rules;                /* every rule, for cleanup   */
+};
+
+int mk_vhost_match_init(struct mk_server *server);
+int mk_vhost_match_create(struct mk_vhost *host);
+void mk_vhost_match_destroy(struct mk_vhost *host);
+
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               const char *uri, size_t len,
+                                               int *id);
+
+#endif
@@ -25,6 +25,16 @@
 #include <signal.h>
 #include <getopt.h>
 
+#ifdef MALLOC_JEMALLOC
+/*
+ * Use time based purging of dirty pages, so MemoryDecayTime can be
+ * tuned per worker arena. jemalloc declares this symbol as weak, it's
+ * set by the server binary only: an application embedding the library
+ * keeps its own allocator options.
+ */
+const char *je_malloc_conf = "purge:decay";
+#endif
+
 #if defined(__DATE__) && defined(__TIME__)
 static const char MONKEY_BUILT[] = __DATE__ " " __TIME__;
 #else
@@ -151,7 +151,22 @@ int mk_event_channel_create(struct mk_event_loop *loop,
 /* Poll events */
 int mk_event_wait(struct mk_event_loop *loop)
 {
-    return _mk_event_wait(loop);
+    return _mk_event_wait_2(loop, -1);
+}
+
+/* Poll events, waiting at most 'timeout' milliseconds (-1 = forever) */
+int mk_event_wait_2(struct mk_event_loop *loop, int timeout)
+{
+    return _mk_event_wait_2(loop, timeout);
+}
+
+/*
+ * Descriptor of the backend that becomes readable when events are ready,
+ * so the loop can be nested into another one. -1 if the backend has none.
+ */
+int mk_event_loop_fd(struct mk_event_loop *loop)
+{
+    return _mk_event_fd(loop);
 }
 
 /* Return the backend name */
@@ -325,14 +325,22 @@ static inline int _mk_event_channel_create(struct mk_event_ctx *ctx,
     return 0;
 }
 
-static inline int _mk_event_wait(struct mk_event_loop *loop)
+static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
 {
     struct mk_event_ctx *ctx = loop->data;
 
-    loop->n_events = epoll_wait(ctx->efd, ctx->events, ctx->queue_size, -1);
+    loop->n_events = epoll_wait(ctx->efd, ctx->events, ctx->queue_size,
+                                timeout);
     return loop->n_events;
 }
 
+static inline int _mk_event_fd(struct mk_event_loop *loop)
+{
+    struct mk_event_ctx *ctx = loop->data;
+
+    return ctx->efd;
+}
+
 static inline char *_mk_event_backend()
 {
     return "epoll";
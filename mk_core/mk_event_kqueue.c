@@ -231,14 +231,31 @@ static inline int _mk_event_channel_create(struct mk_event_ctx *ctx,
     return 0;
 }
 
-static inline int _mk_event_wait(struct mk_event_loop *loop)
+static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
 {
+    struct timespec ts;
     struct mk_event_ctx *ctx = loop->data;
 
-    loop->n_events = kevent(ctx->kfd, NULL, 0, ctx->events, ctx->queue_size, NULL);
+    if (timeout < 0) {
+        loop->n_events = kevent(ctx->kfd, NULL, 0, ctx->events,
+                                ctx->queue_size, NULL);
+        return loop->n_events;
+    }
+
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    loop->n_events = kevent(ctx->kfd, NULL, 0, ctx->events, ctx->queue_size,
+                            &ts);
     return loop->n_events;
 }
 
+static inline int _mk_event_fd(struct mk_event_loop *loop)
+{
+    struct mk_event_ctx *ctx = loop->data;
+
+    return ctx->kfd;
+}
+
 static inline char *_mk_event_backend()
 {
 #ifdef LINUX_KQUEUE
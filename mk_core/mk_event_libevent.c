@@ -259,8 +259,9 @@ static inline int _mk_event_channel_create(struct mk_event_ctx *ctx,
     return 0;
 }
 
-static inline int _mk_event_wait(struct mk_event_loop *loop)
+static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
 {
+    struct timeval tv;
     struct mk_event_ctx *ctx = loop->data;
 
     /*
@@ -269,12 +270,30 @@ static inline int _mk_event_wait(struct mk_event_loop *loop)
      * is called.
      */
     ctx->fired_count = 0;
-    event_base_loop(ctx->base, EVLOOP_ONCE);
+    if (timeout == 0) {
+        event_base_loop(ctx->base, EVLOOP_NONBLOCK);
+    }
+    else {
+        if (timeout > 0) {
+            tv.tv_sec  = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+            event_base_loopexit(ctx->base, &tv);
+        }
+        event_base_loop(ctx->base, EVLOOP_ONCE);
+    }
     loop->n_events = ctx->fired_count;
 
     return loop->n_events;
 }
 
+/* Callbacks based, there is no descriptor to poll */
+static inline int _mk_event_fd(struct mk_event_loop *loop)
+{
+    (void) loop;
+
+    return -1;
+}
+
 static inline char *_mk_event_backend()
 {
     return "libevent";
@@ -263,18 +263,27 @@ static inline int _mk_event_channel_create(struct mk_event_ctx *ctx,
     return 0;
 }
 
-static inline int _mk_event_wait(struct mk_event_loop *loop)
+static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
 {
     int i;
     int f = 0;
     uint32_t mask;
+    struct timeval tv;
+    struct timeval *ptv = NULL;
     struct mk_event *fired;
     struct mk_event_ctx *ctx = loop->data;
 
     memcpy(&ctx->_rfds, &ctx->rfds, sizeof(fd_set));
     memcpy(&ctx->_wfds, &ctx->wfds, sizeof(fd_set));
 
-    loop->n_events = select(ctx->max_fd + 1, &ctx->_rfds, &ctx->_wfds, NULL, NULL);
+    if (timeout >= 0) {
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv = &tv;
+    }
+
+    loop->n_events = select(ctx->max_fd + 1, &ctx->_rfds, &ctx->_wfds, NULL,
+                            ptv);
     if (loop->n_events <= 0) {
         return loop->n_events;
     }
@@ -312,6 +321,14 @@ static inline int _mk_event_wait(struct mk_event_loop *loop)
     return loop->n_events;
 }
 
+/* select(2) keeps no kernel object, there is no descriptor to poll */
+static inline int _mk_event_fd(struct mk_event_loop *loop)
+{
+    (void) loop;
+
+    return -1;
+}
+
 static inline char *_mk_event_backend()
 {
     return "select";
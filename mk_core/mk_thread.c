@@ -18,16 +18,14 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <string.h>
-
-#if defined (__APPLE__)
-#include <sys/ucontext.h>
-#else
-#include <ucontext.h>
-#endif
-
-#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <mk_core/mk_pthread.h>
 #include <mk_core/mk_memory.h>
@@ -47,47 +45,355 @@
  *
  */
 
+/*
+ * Context switch
+ * --------------
+ * On x86-64 and aarch64 a switch only saves the callee saved registers on
+ * the current stack, stores the stack pointer and loads the one of the
+ * target: no system calls (swapcontext(3) changes the signal mask on every
+ * call) and no memory besides the stack itself. Other platforms use the
+ * ucontext(3) functions.
+ *
+ * Stacks are mmap(2)'ed with a guard page at the bottom, an overflow
+ * faults instead of corrupting the memory below. The dthread descriptor
+ * lives at the top of its own stack and finished dthreads are kept in a
+ * per scheduler pool, creating a dthread is usually just taking one from
+ * the pool.
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+#define MK_THREAD_ASM
+#else
+#if defined (__APPLE__)
+#include <sys/ucontext.h>
+#else
+#include <ucontext.h>
+#endif
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define MK_THREAD_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MK_THREAD_ASAN
+#endif
+#endif
+
+#ifdef MK_THREAD_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
 #ifdef USE_VALGRIND
 #include <valgrind/valgrind.h>
 #endif
 
-#define MK_THREAD_STACK_SIZE (3 * (PTHREAD_STACK_MIN) / 2)
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+#define MK_THREAD_STACK_SIZE     (64 * 1024)
+#define MK_THREAD_STACK_POOL     64
 #define DEFAULT_MK_THREAD_NUM    16
 
+pthread_key_t mk_thread_scheduler;
+static pthread_once_t mk_thread_once = PTHREAD_ONCE_INIT;
+
+struct mk_thread_context {
+#ifdef MK_THREAD_ASM
+    void *sp;
+#else
+    ucontext_t uc;
+#endif
+#ifdef MK_THREAD_ASAN
+    void *fake_stack;
+    const void *stack_bottom;
+    size_t stack_size;
+#endif
+};
+
 struct mk_thread {
     mk_thread_func func;
     void *data;
-    ucontext_t context;
+    struct mk_thread_context context;
     struct mk_thread_scheduler *sch;
+    int id;
     int status;
     int parent_id;
+
+    /* Memory mapping holding the stack and this descriptor */
+    char *map;
+    size_t map_size;
+    char *stack_top;
+    struct mk_thread *pool_next;
 #ifdef USE_VALGRIND
     unsigned int valgrind_stack_id;
 #endif
     struct mk_list chan_list;
-    char stack[MK_THREAD_STACK_SIZE];
-} mk_thread_t;
+};
 
 struct mk_thread_scheduler {
-    ucontext_t main;
+    struct mk_thread_context main;
     int n_dthread;
     int cap;
     int running_id;
     struct mk_thread **dt;
+
+    /* Released ids, used before the ones never taken */
+    int *free_ids;
+    int n_free;
+    int n_used;
+
+    /* Finished dthread, released by the next context it switched to */
+    struct mk_thread *dead;
+
+    /* Stacks ready to be reused */
+    struct mk_thread *pool;
+    int pool_size;
+    size_t page_size;
 };
 
-static void _mk_thread_release(struct mk_thread *dt);
+#ifdef MK_THREAD_ASM
+/*
+ * void mk_thread_context_switch(void **from_sp, void *to_sp)
+ *
+ * Push the callee saved registers of the running context, store its stack
+ * pointer in *from_sp, switch to to_sp and pop the registers of the target,
+ * then jump to the address on top: where the target called the switch, or
+ * the entry point of a new dthread. On x86-64 the return is an indirect
+ * jump, a 'ret' to another stack is always mispredicted. The floating
+ * point control words are not switched, dthreads share them with the
+ * worker thread.
+ */
+#if defined(__x86_64__)
+__asm__ (
+    "\t.text\n"
+    "\t.globl mk_thread_context_switch\n"
+    "\t.hidden mk_thread_context_switch\n"
+    "\t.type mk_thread_context_switch,@function\n"
+    "mk_thread_context_switch:\n"
+    "\tpushq %rbp\n"
+    "\tpushq %rbx\n"
+    "\tpushq %r12\n"
+    "\tpushq %r13\n"
+    "\tpushq %r14\n"
+    "\tpushq %r15\n"
+    "\tmovq %rsp, (%rdi)\n"
+    "\tmovq %rsi, %rsp\n"
+    "\tpopq %r15\n"
+    "\tpopq %r14\n"
+    "\tpopq %r13\n"
+    "\tpopq %r12\n"
+    "\tpopq %rbx\n"
+    "\tpopq %rbp\n"
+    "\tpopq %rcx\n"
+    "\tjmpq *%rcx\n"
+    "\t.size mk_thread_context_switch,.-mk_thread_context_switch\n"
+);
+#elif defined(__aarch64__)
+__asm__ (
+    "\t.text\n"
+    "\t.globl mk_thread_context_switch\n"
+    "\t.hidden mk_thread_context_switch\n"
+    "\t.type mk_thread_context_switch,%function\n"
+    "mk_thread_context_switch:\n"
+    "\tsub sp, sp, #176\n"
+    "\tstp x19, x20, [sp, #0]\n"
+    "\tstp x21, x22, [sp, #16]\n"
+    "\tstp x23, x24, [sp, #32]\n"
+    "\tstp x25, x26, [sp, #48]\n"
+    "\tstp x27, x28, [sp, #64]\n"
+    "\tstp x29, x30, [sp, #80]\n"
+    "\tstp d8, d9, [sp, #96]\n"
+    "\tstp d10, d11, [sp, #112]\n"
+    "\tstp d12, d13, [sp, #128]\n"
+    "\tstp d14, d15, [sp, #144]\n"
+    "\tmov x2, sp\n"
+    "\tstr x2, [x0]\n"
+    "\tmov sp, x1\n"
+    "\tldp x19, x20, [sp, #0]\n"
+    "\tldp x21, x22, [sp, #16]\n"
+    "\tldp x23, x24, [sp, #32]\n"
+    "\tldp x25, x26, [sp, #48]\n"
+    "\tldp x27, x28, [sp, #64]\n"
+    "\tldp x29, x30, [sp, #80]\n"
+    "\tldp d8, d9, [sp, #96]\n"
+    "\tldp d10, d11, [sp, #112]\n"
+    "\tldp d12, d13, [sp, #128]\n"
+    "\tldp d14, d15, [sp, #144]\n"
+    "\tadd sp, sp, #176\n"
+    "\tret\n"
+    "\t.size mk_thread_context_switch,.-mk_thread_context_switch\n"
+);
+#endif
 
-static void _mk_thread_entry_point(struct mk_thread_scheduler *sch)
+void mk_thread_context_switch(void **from_sp, void *to_sp);
+#endif
+
+static void mk_thread_entry_point();
+
+static void mk_thread_key_init()
 {
-    int id;
+    pthread_key_create(&mk_thread_scheduler, NULL);
+}
+
+/* Prepare the first switch to a dthread, it lands in the entry point */
+static void mk_thread_context_init(struct mk_thread *dt)
+{
+#ifdef MK_THREAD_ASM
+    void **sp = (void **) dt->stack_top;
+
+#if defined(__x86_64__)
+    *--sp = NULL;                           /* entry point return address */
+    *--sp = (void *) mk_thread_entry_point; /* jump target of the switch  */
+    sp -= 6;                                /* rbp, rbx, r12 - r15        */
+    memset(sp, '\0', sizeof(void *) * 6);
+#elif defined(__aarch64__)
+    sp -= 22;                               /* 176 bytes frame            */
+    memset(sp, '\0', sizeof(void *) * 22);
+    sp[11] = (void *) mk_thread_entry_point; /* x30, the link register    */
+#endif
+    dt->context.sp = sp;
+#else
+    getcontext(&dt->context.uc);
+    dt->context.uc.uc_stack.ss_sp = dt->map + dt->sch->page_size;
+    dt->context.uc.uc_stack.ss_size = dt->stack_top -
+        (dt->map + dt->sch->page_size);
+    dt->context.uc.uc_link = NULL;
+    makecontext(&dt->context.uc, (void (*)(void)) mk_thread_entry_point, 0);
+#endif
+
+#ifdef MK_THREAD_ASAN
+    dt->context.stack_bottom = dt->map + dt->sch->page_size;
+    dt->context.stack_size = dt->stack_top - (dt->map + dt->sch->page_size);
+#endif
+}
+
+static struct mk_thread *mk_thread_stack_get(struct mk_thread_scheduler *sch)
+{
+    char *map;
+    size_t size;
     struct mk_thread *dt;
+
+    if (sch->pool) {
+        dt = sch->pool;
+        sch->pool = dt->pool_next;
+        sch->pool_size--;
+        return dt;
+    }
+
+    size = sch->page_size + MK_THREAD_STACK_SIZE;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* Guard page */
+    if (mprotect(map, sch->page_size, PROT_NONE) != 0) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    /* The descriptor takes the top of the mapping, the stack starts below */
+    dt = (struct mk_thread *) ((uintptr_t) (map + size - sizeof(*dt)) &
+                               ~((uintptr_t) 63));
+    dt->map = map;
+    dt->map_size = size;
+    dt->stack_top = (char *) ((uintptr_t) dt & ~((uintptr_t) 15));
+#ifdef USE_VALGRIND
+    dt->valgrind_stack_id = VALGRIND_STACK_REGISTER(map + sch->page_size,
+                                                    dt->stack_top);
+#endif
+
+    return dt;
+}
+
+static void mk_thread_stack_free(struct mk_thread *dt)
+{
+#ifdef USE_VALGRIND
+    VALGRIND_STACK_DEREGISTER(dt->valgrind_stack_id);
+#endif
+    munmap(dt->map, dt->map_size);
+}
+
+/* Give back the id and the stack of a finished dthread */
+static void _mk_thread_release(struct mk_thread_scheduler *sch,
+                               struct mk_thread *dt)
+{
+    assert(dt);
+
+    sch->dt[dt->id] = NULL;
+    sch->free_ids[sch->n_free++] = dt->id;
+
+    if (sch->pool_size < MK_THREAD_STACK_POOL) {
+        dt->pool_next = sch->pool;
+        sch->pool = dt;
+        sch->pool_size++;
+    }
+    else {
+        mk_thread_stack_free(dt);
+    }
+}
+
+/* Switch contexts, it returns when somebody switches back to 'from' */
+static inline void mk_thread_swap(struct mk_thread_scheduler *sch,
+                                  struct mk_thread_context *from,
+                                  struct mk_thread_context *to)
+{
+#ifdef MK_THREAD_ASAN
+    __sanitizer_start_switch_fiber(&from->fake_stack,
+                                   to->stack_bottom, to->stack_size);
+#endif
+
+#ifdef MK_THREAD_ASM
+    mk_thread_context_switch(&from->sp, to->sp);
+#else
+    swapcontext(&from->uc, &to->uc);
+#endif
+
+#ifdef MK_THREAD_ASAN
+    __sanitizer_finish_switch_fiber(from->fake_stack, NULL, NULL);
+#endif
+
+    if (sch->dead) {
+        _mk_thread_release(sch, sch->dead);
+        sch->dead = NULL;
+    }
+}
+
+/*
+ * A dthread starts here, once its function returns the control goes back
+ * to the context that resumed it the last time. Its stack is still in use
+ * until that switch, so the target releases it.
+ */
+static void mk_thread_entry_point()
+{
+    struct mk_thread *dt;
+    struct mk_thread *parent = NULL;
+    struct mk_thread_context *to;
+    struct mk_thread_scheduler *sch;
     struct mk_list *head;
     struct mk_thread_channel *chan;
 
+    sch = pthread_getspecific(mk_thread_scheduler);
     assert(sch);
-    id = sch->running_id;
-    dt = sch->dt[id];
+    dt = sch->dt[sch->running_id];
+
+#ifdef MK_THREAD_ASAN
+    /* The first switch into a dthread always comes from resume() */
+    if (dt->parent_id == -1) {
+        __sanitizer_finish_switch_fiber(NULL, &sch->main.stack_bottom,
+                                        &sch->main.stack_size);
+    }
+    else {
+        __sanitizer_finish_switch_fiber(NULL, NULL, NULL);
+    }
+#endif
+
+    if (sch->dead) {
+        _mk_thread_release(sch, sch->dead);
+        sch->dead = NULL;
+    }
+
     dt->func(dt->data);
     dt->status = MK_THREAD_DEAD;
 
@@ -97,22 +403,52 @@ static void _mk_thread_entry_point(struct mk_thread_scheduler *sch)
     }
     sch->n_dthread--;
     sch->running_id = dt->parent_id;
+    sch->dead = dt;
+
+    if (dt->parent_id != -1) {
+        parent = sch->dt[dt->parent_id];
+        parent->status = MK_THREAD_RUNNING;
+        to = &parent->context;
+    }
+    else {
+        to = &sch->main;
+    }
+
+#ifdef MK_THREAD_ASAN
+    __sanitizer_start_switch_fiber(NULL, to->stack_bottom, to->stack_size);
+#endif
+
+#ifdef MK_THREAD_ASM
+    mk_thread_context_switch(&dt->context.sp, to->sp);
+#else
+    setcontext(&to->uc);
+#endif
+
+    /* Never reached */
+    abort();
 }
 
 struct mk_thread_scheduler *mk_thread_open()
 {
+    long page;
     struct mk_thread_scheduler *sch;
 
-    sch = mk_mem_alloc(sizeof(*sch));
+    pthread_once(&mk_thread_once, mk_thread_key_init);
+
+    sch = mk_mem_alloc_z(sizeof(*sch));
     if (!sch) {
         return NULL;
     }
 
-    sch->n_dthread = 0;
+    page = sysconf(_SC_PAGESIZE);
+    sch->page_size = (page > 0) ? page : 4096;
     sch->cap = DEFAULT_MK_THREAD_NUM;
     sch->running_id = -1;
     sch->dt = mk_mem_alloc_z(sizeof(struct mk_thread *) * sch->cap);
-    if (!sch->dt) {
+    sch->free_ids = mk_mem_alloc(sizeof(int) * sch->cap);
+    if (!sch->dt || !sch->free_ids) {
+        mk_mem_free(sch->dt);
+        mk_mem_free(sch->free_ids);
         mk_mem_free(sch);
         return NULL;
     }
@@ -122,18 +458,30 @@ struct mk_thread_scheduler *mk_thread_open()
 
 void mk_thread_close(struct mk_thread_scheduler *sch)
 {
+    int i;
     struct mk_thread *dt;
 
-    int i;
-    for (i = 0; i < sch->cap; ++i) {
+    for (i = 0; i < sch->n_used; ++i) {
         dt = sch->dt[i];
         if (dt) {
-            _mk_thread_release(dt);
+            mk_thread_stack_free(dt);
         }
     }
+
+    while (sch->pool) {
+        dt = sch->pool;
+        sch->pool = dt->pool_next;
+        mk_thread_stack_free(dt);
+    }
+
+    mk_mem_free(sch->free_ids);
     mk_mem_free(sch->dt);
     sch->dt = NULL;
     mk_mem_free(sch);
+
+    if (pthread_getspecific(mk_thread_scheduler) == sch) {
+        pthread_setspecific(mk_thread_scheduler, NULL);
+    }
 }
 
 /*
@@ -147,73 +495,62 @@ void mk_thread_close(struct mk_thread_scheduler *sch)
  */
 int mk_thread_create(mk_thread_func func, void *data)
 {
-    int i;
     int id;
     void *p;
     struct mk_thread_scheduler *sch;
     struct mk_thread *dt;
 
+    pthread_once(&mk_thread_once, mk_thread_key_init);
+
     sch = pthread_getspecific(mk_thread_scheduler);
     if (!sch) {
         sch = mk_thread_open();
-        assert(sch);
+        if (!sch) {
+            return -1;
+        }
         pthread_setspecific(mk_thread_scheduler, (void *) sch);
     }
 
-    if (sch->n_dthread >= sch->cap) {
-        id = sch->cap;
-
+    if (sch->n_free == 0 && sch->n_used == sch->cap) {
         p = mk_mem_realloc(sch->dt, sch->cap * 2 * sizeof(struct mk_thread *));
         if (!p) {
             return -1;
         }
         sch->dt = p;
         memset(sch->dt + sch->cap, 0, sizeof(struct mk_thread *) * sch->cap);
-        sch->cap *= 2;
-    }
-    else {
-        for (i = 0; i < sch->cap; ++i) {
-            id = (i + sch->cap) % sch->cap;
-            if (sch->dt[id] == NULL || sch->dt[id]->status == MK_THREAD_DEAD) {
-                break;
-            }
-        }
-    }
 
-    /* may use dthread pooling instead of release and realloc */
-    if (sch->dt[id] && sch->dt[id]->status == MK_THREAD_DEAD) {
-        _mk_thread_release(sch->dt[id]);
-        sch->dt[id] = NULL;
+        p = mk_mem_realloc(sch->free_ids, sch->cap * 2 * sizeof(int));
+        if (!p) {
+            return -1;
+        }
+        sch->free_ids = p;
+        sch->cap *= 2;
     }
 
-    dt = mk_mem_alloc(sizeof(*dt));
+    dt = mk_thread_stack_get(sch);
     if (!dt) {
         return -1;
     }
 
+    if (sch->n_free > 0) {
+        id = sch->free_ids[--sch->n_free];
+    }
+    else {
+        id = sch->n_used++;
+    }
+
     dt->func = func;
     dt->data = data;
     dt->sch = sch;
+    dt->id = id;
     dt->status = MK_THREAD_READY;
     dt->parent_id = -1;
-#ifdef USE_VALGRIND
-    dt->valgrind_stack_id = VALGRIND_STACK_REGISTER(dt->stack, dt->stack + MK_THREAD_STACK_SIZE);
-#endif
     mk_list_init(&dt->chan_list);
     sch->dt[id] = dt;
     sch->n_dthread++;
     return id;
 }
 
-static void _mk_thread_release(struct mk_thread *dt)
-{
-    assert(dt);
-#ifdef USE_VALGRIND
-    VALGRIND_STACK_DEREGISTER(dt->valgrind_stack_id);
-#endif
-    mk_mem_free(dt);
-}
-
 /*
  * @METHOD_NAME: status
  * @METHOD_DESC: get the status of a given dthread.
@@ -255,12 +592,13 @@ void mk_thread_yield()
     dt = sch->dt[id];
     dt->status = MK_THREAD_SUSPEND;
     sch->running_id = -1;
-    swapcontext(&dt->context, &sch->main);
+    mk_thread_swap(sch, &dt->context, &sch->main);
 }
 
 /*
  * @METHOD_NAME: resume
  * @METHOD_DESC: resume a given dthread and suspend the currently running dthread.
+ * When the resumed dthread finishes, the control goes back to the caller.
  * @METHOD_PROTO: void resume(int id)
  * @METHOD_PARAM: id the dthread id of the target dthread.
  * @METHOD_RETURN: this method do not return any value.
@@ -269,53 +607,35 @@ void mk_thread_resume(int id)
 {
     struct mk_thread *dt;
     struct mk_thread *running_dt;
+    struct mk_thread_context *from;
     struct mk_thread_scheduler *sch;
 
     sch = pthread_getspecific(mk_thread_scheduler);
     assert(sch);
     assert(id >= 0 && id < sch->cap);
 
+    dt = sch->dt[id];
+    if (!dt) return;
+    assert(dt->status == MK_THREAD_READY || dt->status == MK_THREAD_SUSPEND);
+
     running_dt = NULL;
     if (sch->running_id != -1) {
         running_dt = sch->dt[sch->running_id];
+        running_dt->status = MK_THREAD_SUSPEND;
+        from = &running_dt->context;
+    }
+    else {
+        from = &sch->main;
     }
 
-    dt = sch->dt[id];
-    if (!dt) return;
-    switch (dt->status) {
-    case MK_THREAD_READY:
-        getcontext(&dt->context);
-        dt->context.uc_stack.ss_sp = dt->stack;
-        dt->context.uc_stack.ss_size = MK_THREAD_STACK_SIZE;
-        if (running_dt) {
-            dt->context.uc_link = &running_dt->context;
-            dt->parent_id = sch->running_id;
-            running_dt->status = MK_THREAD_SUSPEND;
-        } else {
-            dt->context.uc_link = &sch->main;
-        }
-        sch->running_id = id;
-        dt->status = MK_THREAD_RUNNING;
-        makecontext(&dt->context, (void (*)(void))_mk_thread_entry_point, 1, sch);
-        if (running_dt) {
-            swapcontext(&running_dt->context, &dt->context);
-        } else {
-            swapcontext(&sch->main, &dt->context);
-        }
-        break;
-    case MK_THREAD_SUSPEND:
-        sch->running_id = id;
-        dt->status = MK_THREAD_RUNNING;
-        if (running_dt) {
-            running_dt->status = MK_THREAD_SUSPEND;
-            swapcontext(&running_dt->context, &dt->context);
-        } else {
-            swapcontext(&sch->main, &dt->context);
-        }
-        break;
-    default:
-        assert(0);
+    if (dt->status == MK_THREAD_READY) {
+        mk_thread_context_init(dt);
     }
+
+    dt->parent_id = sch->running_id;
+    sch->running_id = id;
+    dt->status = MK_THREAD_RUNNING;
+    mk_thread_swap(sch, from, &dt->context);
 }
 
 /*
@@ -0,0 +1,360 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_affinity.h>
+#include <monkey/mk_scheduler.h>
+
+#include <sched.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Parse a CPU list in the sysfs format, e.g: "0-3,8,10-11" */
+static int mk_affinity_cpulist(const char *str, cpu_set_t *set)
+{
+    long a;
+    long b;
+    char *end;
+    const char *p = str;
+
+    CPU_ZERO(set);
+    while (*p) {
+        if (*p == ',' || isspace((unsigned char) *p)) {
+            p++;
+            continue;
+        }
+
+        a = strtol(p, &end, 10);
+        if (end == p || a < 0 || a >= CPU_SETSIZE) {
+            return -1;
+        }
+        b = a;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            b = strtol(p, &end, 10);
+            if (end == p || b < a || b >= CPU_SETSIZE) {
+                return -1;
+            }
+            p = end;
+        }
+
+        for (; a <= b; a++) {
+            CPU_SET(a, set);
+        }
+    }
+
+    if (CPU_COUNT(set) == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Map every CPU to its NUMA node using sysfs, returns the number of
+ * nodes found (zero if the topology is not exported).
+ */
+static int mk_affinity_topology(short *cpu_node)
+{
+    int i;
+    int node;
+    int nodes = 0;
+    char *buf;
+    char path[MK_MAX_PATH];
+    cpu_set_t set;
+    DIR *dir;
+    struct dirent *ent;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        cpu_node[i] = -1;
+    }
+
+    dir = opendir(MK_AFFINITY_SYSFS_NODE);
+    if (!dir) {
+        return 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) != 0 ||
+            !isdigit((unsigned char) ent->d_name[4])) {
+            continue;
+        }
+
+        node = atoi(ent->d_name + 4);
+        if (node >= MK_AFFINITY_MAX_NODES) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s/cpulist",
+                 MK_AFFINITY_SYSFS_NODE, ent->d_name);
+        buf = mk_file_to_buffer(path);
+        if (!buf) {
+            continue;
+        }
+
+        /* Memory only nodes have an empty list */
+        if (mk_affinity_cpulist(buf, &set) == 0) {
+            for (i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &set)) {
+                    cpu_node[i] = node;
+                }
+            }
+            nodes++;
+        }
+        mk_mem_free(buf);
+    }
+    closedir(dir);
+
+    return nodes;
+}
+
+/*
+ * Order the allowed CPUs so consecutive workers land on different NUMA
+ * nodes: the first CPU of every node, then the second one, and so on.
+ */
+static int mk_affinity_auto(cpu_set_t *allowed, short *cpu_node, int *cpus)
+{
+    int i;
+    int n = 0;
+    int rank;
+    int more;
+    short *node_rank;
+    int count[MK_AFFINITY_MAX_NODES + 1] = {0};
+
+    node_rank = mk_mem_alloc(sizeof(short) * CPU_SETSIZE);
+    if (!node_rank) {
+        return -1;
+    }
+
+    /* CPUs with an unknown node are grouped in the last slot */
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, allowed)) {
+            continue;
+        }
+        if (cpu_node[i] >= 0) {
+            node_rank[i] = count[cpu_node[i]]++;
+        }
+        else {
+            node_rank[i] = count[MK_AFFINITY_MAX_NODES]++;
+        }
+    }
+
+    rank = 0;
+    do {
+        more = MK_FALSE;
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, allowed)) {
+                continue;
+            }
+            if (node_rank[i] == rank) {
+                cpus[n++] = i;
+            }
+            else if (node_rank[i] > rank) {
+                more = MK_TRUE;
+            }
+        }
+        rank++;
+    } while (more == MK_TRUE);
+
+    mk_mem_free(node_rank);
+    return n;
+}
+
+/*
+ * Assign a CPU (and its NUMA node) to every worker based on the
+ * WorkerAffinity setting. It runs before the workers are launched.
+ */
+int mk_affinity_init(struct mk_server *server, struct mk_sched_ctx *ctx)
+{
+    int i;
+    int n = 0;
+    int nodes;
+    int *cpus;
+    short *cpu_node;
+    char *conf = server->workers_affinity;
+    cpu_set_t allowed;
+    cpu_set_t set;
+    struct mk_sched_worker *worker;
+
+    for (i = 0; i < server->workers; i++) {
+        ctx->workers[i].cpu = -1;
+        ctx->workers[i].numa_node = -1;
+    }
+
+    if (!conf || strcasecmp(conf, MK_AFFINITY_OFF) == 0) {
+        if (server->reuseport_steering == MK_TRUE) {
+            mk_warn("[affinity] ReusePortSteering needs WorkerAffinity, "
+                    "disabled");
+            server->reuseport_steering = MK_FALSE;
+        }
+        return 0;
+    }
+
+#if defined(__linux__)
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        mk_libc_error("sched_getaffinity");
+        return -1;
+    }
+
+    cpus = mk_mem_alloc(sizeof(int) * CPU_SETSIZE);
+    cpu_node = mk_mem_alloc(sizeof(short) * CPU_SETSIZE);
+    if (!cpus || !cpu_node) {
+        mk_mem_free(cpus);
+        mk_mem_free(cpu_node);
+        return -1;
+    }
+    nodes = mk_affinity_topology(cpu_node);
+
+    if (strcasecmp(conf, MK_AFFINITY_AUTO) == 0) {
+        n = mk_affinity_auto(&allowed, cpu_node, cpus);
+    }
+    else {
+        if (mk_affinity_cpulist(conf, &set) != 0) {
+            mk_err("[affinity] invalid WorkerAffinity value '%s'", conf);
+            goto error;
+        }
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &set)) {
+                continue;
+            }
+            if (!CPU_ISSET(i, &allowed)) {
+                mk_err("[affinity] CPU %i is not available", i);
+                goto error;
+            }
+            cpus[n++] = i;
+        }
+    }
+
+    if (n <= 0) {
+        goto error;
+    }
+
+    if (server->workers > n) {
+        mk_warn("[affinity] %i workers share %i CPUs", server->workers, n);
+
+        /*
+         * The steering program returns the first worker pinned to the
+         * receiving CPU, the other workers sharing it would stay idle.
+         */
+        if (server->reuseport_steering == MK_TRUE) {
+            mk_warn("[affinity] ReusePortSteering needs one CPU per worker, "
+                    "disabled");
+            server->reuseport_steering = MK_FALSE;
+        }
+    }
+
+    for (i = 0; i < server->workers; i++) {
+        worker = &ctx->workers[i];
+        worker->cpu = cpus[i % n];
+
+        /* Memory placement only matters with more than one node */
+        if (nodes > 1) {
+            worker->numa_node = cpu_node[worker->cpu];
+        }
+    }
+
+    if (server->reuseport_steering == MK_TRUE &&
+        server->scheduler_mode != MK_SCHEDULER_REUSEPORT) {
+        mk_warn("[affinity] ReusePortSteering needs SO_REUSEPORT, disabled");
+        server->reuseport_steering = MK_FALSE;
+    }
+
+    mk_mem_free(cpus);
+    mk_mem_free(cpu_node);
+    return 0;
+
+error:
+    mk_mem_free(cpus);
+    mk_mem_free(cpu_node);
+    return -1;
+#else
+    (void) allowed;
+    (void) set;
+    (void) cpus;
+    (void) cpu_node;
+    (void) nodes;
+    (void) n;
+    (void) worker;
+
+    mk_warn("[affinity] WorkerAffinity is not supported on this platform");
+    server->reuseport_steering = MK_FALSE;
+    return 0;
+#endif
+}
+
+/*
+ * Pin the calling worker thread to its CPU and make its future memory
+ * allocations prefer the local NUMA node. It must run in the worker
+ * context before the per thread caches are allocated.
+ */
+int mk_affinity_worker_bind(struct mk_sched_worker *worker)
+{
+#if defined(__linux__)
+    int ret;
+    cpu_set_t set;
+    unsigned long mask[MK_AFFINITY_MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (worker->cpu < 0) {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        mk_warn("[affinity] could not pin worker %i to CPU %i",
+                worker->idx, worker->cpu);
+        return -1;
+    }
+
+    if (worker->numa_node < 0) {
+        return 0;
+    }
+
+    memset(mask, '\0', sizeof(mask));
+    mask[worker->numa_node / (8 * sizeof(unsigned long))] |=
+        1UL << (worker->numa_node % (8 * sizeof(unsigned long)));
+
+    ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                  MK_AFFINITY_MAX_NODES + 1);
+    if (ret != 0) {
+        mk_warn("[affinity] could not set memory policy for worker %i",
+                worker->idx);
+        return -1;
+    }
+
+    MK_TRACE("[affinity] worker %i on CPU %i, node %i",
+             worker->idx, worker->cpu, worker->numa_node);
+    return 0;
+#else
+    (void) worker;
+    return 0;
+#endif
+}
@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_allocator.h>
+
+#ifdef MALLOC_JEMALLOC
+
+static int mk_allocator_get(const char *fmt, unsigned int arena, size_t *val)
+{
+    size_t len = sizeof(size_t);
+    char name[64];
+
+    snprintf(name, sizeof(name), fmt, arena);
+    return je_mallctl(name, val, &len, NULL, 0);
+}
+
+/*
+ * Bind the calling worker thread to its own jemalloc arena and apply the
+ * thread cache and decay settings. It runs in the worker context right
+ * after the thread is registered.
+ */
+int mk_allocator_worker_init(struct mk_server *server,
+                             struct mk_sched_worker *worker)
+{
+    int ret;
+    bool tcache;
+    char name[64];
+    unsigned int arena;
+    size_t len = sizeof(arena);
+    ssize_t decay;
+
+    worker->malloc_arena = -1;
+
+    if (server->mem_tcache == MK_FALSE) {
+        tcache = false;
+        ret = je_mallctl("thread.tcache.enabled", NULL, NULL,
+                         &tcache, sizeof(tcache));
+        if (ret != 0) {
+            mk_warn("[allocator] could not disable thread cache: %s",
+                    strerror(ret));
+        }
+    }
+
+    if (server->mem_worker_arena == MK_FALSE) {
+        return 0;
+    }
+
+    ret = je_mallctl("arenas.extend", &arena, &len, NULL, 0);
+    if (ret != 0) {
+        mk_warn("[allocator] could not create worker arena: %s",
+                strerror(ret));
+        return -1;
+    }
+
+    ret = je_mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena));
+    if (ret != 0) {
+        mk_warn("[allocator] could not bind worker %i to arena %u: %s",
+                worker->idx, arena, strerror(ret));
+        return -1;
+    }
+    worker->malloc_arena = arena;
+
+    if (server->mem_decay_time != MK_ALLOCATOR_DECAY_DEFAULT) {
+        decay = server->mem_decay_time;
+        snprintf(name, sizeof(name), "arena.%u.decay_time", arena);
+        ret = je_mallctl(name, NULL, NULL, &decay, sizeof(decay));
+        if (ret != 0) {
+            mk_warn("[allocator] could not set decay time on arena %u: %s",
+                    arena, strerror(ret));
+        }
+    }
+
+    MK_TRACE("[allocator] worker %i uses arena %u", worker->idx, arena);
+    return 0;
+}
+
+/* Statistics are cached by jemalloc, refresh them once per report */
+int mk_allocator_stats_refresh()
+{
+    uint64_t epoch = 1;
+    size_t len = sizeof(epoch);
+
+    return je_mallctl("epoch", &epoch, &len, &epoch, len);
+}
+
+int mk_allocator_worker_stats(struct mk_sched_worker *worker,
+                              struct mk_allocator_stats *stats)
+{
+    int ret = 0;
+    unsigned int i;
+    size_t page;
+    size_t small;
+    size_t large;
+    size_t huge;
+    size_t pactive;
+    size_t pdirty;
+    size_t metadata;
+    size_t len = sizeof(page);
+
+    if (worker->malloc_arena < 0) {
+        return -1;
+    }
+    i = worker->malloc_arena;
+
+    ret |= je_mallctl("arenas.page", &page, &len, NULL, 0);
+    ret |= mk_allocator_get("stats.arenas.%u.small.allocated", i, &small);
+    ret |= mk_allocator_get("stats.arenas.%u.large.allocated", i, &large);
+    ret |= mk_allocator_get("stats.arenas.%u.huge.allocated", i, &huge);
+    ret |= mk_allocator_get("stats.arenas.%u.pactive", i, &pactive);
+    ret |= mk_allocator_get("stats.arenas.%u.pdirty", i, &pdirty);
+    ret |= mk_allocator_get("stats.arenas.%u.metadata.mapped", i, &metadata);
+    ret |= mk_allocator_get("stats.arenas.%u.mapped", i, &stats->mapped);
+    if (ret != 0) {
+        return -1;
+    }
+
+    stats->allocated = small + large + huge;
+    stats->active    = pactive * page;
+    stats->resident  = (pactive + pdirty) * page + metadata;
+    stats->fragmented = stats->active - stats->allocated;
+
+    return 0;
+}
+
+#else
+
+/* The system allocator does not offer any of this */
+int mk_allocator_worker_init(struct mk_server *server,
+                             struct mk_sched_worker *worker)
+{
+    (void) server;
+
+    worker->malloc_arena = -1;
+    return 0;
+}
+
+int mk_allocator_stats_refresh()
+{
+    return -1;
+}
+
+int mk_allocator_worker_stats(struct mk_sched_worker *worker,
+                              struct mk_allocator_stats *stats)
+{
+    (void) worker;
+    (void) stats;
+
+    return -1;
+}
+
+#endif
@@ -0,0 +1,198 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdarg.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_arena.h>
+
+/* Usable bytes of a regular chunk */
+#define MK_ARENA_CHUNK_DATA  (MK_ARENA_CHUNK_SIZE - sizeof(struct mk_arena_chunk))
+
+void mk_arena_pool_init(struct mk_arena_pool *pool, int max)
+{
+    pool->count  = 0;
+    pool->max    = max;
+    pool->chunks = NULL;
+}
+
+void mk_arena_pool_destroy(struct mk_arena_pool *pool)
+{
+    struct mk_arena_chunk *c;
+
+    while (pool->chunks) {
+        c = pool->chunks;
+        pool->chunks = c->next;
+        mk_mem_free(c);
+    }
+    pool->count = 0;
+}
+
+static struct mk_arena_chunk *mk_arena_chunk_get(struct mk_arena *arena,
+                                                 size_t size)
+{
+    struct mk_arena_chunk *c;
+    struct mk_arena_pool *pool = arena->pool;
+
+    if (size == MK_ARENA_CHUNK_DATA && pool && pool->chunks) {
+        c = pool->chunks;
+        pool->chunks = c->next;
+        pool->count--;
+    }
+    else {
+        c = mk_mem_alloc(sizeof(struct mk_arena_chunk) + size);
+        if (!c) {
+            return NULL;
+        }
+        c->size = size;
+    }
+    c->used = 0;
+
+    return c;
+}
+
+/*
+ * The current chunk is full: small requests open a new regular chunk,
+ * big ones (more than half a chunk) get their own chunk so the free
+ * space left in the current one is not wasted.
+ */
+void *mk_arena_alloc_slow(struct mk_arena *arena, size_t size)
+{
+    struct mk_arena_chunk *c;
+
+    if (size > MK_ARENA_CHUNK_DATA / 2) {
+        c = mk_arena_chunk_get(arena, size);
+        if (!c) {
+            return NULL;
+        }
+        c->used = size;
+
+        if (arena->head) {
+            c->next = arena->head->next;
+            arena->head->next = c;
+        }
+        else {
+            c->next = NULL;
+            arena->head = c;
+        }
+        return c->data;
+    }
+
+    c = mk_arena_chunk_get(arena, MK_ARENA_CHUNK_DATA);
+    if (!c) {
+        return NULL;
+    }
+    c->used = size;
+    c->next = arena->head;
+    arena->head = c;
+
+    return c->data;
+}
+
+char *mk_arena_strndup(struct mk_arena *arena, const char *s, size_t len)
+{
+    char *p;
+
+    p = mk_arena_alloc(arena, len + 1);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, s, len);
+    p[len] = '\0';
+
+    return p;
+}
+
+/* Concatenate two buffers into a NULL terminated string */
+char *mk_arena_cat(struct mk_arena *arena,
+                   const char *buf1, size_t len1,
+                   const char *buf2, size_t len2)
+{
+    char *p;
+
+    p = mk_arena_alloc(arena, len1 + len2 + 1);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, buf1, len1);
+    memcpy(p + len1, buf2, len2);
+    p[len1 + len2] = '\0';
+
+    return p;
+}
+
+/* Format a string, trying first to write it in place on the current chunk */
+char *mk_arena_printf(struct mk_arena *arena, const char *fmt, ...)
+{
+    int n;
+    char *p = NULL;
+    size_t avail = 0;
+    va_list ap;
+    struct mk_arena_chunk *c = arena->head;
+
+    if (c) {
+        p = c->data + c->used;
+        avail = c->size - c->used;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(p, avail, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return NULL;
+    }
+
+    if ((size_t) n < avail) {
+        /* Already in place, just claim the space */
+        return mk_arena_alloc(arena, n + 1);
+    }
+
+    p = mk_arena_alloc(arena, n + 1);
+    if (!p) {
+        return NULL;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(p, n + 1, fmt, ap);
+    va_end(ap);
+
+    return p;
+}
+
+/* Release every allocation, regular chunks are kept in the pool */
+void mk_arena_reset(struct mk_arena *arena)
+{
+    struct mk_arena_chunk *c;
+    struct mk_arena_pool *pool = arena->pool;
+
+    while (arena->head) {
+        c = arena->head;
+        arena->head = c->next;
+
+        if (c->size == MK_ARENA_CHUNK_DATA && pool && pool->count < pool->max) {
+            c->next = pool->chunks;
+            pool->chunks = c;
+            pool->count++;
+        }
+        else {
+            mk_mem_free(c);
+        }
+    }
+}
@@ -27,6 +27,9 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_allocator.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_ratelimit.h>
 #include <monkey/mk_mimetype.h>
 
 #include <ctype.h>
@@ -102,6 +105,14 @@ void mk_config_free_all(struct mk_server *server)
         mk_mem_free(server->transport_layer);
     }
 
+    if (server->metrics_path) {
+        mk_mem_free(server->metrics_path);
+    }
+
+    if (server->workers_affinity) {
+        mk_mem_free(server->workers_affinity);
+    }
+
     mk_config_listeners_free(server);
 
     mk_ptr_free(&server->server_software);
@@ -275,8 +286,10 @@ static int mk_config_listen_read(struct mk_rconf_section *section,
 static int mk_config_read_files(char *path_conf, char *file_conf,
                                 struct mk_server *server)
 {
+    long num;
     unsigned long len;
     char *tmp = NULL;
+    char *value;
     struct stat checkdir;
     struct mk_rconf *cnf;
     struct mk_rconf_section *section;
@@ -342,6 +355,59 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         }
     }
 
+    /* Workers CPU affinity */
+    if (!server->workers_affinity) {
+        server->workers_affinity = mk_rconf_section_get_key(section,
+                                                            "WorkerAffinity",
+                                                            MK_RCONF_STR);
+    }
+
+    /* Steer REUSEPORT connections to the worker on the receiving CPU */
+    if (server->reuseport_steering == MK_FALSE) {
+        server->reuseport_steering =
+            (size_t) mk_rconf_section_get_key(section, "ReusePortSteering",
+                                              MK_RCONF_BOOL);
+        if (server->reuseport_steering == MK_ERROR) {
+            mk_config_print_error_msg("ReusePortSteering", tmp);
+        }
+    }
+
+    /*
+     * Allocator: per worker arenas, thread cache and decay time. They are
+     * optional, a missing key keeps the default.
+     */
+    value = mk_rconf_section_get_key(section, "MemoryWorkerArena",
+                                     MK_RCONF_STR);
+    if (value) {
+        mk_mem_free(value);
+        server->mem_worker_arena =
+            (size_t) mk_rconf_section_get_key(section, "MemoryWorkerArena",
+                                              MK_RCONF_BOOL);
+        if (server->mem_worker_arena == MK_ERROR) {
+            mk_config_print_error_msg("MemoryWorkerArena", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "MemoryTcache", MK_RCONF_STR);
+    if (value) {
+        mk_mem_free(value);
+        server->mem_tcache =
+            (size_t) mk_rconf_section_get_key(section, "MemoryTcache",
+                                              MK_RCONF_BOOL);
+        if (server->mem_tcache == MK_ERROR) {
+            mk_config_print_error_msg("MemoryTcache", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "MemoryDecayTime", MK_RCONF_STR);
+    if (value) {
+        server->mem_decay_time = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->mem_decay_time < -1) {
+            mk_config_print_error_msg("MemoryDecayTime", tmp);
+        }
+    }
+
     /* Timeout */
     server->timeout = (size_t) mk_rconf_section_get_key(section,
                                                            "Timeout", MK_RCONF_NUM);
@@ -427,6 +493,73 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         mk_config_print_error_msg("SymLink", tmp);
     }
 
+    /* Metrics endpoint */
+    if (!server->metrics_path) {
+        server->metrics_path = mk_rconf_section_get_key(section,
+                                                        "MetricsPath",
+                                                        MK_RCONF_STR);
+        if (server->metrics_path && server->metrics_path[0] != '/') {
+            mk_config_print_error_msg("MetricsPath", tmp);
+        }
+    }
+
+    /* Per client rate limiting */
+    value = mk_rconf_section_get_key(section, "RateLimitConnections",
+                                     MK_RCONF_STR);
+    if (value) {
+        server->ratelimit_connections = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->ratelimit_connections < 0) {
+            mk_config_print_error_msg("RateLimitConnections", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "RateLimitRequests",
+                                     MK_RCONF_STR);
+    if (value) {
+        server->ratelimit_requests = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->ratelimit_requests < 0) {
+            mk_config_print_error_msg("RateLimitRequests", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "RateLimitBurst", MK_RCONF_STR);
+    if (value) {
+        server->ratelimit_burst = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->ratelimit_burst < 1) {
+            mk_config_print_error_msg("RateLimitBurst", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "RateLimitPrefixIPv4",
+                                     MK_RCONF_STR);
+    if (value) {
+        server->ratelimit_prefix4 = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->ratelimit_prefix4 < 0 || server->ratelimit_prefix4 > 32) {
+            mk_config_print_error_msg("RateLimitPrefixIPv4", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "RateLimitPrefixIPv6",
+                                     MK_RCONF_STR);
+    if (value) {
+        server->ratelimit_prefix6 = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->ratelimit_prefix6 < 0 || server->ratelimit_prefix6 > 128) {
+            mk_config_print_error_msg("RateLimitPrefixIPv6", tmp);
+        }
+    }
+
+    server->ratelimit_silent = (size_t) mk_rconf_section_get_key(section,
+                                                                 "RateLimitSilent",
+                                                                 MK_RCONF_BOOL);
+    if (server->ratelimit_silent == MK_ERROR) {
+        mk_config_print_error_msg("RateLimitSilent", tmp);
+    }
+
     /* Transport Layer plugin */
     if (!server->transport_layer) {
         server->transport_layer = mk_rconf_section_get_key(section,
@@ -441,18 +574,72 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", tmp);
     }
 
-    /* File Descriptor Table (FDT) */
+    /* Open file cache (FDT) */
     server->fdt = (size_t) mk_rconf_section_get_key(section,
                                                     "FDT",
                                                     MK_RCONF_BOOL);
 
-    /* FIXME: Overcapacity not ready */
+    value = mk_rconf_section_get_key(section, "FileCacheSize", MK_RCONF_STR);
+    if (value) {
+        server->file_cache_size = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->file_cache_size < 1) {
+            mk_config_print_error_msg("FileCacheSize", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "FileCacheValid", MK_RCONF_STR);
+    if (value) {
+        server->file_cache_valid = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->file_cache_valid < 0) {
+            mk_config_print_error_msg("FileCacheValid", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "FileCacheThreads", MK_RCONF_STR);
+    if (value) {
+        server->file_cache_threads = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (server->file_cache_threads < 0) {
+            mk_config_print_error_msg("FileCacheThreads", tmp);
+        }
+    }
+
+    value = mk_rconf_section_get_key(section, "ZeroCopyThreshold",
+                                     MK_RCONF_STR);
+    if (value) {
+        num = strtol(value, NULL, 10);
+        mk_mem_free(value);
+        if (num < 0) {
+            mk_config_print_error_msg("ZeroCopyThreshold", tmp);
+        }
+        server->zerocopy_threshold = num;
+#ifndef MK_HAVE_ZEROCOPY
+        if (num > 0) {
+            mk_warn("ZeroCopyThreshold: MSG_ZEROCOPY is not supported");
+            server->zerocopy_threshold = 0;
+        }
+#endif
+    }
+
+        /* FIXME: Overcapacity not ready */
     server->fd_limit = (size_t) mk_rconf_section_get_key(section,
                                                            "FDLimit",
                                                            MK_RCONF_NUM);
     /* Get each worker clients capacity based on FDs system limits */
     server->server_capacity = mk_server_capacity(server);
 
+    /* Cached files must not take more than half of the descriptors */
+    if (server->fdt == MK_TRUE &&
+        (unsigned int) (server->file_cache_size * server->workers) >
+        server->server_capacity / 2) {
+        server->file_cache_size = server->server_capacity /
+                                  (2 * server->workers);
+        mk_warn("FileCacheSize reduced to %i per worker by FDLimit",
+                server->file_cache_size);
+    }
+
 
     if (!server->one_shot) {
         mk_vhost_init(path_conf, server);
@@ -584,7 +771,25 @@ void mk_config_set_init_values(struct mk_server *server)
     server->open_flags = O_RDONLY | O_NONBLOCK;
     server->index_files = NULL;
     server->conf_user_pub = NULL;
+    server->metrics_path = NULL;
+    server->ratelimit_connections = 0;
+    server->ratelimit_requests = 0;
+    server->ratelimit_burst = MK_RATELIMIT_BURST;
+    server->ratelimit_prefix4 = 32;
+    server->ratelimit_prefix6 = 64;
+    server->ratelimit_silent = MK_FALSE;
+    server->ratelimit = NULL;
     server->workers = 1;
+    server->workers_affinity = NULL;
+    server->reuseport_steering = MK_FALSE;
+    server->mem_worker_arena = MK_TRUE;
+    server->mem_tcache = MK_TRUE;
+    server->mem_decay_time = MK_ALLOCATOR_DECAY_DEFAULT;
+    server->file_cache_size = MK_FILE_CACHE_SIZE;
+    server->file_cache_valid = MK_FILE_CACHE_VALID;
+    server->file_cache_threads = 0;
+    server->file_cache_pool = NULL;
+    server->zerocopy_threshold = 0;
 
     /* TCP REUSEPORT: available on Linux >= 3.9 */
     if (server->scheduler_mode == -1) {
@@ -0,0 +1,714 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_internal.h>
+#include <monkey/mk_file_cache.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+int mk_file_cache_init(struct mk_file_cache *fc, int max, int valid)
+{
+    unsigned int i;
+    unsigned int size = 16;
+
+    /* Around two buckets per entry */
+    while (size < (unsigned int) max * 2) {
+        size <<= 1;
+    }
+
+    fc->table = mk_mem_alloc(sizeof(struct mk_list) * size);
+    if (!fc->table) {
+        fc->max = 0;
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        mk_list_init(&fc->table[i]);
+    }
+    mk_list_init(&fc->lru);
+
+    fc->count = 0;
+    fc->max   = max;
+    fc->valid = valid;
+    fc->mask  = size - 1;
+
+    fc->ch_r   = -1;
+    fc->ch_w   = -1;
+    fc->closed = MK_FALSE;
+    fc->pool   = NULL;
+    mk_list_init(&fc->done);
+    pthread_mutex_init(&fc->lock, NULL);
+
+    return 0;
+}
+
+static void mk_file_cache_entry_free(struct mk_file_cache_entry *e)
+{
+    if (e->fd != -1) {
+        close(e->fd);
+    }
+    mk_mem_free(e);
+}
+
+static void mk_file_cache_job_free(struct mk_file_cache_job *job)
+{
+    if (job->fd != -1) {
+        close(job->fd);
+    }
+    mk_mem_free(job);
+}
+
+/* Take the entry out of the cache, it's released once nobody uses it */
+static void mk_file_cache_detach(struct mk_file_cache *fc,
+                                 struct mk_file_cache_entry *e)
+{
+    mk_list_del(&e->_hash);
+    mk_list_del(&e->_lru);
+    fc->count--;
+
+    if (e->readers > 0) {
+        e->stale = MK_TRUE;
+        return;
+    }
+    mk_file_cache_entry_free(e);
+}
+
+void mk_file_cache_exit(struct mk_file_cache *fc)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache_entry *e;
+    struct mk_file_cache_job *job;
+
+    if (!fc->table) {
+        return;
+    }
+
+    /* Jobs still running on the pool are released by the pool threads */
+    pthread_mutex_lock(&fc->lock);
+    fc->closed = MK_TRUE;
+    mk_list_foreach_safe(head, tmp, &fc->done) {
+        job = mk_list_entry(head, struct mk_file_cache_job, _head);
+        mk_list_del(&job->_head);
+        mk_file_cache_job_free(job);
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    if (fc->ch_r != -1) {
+        close(fc->ch_r);
+    }
+    if (fc->ch_w != -1 && fc->ch_w != fc->ch_r) {
+        close(fc->ch_w);
+    }
+
+    /* Any entry still referenced is freed by its last reader */
+    mk_list_foreach_safe(head, tmp, &fc->lru) {
+        e = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+        mk_file_cache_detach(fc, e);
+    }
+
+    mk_mem_free(fc->table);
+    fc->table = NULL;
+    fc->max = 0;
+}
+
+static inline struct mk_file_cache *mk_file_cache_get(struct mk_server *server)
+{
+    struct mk_sched_worker *worker;
+
+    if (server->fdt == MK_FALSE) {
+        return NULL;
+    }
+
+    worker = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (mk_unlikely(!worker || worker->file_cache.max <= 0)) {
+        return NULL;
+    }
+
+    return &worker->file_cache;
+}
+
+static struct mk_file_cache_entry *mk_file_cache_lookup(struct mk_file_cache *fc,
+                                                        unsigned int hash,
+                                                        const char *path,
+                                                        int len)
+{
+    struct mk_list *head;
+    struct mk_file_cache_entry *e;
+
+    mk_list_foreach(head, &fc->table[hash & fc->mask]) {
+        e = mk_list_entry(head, struct mk_file_cache_entry, _hash);
+        if (e->hash == hash && e->len == len &&
+            memcmp(e->path, path, len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* Compare the entry with a fresh stat(2) of its path */
+static inline int mk_file_cache_same(struct mk_file_cache_entry *e,
+                                     struct stat *st)
+{
+    return (st->st_dev == e->dev && st->st_ino == e->ino &&
+            st->st_size == e->size && st->st_mtime == e->mtime &&
+            st->st_ctime == e->ctime);
+}
+
+/* Get the file information plus its identity for the cache */
+static int mk_file_cache_fetch(const char *path, struct file_info *info,
+                               struct stat *st)
+{
+    int ret;
+
+    ret = mk_file_get_info(path, info, MK_FILE_READ);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (stat(path, st) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Make room for a new entry closing the least recently used one that is
+ * not serving a request. Returns -1 if every entry is busy.
+ */
+static int mk_file_cache_evict(struct mk_file_cache *fc)
+{
+    struct mk_list *head;
+    struct mk_file_cache_entry *e;
+
+    mk_list_foreach(head, &fc->lru) {
+        e = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+        if (e->readers == 0) {
+            mk_file_cache_detach(fc, e);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static struct mk_file_cache_entry *mk_file_cache_add(struct mk_file_cache *fc,
+                                                     unsigned int hash,
+                                                     const char *path, int len,
+                                                     struct file_info *info,
+                                                     struct stat *st)
+{
+    struct mk_file_cache_entry *e;
+
+    if (fc->count >= fc->max && mk_file_cache_evict(fc) == -1) {
+        return NULL;
+    }
+
+    e = mk_mem_alloc(sizeof(struct mk_file_cache_entry) + len + 1);
+    if (!e) {
+        return NULL;
+    }
+
+    e->hash    = hash;
+    e->fd      = -1;
+    e->readers = 0;
+    e->stale   = MK_FALSE;
+    e->checked = log_current_utime;
+    e->dev     = st->st_dev;
+    e->ino     = st->st_ino;
+    e->size    = st->st_size;
+    e->mtime   = st->st_mtime;
+    e->ctime   = st->st_ctime;
+    e->info    = *info;
+    e->len     = len;
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+
+    mk_list_add(&e->_hash, &fc->table[hash & fc->mask]);
+    mk_list_add(&e->_lru, &fc->lru);
+    fc->count++;
+
+    return e;
+}
+
+/* The request references the entry until mk_file_cache_close() */
+static inline void mk_file_cache_pin(struct mk_file_cache *fc,
+                                     struct mk_http_request *sr,
+                                     struct mk_file_cache_entry *e)
+{
+    /* Most recently used goes last */
+    mk_list_del(&e->_lru);
+    mk_list_add(&e->_lru, &fc->lru);
+
+    e->readers++;
+    sr->file_cache = e;
+    sr->file_info = e->info;
+}
+
+static void mk_file_cache_release(struct mk_http_request *sr)
+{
+    struct mk_file_cache_entry *e = sr->file_cache;
+
+    sr->file_cache = NULL;
+    e->readers--;
+
+    if (e->stale == MK_TRUE && e->readers == 0) {
+        mk_file_cache_entry_free(e);
+    }
+}
+
+/*
+ * Store the result of a lookup. A current entry for the same path is
+ * kept if the file did not change, 'fd' (if any) is owned by the cache.
+ */
+static int mk_file_cache_update(struct mk_file_cache *fc,
+                                struct mk_http_request *sr,
+                                unsigned int hash, int ret,
+                                struct file_info *info, struct stat *st,
+                                int fd)
+{
+    struct mk_file_cache_entry *e;
+
+    e = mk_file_cache_lookup(fc, hash, sr->real_path.data, sr->real_path.len);
+    if (e) {
+        if (ret == 0 && mk_file_cache_same(e, st)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            e->checked = log_current_utime;
+            mk_file_cache_pin(fc, sr, e);
+            return 0;
+        }
+        MK_TRACE("[file cache] '%s' changed", e->path);
+        mk_file_cache_detach(fc, e);
+    }
+
+    sr->file_info = *info;
+    if (ret != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return ret;
+    }
+
+    e = mk_file_cache_add(fc, hash, sr->real_path.data, sr->real_path.len,
+                          info, st);
+    if (!e) {
+        /* Not cached, the file is opened again by the request */
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    e->fd = fd;
+    mk_file_cache_pin(fc, sr, e);
+    return 0;
+}
+
+/* Queue a lookup on the pool, the request resumes on completion */
+static int mk_file_cache_submit(struct mk_file_cache *fc,
+                                struct mk_http_request *sr)
+{
+    struct mk_file_cache_job *job;
+    struct mk_file_cache_pool *pool = fc->pool;
+
+    job = mk_mem_alloc(sizeof(struct mk_file_cache_job) +
+                       sr->real_path.len + 1);
+    if (!job) {
+        return -1;
+    }
+
+    job->done = MK_FALSE;
+    job->ret  = -1;
+    job->fd   = -1;
+    job->sr   = sr;
+    job->fc   = fc;
+    job->len  = sr->real_path.len;
+    memcpy(job->path, sr->real_path.data, job->len);
+    job->path[job->len] = '\0';
+    sr->file_job = job;
+
+    pthread_mutex_lock(&pool->lock);
+    mk_list_add(&job->_head, &pool->queue);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/*
+ * Get the file information of the request real path, it replaces a call
+ * to mk_file_get_info(). On success the request holds a reference to the
+ * cache entry until mk_file_cache_close(). If the lookup went to the pool
+ * it returns MK_FILE_CACHE_PENDING and the request is resumed later, the
+ * next call consumes the result.
+ */
+int mk_file_cache_stat(struct mk_http_request *sr, struct mk_server *server)
+{
+    int ret;
+    unsigned int hash;
+    struct stat st;
+    struct file_info info;
+    struct mk_file_cache *fc;
+    struct mk_file_cache_job *job;
+    struct mk_file_cache_entry *e;
+
+    /* A new lookup for the same request, e.g: the directory index */
+    if (sr->file_cache) {
+        mk_file_cache_release(sr);
+    }
+
+    fc = mk_file_cache_get(server);
+    if (!fc) {
+        return mk_file_get_info(sr->real_path.data, &sr->file_info,
+                                MK_FILE_READ);
+    }
+
+    hash = mk_utils_gen_hash(sr->real_path.data, sr->real_path.len);
+
+    /*
+     * Resumed request: the pool already did the job. The request starts
+     * over from the URI, so the job may belong to a later lookup (e.g: the
+     * directory index), in that case it's kept and the lookups before it
+     * run in the worker, otherwise the request would be parked forever.
+     */
+    job = sr->file_job;
+    if (job && job->len == (int) sr->real_path.len &&
+        memcmp(job->path, sr->real_path.data, job->len) == 0) {
+        sr->file_job = NULL;
+        ret = mk_file_cache_update(fc, sr, hash, job->ret, &job->info,
+                                   &job->st, job->fd);
+        job->fd = -1;
+        mk_mem_free(job);
+        return ret;
+    }
+
+    e = mk_file_cache_lookup(fc, hash, sr->real_path.data, sr->real_path.len);
+    if (e) {
+        if (log_current_utime - e->checked < fc->valid) {
+            mk_file_cache_pin(fc, sr, e);
+            return 0;
+        }
+
+        /* Cheap revalidation when it runs in the worker */
+        if ((!fc->pool || job) && stat(e->path, &st) == 0 &&
+            mk_file_cache_same(e, &st)) {
+            e->checked = log_current_utime;
+            mk_file_cache_pin(fc, sr, e);
+            return 0;
+        }
+    }
+
+    if (fc->pool && !job && mk_file_cache_submit(fc, sr) == 0) {
+        return MK_FILE_CACHE_PENDING;
+    }
+
+    ret = mk_file_cache_fetch(sr->real_path.data, &info, &st);
+    return mk_file_cache_update(fc, sr, hash, ret, &info, &st, -1);
+}
+
+/* Open the request file, cached entries share one descriptor */
+int mk_file_cache_open(struct mk_http_request *sr, struct mk_server *server)
+{
+    struct mk_file_cache_entry *e = sr->file_cache;
+    (void) server;
+
+    if (!e) {
+        return open(sr->real_path.data, sr->file_info.flags_read_only);
+    }
+
+    if (e->fd == -1) {
+        e->fd = open(e->path, e->info.flags_read_only);
+    }
+
+    return e->fd;
+}
+
+/* The request is done with its file */
+int mk_file_cache_close(struct mk_http_request *sr, struct mk_server *server)
+{
+    int fd;
+    int ret = -1;
+    struct mk_file_cache_job *job = sr->file_job;
+    (void) server;
+
+    /* A pending job is dropped once it completes */
+    if (job) {
+        sr->file_job = NULL;
+        if (job->done == MK_TRUE) {
+            mk_file_cache_job_free(job);
+        }
+        else {
+            job->sr = NULL;
+        }
+    }
+
+    /*
+     * The entry owns its descriptor. A request that looked up a cached
+     * file may still get its own one, e.g: a custom error page.
+     */
+    fd = sr->file_fd;
+    sr->file_fd = -1;
+    if (sr->file_cache) {
+        if (fd == sr->file_cache->fd) {
+            fd = -1;
+        }
+        mk_file_cache_release(sr);
+        ret = 0;
+    }
+
+    /* in_file is not reset between requests, file_fd is */
+    if (fd > 0) {
+        ret = close(fd);
+    }
+
+    return ret;
+}
+
+/* Is the request parked waiting for the pool ? */
+int mk_file_cache_pending(struct mk_http_request *sr)
+{
+    return (sr->file_job && sr->file_job->done == MK_FALSE);
+}
+
+/* Worker side: the pool delivered some results */
+static int mk_file_cache_notify(void *data)
+{
+    int ret;
+    uint64_t val;
+    struct mk_list jobs;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_event *event = data;
+    struct mk_file_cache *fc;
+    struct mk_file_cache_job *job;
+    struct mk_http_request *sr;
+
+    fc = mk_list_entry(event, struct mk_file_cache, event);
+
+    ret = read(fc->ch_r, &val, sizeof(val));
+    if (ret <= 0) {
+        return 0;
+    }
+
+    mk_list_init(&jobs);
+    pthread_mutex_lock(&fc->lock);
+    mk_list_foreach_safe(head, tmp, &fc->done) {
+        job = mk_list_entry(head, struct mk_file_cache_job, _head);
+        mk_list_del(&job->_head);
+        mk_list_add(&job->_head, &jobs);
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    mk_list_foreach_safe(head, tmp, &jobs) {
+        job = mk_list_entry(head, struct mk_file_cache_job, _head);
+        mk_list_del(&job->_head);
+
+        sr = job->sr;
+        if (!sr) {
+            /* The connection went away while the job was running */
+            mk_file_cache_job_free(job);
+            continue;
+        }
+
+        /* From here the job belongs to the request */
+        job->done = MK_TRUE;
+        mk_http_request_resume(sr, fc->pool->server);
+    }
+
+    return 0;
+}
+
+/* Register the completion channel in the worker event loop */
+int mk_file_cache_worker_start(struct mk_file_cache *fc,
+                               struct mk_event_loop *loop,
+                               struct mk_server *server)
+{
+    int ret;
+    int fd[2];
+
+    if (!fc->table || !server->file_cache_pool) {
+        return 0;
+    }
+
+#ifdef MK_HAVE_EVENTFD
+    fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd[0] == -1) {
+        mk_libc_error("eventfd");
+        return -1;
+    }
+    fd[1] = fd[0];
+#else
+    if (pipe(fd) == -1) {
+        mk_libc_error("pipe");
+        return -1;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+#endif
+
+    fc->ch_r = fd[0];
+    fc->ch_w = fd[1];
+
+    MK_EVENT_INIT(&fc->event, fc->ch_r, fc, mk_file_cache_notify);
+    ret = mk_event_add(loop, fc->ch_r, MK_EVENT_CUSTOM, MK_EVENT_READ,
+                       &fc->event);
+    if (ret != 0) {
+        return -1;
+    }
+
+    fc->pool = server->file_cache_pool;
+    return 0;
+}
+
+/* Pool thread: run the blocking calls and hand the result to the worker */
+static void mk_file_cache_pool_worker(void *data)
+{
+    uint64_t val = 1;
+    struct mk_file_cache_pool *pool = data;
+    struct mk_file_cache_job *job;
+    struct mk_file_cache *fc;
+
+    mk_utils_worker_rename("monkey: file io");
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->stop == MK_FALSE && mk_list_is_empty(&pool->queue) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop == MK_TRUE) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = mk_list_entry_first(&pool->queue,
+                                  struct mk_file_cache_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->ret = mk_file_cache_fetch(job->path, &job->info, &job->st);
+        if (job->ret == 0 && job->info.is_directory == MK_FALSE &&
+            job->info.read_access == MK_TRUE && job->info.size > 0) {
+            job->fd = open(job->path, job->info.flags_read_only);
+        }
+
+        fc = job->fc;
+        pthread_mutex_lock(&fc->lock);
+        if (fc->closed == MK_TRUE) {
+            pthread_mutex_unlock(&fc->lock);
+            mk_file_cache_job_free(job);
+            continue;
+        }
+        mk_list_add(&job->_head, &fc->done);
+        if (write(fc->ch_w, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+            mk_libc_error("write");
+        }
+        pthread_mutex_unlock(&fc->lock);
+    }
+}
+
+int mk_file_cache_pool_create(struct mk_server *server)
+{
+    int i;
+    struct mk_file_cache_pool *pool;
+
+    if (server->fdt == MK_FALSE || server->file_cache_threads <= 0) {
+        return 0;
+    }
+
+    pool = mk_mem_alloc_z(sizeof(struct mk_file_cache_pool));
+    if (!pool) {
+        return -1;
+    }
+
+    pool->tids = mk_mem_alloc_z(sizeof(pthread_t) * server->file_cache_threads);
+    if (!pool->tids) {
+        mk_mem_free(pool);
+        return -1;
+    }
+
+    pool->stop = MK_FALSE;
+    pool->server = server;
+    mk_list_init(&pool->queue);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    server->file_cache_pool = pool;
+
+    for (i = 0; i < server->file_cache_threads; i++) {
+        if (mk_utils_worker_spawn(mk_file_cache_pool_worker, pool,
+                                  &pool->tids[i]) != 0) {
+            break;
+        }
+        pool->threads++;
+    }
+
+    if (pool->threads == 0) {
+        mk_file_cache_pool_destroy(server);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* It runs once the workers are gone */
+void mk_file_cache_pool_destroy(struct mk_server *server)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache_job *job;
+    struct mk_file_cache_pool *pool = server->file_cache_pool;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = MK_TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threads; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->queue) {
+        job = mk_list_entry(head, struct mk_file_cache_job, _head);
+        mk_list_del(&job->_head);
+        mk_file_cache_job_free(job);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    mk_mem_free(pool->tids);
+    mk_mem_free(pool);
+    server->file_cache_pool = NULL;
+}
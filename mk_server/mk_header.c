@@ -113,6 +113,7 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_CLIENT_UNSUPPORTED_MEDIA, MK_RH_CLIENT_UNSUPPORTED_MEDIA),
     status_entry(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
                  MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF),
+    status_entry(MK_CLIENT_TOO_MANY_REQUESTS, MK_RH_CLIENT_TOO_MANY_REQUESTS),
 
     /* Server side errors */
     status_entry(MK_SERVER_INTERNAL_ERROR, MK_RH_SERVER_INTERNAL_ERROR),
@@ -129,9 +130,21 @@ static const int status_response_len =
 static void mk_header_cb_finished(struct mk_stream_input *in)
 {
     struct mk_iov *iov = in->buffer;
+    struct mk_metrics *metrics;
+    struct mk_http_request *sr;
 
     mk_iov_free_marked(iov);
 
+    /* Headers are out: time to first byte */
+    sr = container_of(in, struct mk_http_request, in_headers);
+    if (sr->metrics_start > 0) {
+        metrics = mk_sched_metrics();
+        if (metrics) {
+            mk_metrics_hist_add(&metrics->ttfb,
+                                mk_metrics_now() - sr->metrics_start);
+        }
+    }
+
 #if defined(__APPLE__)
         /*
          * Disable TCP_CORK right away, according to:
@@ -162,6 +175,84 @@ static void cb_stream_iov_extended_free(struct mk_stream_input *in)
     mk_iov_free(iov);
 }
 
+/* Connection row, only needed to close or to keep alive a HTTP/1.0 client */
+static inline void mk_header_connection(struct mk_http_session *cs,
+                                        struct mk_http_request *sr,
+                                        struct mk_iov *iov)
+{
+    if (cs->close_now == MK_FALSE) {
+        if (sr->connection.len > 0) {
+            if (sr->protocol != MK_HTTP_PROTOCOL_11) {
+                mk_iov_add(iov,
+                           mk_header_conn_ka.data,
+                           mk_header_conn_ka.len,
+                           MK_FALSE);
+            }
+        }
+    }
+    else {
+        mk_iov_add(iov,
+                   mk_header_conn_close.data,
+                   mk_header_conn_close.len,
+                   MK_FALSE);
+    }
+}
+
+/* Status line of a known HTTP status code */
+int mk_header_status_line(int status, mk_ptr_t *line)
+{
+    int i;
+
+    for (i = 0; i < status_response_len; i++) {
+        if (status_response[i].status == status) {
+            line->data = status_response[i].response;
+            line->len  = status_response[i].length;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Send a pre-rendered response: the status line and the block of fixed
+ * headers and body are referenced as they are, just the preset rows
+ * (Server and Date) and the Connection row are set per request.
+ */
+int mk_header_prepare_static(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_vhost_static *st)
+{
+    size_t len;
+    struct response_headers *sh = &sr->headers;
+    struct mk_iov *iov = &sh->headers_iov;
+
+    sh->status = st->status;
+    sh->content_length = st->body_len;
+
+    mk_iov_add(iov, st->buf, st->head_len, MK_FALSE);
+    mk_iov_add(iov, headers_preset.data, headers_preset.len, MK_FALSE);
+    mk_header_connection(cs, sr, iov);
+
+    len = st->tail_len;
+    if (sr->method == MK_METHOD_HEAD) {
+        len -= st->body_len;
+    }
+    mk_iov_add(iov, st->buf + st->head_len, len, MK_FALSE);
+
+    sr->in_headers.type        = MK_STREAM_IOV;
+    sr->in_headers.dynamic     = MK_FALSE;
+    sr->in_headers.cb_consumed = NULL;
+    sr->in_headers.cb_finished = mk_header_cb_finished;
+    sr->in_headers.stream      = &sr->stream;
+    sr->in_headers.buffer      = iov;
+    sr->in_headers.bytes_total = iov->total_len;
+    mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
+
+    sh->sent = MK_TRUE;
+    return 0;
+}
+
 /* Send response headers */
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server)
@@ -224,22 +315,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
 
     /* Connection */
     if (sh->connection == 0) {
-        if (cs->close_now == MK_FALSE) {
-            if (sr->connection.len > 0) {
-                if (sr->protocol != MK_HTTP_PROTOCOL_11) {
-                    mk_iov_add(iov,
-                               mk_header_conn_ka.data,
-                               mk_header_conn_ka.len,
-                               MK_FALSE);
-                }
-            }
-        }
-        else {
-            mk_iov_add(iov,
-                       mk_header_conn_close.data,
-                       mk_header_conn_close.len,
-                       MK_FALSE);
-        }
+        mk_header_connection(cs, sr, iov);
     }
     else if (sh->connection == MK_HEADER_CONN_UPGRADED) {
              mk_iov_add(iov,
@@ -255,10 +331,11 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    mk_header_short_location.len,
                    MK_FALSE);
 
+        /* The location belongs to the request arena */
         mk_iov_add(iov,
                    sh->location,
                    strlen(sh->location),
-                   MK_TRUE);
+                   MK_FALSE);
     }
 
     /* allowed methods */
@@ -385,6 +462,12 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
      * Configure the Stream to dispatch the headers
      */
 
+    /* Headers deferred by a stage30 handler were unlinked, put them first */
+    if (sh->sent == MK_FALSE && !sr->in_headers._head.next) {
+        __mk_list_add(&sr->in_headers._head,
+                      &sr->stream.inputs, sr->stream.inputs.next);
+    }
+
     /* Set the IOV input stream */
     sr->in_headers.buffer      = iov;
     sr->in_headers.bytes_total = iov->total_len;
@@ -442,6 +525,7 @@ void mk_header_response_reset(struct response_headers *header)
     header->location = NULL;
     header->_extra_rows = NULL;
     header->allow_methods.len = 0;
+    header->etag_len = 0;
 
     /* Initialize headers IOV */
     iov = &header->headers_iov;
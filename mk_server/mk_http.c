@@ -39,8 +39,13 @@
 #include <monkey/mk_header.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_match.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_ratelimit.h>
+#include <monkey/mk_http_thread.h>
+#include <monkey/mk_http_async.h>
 
 const mk_ptr_t mk_http_method_get_p = mk_ptr_init(MK_METHOD_GET_STR);
 const mk_ptr_t mk_http_method_post_p = mk_ptr_init(MK_METHOD_POST_STR);
@@ -64,31 +69,86 @@ void mk_http_request_init(struct mk_http_session *session,
 
     request->port = 0;
     request->status = MK_TRUE;
+    request->user_home = MK_FALSE;
     request->uri.data = NULL;
     request->method = MK_METHOD_UNKNOWN;
     request->protocol = MK_HTTP_PROTOCOL_UNKNOWN;
     request->connection.len = -1;
+    request->headers_len = 0;
+    request->content_length = 0;
+
+    /*
+     * The request buffer comes from a worker pool, it's not zeroed: the
+     * fields the parser sets only when present in the request would be
+     * left from a previous client.
+     */
+    mk_ptr_reset(&request->method_p);
+    mk_ptr_reset(&request->protocol_p);
+    mk_ptr_reset(&request->body);
+    mk_ptr_reset(&request->data);
+    mk_ptr_reset(&request->query_string);
+    mk_ptr_reset(&request->content_type);
+    mk_ptr_reset(&request->_content_length);
+    mk_ptr_reset(&request->host_port);
+    mk_ptr_reset(&request->if_modified_since);
+    mk_ptr_reset(&request->last_modified_since);
+    mk_ptr_reset(&request->range);
     request->file_fd        = -1;
     request->file_info.size = -1;
-    request->vhost_fdt_id = 0;
-    request->vhost_fdt_hash = 0;
-    request->vhost_fdt_enabled = MK_FALSE;
+    request->file_cache = NULL;
+    request->file_job = NULL;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
+    request->stage30_handler = NULL;
+    request->stage30_async = MK_FALSE;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct mk_vhost, _head);
+    request->host_alias = NULL;
     request->uri_processed.data = NULL;
     request->real_path.data = NULL;
     request->handler_data = NULL;
+    request->http_thread = NULL;
+    request->http_async = NULL;
+
+    /* Arrival time, used by the latency histograms */
+    if (mk_metrics_enabled(server)) {
+        request->metrics_start = mk_metrics_now();
+    }
+    else {
+        request->metrics_start = 0;
+    }
 
     /* Response Headers */
     mk_header_response_reset(&request->headers);
 
+    /* Request arena, chunks come from the worker pool */
+    mk_arena_init(&request->arena, mk_sched_arena_pool());
+
     /* Reset callbacks for headers stream */
     mk_stream_set(&request->stream,
                   session->channel,
-                  NULL,
+                  request,
                   NULL, NULL, NULL);
+    request->stream.arena = &request->arena;
+
+    /*
+     * Headers input, mk_http_init() links it. An error raised before that
+     * point (e.g: bad request) gets it linked by mk_header_prepare().
+     */
+    request->in_headers.type        = MK_STREAM_IOV;
+    request->in_headers.dynamic     = MK_FALSE;
+    request->in_headers.cb_consumed = NULL;
+    request->in_headers.cb_finished = NULL;
+    request->in_headers.stream      = &request->stream;
+    request->in_headers._head.prev  = NULL;
+    request->in_headers._head.next  = NULL;
+
+    /* File input, fd and bytes are set once the file is opened */
+    request->in_file.type           = MK_STREAM_FILE;
+    request->in_file.dynamic        = MK_FALSE;
+    request->in_file.cb_consumed    = NULL;
+    request->in_file.cb_finished    = NULL;
+    request->in_file.stream         = &request->stream;
 }
 
 static inline int mk_http_point_header(mk_ptr_t *h,
@@ -120,6 +180,7 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     struct mk_list *hosts = &server->hosts;
     struct mk_list *alias;
     struct mk_http_header *header;
+    struct mk_metrics *metrics;
 
     /*
      * Process URI, if it contains ASCII encoded strings like '%20',
@@ -148,17 +209,17 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     }
 
     /* Check if we have a Host header: Hostname ; port */
-    mk_http_point_header(&sr->host, &cs->parser, MK_HEADER_HOST);
+    mk_http_point_header(&sr->host, cs->parser, MK_HEADER_HOST);
 
     /* Header: Connection */
-    mk_http_point_header(&sr->connection, &cs->parser, MK_HEADER_CONNECTION);
+    mk_http_point_header(&sr->connection, cs->parser, MK_HEADER_CONNECTION);
 
     /* Header: Range */
-    mk_http_point_header(&sr->range, &cs->parser, MK_HEADER_RANGE);
+    mk_http_point_header(&sr->range, cs->parser, MK_HEADER_RANGE);
 
     /* Header: If-Modified-Since */
     mk_http_point_header(&sr->if_modified_since,
-                         &cs->parser,
+                         cs->parser,
                          MK_HEADER_IF_MODIFIED_SINCE);
 
     /* HTTP/1.1 needs Host header */
@@ -170,8 +231,25 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     /* Should we close the session after this request ? */
     mk_http_keepalive_check(cs, sr, server);
 
+    /* Per client request rate limit, the 429 honors the keep-alive check */
+    if (server->ratelimit &&
+        mk_ratelimit_request(cs->conn->ratelimit_key, server) != 0) {
+        MK_TRACE("[FD %i] Request rate limit", cs->socket);
+        metrics = mk_sched_metrics();
+        if (metrics) {
+            metrics->ratelimit_requests++;
+        }
+
+        if (server->ratelimit_silent == MK_TRUE) {
+            cs->close_now = MK_TRUE;
+            return MK_EXIT_ABORT;
+        }
+        mk_http_error(MK_CLIENT_TOO_MANY_REQUESTS, cs, sr, server);
+        return MK_EXIT_OK;
+    }
+
     /* Content Length */
-    header = &cs->parser.headers[MK_HEADER_CONTENT_LENGTH];
+    header = &cs->parser->headers[MK_HEADER_CONTENT_LENGTH];
     if (header->type == MK_HEADER_CONTENT_LENGTH) {
         sr->_content_length.data = header->val.data;
         sr->_content_length.len  = header->val.len;
@@ -187,8 +265,8 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
 
     if (sr->host.data) {
         /* Set the given port */
-        if (cs->parser.header_host_port > 0) {
-            sr->port = cs->parser.header_host_port;
+        if (cs->parser->header_host_port > 0) {
+            sr->port = cs->parser->header_host_port;
         }
 
         /* Match the virtual host */
@@ -197,7 +275,8 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         /* Check if this virtual host have some redirection */
         if (sr->host_conf->header_redirect.data) {
             mk_header_set_http_status(sr, MK_REDIR_MOVED);
-            sr->headers.location = mk_string_dup(sr->host_conf->header_redirect.data);
+            sr->headers.location = mk_arena_strdup(&sr->arena,
+                                                   sr->host_conf->header_redirect.data);
             sr->headers.content_length = 0;
             sr->headers.location = NULL;
             mk_header_prepare(cs, sr, server);
@@ -210,9 +289,10 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         sr->uri_processed.len > 2 &&
         sr->uri_processed.data[1] == MK_USER_HOME) {
 
-        if (mk_user_init(cs, sr, server) != 0) {
+        /* The error response ends the request */
+        if (mk_user_init(sr, server) != 0) {
             mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
-            return MK_EXIT_ABORT;
+            return MK_EXIT_OK;
         }
     }
 
@@ -247,7 +327,7 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
      * to do not break the plugins stages
      */
     if (mk_list_is_empty(sr_list) == 0) {
-        sr = &cs->sr_fixed;
+        sr = cs->sr_fixed;
         memset(sr, 0, sizeof(struct mk_http_request));
         mk_http_request_init(cs, sr, server);
         mk_list_add(&sr->_head, &cs->request_list);
@@ -282,6 +362,7 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
     int new_size;
     int total_bytes = 0;
     char *tmp = 0;
+    struct mk_metrics *metrics;
 
 #ifdef TRACE
     int socket = conn->event.fd;
@@ -344,6 +425,11 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
         return -1;
     }
 
+    metrics = mk_sched_metrics();
+    if (metrics) {
+        metrics->bytes_in += bytes;
+    }
+
     if (bytes > max_read) {
         MK_TRACE("[FD %i] Buffer still have data: %i",
                  socket, bytes - max_read);
@@ -494,10 +580,8 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
 {
     int port_redirect = 0;
     char *host;
-    char *location = 0;
     char *real_location = 0;
     char *protocol = "http";
-    unsigned long len;
 
     /*
      * We have to check if there is a slash at the end of
@@ -507,15 +591,10 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
         return 0;
     }
 
-    host = mk_ptr_to_buf(sr->host);
-
-    /*
-     * Add ending slash to the location string
-     */
-    location = mk_mem_alloc(sr->uri_processed.len + 2);
-    memcpy(location, sr->uri_processed.data, sr->uri_processed.len);
-    location[sr->uri_processed.len]     = '/';
-    location[sr->uri_processed.len + 1] = '\0';
+    host = mk_arena_strndup(&sr->arena, sr->host.data, sr->host.len);
+    if (!host) {
+        return -1;
+    }
 
     /* FIXME: should we done something similar for SSL = 443 */
     if (sr->host.data && sr->port > 0) {
@@ -528,17 +607,21 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
         protocol = "https";
     }
 
+    /* Add ending slash to the location string */
     if (port_redirect > 0) {
-        mk_string_build(&real_location, &len, "%s://%s:%i%s\r\n",
-                        protocol, host, port_redirect, location);
+        real_location = mk_arena_printf(&sr->arena, "%s://%s:%i%.*s/\r\n",
+                                        protocol, host, port_redirect,
+                                        (int) sr->uri_processed.len,
+                                        sr->uri_processed.data);
     }
     else {
-        mk_string_build(&real_location, &len, "%s://%s%s\r\n",
-                        protocol, host, location);
+        real_location = mk_arena_printf(&sr->arena, "%s://%s%.*s/\r\n",
+                                        protocol, host,
+                                        (int) sr->uri_processed.len,
+                                        sr->uri_processed.data);
     }
 
     MK_TRACE("Redirecting to '%s'", real_location);
-    mk_mem_free(host);
 
     mk_header_set_http_status(sr, MK_REDIR_MOVED);
     sr->headers.content_length = 0;
@@ -551,8 +634,7 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
 
     mk_header_prepare(cs, sr, server);
 
-    /* we do not free() real_location as it's freed by iov */
-    mk_mem_free(location);
+    /* real_location lives in the request arena */
     sr->headers.location = NULL;
     return -1;
 }
@@ -625,13 +707,15 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 {
     int ret;
     int ret_file;
+    int handler_id;
+    size_t uri_len;
     struct mk_mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
     struct mk_plugin *plugin;
     struct mk_vhost_handler *h_handler;
+    struct mk_vhost_static *st;
     size_t index_length;
     size_t index_bytes;
+    uint64_t start;
     char *index_path = NULL;
 
 
@@ -660,31 +744,31 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             sr->real_path.len = len;
         }
         else {
-            ret = mk_buffer_cat(&sr->real_path,
-                                sr->host_conf->documentroot.data,
-                                sr->host_conf->documentroot.len,
-                                sr->uri_processed.data,
-                                sr->uri_processed.len);
-
-            if (ret < 0) {
+            sr->real_path.data = mk_arena_cat(&sr->arena,
+                                              sr->host_conf->documentroot.data,
+                                              sr->host_conf->documentroot.len,
+                                              sr->uri_processed.data,
+                                              sr->uri_processed.len);
+            if (!sr->real_path.data) {
                 MK_TRACE("Error composing real path");
                 return MK_EXIT_ERROR;
             }
+            sr->real_path.len = len;
         }
     }
 
     /* Check if this is related to a protocol upgrade */
-    if (cs->parser.header_connection & MK_HTTP_PARSER_CONN_UPGRADE) {
+    if (cs->parser->header_connection & MK_HTTP_PARSER_CONN_UPGRADE) {
         /* HTTP/2.0 upgrade ? */
-        if (cs->parser.header_connection & MK_HTTP_PARSER_CONN_HTTP2_SE) {
+        if (cs->parser->header_connection & MK_HTTP_PARSER_CONN_HTTP2_SE) {
             MK_TRACE("Connection Upgrade request: HTTP/2.0");
             /*
              * This is a HTTP/2.0 upgrade, we need to validate that we
              * have at least the 'Upgrade' and 'HTTP2-Settings' headers.
              */
             struct mk_http_header *p;
-            p = &cs->parser.headers[MK_HEADER_HTTP2_SETTINGS];
-            if (cs->parser.header_upgrade == MK_HTTP_PARSER_UPGRADE_H2C &&
+            p = &cs->parser->headers[MK_HEADER_HTTP2_SETTINGS];
+            if (cs->parser->header_upgrade == MK_HTTP_PARSER_UPGRADE_H2C &&
                 p->key.data) {
                 /*
                  * Switch protocols and invoke the callback upgrade to prepare
@@ -712,8 +796,21 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
     }
 
+    /* Pre-rendered responses skip the file system and the handlers */
+    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
+        st = mk_vhost_static_lookup(sr->host_conf,
+                                    sr->uri_processed.data,
+                                    sr->uri_processed.len);
+        if (st) {
+            return mk_header_prepare_static(cs, sr, st);
+        }
+    }
 
-    ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+    ret_file = mk_file_cache_stat(sr, server);
+    if (ret_file == MK_FILE_CACHE_PENDING) {
+        /* Parked, mk_http_request_resume() starts over */
+        return MK_EXIT_OK;
+    }
 
     /* Manually set the headers input streams */
     sr->in_headers.type        = MK_STREAM_IOV;
@@ -726,17 +823,22 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         sr->uri_processed.data[sr->uri_processed.len] = '\0';
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(&h_handler->match,
-                        sr->uri_processed.data, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        handler_id = -1;
+        while ((h_handler = mk_vhost_handler_next(sr->host_conf,
+                                                  sr->uri_processed.data,
+                                                  sr->uri_processed.len,
+                                                  &handler_id))) {
             if (h_handler->cb) {
                 sr->headers.content_length = 0;
+                if (h_handler->thread == MK_TRUE) {
+                    return mk_http_thread_start(cs, sr, h_handler, server);
+                }
                 h_handler->cb(sr, h_handler->data);
+                if (sr->http_async) {
+                    /* Completed later through mk_http_async_done() */
+                    mk_http_request_defer(sr);
+                    return MK_PLUGIN_RET_CONTINUE;
+                }
                 mk_header_prepare(cs, sr, server);
                 return 0;
             }
@@ -747,15 +849,29 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                 }
                 plugin = h_handler->handler;
                 sr->stage30_handler = h_handler->handler;
+                start = mk_plugin_stage_clock(NULL, server);
                 ret = plugin->stage->stage30(plugin, cs, sr,
                                              h_handler->n_params,
                                              &h_handler->params);
-                mk_header_prepare(cs, sr, server);
+                mk_plugin_stage_account(MK_METRICS_STAGE_30, start);
+
+                /* Unless the handler already prepared them (e.g: auth) */
+                if (sr->headers.sent == MK_TRUE) {
+                    MK_TRACE("[FD %i] STAGE_30 headers ready", cs->socket);
+                }
+                else if (sr->headers.status > 0) {
+                    mk_header_prepare(cs, sr, server);
+                }
+                else {
+                    /* The handler will compose the headers later */
+                    mk_stream_input_unlink(&sr->in_headers);
+                }
             }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
+                sr->stage30_async = MK_TRUE;
                 return MK_PLUGIN_RET_CONTINUE;
             case MK_PLUGIN_RET_CLOSE_CONX:
                 if (sr->headers.status > 0) {
@@ -770,6 +886,14 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         }
     }
 
+    /*
+     * Internal metrics endpoint, served once the handlers matching its path
+     * passed on the request: a plugin like auth can protect it.
+     */
+    if (server->metrics_path && mk_metrics_is_path(sr, server) == MK_TRUE) {
+        return mk_metrics_serve(cs, sr, server);
+    }
+
     /* If there is no handler and the resource don't exists, raise a 404 */
     if (ret_file == -1) {
         return mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
@@ -792,24 +916,28 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                                           &index_length, &index_bytes,
                                           server);
         if (index_path) {
-            if (sr->real_path.data != sr->real_path_static) {
-                mk_ptr_free(&sr->real_path);
-                sr->real_path.data = mk_string_dup(index_path);
-            }
             /* If it's static and it still fits */
-            else if (index_length < MK_PATH_BASE) {
+            if (sr->real_path.data == sr->real_path_static &&
+                index_length < MK_PATH_BASE) {
                 memcpy(sr->real_path_static, index_path, index_length);
                 sr->real_path_static[index_length] = '\0';
             }
-            /* It was static, but didn't fit */
             else {
-                sr->real_path.data = mk_string_dup(index_path);
+                sr->real_path.data = mk_arena_strndup(&sr->arena, index_path,
+                                                      index_length);
+                if (!sr->real_path.data) {
+                    return mk_http_error(MK_SERVER_INTERNAL_ERROR,
+                                         cs, sr, server);
+                }
             }
             sr->real_path.len  = index_length;
 
-            ret = mk_file_get_info(sr->real_path.data,
-                                   &sr->file_info, MK_FILE_READ);
-            if (ret != 0) {
+            ret = mk_file_cache_stat(sr, server);
+            if (ret == MK_FILE_CACHE_PENDING) {
+                mk_stream_input_unlink(&sr->in_headers);
+                return MK_EXIT_OK;
+            }
+            else if (ret != 0) {
                 return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
             }
 
@@ -838,28 +966,29 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         if (!index_path) {
             sr->uri_processed.data[sr->uri_processed.len] = '\0';
             uri = sr->uri_processed.data;
+            uri_len = sr->uri_processed.len;
         }
         else {
             uri = sr->real_path.data + index_bytes;
+            uri_len = sr->real_path.len - index_bytes;
         }
 
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(&h_handler->match,
-                        uri, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        handler_id = -1;
+        while ((h_handler = mk_vhost_handler_next(sr->host_conf,
+                                                  uri, uri_len,
+                                                  &handler_id))) {
             plugin = h_handler->handler;
             sr->stage30_handler = h_handler->handler;
+            start = mk_plugin_stage_clock(NULL, server);
             ret = plugin->stage->stage30(plugin, cs, sr,
                                          h_handler->n_params,
                                          &h_handler->params);
+            mk_plugin_stage_account(MK_METRICS_STAGE_30, start);
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
+                sr->stage30_async = MK_TRUE;
                 return MK_PLUGIN_RET_CONTINUE;
             case MK_PLUGIN_RET_CLOSE_CONX:
                 if (sr->headers.status > 0) {
@@ -961,7 +1090,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     /* Open file */
     if (mk_likely(sr->file_info.size > 0)) {
-        sr->file_fd = mk_vhost_open(sr, server);
+        sr->file_fd = mk_file_cache_open(sr, server);
         if (sr->file_fd == -1) {
             MK_TRACE("open() failed");
             return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
@@ -1061,10 +1190,10 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
     }
 
     if (sr->connection.data) {
-        if (cs->parser.header_connection == MK_HTTP_PARSER_CONN_KA) {
+        if (cs->parser->header_connection == MK_HTTP_PARSER_CONN_KA) {
             cs->close_now  = MK_FALSE;
         }
-        else if (cs->parser.header_connection == MK_HTTP_PARSER_CONN_CLOSE) {
+        else if (cs->parser->header_connection == MK_HTTP_PARSER_CONN_CLOSE) {
             cs->close_now  = MK_TRUE;
         }
     }
@@ -1087,8 +1216,8 @@ static inline void mk_http_request_ka_next(struct mk_http_session *cs)
     cs->init_time = log_current_utime;
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
 
-    /* Initialize parser */
-    mk_http_parser_init(&cs->parser);
+    /* Nothing is pending, release the buffers until the next request */
+    mk_http_session_idle(cs);
 }
 
 int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
@@ -1098,20 +1227,25 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
     int len;
     struct mk_http_request *sr;
 
+    /* Already ended, the session went idle until the next request */
+    if (!cs->buf) {
+        return 0;
+    }
+
     if (server->max_keep_alive_request <= cs->counter_connections) {
         cs->close_now = MK_TRUE;
         goto shutdown;
     }
 
     /* Check if we have some enqueued pipeline requests */
-    ret = mk_http_parser_more(&cs->parser, cs->body_length);
+    ret = mk_http_parser_more(cs->parser, cs->body_length);
     if (ret == MK_TRUE) {
 
         /* Our pipeline request limit is the same that our keepalive limit */
         cs->counter_connections++;
-        len = (cs->body_length - cs->parser.i) -1;
+        len = (cs->body_length - cs->parser->i) -1;
         memmove(cs->body,
-                cs->body + cs->parser.i + 1,
+                cs->body + cs->parser->i + 1,
                 len);
         cs->body_length = len;
 
@@ -1119,8 +1253,8 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
         sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
         mk_http_request_free(sr, server);
         mk_http_request_init(cs, sr, server);
-        mk_http_parser_init(&cs->parser);
-        status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length,
+        mk_http_parser_init(cs->parser);
+        status = mk_http_parser(sr, cs->parser, cs->body, cs->body_length,
                                 server);
         if (status == MK_HTTP_PARSER_OK) {
             mk_http_request_prepare(cs, sr, server);
@@ -1217,7 +1351,8 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
             sr->headers.real_length    = finfo.size;
             mk_header_prepare(cs, sr, server);
 
-            /* Stream setup */
+            /* Stream setup, the descriptor is closed with the request */
+            sr->file_fd = fd;
             mk_stream_in_file(&sr->stream, &sr->in_file, sr->file_fd,
                               finfo.size, 0, NULL, NULL);
             return MK_EXIT_OK;
@@ -1251,6 +1386,15 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
                            &page.data, &page.len);
         mk_ptr_free(&message);
         break;
+    case MK_CLIENT_TOO_MANY_REQUESTS:
+        mk_string_build(&message.data, &message.len,
+                        "Too many requests, please try again later.");
+        mk_http_error_page("Too Many Requests",
+                           &message,
+                           server->server_signature,
+                           &page.data, &page.len);
+        mk_ptr_free(&message);
+        break;
     case MK_CLIENT_METHOD_NOT_ALLOWED:
         mk_http_error_page("Method Not Allowed",
                            &sr->uri,
@@ -1334,6 +1478,14 @@ void mk_http_session_remove(struct mk_http_session *cs,
     /* On session remove, make sure to cleanup any handler */
     mk_list_foreach_safe(head, tmp, &cs->request_list) {
         sr = mk_list_entry(head, struct mk_http_request, _head);
+        if (sr->http_thread) {
+            MK_TRACE("Hangup library handler dthread");
+            mk_http_thread_cancel(sr->http_thread);
+        }
+        if (sr->http_async) {
+            MK_TRACE("Hangup deferred library response");
+            mk_http_async_cancel(sr->http_async);
+        }
         if (sr->stage30_handler) {
             MK_TRACE("Hangup stage30 handler");
             handler = sr->stage30_handler;
@@ -1345,16 +1497,128 @@ void mk_http_session_remove(struct mk_http_session *cs,
         }
     }
 
-    if (cs->body != cs->body_fixed) {
-        mk_mem_free(cs->body);
-    }
     mk_http_request_free_list(cs, server);
     mk_list_del(&cs->request_list);
+    mk_http_session_idle(cs);
 
     cs->_sched_init = MK_FALSE;
 
 }
 
+/* Get a session buffer from the worker pool */
+static struct mk_http_session_buf *mk_http_session_buf_get()
+{
+    struct mk_http_session_buf *buf;
+    struct mk_sched_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (worker && worker->session_pool_count > 0) {
+        buf = mk_list_entry_first(&worker->session_pool,
+                                  struct mk_http_session_buf, _head);
+        mk_list_del(&buf->_head);
+        worker->session_pool_count--;
+        return buf;
+    }
+
+    return mk_mem_alloc(sizeof(struct mk_http_session_buf));
+}
+
+static void mk_http_session_buf_put(struct mk_http_session_buf *buf)
+{
+    struct mk_sched_worker *worker;
+
+    worker = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (worker && worker->session_pool_count < MK_HTTP_SESSION_POOL_MAX) {
+        mk_list_add(&buf->_head, &worker->session_pool);
+        worker->session_pool_count++;
+        return;
+    }
+
+    mk_mem_free(buf);
+}
+
+/* Release the pool of session buffers of the calling worker */
+void mk_http_session_pool_exit(struct mk_sched_worker *worker)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_session_buf *buf;
+
+    mk_list_foreach_safe(head, tmp, &worker->session_pool) {
+        buf = mk_list_entry(head, struct mk_http_session_buf, _head);
+        mk_list_del(&buf->_head);
+        mk_mem_free(buf);
+    }
+    worker->session_pool_count = 0;
+}
+
+/*
+ * Attach the request state to a session: data arrived on a new or idle
+ * connection.
+ */
+int mk_http_session_wake(struct mk_http_session *cs)
+{
+    struct mk_http_session_buf *buf;
+
+    buf = mk_http_session_buf_get();
+    if (!buf) {
+        return -1;
+    }
+
+    cs->buf = buf;
+    cs->body_fixed = buf->body_fixed;
+    cs->sr_fixed = &buf->sr_fixed;
+    cs->parser = &buf->parser;
+
+    /* alloc space for body content */
+    if (cs->conn->net->buffer_size > MK_REQUEST_CHUNK) {
+        cs->body = mk_mem_alloc(cs->conn->net->buffer_size);
+        if (!cs->body) {
+            mk_http_session_idle(cs);
+            return -1;
+        }
+        cs->body_size = cs->conn->net->buffer_size;
+    }
+    else {
+        /* Buffer size based in Chunk bytes */
+        cs->body = cs->body_fixed;
+        cs->body_size = MK_REQUEST_CHUNK;
+    }
+
+    /* Current data length */
+    cs->body_length = 0;
+
+    /* Initialize the parser */
+    mk_http_parser_init(cs->parser);
+
+    return 0;
+}
+
+/*
+ * The connection is waiting for a new keep-alive request: give back the
+ * request state and any grown body buffer, an idle session only keeps
+ * the mk_http_session fields.
+ */
+void mk_http_session_idle(struct mk_http_session *cs)
+{
+    if (!cs->buf) {
+        return;
+    }
+
+    if (cs->body != cs->body_fixed) {
+        mk_mem_free(cs->body);
+    }
+    mk_http_session_buf_put(cs->buf);
+
+    cs->body = NULL;
+    cs->body_size = 0;
+    cs->body_length = 0;
+    cs->body_fixed = NULL;
+    cs->sr_fixed = NULL;
+    cs->parser = NULL;
+    cs->buf = NULL;
+}
+
 /* FIXME: nobody is using this */
 struct mk_http_session *mk_http_session_lookup(int socket)
 {
@@ -1383,25 +1647,15 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn)
     /* creation time in unix time */
     cs->init_time = conn->arrive_time;
 
-    /* alloc space for body content */
-    if (conn->net->buffer_size > MK_REQUEST_CHUNK) {
-        cs->body = mk_mem_alloc(conn->net->buffer_size);
-        cs->body_size = conn->net->buffer_size;
-    }
-    else {
-        /* Buffer size based in Chunk bytes */
-        cs->body = cs->body_fixed;
-        cs->body_size = MK_REQUEST_CHUNK;
-    }
-
-    /* Current data length */
-    cs->body_length = 0;
-
     /* Init session request list */
     mk_list_init(&cs->request_list);
 
-    /* Initialize the parser */
-    mk_http_parser_init(&cs->parser);
+    /* Request state: body buffer and parser */
+    cs->buf = NULL;
+    if (mk_http_session_wake(cs) != 0) {
+        cs->_sched_init = MK_FALSE;
+        return -1;
+    }
 
     return 0;
 }
@@ -1409,24 +1663,50 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn)
 
 void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
 {
-    /* Let the vhost interface to handle the session close */
-    mk_vhost_close(sr, server);
+    int status;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_metrics *metrics;
+    struct mk_stream_input *in;
 
-    if (sr->headers.location) {
-        mk_mem_free(sr->headers.location);
+    /* Account the request if a response was sent */
+    metrics = mk_sched_metrics();
+    if (metrics && sr->headers.sent == MK_TRUE) {
+        metrics->requests++;
+
+        status = sr->headers.status / 100;
+        if (status < 1 || status > 5) {
+            status = 0;
+        }
+        metrics->status[status]++;
+
+        if (sr->metrics_start > 0) {
+            mk_metrics_hist_add(&metrics->total,
+                                mk_metrics_now() - sr->metrics_start);
+        }
+        sr->headers.sent = MK_FALSE;
     }
 
+    /* Release the file, the cache decides if it's closed */
+    mk_file_cache_close(sr, server);
+
     if (sr->uri_processed.data != sr->uri.data) {
         mk_ptr_free(&sr->uri_processed);
     }
 
-    if (sr->real_path.data != sr->real_path_static) {
-        mk_ptr_free(&sr->real_path);
-    }
-
     if (sr->stream.channel) {
+        /* Inputs not sent (client gone) may hold shared buffer references */
+        mk_list_foreach_safe(head, tmp, &sr->stream.inputs) {
+            in = mk_list_entry(head, struct mk_stream_input, _head);
+            mk_stream_in_release(in);
+        }
         mk_stream_release(&sr->stream);
     }
+
+    /* The location, real path and stream inputs go away with the arena */
+    sr->headers.location = NULL;
+    sr->real_path.data = NULL;
+    mk_arena_reset(&sr->arena);
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs,
@@ -1442,7 +1722,7 @@ void mk_http_request_free_list(struct mk_http_session *cs,
         mk_list_del(&request->_head);
 
         mk_http_request_free(request, server);
-        if (request != &cs->sr_fixed) {
+        if (request != cs->sr_fixed) {
             mk_mem_free(request);
         }
     }
@@ -1456,7 +1736,7 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
                                           const char *key, unsigned int len)
 {
     int i;
-    struct mk_http_parser *parser = &req->session->parser;
+    struct mk_http_parser *parser = req->session->parser;
     struct mk_http_header *header;
 
     /* Known header */
@@ -1483,6 +1763,90 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
     return NULL;
 }
 
+/* Does any stream of the channel have data waiting to be sent ? */
+static int mk_http_channel_pending(struct mk_channel *channel)
+{
+    struct mk_list *head;
+    struct mk_stream *stream;
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * The file cache pool completed the lookup of a parked request: run the
+ * request again (the lookup result is consumed this time) and flush the
+ * response from the write handler.
+ */
+void mk_http_request_resume(struct mk_http_request *sr,
+                            struct mk_server *server)
+{
+    int status;
+    struct mk_http_session *cs = sr->session;
+    struct mk_sched_conn *conn = cs->conn;
+
+    /* The directory index lookup may have replaced the user home path */
+    if (sr->user_home == MK_TRUE && mk_user_init(sr, server) != 0) {
+        mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
+        status = MK_EXIT_OK;
+    }
+    else {
+        status = mk_http_init(cs, sr, server);
+        if (mk_file_cache_pending(sr)) {
+            /* Parked again, e.g: looking for the directory index */
+            return;
+        }
+    }
+
+    /* Same outcomes as mk_http_request_prepare() in mk_http_sched_read() */
+    if (cs->_sched_init == MK_FALSE ||
+        (status == MK_EXIT_ABORT &&
+         mk_http_channel_pending(cs->channel) == MK_FALSE)) {
+        mk_sched_event_close(conn, mk_sched_get_thread_conf(),
+                             MK_EP_SOCKET_CLOSED, server);
+        return;
+    }
+    else if (status == MK_EXIT_ABORT) {
+        cs->close_now = MK_TRUE;
+    }
+
+    mk_event_add(mk_sched_loop(), conn->event.fd,
+                 MK_EVENT_CONNECTION, MK_EVENT_WRITE, conn);
+}
+
+/*
+ * A library handler will complete the response later: keep it out of the
+ * channel meanwhile, the headers are composed at the end and they must go
+ * first.
+ */
+void mk_http_request_defer(struct mk_http_request *sr)
+{
+    mk_list_del(&sr->stream._head);
+    mk_list_init(&sr->stream._head);
+    sr->stage30_async = MK_TRUE;
+}
+
+/* The deferred response is complete, compose the headers and flush it */
+void mk_http_request_complete(struct mk_http_session *cs,
+                              struct mk_http_request *sr,
+                              struct mk_server *server)
+{
+    struct mk_sched_conn *conn = cs->conn;
+
+    mk_header_prepare(cs, sr, server);
+    mk_list_add(&sr->stream._head, &cs->channel->streams);
+    sr->stage30_async = MK_FALSE;
+
+    mk_event_add(mk_sched_loop(), conn->event.fd,
+                 MK_EVENT_CONNECTION, MK_EVENT_WRITE, conn);
+}
+
 /*
  * Main callbacks for the Scheduler
  */
@@ -1510,20 +1874,36 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
             return -1;
         }
     }
+    else if (!cs->buf) {
+        /* Idle keep-alive connection got a new request */
+        ret = mk_http_session_wake(cs);
+        if (ret == -1) {
+            return -1;
+        }
+    }
 
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
     ret = mk_http_handler_read(conn, cs, server);
     if (ret > 0) {
         if (mk_list_is_empty(&cs->request_list) == 0) {
             /* Add the first entry */
-            sr = &cs->sr_fixed;
+            sr = cs->sr_fixed;
             mk_list_add(&sr->_head, &cs->request_list);
             mk_http_request_init(cs, sr, server);
         }
         else {
             sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+
+            /*
+             * Parked on the file cache or on a library handler, keep the
+             * data for the next request.
+             */
+            if (mk_file_cache_pending(sr) || sr->http_thread ||
+                sr->http_async) {
+                return ret;
+            }
         }
-        status = mk_http_parser(sr, &cs->parser, cs->body,
+        status = mk_http_parser(sr, cs->parser, cs->body,
                                 cs->body_length, server);
         if (status == MK_HTTP_PARSER_OK) {
             MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
@@ -1532,7 +1912,25 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
                 return -1;
             }
             mk_sched_conn_timeout_del(conn);
-            mk_http_request_prepare(cs, sr, server);
+            status = mk_http_request_prepare(cs, sr, server);
+
+            /* An error response ended the session already */
+            if (cs->_sched_init == MK_FALSE) {
+                return -1;
+            }
+
+            /*
+             * The request was aborted: a response queued before that (e.g:
+             * by a plugin) is still sent, then the connection is closed.
+             */
+            if (status == MK_EXIT_ABORT) {
+                if (mk_http_channel_pending(cs->channel) == MK_TRUE) {
+                    cs->close_now = MK_TRUE;
+                    return ret;
+                }
+                mk_http_session_remove(cs, server);
+                return -1;
+            }
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
             /* The HTTP parser may enqueued some response error */
@@ -1580,8 +1978,23 @@ int mk_http_sched_done(struct mk_sched_conn *conn,
     struct mk_http_request *sr;
 
     cs = mk_http_session_get(conn);
+
+    /* A plugin handler already finished the request */
+    if (mk_list_is_empty(&cs->request_list) == 0) {
+        return 0;
+    }
     sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
 
+    /* The plugin handler still owns the request, wait for more data */
+    if (sr->stage30_async == MK_TRUE) {
+        return 0;
+    }
+
+    /* Waiting for the file cache, the request resumes by itself */
+    if (mk_file_cache_pending(sr)) {
+        return 0;
+    }
+
     mk_plugin_stage_run_40(cs, sr, server);
 
     return mk_http_request_end(cs, server);
@@ -0,0 +1,347 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_lib.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_internal.h>
+#include <monkey/mk_http_async.h>
+#include <monkey/mk_scheduler.h>
+
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * Intrusive MPSC queue (D. Vyukov): a push is one exchange on the head
+ * plus linking the previous node, the worker pops from the tail without
+ * locks. A pop may find a push halfway, the producer signals the channel
+ * right after finishing it so the worker comes back for it.
+ */
+static inline void mk_http_async_push(struct mk_http_async_queue *q,
+                                      struct mk_http_async_msg *msg)
+{
+    struct mk_http_async_msg *prev;
+
+    msg->next = NULL;
+    prev = __atomic_exchange_n(&q->head, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+static struct mk_http_async_msg *mk_http_async_pop(struct mk_http_async_queue *q)
+{
+    struct mk_http_async_msg *tail = q->tail;
+    struct mk_http_async_msg *next;
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* A producer is between the exchange and the link */
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    mk_http_async_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/*
+ * Apply a message to its request, 'done' releases the handle. Returns
+ * MK_TRUE if the message ownership was taken and it must not be freed.
+ */
+static int mk_http_async_apply(struct mk_http_async_msg *msg)
+{
+    struct mk_stream_buffer *buf;
+    struct mk_http_async *as = msg->async;
+    struct mk_http_request *sr = as->request;
+
+    if (msg->type == MK_HTTP_ASYNC_DONE) {
+        as->queue->count--;
+        if (sr) {
+            sr->http_async = NULL;
+            mk_http_request_complete(as->session, sr, as->queue->server);
+        }
+        mk_mem_free(as);
+        return MK_FALSE;
+    }
+
+    /* The client went away, drop it */
+    if (!sr) {
+        return MK_FALSE;
+    }
+
+    switch (msg->type) {
+    case MK_HTTP_ASYNC_STATUS:
+        mk_http_status(sr, msg->status);
+        break;
+    case MK_HTTP_ASYNC_HEADER:
+        mk_http_header(sr, msg->data, msg->key_len,
+                       msg->data + msg->key_len, msg->len - msg->key_len);
+        break;
+    case MK_HTTP_ASYNC_BODY:
+        /* The body is sent from the message, freed once it's written */
+        buf = mk_stream_buffer_create(msg->data, msg->len, mk_mem_free, msg);
+        if (!buf) {
+            break;
+        }
+        mk_http_send_buffer(sr, buf);
+
+        /* The message now belongs to the buffer */
+        mk_stream_buffer_put(buf);
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+static int mk_http_async_notify(void *data)
+{
+    int ret;
+    uint64_t val;
+    struct mk_event *event = data;
+    struct mk_http_async_queue *q;
+    struct mk_http_async_msg *msg;
+
+    q = (struct mk_http_async_queue *) event;
+
+    ret = read(q->ch_r, &val, sizeof(val));
+    if (ret <= 0 && errno != EAGAIN) {
+        return 0;
+    }
+
+    /* Messages pushed after this point signal again */
+    __atomic_store_n(&q->signaled, MK_FALSE, __ATOMIC_SEQ_CST);
+
+    while ((msg = mk_http_async_pop(q))) {
+        if (mk_http_async_apply(msg) == MK_FALSE) {
+            mk_mem_free(msg);
+        }
+    }
+
+    return 0;
+}
+
+static struct mk_http_async_queue *mk_http_async_queue_get()
+{
+    int ret;
+    int fd[2];
+    struct mk_http_async_queue *q;
+    struct mk_sched_worker *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (sched->async_queue) {
+        return sched->async_queue;
+    }
+
+#ifdef MK_HAVE_EVENTFD
+    fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd[0] == -1) {
+        mk_libc_error("eventfd");
+        return NULL;
+    }
+    fd[1] = fd[0];
+#else
+    if (pipe(fd) == -1) {
+        mk_libc_error("pipe");
+        return NULL;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+#endif
+
+    q = mk_mem_alloc_z(sizeof(struct mk_http_async_queue));
+    if (!q) {
+        goto error;
+    }
+    q->ch_r = fd[0];
+    q->ch_w = fd[1];
+    q->server = sched->server;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+
+    MK_EVENT_INIT(&q->event, q->ch_r, q, mk_http_async_notify);
+    ret = mk_event_add(sched->loop, q->ch_r, MK_EVENT_CUSTOM, MK_EVENT_READ,
+                       &q->event);
+    if (ret != 0) {
+        mk_mem_free(q);
+        goto error;
+    }
+
+    sched->async_queue = q;
+    return q;
+
+ error:
+    close(fd[0]);
+    if (fd[1] != fd[0]) {
+        close(fd[1]);
+    }
+    return NULL;
+}
+
+/* Runs on the worker, from the handler */
+mk_async_t *mk_http_defer(mk_request_t *req)
+{
+    struct mk_http_async *as;
+    struct mk_http_async_queue *q;
+
+    if (req->http_async) {
+        return req->http_async;
+    }
+
+    q = mk_http_async_queue_get();
+    if (!q) {
+        return NULL;
+    }
+
+    as = mk_mem_alloc_z(sizeof(struct mk_http_async));
+    if (!as) {
+        return NULL;
+    }
+    as->session = req->session;
+    as->request = req;
+    as->queue = q;
+    q->count++;
+
+    req->http_async = as;
+    return as;
+}
+
+/* Runs on any thread */
+static int mk_http_async_post(mk_async_t *as, int type, int status,
+                              const char *key, size_t key_len,
+                              const char *buf, size_t len)
+{
+    uint64_t val = 1;
+    struct mk_http_async_msg *msg;
+    struct mk_http_async_queue *q = as->queue;
+
+    if (type != MK_HTTP_ASYNC_DONE &&
+        __atomic_load_n(&as->cancelled, __ATOMIC_RELAXED) == MK_TRUE) {
+        return -1;
+    }
+
+    msg = mk_mem_alloc(sizeof(struct mk_http_async_msg) + key_len + len);
+    if (!msg) {
+        return -1;
+    }
+    msg->async = as;
+    msg->type = type;
+    msg->status = status;
+    msg->key_len = key_len;
+    msg->len = key_len + len;
+    if (key_len > 0) {
+        memcpy(msg->data, key, key_len);
+    }
+    if (len > 0) {
+        memcpy(msg->data + key_len, buf, len);
+    }
+
+    mk_http_async_push(q, msg);
+
+    /* Wake up the worker, unless a previous post did it already */
+    if (__atomic_exchange_n(&q->signaled, MK_TRUE, __ATOMIC_SEQ_CST) == MK_FALSE) {
+        if (write(q->ch_w, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+            mk_libc_error("write");
+        }
+    }
+
+    return 0;
+}
+
+int mk_http_async_status(mk_async_t *as, int status)
+{
+    return mk_http_async_post(as, MK_HTTP_ASYNC_STATUS, status,
+                              NULL, 0, NULL, 0);
+}
+
+int mk_http_async_header(mk_async_t *as,
+                         char *key, int key_len,
+                         char *val, int val_len)
+{
+    return mk_http_async_post(as, MK_HTTP_ASYNC_HEADER, 0,
+                              key, key_len, val, val_len);
+}
+
+int mk_http_async_send(mk_async_t *as, char *buf, size_t len)
+{
+    return mk_http_async_post(as, MK_HTTP_ASYNC_BODY, 0,
+                              NULL, 0, buf, len);
+}
+
+int mk_http_async_done(mk_async_t *as)
+{
+    return mk_http_async_post(as, MK_HTTP_ASYNC_DONE, 0,
+                              NULL, 0, NULL, 0);
+}
+
+/* The session is being removed, the handle lives until 'done' arrives */
+void mk_http_async_cancel(struct mk_http_async *as)
+{
+    __atomic_store_n(&as->cancelled, MK_TRUE, __ATOMIC_RELAXED);
+    as->request->http_async = NULL;
+    as->request = NULL;
+}
+
+void mk_http_async_worker_exit(struct mk_sched_worker *sched)
+{
+    struct mk_http_async_msg *msg;
+    struct mk_http_async_queue *q = sched->async_queue;
+
+    if (!q) {
+        return;
+    }
+
+    /* Handles still owned by the application keep pushing here */
+    if (q->count > 0) {
+        return;
+    }
+
+    while ((msg = mk_http_async_pop(q))) {
+        mk_mem_free(msg);
+    }
+
+    close(q->ch_r);
+    if (q->ch_w != q->ch_r) {
+        close(q->ch_w);
+    }
+    mk_mem_free(q);
+    sched->async_queue = NULL;
+}
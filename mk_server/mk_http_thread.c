@@ -0,0 +1,451 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_lib.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_internal.h>
+#include <monkey/mk_http_thread.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_socket.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_vhost.h>
+
+#ifdef MK_HAVE_TIMERFD_CREATE
+#include <sys/timerfd.h>
+#endif
+
+#ifdef MK_THREADS_POSIX
+
+/* Return the dthread of the request, only if the caller runs on it */
+static struct mk_http_thread *mk_http_thread_get(mk_request_t *req)
+{
+    struct mk_http_thread *th = req->http_thread;
+
+    if (!th || mk_thread_running() != th->id) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return th;
+}
+
+/*
+ * Park the dthread until the file descriptor reports the events in mask,
+ * the worker loop resumes it through mk_http_thread_event().
+ */
+static int mk_http_thread_wait(struct mk_http_thread *th, int fd,
+                               uint32_t mask)
+{
+    int ret;
+    struct mk_event_loop *evl;
+
+    if (th->cancelled == MK_TRUE) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    evl = mk_sched_loop();
+    ret = mk_event_add(evl, fd, MK_EVENT_CUSTOM, mask, &th->event);
+    if (ret == -1) {
+        return -1;
+    }
+
+    th->parked = MK_TRUE;
+    mk_thread_yield();
+    th->parked = MK_FALSE;
+
+    /* On cancellation the event was already removed */
+    mk_event_del(evl, &th->event);
+
+    if (th->cancelled == MK_TRUE) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mk_http_thread_entry(void *data)
+{
+    struct mk_http_thread *th = data;
+
+    th->handler->cb(th->request, th->handler->data);
+}
+
+/*
+ * The event is released together with the worker events, it may still be
+ * referenced by the events reported in the current loop iteration.
+ */
+static void mk_http_thread_release(struct mk_http_thread *th)
+{
+    th->request->http_thread = NULL;
+    mk_sched_event_free(&th->event);
+}
+
+static int mk_http_thread_event(void *data)
+{
+    struct mk_event *event = data;
+    struct mk_http_thread *th = event->data;
+    struct mk_http_request *sr = th->request;
+
+    mk_thread_resume(th->id);
+    if (th->parked == MK_TRUE) {
+        return 0;
+    }
+
+    /* The handler returned, unless it deferred the response flush it */
+    mk_http_thread_release(th);
+    if (!sr->http_async) {
+        mk_http_request_complete(th->session, sr, th->server);
+    }
+
+    return 0;
+}
+
+int mk_http_thread_start(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_vhost_handler *handler,
+                         struct mk_server *server)
+{
+    int id;
+    struct mk_http_thread *th;
+    struct mk_sched_worker *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (!sched->dthreads) {
+        sched->dthreads = mk_thread_open();
+        if (!sched->dthreads) {
+            return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+        }
+        pthread_setspecific(mk_thread_scheduler, sched->dthreads);
+    }
+
+    th = mk_mem_alloc_z(sizeof(struct mk_http_thread));
+    if (!th) {
+        return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+    }
+    MK_EVENT_INIT(&th->event, -1, th, mk_http_thread_event);
+
+    id = mk_thread_create(mk_http_thread_entry, th);
+    if (id == -1) {
+        mk_mem_free(th);
+        return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+    }
+
+    th->id = id;
+    th->handler = handler;
+    th->session = cs;
+    th->request = sr;
+    th->server = server;
+    sr->http_thread = th;
+
+    mk_thread_resume(id);
+    if (th->parked == MK_FALSE) {
+        mk_http_thread_release(th);
+
+        /* It never waited, same path than a regular handler */
+        if (!sr->http_async) {
+            mk_header_prepare(cs, sr, server);
+            return 0;
+        }
+    }
+
+    mk_http_request_defer(sr);
+    return MK_PLUGIN_RET_CONTINUE;
+}
+
+/*
+ * The session is being removed while the handler is parked: wake it up so
+ * its pending wait fails. Any further wait fails as well, so it can't park
+ * again and it has returned once the resume comes back.
+ */
+void mk_http_thread_cancel(struct mk_http_thread *th)
+{
+    th->cancelled = MK_TRUE;
+    if (th->parked == MK_TRUE) {
+        mk_event_del(mk_sched_loop(), &th->event);
+        mk_thread_resume(th->id);
+    }
+
+    mk_http_thread_release(th);
+}
+
+void mk_http_thread_worker_exit(struct mk_sched_worker *sched)
+{
+    if (sched->dthreads) {
+        mk_thread_close(sched->dthreads);
+        sched->dthreads = NULL;
+    }
+}
+
+int mk_http_thread_connect(mk_request_t *req, char *host, int port)
+{
+    int fd = -1;
+    int ret;
+    int err;
+    char port_str[16];
+    socklen_t len;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *rp;
+    struct mk_http_thread *th;
+
+    th = mk_http_thread_get(req);
+    if (!th) {
+        return -1;
+    }
+
+    /* A name lookup would block the worker, only addresses are taken */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(port_str, sizeof(port_str), "%i", port);
+
+    ret = getaddrinfo(host, port_str, &hints, &res);
+    if (ret != 0) {
+        mk_err("Can't get addr info: %s", gai_strerror(ret));
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        fd = mk_socket_create(rp->ai_family, rp->ai_socktype,
+                              rp->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        mk_socket_set_nonblocking(fd);
+
+        ret = connect(fd, rp->ai_addr, rp->ai_addrlen);
+        if (ret == -1 && errno == EINPROGRESS) {
+            ret = mk_http_thread_wait(th, fd, MK_EVENT_WRITE);
+            if (ret == 0) {
+                len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    errno = err;
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            break;
+        }
+
+        err = errno;
+        close(fd);
+        fd = -1;
+        errno = err;
+
+        if (th->cancelled == MK_TRUE) {
+            break;
+        }
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+ssize_t mk_http_thread_read(mk_request_t *req, int fd, void *buf, size_t count)
+{
+    ssize_t bytes;
+    struct mk_http_thread *th;
+
+    th = mk_http_thread_get(req);
+    if (!th) {
+        return -1;
+    }
+
+    while (1) {
+        bytes = read(fd, buf, count);
+        if (bytes >= 0) {
+            return bytes;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        if (mk_http_thread_wait(th, fd, MK_EVENT_READ) == -1) {
+            return -1;
+        }
+    }
+}
+
+ssize_t mk_http_thread_write(mk_request_t *req, int fd,
+                             const void *buf, size_t count)
+{
+    size_t total = 0;
+    ssize_t bytes;
+    struct mk_http_thread *th;
+
+    th = mk_http_thread_get(req);
+    if (!th) {
+        return -1;
+    }
+
+    while (total < count) {
+        bytes = write(fd, (const char *) buf + total, count - total);
+        if (bytes > 0) {
+            total += bytes;
+            continue;
+        }
+
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        if (mk_http_thread_wait(th, fd, MK_EVENT_WRITE) == -1) {
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+int mk_http_thread_sleep(mk_request_t *req, int ms)
+{
+#ifdef MK_HAVE_TIMERFD_CREATE
+    int fd;
+    int ret;
+    struct itimerspec its;
+    struct mk_http_thread *th;
+
+    th = mk_http_thread_get(req);
+    if (!th) {
+        return -1;
+    }
+
+    if (ms < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        mk_libc_error("timerfd_create");
+        return -1;
+    }
+
+    /* A zero timeout disarms the timer, sleeping 0 just yields a round */
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (ms == 0) {
+        its.it_value.tv_nsec = 1;
+    }
+
+    ret = timerfd_settime(fd, 0, &its, NULL);
+    if (ret == 0) {
+        ret = mk_http_thread_wait(th, fd, MK_EVENT_READ);
+    }
+    close(fd);
+
+    return ret;
+#else
+    (void) req;
+    (void) ms;
+
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#else
+
+int mk_http_thread_start(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_vhost_handler *handler,
+                         struct mk_server *server)
+{
+    (void) handler;
+
+    return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+}
+
+void mk_http_thread_cancel(struct mk_http_thread *th)
+{
+    (void) th;
+}
+
+void mk_http_thread_worker_exit(struct mk_sched_worker *sched)
+{
+    (void) sched;
+}
+
+int mk_http_thread_connect(mk_request_t *req, char *host, int port)
+{
+    (void) req;
+    (void) host;
+    (void) port;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t mk_http_thread_read(mk_request_t *req, int fd, void *buf, size_t count)
+{
+    (void) req;
+    (void) fd;
+    (void) buf;
+    (void) count;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t mk_http_thread_write(mk_request_t *req, int fd,
+                             const void *buf, size_t count)
+{
+    (void) req;
+    (void) fd;
+    (void) buf;
+    (void) count;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+int mk_http_thread_sleep(mk_request_t *req, int ms)
+{
+    (void) req;
+    (void) ms;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
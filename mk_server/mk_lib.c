@@ -94,9 +94,10 @@ static void mk_lib_worker(void *data)
         }
 
         if (val == MK_SERVER_SIGNAL_STOP) {
+            /* the server context is released, do not touch it anymore */
             mk_exit_all(server);
             fflush(stdout);
-            pthread_kill(pthread_self(), 0);
+            return;
         }
     }
 
@@ -141,12 +142,81 @@ int mk_start(mk_ctx_t *ctx)
     return 0;
 }
 
+/*
+ * Embedded mode: set up the server with its only worker running on the
+ * calling thread, no threads are spawned to process requests. The same
+ * thread drives it through mk_run_once() and stops it with mk_stop().
+ */
+int mk_start_embedded(mk_ctx_t *ctx)
+{
+    int ret;
+    struct mk_server *server = ctx->server;
+
+    server->lib_embedded = MK_TRUE;
+    ret = mk_server_setup(server);
+    if (ret != 0) {
+        return -1;
+    }
+
+    mk_info("HTTP Server started");
+    return 0;
+}
+
+/*
+ * Embedded mode: process the pending events, waiting at most 'timeout'
+ * milliseconds for them (0 returns right away, -1 blocks). Returns the
+ * number of events processed or -1 on error.
+ */
+int mk_run_once(mk_ctx_t *ctx, int timeout)
+{
+    return mk_server_worker_run_once(ctx->server, timeout);
+}
+
+/*
+ * Embedded mode: event loop of the worker. The application can register
+ * its own file descriptors with mk_event_add() and MK_EVENT_CUSTOM
+ * events, their handlers are invoked from mk_run_once().
+ */
+struct mk_event_loop *mk_loop_get(mk_ctx_t *ctx)
+{
+    struct mk_sched_ctx *sched_ctx = ctx->server->sched_ctx;
+
+    if (ctx->server->lib_embedded == MK_FALSE || !sched_ctx) {
+        return NULL;
+    }
+
+    return sched_ctx->workers[0].loop;
+}
+
+/*
+ * Embedded mode: descriptor that becomes readable when mk_run_once() has
+ * events to process, to be polled by the application loop. -1 if the
+ * event loop backend has none.
+ */
+int mk_loop_fd(mk_ctx_t *ctx)
+{
+    struct mk_event_loop *evl;
+
+    evl = mk_loop_get(ctx);
+    if (!evl) {
+        return -1;
+    }
+
+    return mk_event_loop_fd(evl);
+}
+
 int mk_stop(mk_ctx_t *ctx)
 {
     int n;
     uint64_t val;
     struct mk_server *server = ctx->server;
 
+    /* Embedded mode: the worker is released right here */
+    if (server->lib_embedded == MK_TRUE) {
+        mk_exit_all(server);
+        return 0;
+    }
+
     val = MK_SERVER_SIGNAL_STOP;
     n = write(server->lib_ch_manager[1], &val, sizeof(val));
     if (n <= 0) {
@@ -192,6 +262,38 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
             server->workers = num;
         }
     }
+    else if (config_eq(k, "WorkerAffinity") == 0) {
+        server->workers_affinity = mk_string_dup(v);
+    }
+    else if (config_eq(k, "ReusePortSteering") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->reuseport_steering = b;
+    }
+    else if (config_eq(k, "MemoryWorkerArena") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->mem_worker_arena = b;
+    }
+    else if (config_eq(k, "MemoryTcache") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->mem_tcache = b;
+    }
+    else if (config_eq(k, "MemoryDecayTime") == 0) {
+        /* jemalloc needs the 'purge:decay' option from the application */
+        num = atoi(v);
+        if (num < -1) {
+            return -1;
+        }
+        server->mem_decay_time = num;
+    }
     else if (config_eq(k, "Timeout") == 0) {
         num = atoi(v);
         if (num <= 0) {
@@ -260,6 +362,54 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
     else if (config_eq(k, "DefaultMimeType") == 0) {
         mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", v);
     }
+    else if (config_eq(k, "MetricsPath") == 0) {
+        if (v[0] != '/') {
+            return -1;
+        }
+        server->metrics_path = mk_string_dup(v);
+    }
+    else if (config_eq(k, "RateLimitConnections") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->ratelimit_connections = num;
+    }
+    else if (config_eq(k, "RateLimitRequests") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->ratelimit_requests = num;
+    }
+    else if (config_eq(k, "RateLimitBurst") == 0) {
+        num = atoi(v);
+        if (num < 1) {
+            return -1;
+        }
+        server->ratelimit_burst = num;
+    }
+    else if (config_eq(k, "RateLimitPrefixIPv4") == 0) {
+        num = atoi(v);
+        if (num < 0 || num > 32) {
+            return -1;
+        }
+        server->ratelimit_prefix4 = num;
+    }
+    else if (config_eq(k, "RateLimitPrefixIPv6") == 0) {
+        num = atoi(v);
+        if (num < 0 || num > 128) {
+            return -1;
+        }
+        server->ratelimit_prefix6 = num;
+    }
+    else if (config_eq(k, "RateLimitSilent") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->ratelimit_silent = b;
+    }
     else if (config_eq(k, "FDT") == 0) {
         b = bool_val(v);
         if (b == -1) {
@@ -267,6 +417,40 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->fdt = b;
     }
+    else if (config_eq(k, "FileCacheSize") == 0) {
+        num = atoi(v);
+        if (num < 1) {
+            return -1;
+        }
+        server->file_cache_size = num;
+    }
+    else if (config_eq(k, "FileCacheValid") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_valid = num;
+    }
+    else if (config_eq(k, "FileCacheThreads") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_threads = num;
+    }
+    else if (config_eq(k, "ZeroCopyThreshold") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+#ifndef MK_HAVE_ZEROCOPY
+        if (num > 0) {
+            mk_warn("ZeroCopyThreshold: MSG_ZEROCOPY is not supported");
+            num = 0;
+        }
+#endif
+        server->zerocopy_threshold = num;
+    }
 
     return 0;
 }
@@ -330,6 +514,7 @@ int mk_vhost_create(mk_ctx_t *ctx, char *name)
     mk_list_init(&h->error_pages);
     mk_list_init(&h->server_names);
     mk_list_init(&h->handlers);
+    mk_list_init(&h->statics);
 
     /* Host alias */
     halias = mk_mem_alloc_z(sizeof(struct mk_vhost_alias));
@@ -430,6 +615,150 @@ int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
     return 0;
 }
 
+/*
+ * Same as mk_vhost_handler() but the callback runs on a dthread of the
+ * worker, so it can wait for backends through the mk_http_thread_*()
+ * calls without blocking other connections.
+ */
+int mk_vhost_handler_thread(mk_ctx_t *ctx, int vid, char *regex,
+                            void (*cb)(mk_request_t *, void *), void *data)
+{
+#ifdef MK_THREADS_POSIX
+    int ret;
+    struct mk_vhost *vh;
+    struct mk_vhost_handler *handler;
+
+    ret = mk_vhost_handler(ctx, vid, regex, cb, data);
+    if (ret != 0) {
+        return ret;
+    }
+
+    vh = mk_vhost_lookup(ctx, vid);
+    handler = mk_list_entry_last(&vh->handlers, struct mk_vhost_handler, _head);
+    handler->thread = MK_TRUE;
+
+    return 0;
+#else
+    (void) ctx;
+    (void) vid;
+    (void) regex;
+    (void) cb;
+    (void) data;
+
+    return -1;
+#endif
+}
+
+/* Headers set by the server on every response */
+static int mk_vhost_static_managed(char *key)
+{
+    if (strcasecmp(key, "Server") == 0 ||
+        strcasecmp(key, "Date") == 0 ||
+        strcasecmp(key, "Connection") == 0 ||
+        strcasecmp(key, "Content-Length") == 0 ||
+        strcasecmp(key, "Transfer-Encoding") == 0) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Register a fixed response for an exact path: the status line, headers
+ * and body are rendered once, each hit only adds the Server, Date and
+ * Connection rows. Extra headers are given as key/value pairs terminated
+ * by NULL, e.g:
+ *
+ *   mk_vhost_static(ctx, vid, "/health", 200, "OK", 2,
+ *                   "Content-Type", "text/plain", NULL);
+ */
+int mk_vhost_static(mk_ctx_t *ctx, int vid, char *path, int status,
+                    char *body, size_t len, ...)
+{
+    int n;
+    int ret;
+    char *key;
+    char *value;
+    char *p;
+    char cl[32];
+    size_t size;
+    va_list va;
+    mk_ptr_t line;
+    struct mk_vhost *vh;
+    struct mk_vhost_static *st;
+
+    vh = mk_vhost_lookup(ctx, vid);
+    if (!vh || !path || path[0] != '/' || (!body && len > 0)) {
+        return -1;
+    }
+
+    if (mk_vhost_static_lookup(vh, path, strlen(path))) {
+        mk_err("Static response for '%s' already registered", path);
+        return -1;
+    }
+
+    ret = mk_header_status_line(status, &line);
+    if (ret != 0) {
+        mk_err("Invalid HTTP status %i for '%s'", status, path);
+        return -1;
+    }
+
+    /* Measure the headers */
+    size = line.len;
+    va_start(va, len);
+    while ((key = va_arg(va, char *))) {
+        value = va_arg(va, char *);
+        if (!value || mk_vhost_static_managed(key) == MK_TRUE) {
+            va_end(va);
+            return -1;
+        }
+        size += strlen(key) + 2 + strlen(value) + 2;
+    }
+    va_end(va);
+
+    n = snprintf(cl, sizeof(cl), "Content-Length: %zu\r\n\r\n", len);
+    size += n + len;
+
+    st = mk_mem_alloc_z(sizeof(struct mk_vhost_static));
+    if (!st) {
+        return -1;
+    }
+
+    st->buf = mk_mem_alloc(size);
+    if (!st->buf) {
+        mk_mem_free(st);
+        return -1;
+    }
+
+    /* Render */
+    p = st->buf;
+    memcpy(p, line.data, line.len);
+    p += line.len;
+
+    va_start(va, len);
+    while ((key = va_arg(va, char *))) {
+        value = va_arg(va, char *);
+        p += sprintf(p, "%s: %s\r\n", key, value);
+    }
+    va_end(va);
+
+    memcpy(p, cl, n);
+    p += n;
+    if (len > 0) {
+        memcpy(p, body, len);
+    }
+
+    st->path.data = mk_string_dup(path);
+    st->path.len  = strlen(path);
+    st->status    = status;
+    st->head_len  = line.len;
+    st->tail_len  = size - line.len;
+    st->body_len  = len;
+    mk_list_add(&st->_head, &vh->statics);
+
+    return 0;
+}
+
 int mk_http_status(mk_request_t *req, int status)
 {
     req->headers.status = status;
@@ -454,8 +783,9 @@ int mk_http_header(mk_request_t *req,
         }
     }
 
+    /* Rows are request scoped, released together with the request */
     len = key_len + val_len + 4;
-    buf = mk_mem_alloc(len);
+    buf = mk_arena_alloc(&req->arena, len);
     if (!buf) {
         /* we don't free extra_rows as it's released later */
         return -1;
@@ -472,24 +802,66 @@ int mk_http_header(mk_request_t *req,
     buf[pos++] = '\n';
 
     /* Add the new buffer */
-    mk_iov_add(h->_extra_rows, buf, pos, MK_TRUE);
+    mk_iov_add(h->_extra_rows, buf, pos, MK_FALSE);
 
     return 0;
 }
 
+static void mk_http_send_finished(struct mk_stream_input *in)
+{
+    void (*cb_finish)(mk_request_t *);
+
+    cb_finish = (void (*)(mk_request_t *)) in->context;
+    cb_finish(in->stream->context);
+}
+
 /* Enqueue some data for the body response */
 int mk_http_send(mk_request_t *req, char *buf, size_t len,
                  void (*cb_finish)(mk_request_t *))
 {
     int ret;
-    (void) cb_finish;
+    struct mk_stream_input *in;
 
     ret = mk_stream_in_raw(&req->stream, NULL,
-                           buf, len, NULL, NULL);
-    if (ret == 0) {
-        /* Update content length */
-        req->headers.content_length += len;
+                           buf, len, NULL,
+                           cb_finish ? mk_http_send_finished : NULL);
+    if (ret != 0) {
+        return -1;
+    }
+
+    if (cb_finish) {
+        in = mk_list_entry_last(&req->stream.inputs,
+                                struct mk_stream_input, _head);
+        in->context = (void *) cb_finish;
+    }
+
+    /* Update content length */
+    req->headers.content_length += len;
+    return 0;
+}
+
+mk_buffer_t *mk_buffer_create(char *data, size_t size,
+                              void (*cb_release)(void *), void *context)
+{
+    return mk_stream_buffer_create(data, size, cb_release, context);
+}
+
+void mk_buffer_release(mk_buffer_t *buf)
+{
+    mk_stream_buffer_put(buf);
+}
+
+/* Enqueue a shared buffer, it holds a reference until it's sent */
+int mk_http_send_buffer(mk_request_t *req, mk_buffer_t *buf)
+{
+    int ret;
+
+    ret = mk_stream_in_buffer(&req->stream, NULL, buf, 0, buf->size,
+                              NULL, NULL);
+    if (ret != 0) {
+        return -1;
     }
 
-    return ret;
+    req->headers.content_length += buf->size;
+    return 0;
 }
@@ -0,0 +1,366 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_status.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_allocator.h>
+
+#define METRICS_BUF_SIZE  16384
+
+/* Growable text buffer used to render the report */
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static int metrics_printf(struct metrics_buf *buf, const char *fmt, ...)
+{
+    int ret;
+    size_t size;
+    char *tmp;
+    va_list va;
+
+    while (1) {
+        va_start(va, fmt);
+        ret = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, va);
+        va_end(va);
+
+        if (ret < 0) {
+            return -1;
+        }
+
+        if ((size_t) ret < buf->size - buf->len) {
+            buf->len += ret;
+            return 0;
+        }
+
+        size = buf->size + METRICS_BUF_SIZE;
+        tmp = mk_mem_realloc(buf->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+}
+
+static void metrics_header(struct metrics_buf *buf, const char *name,
+                           const char *type, const char *help)
+{
+    metrics_printf(buf, "# HELP monkey_%s %s\n", name, help);
+    metrics_printf(buf, "# TYPE monkey_%s %s\n", name, type);
+}
+
+/*
+ * One line per worker for a counter or gauge, 'expr' is evaluated with
+ * 'w' pointing to each worker (the caller owns the 'w' variable).
+ */
+#define METRICS_PER_WORKER(buf, ctx, server, name, expr)                \
+    do {                                                                \
+        int __i;                                                        \
+        for (__i = 0; __i < server->workers; __i++) {                   \
+            w = &ctx->workers[__i];                                     \
+            metrics_printf(buf, "monkey_%s{worker=\"%i\"} %llu\n",      \
+                           name, __i, (unsigned long long) (expr));     \
+        }                                                               \
+    } while (0)
+
+static void metrics_hist(struct metrics_buf *buf, const char *name,
+                         const char *help, struct mk_sched_ctx *ctx,
+                         int hist_offset, struct mk_server *server)
+{
+    int i;
+    int j;
+    int last = -1;
+    uint64_t cumulative = 0;
+    struct mk_metrics_hist *h;
+    struct mk_metrics_hist total;
+
+    /* Aggregate all workers */
+    memset(&total, '\0', sizeof(total));
+    for (i = 0; i < server->workers; i++) {
+        h = (struct mk_metrics_hist *)
+            ((char *) &ctx->workers[i].metrics + hist_offset);
+        total.count += h->count;
+        total.sum   += h->sum;
+        for (j = 0; j < MK_METRICS_HIST_BUCKETS; j++) {
+            total.buckets[j] += h->buckets[j];
+        }
+    }
+
+    /* Only print buckets up to the last one used */
+    for (i = 0; i < MK_METRICS_HIST_BUCKETS; i++) {
+        if (total.buckets[i] > 0) {
+            last = i;
+        }
+    }
+
+    metrics_header(buf, name, "histogram", help);
+    for (i = 0; i <= last; i++) {
+        cumulative += total.buckets[i];
+        metrics_printf(buf, "monkey_%s_bucket{le=\"%.6f\"} %llu\n",
+                       name, mk_metrics_hist_bound(i) / 1000000.0,
+                       (unsigned long long) cumulative);
+    }
+    metrics_printf(buf, "monkey_%s_bucket{le=\"+Inf\"} %llu\n",
+                   name, (unsigned long long) total.count);
+    metrics_printf(buf, "monkey_%s_sum %.6f\n",
+                   name, total.sum / 1000000.0);
+    metrics_printf(buf, "monkey_%s_count %llu\n",
+                   name, (unsigned long long) total.count);
+}
+
+/* Memory of the worker arenas, only with the bundled jemalloc */
+static void metrics_memory(struct metrics_buf *buf, struct mk_sched_ctx *ctx,
+                           struct mk_server *server)
+{
+    int i;
+    int g;
+    int n;
+    int *valid;
+    struct mk_allocator_stats *stats;
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } gauges[] = {
+        {"memory_allocated_bytes", "Bytes allocated by the worker.",
+         offsetof(struct mk_allocator_stats, allocated)},
+        {"memory_active_bytes", "Bytes in pages backing the worker allocations.",
+         offsetof(struct mk_allocator_stats, active)},
+        {"memory_resident_bytes", "Bytes of the worker arena resident in memory.",
+         offsetof(struct mk_allocator_stats, resident)},
+        {"memory_fragmentation_bytes", "Active bytes not used by allocations.",
+         offsetof(struct mk_allocator_stats, fragmented)},
+        {"memory_mapped_bytes", "Bytes mapped by the worker arena.",
+         offsetof(struct mk_allocator_stats, mapped)}
+    };
+
+    if (mk_allocator_stats_refresh() != 0) {
+        return;
+    }
+
+    stats = mk_mem_alloc(sizeof(struct mk_allocator_stats) * server->workers);
+    valid = mk_mem_alloc(sizeof(int) * server->workers);
+    if (!stats || !valid) {
+        mk_mem_free(stats);
+        mk_mem_free(valid);
+        return;
+    }
+
+    n = 0;
+    for (i = 0; i < server->workers; i++) {
+        valid[i] = mk_allocator_worker_stats(&ctx->workers[i], &stats[i]);
+        if (valid[i] == 0) {
+            n++;
+        }
+    }
+
+    /* Workers share the default arenas (MemoryWorkerArena off) */
+    for (g = 0; n > 0 && g < (int) (sizeof(gauges) / sizeof(gauges[0])); g++) {
+        metrics_header(buf, gauges[g].name, "gauge", gauges[g].help);
+        for (i = 0; i < server->workers; i++) {
+            if (valid[i] != 0) {
+                continue;
+            }
+            metrics_printf(buf, "monkey_%s{worker=\"%i\"} %zu\n",
+                           gauges[g].name, i,
+                           *(size_t *) ((char *) &stats[i] + gauges[g].offset));
+        }
+    }
+
+    mk_mem_free(stats);
+    mk_mem_free(valid);
+}
+
+static int metrics_render(struct metrics_buf *buf, struct mk_server *server)
+{
+    int i;
+    int s;
+    struct mk_sched_worker *w;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    static const char *stages[] = {"10", "20", "30", "40", "50"};
+
+    metrics_header(buf, "requests_total", "counter",
+                   "Requests answered.");
+    METRICS_PER_WORKER(buf, ctx, server, "requests_total", w->metrics.requests);
+
+    metrics_header(buf, "responses_total", "counter",
+                   "Responses by status code class.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        for (s = 1; s < 6; s++) {
+            metrics_printf(buf,
+                           "monkey_responses_total{worker=\"%i\",code=\"%ixx\"} %llu\n",
+                           i, s, (unsigned long long) w->metrics.status[s]);
+        }
+    }
+
+    metrics_header(buf, "received_bytes_total", "counter",
+                   "Bytes read from clients.");
+    METRICS_PER_WORKER(buf, ctx, server, "received_bytes_total",
+                       w->metrics.bytes_in);
+
+    metrics_header(buf, "sent_bytes_total", "counter",
+                   "Bytes written to clients.");
+    METRICS_PER_WORKER(buf, ctx, server, "sent_bytes_total",
+                       w->metrics.bytes_out);
+
+    metrics_header(buf, "connections_accepted_total", "counter",
+                   "Connections accepted.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_accepted_total",
+                       w->accepted_connections);
+
+    metrics_header(buf, "connections_active", "gauge",
+                   "Connections open.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_active",
+                       w->accepted_connections - w->closed_connections);
+
+    metrics_header(buf, "connections_idle", "gauge",
+                   "Connections waiting for a request.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_idle",
+                       w->metrics.idle_in - w->metrics.idle_out);
+
+    metrics_header(buf, "connections_timeout_total", "counter",
+                   "Connections closed by timeout.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_timeout_total",
+                       w->metrics.timeouts);
+
+    metrics_header(buf, "connections_over_capacity_total", "counter",
+                   "Connections dropped because the server is over capacity.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_over_capacity_total",
+                       __atomic_load_n(&w->over_capacity, __ATOMIC_RELAXED));
+
+    metrics_header(buf, "connections_ratelimited_total", "counter",
+                   "Connections refused by the per client rate limit.");
+    METRICS_PER_WORKER(buf, ctx, server, "connections_ratelimited_total",
+                       __atomic_load_n(&w->metrics.ratelimit_conns,
+                                       __ATOMIC_RELAXED));
+
+    metrics_header(buf, "requests_ratelimited_total", "counter",
+                   "Requests refused by the per client rate limit.");
+    METRICS_PER_WORKER(buf, ctx, server, "requests_ratelimited_total",
+                       w->metrics.ratelimit_requests);
+
+    metrics_header(buf, "plugin_stage_calls_total", "counter",
+                   "Plugin stage invocations.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        for (s = 0; s < MK_METRICS_STAGES; s++) {
+            metrics_printf(buf,
+                           "monkey_plugin_stage_calls_total{worker=\"%i\",stage=\"%s\"} %llu\n",
+                           i, stages[s],
+                           (unsigned long long) w->metrics.stage_calls[s]);
+        }
+    }
+
+    metrics_header(buf, "plugin_stage_seconds_total", "counter",
+                   "Time spent in plugin stages.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        for (s = 0; s < MK_METRICS_STAGES; s++) {
+            metrics_printf(buf,
+                           "monkey_plugin_stage_seconds_total{worker=\"%i\",stage=\"%s\"} %.6f\n",
+                           i, stages[s], w->metrics.stage_usec[s] / 1000000.0);
+        }
+    }
+
+    metrics_memory(buf, ctx, server);
+
+    metrics_hist(buf, "time_to_first_byte_seconds",
+                 "Time from request arrival until the response headers are sent.",
+                 ctx, offsetof(struct mk_metrics, ttfb), server);
+    metrics_hist(buf, "request_duration_seconds",
+                 "Time from request arrival until the response is completed.",
+                 ctx, offsetof(struct mk_metrics, total), server);
+
+    return 0;
+}
+
+int mk_metrics_is_path(struct mk_http_request *sr, struct mk_server *server)
+{
+    size_t len;
+
+    len = strlen(server->metrics_path);
+    if (sr->uri_processed.len != len) {
+        return MK_FALSE;
+    }
+
+    if (strncmp(sr->uri_processed.data, server->metrics_path, len) != 0) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/* Compose the metrics report as the response of the current request */
+int mk_metrics_serve(struct mk_http_session *cs, struct mk_http_request *sr,
+                     struct mk_server *server)
+{
+    struct mk_iov *iov;
+    struct metrics_buf buf;
+
+    if (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) {
+        return mk_http_error(MK_CLIENT_METHOD_NOT_ALLOWED, cs, sr, server);
+    }
+
+    buf.data = mk_mem_alloc(METRICS_BUF_SIZE);
+    if (!buf.data) {
+        return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+    }
+    buf.len  = 0;
+    buf.size = METRICS_BUF_SIZE;
+    metrics_render(&buf, server);
+
+    mk_header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_length = buf.len;
+    sr->headers.location = NULL;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.last_modified = -1;
+    mk_ptr_set(&sr->headers.content_type,
+               "Content-Type: text/plain; version=0.0.4\r\n");
+    mk_header_prepare(cs, sr, server);
+
+    if (sr->method == MK_METHOD_HEAD) {
+        mk_mem_free(buf.data);
+        return 0;
+    }
+
+    if (sr->headers._extra_rows) {
+        iov = sr->headers._extra_rows;
+        sr->in_headers_extra.bytes_total += buf.len;
+    }
+    else {
+        iov = &sr->headers.headers_iov;
+        sr->in_headers.bytes_total += buf.len;
+    }
+    mk_iov_add(iov, buf.data, buf.len, MK_TRUE);
+
+    return 0;
+}
@@ -297,6 +297,7 @@ void mk_plugin_api_init(struct mk_server *server)
     api->channel_flush = mk_channel_flush;
     api->channel_write = mk_channel_write;
     api->channel_append_stream = mk_channel_append_stream;
+    api->stream_in_release = mk_stream_in_release;
 
     /* IOV callbacks */
     api->iov_create  = mk_iov_create;
@@ -345,6 +346,7 @@ void mk_plugin_api_init(struct mk_server *server)
     api->sched_event_free     = mk_sched_event_free;
     api->sched_remove_client  = mk_plugin_sched_remove_client;
     api->sched_worker_info    = mk_plugin_sched_get_thread_conf;
+    api->sched_conn_resume    = mk_plugin_sched_conn_resume;
 
     /* Worker functions */
     api->worker_spawn = mk_utils_worker_spawn;
@@ -534,8 +536,19 @@ void mk_plugin_exit_all(struct mk_server *server)
  * When a worker is exiting, it invokes this function to release any plugin
  * associated data.
  */
-void mk_plugin_exit_worker()
+void mk_plugin_exit_worker(struct mk_server *server)
 {
+    struct mk_plugin *node;
+    struct mk_list *head;
+
+    mk_list_foreach(head, &server->plugins) {
+        node = mk_list_entry(head, struct mk_plugin, _head);
+
+        /* Release plugin thread context */
+        if (node->worker_exit) {
+            node->worker_exit(server);
+        }
+    }
 }
 
 /* This function is called by every created worker
@@ -724,6 +737,15 @@ int mk_plugin_header_add(struct mk_http_request *sr, char *row, int len)
     return 0;
 }
 
+/* Resume a connection the network layer suspended (EINPROGRESS) */
+int mk_plugin_sched_conn_resume(int socket)
+{
+    struct mk_sched_worker *sched;
+
+    sched = mk_sched_get_thread_conf();
+    return mk_sched_conn_resume(sched, socket, sched->server);
+}
+
 struct mk_sched_worker *mk_plugin_sched_get_thread_conf()
 {
     return MK_TLS_GET(mk_tls_sched_worker_node);
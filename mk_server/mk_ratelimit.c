@@ -0,0 +1,363 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_ratelimit.h>
+
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Tokens are counted in thousandths, one event costs a full token */
+#define RATELIMIT_COST   1000
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL     0
+#endif
+
+static const char ratelimit_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+/* Milliseconds, the stamp 0 is reserved for a fresh bucket */
+static inline uint32_t ratelimit_now()
+{
+    uint32_t ms;
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    ms = (uint32_t) ((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+    return ms ? ms : 1;
+}
+
+static inline uint64_t ratelimit_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+static inline uint64_t ratelimit_mask(int bits)
+{
+    if (bits <= 0) {
+        return 0;
+    }
+    else if (bits >= 64) {
+        return ~0ULL;
+    }
+
+    return ~0ULL << (64 - bits);
+}
+
+static int ratelimit_table_init(struct mk_ratelimit_table *t,
+                                int rate, int burst)
+{
+    size_t size;
+    uint64_t max;
+
+    memset(t, '\0', sizeof(struct mk_ratelimit_table));
+    if (rate <= 0) {
+        return 0;
+    }
+
+    /* Sets must not share a cache line, align the memory by hand */
+    size = sizeof(struct mk_ratelimit_set) *
+           (MK_RATELIMIT_SLOTS / MK_RATELIMIT_WAYS);
+    t->mem = mk_mem_alloc_z(size + 64);
+    if (!t->mem) {
+        return -1;
+    }
+    t->sets = (struct mk_ratelimit_set *)
+        (((uintptr_t) t->mem + 63) & ~((uintptr_t) 63));
+
+    max = (uint64_t) rate * burst * RATELIMIT_COST;
+    if (max < RATELIMIT_COST) {
+        max = RATELIMIT_COST;
+    }
+    else if (max > UINT32_MAX) {
+        max = UINT32_MAX;
+    }
+
+    t->rate = rate;
+    t->max  = max;
+    t->mask = (MK_RATELIMIT_SLOTS / MK_RATELIMIT_WAYS) - 1;
+
+    return 0;
+}
+
+/* Slot for a client not found in its set: an empty one or the oldest */
+static struct mk_ratelimit_slot *ratelimit_claim(struct mk_ratelimit_set *set,
+                                                 uint64_t key, uint32_t now)
+{
+    int i;
+    uint32_t age;
+    uint32_t oldest_age = 0;
+    uint64_t k;
+    uint64_t state;
+    struct mk_ratelimit_slot *s;
+    struct mk_ratelimit_slot *oldest = NULL;
+
+    for (i = 0; i < MK_RATELIMIT_WAYS; i++) {
+        s = &set->slot[i];
+        k = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&s->key, &k, key, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                return s;
+            }
+            /* Somebody was faster, maybe the same client */
+            if (k == key) {
+                return s;
+            }
+
+            /* Otherwise it's one more candidate, the set may be full now */
+        }
+
+        /* A slot claimed but never updated yet is the newest one */
+        state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+        age = state ? now - (uint32_t) state : 0;
+        if (!oldest || age > oldest_age) {
+            oldest = s;
+            oldest_age = age;
+        }
+    }
+
+    /*
+     * Evict: a concurrent update of the previous owner may land on the
+     * new one, it only moves one token between two clients.
+     */
+    __atomic_store_n(&oldest->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&oldest->state, 0, __ATOMIC_RELAXED);
+
+    return oldest;
+}
+
+/* Take one token from the client bucket, return -1 if it's empty */
+static int ratelimit_take(struct mk_ratelimit_table *t, uint64_t key)
+{
+    int i;
+    int ret;
+    uint32_t now;
+    uint32_t elapsed;
+    uint64_t tokens;
+    uint64_t old;
+    uint64_t new;
+    struct mk_ratelimit_set *set;
+    struct mk_ratelimit_slot *slot = NULL;
+
+    now = ratelimit_now();
+    set = &t->sets[(key >> 32) & t->mask];
+
+    for (i = 0; i < MK_RATELIMIT_WAYS; i++) {
+        if (__atomic_load_n(&set->slot[i].key, __ATOMIC_RELAXED) == key) {
+            slot = &set->slot[i];
+            break;
+        }
+    }
+
+    if (!slot) {
+        slot = ratelimit_claim(set, key, now);
+    }
+
+    old = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+    do {
+        if (old == 0) {
+            tokens = t->max;
+        }
+        else {
+            /* Another worker may have stored a slightly newer stamp */
+            elapsed = now - (uint32_t) old;
+            if ((int32_t) elapsed < 0) {
+                elapsed = 0;
+            }
+
+            tokens = (old >> 32) + ((uint64_t) elapsed * t->rate);
+            if (tokens > t->max) {
+                tokens = t->max;
+            }
+        }
+
+        if (tokens >= RATELIMIT_COST) {
+            tokens -= RATELIMIT_COST;
+            ret = 0;
+        }
+        else {
+            ret = -1;
+        }
+
+        new = (tokens << 32) | now;
+    } while (!__atomic_compare_exchange_n(&slot->state, &old, new, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return ret;
+}
+
+int mk_ratelimit_create(struct mk_server *server)
+{
+    struct mk_ratelimit *rl;
+
+    if (server->ratelimit_connections <= 0 &&
+        server->ratelimit_requests <= 0) {
+        return 0;
+    }
+
+    rl = mk_mem_alloc_z(sizeof(struct mk_ratelimit));
+    if (!rl) {
+        return -1;
+    }
+
+    rl->prefix4 = server->ratelimit_prefix4;
+    rl->prefix6 = server->ratelimit_prefix6;
+
+    if (ratelimit_table_init(&rl->conns, server->ratelimit_connections,
+                             server->ratelimit_burst) != 0 ||
+        ratelimit_table_init(&rl->requests, server->ratelimit_requests,
+                             server->ratelimit_burst) != 0) {
+        mk_mem_free(rl->conns.mem);
+        mk_mem_free(rl);
+        return -1;
+    }
+
+    server->ratelimit = rl;
+    return 0;
+}
+
+void mk_ratelimit_destroy(struct mk_server *server)
+{
+    struct mk_ratelimit *rl = server->ratelimit;
+
+    if (!rl) {
+        return;
+    }
+
+    mk_mem_free(rl->conns.mem);
+    mk_mem_free(rl->requests.mem);
+    mk_mem_free(rl);
+    server->ratelimit = NULL;
+}
+
+/*
+ * Hash of the client address prefix, 0 means 'not limited' (e.g: the
+ * peer is not an IP socket).
+ */
+uint64_t mk_ratelimit_key(int fd, struct mk_server *server)
+{
+    int i;
+    uint32_t addr4;
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+    uint64_t key;
+    uint8_t *b;
+    socklen_t len;
+    struct sockaddr_storage addr;
+    struct sockaddr_in6 *in6;
+    struct mk_ratelimit *rl = server->ratelimit;
+
+    if (!rl) {
+        return 0;
+    }
+
+    len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) == -1) {
+        return 0;
+    }
+
+    if (addr.ss_family == AF_INET) {
+        addr4 = ntohl(((struct sockaddr_in *) &addr)->sin_addr.s_addr);
+    }
+    else if (addr.ss_family == AF_INET6) {
+        in6 = (struct sockaddr_in6 *) &addr;
+        b = in6->sin6_addr.s6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            addr4 = ((uint32_t) b[12] << 24) | ((uint32_t) b[13] << 16) |
+                    ((uint32_t) b[14] << 8) | b[15];
+        }
+        else {
+            for (i = 0; i < 8; i++) {
+                hi = (hi << 8) | b[i];
+                lo = (lo << 8) | b[i + 8];
+            }
+            hi &= ratelimit_mask(rl->prefix6);
+            lo &= ratelimit_mask(rl->prefix6 - 64);
+
+            key = ratelimit_mix(hi ^ ratelimit_mix(lo ^ AF_INET6));
+            return key ? key : 1;
+        }
+    }
+    else {
+        return 0;
+    }
+
+    addr4 &= (uint32_t) (ratelimit_mask(rl->prefix4) >> 32);
+    key = ratelimit_mix(((uint64_t) AF_INET << 32) | addr4);
+
+    return key ? key : 1;
+}
+
+int mk_ratelimit_connection(uint64_t key, struct mk_server *server)
+{
+    struct mk_ratelimit *rl = server->ratelimit;
+
+    if (!rl || key == 0 || rl->conns.rate == 0) {
+        return 0;
+    }
+
+    return ratelimit_take(&rl->conns, key);
+}
+
+int mk_ratelimit_request(uint64_t key, struct mk_server *server)
+{
+    struct mk_ratelimit *rl = server->ratelimit;
+
+    if (!rl || key == 0 || rl->requests.rate == 0) {
+        return 0;
+    }
+
+    return ratelimit_take(&rl->requests, key);
+}
+
+/*
+ * Best effort answer for a connection refused before any session exists,
+ * only used on plain text listeners.
+ */
+void mk_ratelimit_reject(int fd)
+{
+    int ret;
+
+    ret = send(fd, ratelimit_response, sizeof(ratelimit_response) - 1,
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret == -1) {
+        MK_TRACE("[FD %i] rate limit reply failed: %s", fd, strerror(errno));
+    }
+}
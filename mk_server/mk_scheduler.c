@@ -31,8 +31,11 @@
 #include <monkey/mk_linuxtrace.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_affinity.h>
+#include <monkey/mk_allocator.h>
 
 #include <signal.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 
 struct mk_sched_handler mk_http_handler;
@@ -83,6 +86,9 @@ static inline int _next_target(struct mk_server *server)
      */
     if (mk_unlikely(cur >= server->server_capacity)) {
         MK_TRACE("Too many clients: %i", server->server_capacity);
+        /* the balancer thread updates another worker's counter */
+        __atomic_fetch_add(&ctx->workers[target].over_capacity, 1,
+                           __ATOMIC_RELAXED);
 
         /* Instruct to close the connection anyways, we lie, it will die */
         return -1;
@@ -119,14 +125,8 @@ void mk_sched_worker_free(struct mk_server *server)
 
     pthread_mutex_lock(&mutex_worker_exit);
 
-    /*
-     * Fix Me: needs to implement API to make plugins release
-     * their resources first at WORKER LEVEL
-     */
-
-    /* External */
-    mk_plugin_exit_worker();
-    mk_vhost_fdt_worker_exit(server);
+    /* External, plugins release their resources at worker level first */
+    mk_plugin_exit_worker(server);
     mk_cache_worker_exit();
 
     /* Scheduler stuff */
@@ -140,6 +140,9 @@ void mk_sched_worker_free(struct mk_server *server)
     }
 
     mk_bug(!worker);
+    mk_arena_pool_destroy(&worker->arena_pool);
+    mk_http_session_pool_exit(worker);
+    mk_file_cache_exit(&worker->file_cache);
 
     /* FIXME!: there is nothing done here with the worker context */
 
@@ -220,6 +223,12 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     conn->channel.io    = conn->net;            /* network layer    */
     conn->channel.event = event;                /* parent event ref */
     mk_list_init(&conn->channel.streams);
+    mk_list_init(&conn->channel.zc_pending);
+
+    /* Zero copy sends only make sense on plain sockets */
+    if (!(listener->listen->flags & MK_CAP_SOCK_TLS)) {
+        conn->channel.zc_threshold = server->zerocopy_threshold;
+    }
 
     /* FIXME: do we need to have a Scheduler node in a RBT ?
 
@@ -331,37 +340,53 @@ static void mk_signal_thread_sigpipe_safe()
     pthread_sigmask(SIG_BLOCK, &set, &old);
 }
 
-/* created thread, all these calls are in the thread context */
-void *mk_sched_launch_worker_loop(void *data)
+/*
+ * Set up the worker context owned by the calling thread: the worker
+ * threads and, in embedded mode, the application thread. Returns NULL
+ * if the listeners can't be created, the worker is set up otherwise.
+ */
+static struct mk_sched_worker *mk_sched_worker_init(struct mk_server *server)
 {
     int ret;
     int wid;
     unsigned long len;
     char *thread_name = 0;
-    struct mk_list *head;
-    struct mk_sched_worker_cb *wcb;
     struct mk_sched_worker *sched = NULL;
     struct mk_sched_notif *notif = NULL;
-    struct mk_sched_thread_conf *thinfo = data;
     struct mk_sched_ctx *ctx;
-    struct mk_server *server;
 
-    server = thinfo->server;
     ctx = server->sched_ctx;
 
     /* Avoid SIGPIPE signals on this thread */
     mk_signal_thread_sigpipe_safe();
 
+    /* Register working thread */
+    wid = mk_sched_register_thread(server);
+    sched = &ctx->workers[wid];
+    sched->server = server;
+
+    /*
+     * Pin the thread before allocating anything, so the worker memory
+     * gets placed on the NUMA node of its CPU.
+     */
+    mk_affinity_worker_bind(sched);
+
+    /* Dedicated allocator arena, set before the worker allocates */
+    mk_allocator_worker_init(server, sched);
+
     /* Init specific thread cache */
     mk_sched_thread_lists_init();
     mk_cache_worker_init();
+    mk_arena_pool_init(&sched->arena_pool, MK_ARENA_POOL_MAX);
+    mk_list_init(&sched->session_pool);
+    sched->session_pool_count = 0;
+
+    /* Open file cache */
+    if (server->fdt == MK_TRUE) {
+        mk_file_cache_init(&sched->file_cache, server->file_cache_size,
+                           server->file_cache_valid);
+    }
 
-    /* Virtual hosts: initialize per thread-vhost data */
-    mk_vhost_fdt_worker_init(server);
-
-    /* Register working thread */
-    wid = mk_sched_register_thread(server);
-    sched = &ctx->workers[wid];
     sched->loop = mk_event_loop_create(MK_EVENT_QUEUE_SIZE);
     if (!sched->loop) {
         mk_err("Error creating Scheduler loop");
@@ -386,6 +411,15 @@ void *mk_sched_launch_worker_loop(void *data)
     }
 
     mk_list_init(&sched->event_free_queue);
+    mk_list_init(&sched->suspended_queue);
+    mk_list_init(&sched->zc_linger_queue);
+
+    /* Completion channel for the open file cache pool */
+    if (mk_file_cache_worker_start(&sched->file_cache, sched->loop,
+                                   server) != 0) {
+        mk_err("Error registering the file cache channel");
+        exit(EXIT_FAILURE);
+    }
 
     /*
      * ULONG_MAX BUG test only
@@ -397,33 +431,59 @@ void *mk_sched_launch_worker_loop(void *data)
 
     //thinfo->ctx = thconf->ctx;
 
-    /* Rename worker */
-    mk_string_build(&thread_name, &len, "monkey: wrk/%i", sched->idx);
-    mk_utils_worker_rename(thread_name);
-    mk_mem_free(thread_name);
+    /* Rename worker, the application thread keeps its name */
+    if (server->lib_embedded == MK_FALSE) {
+        mk_string_build(&thread_name, &len, "monkey: wrk/%i", sched->idx);
+        mk_utils_worker_rename(thread_name);
+        mk_mem_free(thread_name);
+    }
 
     /* Export known scheduler node to context thread */
     MK_TLS_SET(mk_tls_sched_worker_node, sched);
     mk_plugin_core_thread(server);
 
-    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+    /* The only worker of the embedded mode owns the listeners as well */
+    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT ||
+        server->lib_embedded == MK_TRUE) {
         sched->listeners = mk_server_listen_init(server);
         if (!sched->listeners) {
-            exit(EXIT_FAILURE);
+            return NULL;
         }
     }
 
+    return sched;
+}
+
+/* Invoke custom worker-callbacks defined by the scheduler (lib) */
+static void mk_sched_worker_callbacks(struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_sched_worker_cb *wcb;
+
+    mk_list_foreach(head, &server->sched_worker_callbacks) {
+        wcb = mk_list_entry(head, struct mk_sched_worker_cb, _head);
+        wcb->cb_func(wcb->data);
+    }
+}
+
+/* created thread, all these calls are in the thread context */
+void *mk_sched_launch_worker_loop(void *data)
+{
+    struct mk_sched_thread_conf *thinfo = data;
+    struct mk_server *server;
+
+    server = thinfo->server;
+    if (!mk_sched_worker_init(server)) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Unlock the conditional initializator */
     pthread_mutex_lock(&pth_mutex);
     pth_init = MK_TRUE;
     pthread_cond_signal(&pth_cond);
     pthread_mutex_unlock(&pth_mutex);
 
-    /* Invoke custom worker-callbacks defined by the scheduler (lib) */
-    mk_list_foreach(head, &server->sched_worker_callbacks) {
-        wcb = mk_list_entry(head, struct mk_sched_worker_cb, _head);
-        wcb->cb_func(wcb->data);
-    }
+    mk_sched_worker_callbacks(server);
 
     mk_mem_free(thinfo);
 
@@ -434,6 +494,22 @@ void *mk_sched_launch_worker_loop(void *data)
     return 0;
 }
 
+/*
+ * Embedded mode: the calling thread becomes the only worker, the
+ * application drives its loop through mk_server_worker_run_once().
+ */
+int mk_sched_worker_embed(struct mk_server *server)
+{
+    /* Fail without listeners, the application gets the error */
+    if (!mk_sched_worker_init(server)) {
+        mk_server_worker_stop(server);
+        return -1;
+    }
+    mk_sched_worker_callbacks(server);
+
+    return mk_server_worker_start(server);
+}
+
 /* Create thread which will be listening for incomings requests */
 int mk_sched_launch_thread(struct mk_server *server, pthread_t *tout)
 {
@@ -489,13 +565,18 @@ int mk_sched_init(struct mk_server *server)
     }
 
     size = (sizeof(struct mk_sched_worker) * server->workers);
-    ctx->workers = mk_mem_alloc(size);
+    ctx->workers = mk_mem_alloc_z(size);
     if (!ctx->workers) {
         mk_libc_error("malloc");
         mk_mem_free(ctx);
         return -1;
     }
 
+    /* Assign CPUs to workers (WorkerAffinity) */
+    if (mk_affinity_init(server, ctx) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Initialize helpers */
     pthread_mutex_init(&pth_mutex, NULL);
     pthread_cond_init(&pth_cond, NULL);
@@ -511,10 +592,91 @@ void mk_sched_set_request_list(struct rb_root *list)
     MK_TLS_SET(mk_tls_sched_cs, list);
 }
 
+/* Socket of a closed connection waiting for its zero copy sends */
+struct mk_sched_zc_linger {
+    time_t since;
+    struct mk_channel channel;
+    struct mk_list _head;
+};
+
+/*
+ * Reset the connection: the data still queued on the socket is dropped,
+ * so the pages of the sends in flight are not read anymore.
+ */
+static void mk_sched_zc_reset(struct mk_channel *channel)
+{
+    struct linger lg = {1, 0};
+
+    setsockopt(channel->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+/*
+ * Keep the socket open after the connection is gone, until the kernel
+ * reports the zero copy sends completed: the buffers can't be released
+ * before. The client gets its FIN right away.
+ */
+static int mk_sched_zc_linger(struct mk_sched_conn *conn,
+                              struct mk_sched_worker *sched)
+{
+    struct mk_sched_zc_linger *zl;
+
+    zl = mk_mem_alloc_z(sizeof(struct mk_sched_zc_linger));
+    if (!zl) {
+        return -1;
+    }
+
+    zl->since = log_current_utime;
+    zl->channel.type = conn->channel.type;
+    zl->channel.fd = conn->channel.fd;
+    zl->channel.io = conn->channel.io;
+    mk_list_init(&zl->channel.streams);
+    mk_channel_zerocopy_move(&zl->channel, &conn->channel);
+
+    shutdown(zl->channel.fd, SHUT_WR);
+    mk_list_add(&zl->_head, &sched->zc_linger_queue);
+
+    MK_TRACE("[FD %i] Linger, zero copy sends in flight", zl->channel.fd);
+    return 0;
+}
+
+/*
+ * Close the lingering sockets whose sends completed. The ones waiting for
+ * longer than the connections timeout, or all of them if 'force' is set,
+ * are reset.
+ */
+void mk_sched_zc_linger_check(struct mk_sched_worker *sched,
+                              struct mk_server *server, int force)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_sched_zc_linger *zl;
+
+    sched->zc_linger_check = log_current_utime;
+
+    mk_list_foreach_safe(head, tmp, &sched->zc_linger_queue) {
+        zl = mk_list_entry(head, struct mk_sched_zc_linger, _head);
+
+        mk_channel_zerocopy_reap(&zl->channel);
+        if (mk_list_is_empty(&zl->channel.zc_pending) != 0) {
+            if (force == MK_FALSE &&
+                zl->since + server->timeout > log_current_utime) {
+                continue;
+            }
+            mk_sched_zc_reset(&zl->channel);
+        }
+
+        zl->channel.io->close(zl->channel.fd);
+        mk_channel_clean(&zl->channel);
+        mk_list_del(&zl->_head);
+        mk_mem_free(zl);
+    }
+}
+
 int mk_sched_remove_client(struct mk_sched_conn *conn,
                            struct mk_sched_worker *sched,
                            struct mk_server *server)
 {
+    int linger = MK_FALSE;
     struct mk_event *event;
 
     /*
@@ -537,8 +699,30 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
     //rb_erase(&conn->_rb_head, &sched->rb_queue);
     mk_sched_conn_timeout_del(conn);
 
+    if (conn->suspend_head.next) {
+        mk_list_del(&conn->suspend_head);
+    }
+
+    /*
+     * Zero copy sends still in flight keep the socket open, if that is not
+     * possible it's reset before their buffers are released.
+     */
+    if (mk_list_is_empty(&conn->channel.zc_pending) != 0) {
+        mk_channel_zerocopy_reap(&conn->channel);
+        if (mk_list_is_empty(&conn->channel.zc_pending) != 0) {
+            if (mk_sched_zc_linger(conn, sched) == 0) {
+                linger = MK_TRUE;
+            }
+            else {
+                mk_sched_zc_reset(&conn->channel);
+            }
+        }
+    }
+
     /* Close at network layer level */
-    conn->net->close(event->fd);
+    if (linger == MK_FALSE) {
+        conn->net->close(event->fd);
+    }
 
     /* Release and return */
     mk_channel_clean(&conn->channel);
@@ -592,6 +776,7 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
             MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
                      conn->event.fd);
             MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
+            sched->metrics.timeouts++;
             conn->protocol->cb_close(conn, sched, MK_SCHED_CONN_TIMEOUT,
                                      server);
             mk_sched_drop_connection(conn, sched, server);
@@ -634,6 +819,16 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
             MK_TRACE("[FD %i] EAGAIN: need to read more data", conn->event.fd);
             return 1;
         }
+        else if (errno == EINPROGRESS) {
+            /*
+             * The network layer took the connection for a while, stop
+             * polling it until mk_sched_conn_resume() is called.
+             */
+            MK_TRACE("[FD %i] EINPROGRESS: suspended", conn->event.fd);
+            mk_event_del(sched->loop, &conn->event);
+            mk_list_add(&conn->suspend_head, &sched->suspended_queue);
+            return 1;
+        }
         return -1;
     }
 
@@ -663,7 +858,12 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
         total += count;
     } while (total <= sched->mem_pagesize && ((ret & stop) == 0));
 
-    if (ret == MK_CHANNEL_DONE) {
+    /*
+     * A channel becomes empty (instead of done) once the last input of a
+     * stream that is still attached got flushed, if we wrote something in
+     * this round the response is complete.
+     */
+    if (ret == MK_CHANNEL_DONE || (ret == MK_CHANNEL_EMPTY && total > 0)) {
         if (conn->protocol->cb_done) {
             ret = conn->protocol->cb_done(conn, sched, server);
             if (ret == 1) {
@@ -696,6 +896,44 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
     return ret;
 }
 
+/*
+ * Put back into the event loop a connection suspended by its network
+ * layer. The read handler runs right away: the data the network layer
+ * is waiting for may be buffered already and no event would report it.
+ */
+int mk_sched_conn_resume(struct mk_sched_worker *sched, int remote_fd,
+                         struct mk_server *server)
+{
+    int ret;
+    struct mk_list *head;
+    struct mk_sched_conn *conn = NULL;
+
+    mk_list_foreach(head, &sched->suspended_queue) {
+        conn = mk_list_entry(head, struct mk_sched_conn, suspend_head);
+        if (conn->event.fd == remote_fd) {
+            break;
+        }
+        conn = NULL;
+    }
+
+    if (!conn) {
+        return -1;
+    }
+
+    mk_list_del(&conn->suspend_head);
+    ret = mk_event_add(sched->loop, remote_fd,
+                       MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+    if (ret == 0) {
+        ret = mk_sched_event_read(conn, sched, server);
+    }
+
+    if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
+        mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED, server);
+    }
+
+    return 0;
+}
+
 int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
                          struct mk_server *server)
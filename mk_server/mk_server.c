@@ -27,6 +27,9 @@
 #include <monkey/mk_server_tls.h>
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_core.h>
+#include <monkey/mk_ratelimit.h>
+#include <monkey/mk_http_thread.h>
+#include <monkey/mk_http_async.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -70,6 +73,7 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
 {
     int ret;
     int client_fd = -1;
+    uint64_t ratelimit_key = 0;
     struct mk_sched_conn *conn;
     struct mk_server_listen *listener = data;
 
@@ -79,10 +83,29 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
         goto error;
     }
 
+    /* Per client rate limit, before plugins or sessions see the client */
+    if (server->ratelimit) {
+        ratelimit_key = mk_ratelimit_key(client_fd, server);
+        if (mk_ratelimit_connection(ratelimit_key, server) != 0) {
+            MK_TRACE("[server] Connection rate limit, dropping FD %i",
+                     client_fd);
+            /* in balancer mode this runs outside of the worker thread */
+            __atomic_fetch_add(&sched->metrics.ratelimit_conns, 1,
+                               __ATOMIC_RELAXED);
+            if (server->ratelimit_silent == MK_FALSE &&
+                !(listener->listen->flags & MK_CAP_SOCK_TLS)) {
+                mk_ratelimit_reject(client_fd);
+            }
+            listener->network->network->close(client_fd);
+            return NULL;
+        }
+    }
+
     conn = mk_sched_add_connection(client_fd, listener, sched, server);
     if (mk_unlikely(!conn)) {
         goto error;
     }
+    conn->ratelimit_key = ratelimit_key;
 
     ret = mk_event_add(sched->loop, client_fd,
                        MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
@@ -139,6 +162,42 @@ void mk_server_listen_exit(struct mk_list *list)
     mk_mem_free(list);
 }
 
+/*
+ * ReusePortSteering: each worker creates its own listener sockets in
+ * launch order, so the worker index is also the socket index inside the
+ * REUSEPORT group. Connections are steered to the worker pinned to the
+ * CPU that received them.
+ */
+static void mk_server_listen_steer(struct mk_server *server, int server_fd)
+{
+    int i;
+    int *cpus;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    struct mk_sched_worker *sched;
+
+    sched = MK_TLS_GET(mk_tls_sched_worker_node);
+    if (!sched || sched->cpu < 0) {
+        return;
+    }
+
+    if (mk_socket_set_incoming_cpu(server_fd, sched->cpu) != 0) {
+        mk_warn("[server] Could not set SO_INCOMING_CPU");
+    }
+
+    cpus = mk_mem_alloc(sizeof(int) * server->workers);
+    if (!cpus) {
+        return;
+    }
+    for (i = 0; i < server->workers; i++) {
+        cpus[i] = ctx->workers[i].cpu;
+    }
+
+    if (mk_socket_reuseport_steer(server_fd, cpus, server->workers) != 0) {
+        mk_warn("[server] Could not attach the REUSEPORT CPU steering program");
+    }
+    mk_mem_free(cpus);
+}
+
 struct mk_list *mk_server_listen_init(struct mk_server *server)
 {
     int i = 0;
@@ -177,6 +236,11 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
 #endif
             }
 
+            if (reuse_port == MK_TRUE &&
+                server->reuseport_steering == MK_TRUE) {
+                mk_server_listen_steer(server, server_fd);
+            }
+
             listener = mk_mem_alloc(sizeof(struct mk_server_listen));
 
             /* configure the internal event_state */
@@ -328,6 +392,169 @@ void mk_server_loop_balancer(struct mk_server *server)
     }
 }
 
+/*
+ * Register the listeners owned by the worker and the timeouts checker,
+ * the worker is ready to process connections after this call.
+ */
+int mk_server_worker_start(struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_sched_worker *sched;
+    struct mk_server_listen *listener;
+    struct mk_server_timeout *server_timeout;
+
+    sched = mk_sched_get_thread_conf();
+
+    /* REUSEPORT or embedded mode: register listeners */
+    if (sched->listeners) {
+        mk_list_foreach(head, sched->listeners) {
+            listener = mk_list_entry(head, struct mk_server_listen, _head);
+            mk_event_add(sched->loop, listener->server_fd,
+                         MK_EVENT_LISTENER, MK_EVENT_READ,
+                         listener);
+        }
+    }
+
+    /* create a new timeout file descriptor */
+    server_timeout = mk_mem_alloc(sizeof(struct mk_server_timeout));
+    if (!server_timeout) {
+        return -1;
+    }
+    MK_TLS_SET(mk_tls_server_timeout, server_timeout);
+    sched->timeout_fd = mk_event_timeout_create(sched->loop, server->timeout,
+                                                0, server_timeout);
+    return 0;
+}
+
+/* Release the worker context, it runs in the worker thread */
+static void mk_server_worker_exit(struct mk_server *server,
+                                  struct mk_sched_worker *sched)
+{
+    if (sched->timeout_fd > 0) {
+        close(sched->timeout_fd);
+    }
+    mk_mem_free(MK_TLS_GET(mk_tls_server_timeout));
+    mk_server_listen_exit(sched->listeners);
+    mk_sched_zc_linger_check(sched, server, MK_TRUE);
+    mk_http_thread_worker_exit(sched);
+    mk_http_async_worker_exit(sched);
+    mk_event_loop_destroy(sched->loop);
+    mk_sched_worker_free(server);
+    MK_TLS_SET(mk_tls_sched_worker_node, NULL);
+}
+
+/*
+ * Process the events reported by the last wait on the worker loop.
+ * Returns -1 once the worker has been released (MK_SCHED_SIGNAL_FREE_ALL).
+ */
+static int mk_server_worker_dispatch(struct mk_server *server,
+                                     struct mk_sched_worker *sched)
+{
+    int ret;
+    uint64_t val;
+    struct mk_event *event;
+    struct mk_event_loop *evl;
+    struct mk_sched_conn *conn;
+
+    evl = sched->loop;
+    mk_event_foreach(event, evl) {
+        ret = 0;
+        if (event->type & MK_EVENT_IDLE) {
+            continue;
+        }
+
+        if (event->type == MK_EVENT_CONNECTION) {
+            conn = (struct mk_sched_conn *) event;
+
+            /*
+             * Zero copy completions wake up the socket as an error,
+             * the registered mask doesn't tell it: consume them while
+             * some send is in flight.
+             */
+            if (mk_list_is_empty(&conn->channel.zc_pending) != 0) {
+                mk_channel_zerocopy_reap(&conn->channel);
+            }
+
+            if (event->mask & MK_EVENT_WRITE) {
+                MK_TRACE("[FD %i] Event WRITE", event->fd);
+                ret = mk_sched_event_write(conn, sched, server);
+                //printf("event write ret=%i\n", ret);
+            }
+
+            if (event->mask & MK_EVENT_READ) {
+                MK_TRACE("[FD %i] Event READ", event->fd);
+                ret = mk_sched_event_read(conn, sched, server);
+            }
+
+
+            if (event->mask & MK_EVENT_CLOSE && ret != -1) {
+                MK_TRACE("[FD %i] Event CLOSE", event->fd);
+                ret = -1;
+            }
+
+            if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
+                MK_TRACE("[FD %i] Event FORCE CLOSE | ret = %i",
+                         event->fd, ret);
+                mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED,
+                                     server);
+            }
+        }
+        else if (event->type == MK_EVENT_LISTENER) {
+            /*
+             * A new connection have been accepted..or failed, despite
+             * the result, we let the loop continue processing the other
+             * events triggered.
+             */
+            conn = mk_server_listen_handler(sched, event, server);
+            if (conn) {
+                //conn->event.mask = MK_EVENT_READ
+                //goto speed;
+            }
+            continue;
+        }
+        else if (event->type == MK_EVENT_CUSTOM) {
+            /*
+             * We got an event associated to a custom interface, that
+             * means a plugin registered some file descriptor on this
+             * event loop and an event was triggered. We pass the control
+             * to the defined event handler.
+             */
+            event->handler(event);
+        }
+        else if (event->type == MK_EVENT_NOTIFICATION) {
+            ret = read(event->fd, &val, sizeof(val));
+            if (ret < 0) {
+                mk_libc_error("read");
+                continue;
+            }
+
+            if (event->fd == sched->signal_channel_r) {
+                if (val == MK_SCHED_SIGNAL_DEADBEEF) {
+                    //FIXME:mk_sched_sync_counters();
+                    continue;
+                }
+                else if (val == MK_SCHED_SIGNAL_FREE_ALL) {
+                    mk_server_worker_exit(server, sched);
+                    return -1;
+                }
+            }
+            else if (event->fd == sched->timeout_fd) {
+                mk_sched_check_timeouts(sched, server);
+            }
+            continue;
+        }
+    }
+    mk_sched_event_free_all(sched);
+
+    /* Lingering sockets, checked once per second at most */
+    if (mk_list_is_empty(&sched->zc_linger_queue) != 0 &&
+        sched->zc_linger_check != log_current_utime) {
+        mk_sched_zc_linger_check(sched, server, MK_FALSE);
+    }
+
+    return 0;
+}
+
 /*
  * This function is called when the scheduler is running in the REUSEPORT
  * mode. That means that each worker is listening on shared TCP ports.
@@ -338,16 +565,10 @@ void mk_server_loop_balancer(struct mk_server *server)
 void mk_server_worker_loop(struct mk_server *server)
 {
     int ret = -1;
-    int timeout_fd;
     uint64_t val;
     struct mk_event *event;
     struct mk_event_loop *evl;
-    struct mk_list *list;
-    struct mk_list *head;
-    struct mk_sched_conn *conn;
     struct mk_sched_worker *sched;
-    struct mk_server_listen *listener;
-    struct mk_server_timeout *server_timeout;
 
     /* Get thread conf */
     sched = mk_sched_get_thread_conf();
@@ -376,109 +597,53 @@ void mk_server_worker_loop(struct mk_server *server)
         }
     }
 
-    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
-        /* Register listeners */
-        list = MK_TLS_GET(mk_tls_server_listen);
-        mk_list_foreach(head, list) {
-            listener = mk_list_entry(head, struct mk_server_listen, _head);
-            mk_event_add(sched->loop, listener->server_fd,
-                         MK_EVENT_LISTENER, MK_EVENT_READ,
-                         listener);
-        }
+    if (mk_server_worker_start(server) != 0) {
+        return;
     }
 
-    /* create a new timeout file descriptor */
-    server_timeout = mk_mem_alloc(sizeof(struct mk_server_timeout));
-    MK_TLS_SET(mk_tls_server_timeout, server_timeout);
-    timeout_fd = mk_event_timeout_create(evl, server->timeout, 0, server_timeout);
-
     while (1) {
         mk_event_wait(evl);
-        mk_event_foreach(event, evl) {
-            ret = 0;
-            if (event->type & MK_EVENT_IDLE) {
-                continue;
-            }
-
-            if (event->type == MK_EVENT_CONNECTION) {
-                conn = (struct mk_sched_conn *) event;
+        if (mk_server_worker_dispatch(server, sched) == -1) {
+            return;
+        }
+    }
+}
 
-                if (event->mask & MK_EVENT_WRITE) {
-                    MK_TRACE("[FD %i] Event WRITE", event->fd);
-                    ret = mk_sched_event_write(conn, sched, server);
-                    //printf("event write ret=%i\n", ret);
-                }
+/*
+ * Embedded mode: run one iteration of the worker owned by the calling
+ * thread, waiting at most 'timeout' milliseconds for events (-1 blocks).
+ * Returns the number of events processed, or -1 on error.
+ */
+int mk_server_worker_run_once(struct mk_server *server, int timeout)
+{
+    int n;
+    struct mk_sched_worker *sched;
 
-                if (event->mask & MK_EVENT_READ) {
-                    MK_TRACE("[FD %i] Event READ", event->fd);
-                    ret = mk_sched_event_read(conn, sched, server);
-                }
+    sched = mk_sched_get_thread_conf();
+    if (!sched) {
+        return -1;
+    }
 
+    n = mk_event_wait_2(sched->loop, timeout);
+    if (n <= 0) {
+        if (n == -1 && errno == EINTR) {
+            return 0;
+        }
+        return n;
+    }
 
-                if (event->mask & MK_EVENT_CLOSE && ret != -1) {
-                    MK_TRACE("[FD %i] Event CLOSE", event->fd);
-                    ret = -1;
-                }
+    mk_server_worker_dispatch(server, sched);
+    return n;
+}
 
-                if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
-                    MK_TRACE("[FD %i] Event FORCE CLOSE | ret = %i",
-                             event->fd, ret);
-                    mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED,
-                                         server);
-                }
-            }
-            else if (event->type == MK_EVENT_LISTENER) {
-                /*
-                 * A new connection have been accepted..or failed, despite
-                 * the result, we let the loop continue processing the other
-                 * events triggered.
-                 */
-                conn = mk_server_listen_handler(sched, event, server);
-                if (conn) {
-                    //conn->event.mask = MK_EVENT_READ
-                    //goto speed;
-                }
-                continue;
-            }
-            else if (event->type == MK_EVENT_CUSTOM) {
-                /*
-                 * We got an event associated to a custom interface, that
-                 * means a plugin registered some file descriptor on this
-                 * event loop and an event was triggered. We pass the control
-                 * to the defined event handler.
-                 */
-                event->handler(event);
-            }
-            else if (event->type == MK_EVENT_NOTIFICATION) {
-                ret = read(event->fd, &val, sizeof(val));
-                if (ret < 0) {
-                    mk_libc_error("read");
-                    continue;
-                }
+/* Embedded mode: release the worker owned by the calling thread */
+void mk_server_worker_stop(struct mk_server *server)
+{
+    struct mk_sched_worker *sched;
 
-                if (event->fd == sched->signal_channel_r) {
-                    if (val == MK_SCHED_SIGNAL_DEADBEEF) {
-                        //FIXME:mk_sched_sync_counters();
-                        continue;
-                    }
-                    else if (val == MK_SCHED_SIGNAL_FREE_ALL) {
-                        if (timeout_fd > 0) {
-                            close(timeout_fd);
-                        }
-                        mk_mem_free(MK_TLS_GET(mk_tls_server_timeout));
-                        mk_server_listen_exit(sched->listeners);
-                        mk_event_loop_destroy(evl);
-                        mk_sched_worker_free(server);
-                        return;
-                    }
-                }
-                else if (event->fd == timeout_fd) {
-                    mk_sched_check_timeouts(sched, server);
-                }
-                continue;
-            }
-        }
-        mk_sched_event_free_all(sched);
+    sched = mk_sched_get_thread_conf();
+    if (sched) {
+        mk_server_worker_exit(server, sched);
     }
 }
 
@@ -32,6 +32,10 @@
 #include <netinet/tcp.h>
 #include <sys/un.h>
 
+#if defined (__linux__)
+#include <linux/filter.h>
+#endif
+
 /*
  * Example from:
  * http://www.baus.net/on-tcp_cork
@@ -103,6 +107,67 @@ int mk_socket_set_tcp_reuseport(int sockfd)
     return setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 }
 
+/* Hint the kernel about the CPU that will process this socket */
+int mk_socket_set_incoming_cpu(int sockfd, int cpu)
+{
+    return setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
+
+/*
+ * Attach a classic BPF program to the REUSEPORT group of 'sockfd' that
+ * picks the socket by the CPU handling the incoming packet: if the CPU
+ * matches cpus[i] the connection goes to the i-th socket of the group,
+ * otherwise it falls back to 'cpu % n'. Sockets are indexed in the
+ * order they joined the group.
+ */
+int mk_socket_reuseport_steer(int sockfd, int *cpus, int n)
+{
+#if defined (__linux__)
+    int i;
+    int ret;
+    int len = 0;
+    struct sock_fprog prog;
+    struct sock_filter *code;
+
+    if (n <= 0 || (n * 2) + 3 > BPF_MAXINSNS) {
+        return -1;
+    }
+
+    code = mk_mem_alloc(sizeof(struct sock_filter) * ((n * 2) + 3));
+    if (!code) {
+        return -1;
+    }
+
+    /* A = current CPU */
+    code[len++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    /* if (A == cpus[i]) return i */
+    for (i = 0; i < n; i++) {
+        code[len++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+
+    /* return A % n */
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len    = len;
+    prog.filter = code;
+
+    ret = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                     &prog, sizeof(prog));
+    mk_mem_free(code);
+    return ret;
+#else
+    (void) sockfd;
+    (void) cpus;
+    (void) n;
+    return -1;
+#endif
+}
+
 int mk_socket_create(int domain, int type, int protocol)
 {
     int fd;
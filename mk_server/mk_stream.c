@@ -21,6 +21,18 @@
 #include <monkey/mk_stream.h>
 #include <assert.h>
 
+#ifdef MK_HAVE_ZEROCOPY
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+/* Buffer referenced by zero copy sends not completed yet */
+struct mk_channel_zc {
+    uint32_t seq;                  /* last send using the buffer */
+    struct mk_stream_buffer *buf;
+    struct mk_list _head;
+};
+#endif
+
 /* Create a new channel */
 struct mk_channel *mk_channel_new(int type, int fd)
 {
@@ -29,8 +41,12 @@ struct mk_channel *mk_channel_new(int type, int fd)
     channel = mk_mem_alloc(sizeof(struct mk_channel));
     channel->type = type;
     channel->fd   = fd;
+    channel->zerocopy     = 0;
+    channel->zc_seq       = 0;
+    channel->zc_threshold = 0;
 
     mk_list_init(&channel->streams);
+    mk_list_init(&channel->zc_pending);
 
     return channel;
 }
@@ -55,15 +71,182 @@ static inline size_t channel_write_in_file(struct mk_channel *channel,
     return bytes;
 }
 
+#ifdef MK_HAVE_ZEROCOPY
+/*
+ * Send a shared buffer with MSG_ZEROCOPY: the pages are pinned instead of
+ * copied into the socket buffer, so the buffer is referenced until the
+ * kernel completes the send. Consecutive sends of the same buffer share a
+ * single reference.
+ */
+static inline ssize_t channel_write_zerocopy(struct mk_channel *channel,
+                                             struct mk_stream_input *in)
+{
+    int on = 1;
+    ssize_t bytes;
+    struct mk_channel_zc *zc = NULL;
+    struct mk_channel_zc *new = NULL;
+    struct mk_stream_buffer *buf = in->context;
+
+    if (channel->zerocopy == 0) {
+        if (setsockopt(channel->fd, SOL_SOCKET, SO_ZEROCOPY,
+                       &on, sizeof(on)) == 0) {
+            channel->zerocopy = 1;
+        }
+        else {
+            channel->zerocopy = -1;
+        }
+    }
+
+    if (channel->zerocopy != 1) {
+        return mk_sched_conn_write(channel, in->buffer, in->bytes_total);
+    }
+
+    if (mk_list_is_empty(&channel->zc_pending) != 0) {
+        zc = mk_list_entry_last(&channel->zc_pending,
+                                struct mk_channel_zc, _head);
+        if (zc->buf != buf) {
+            zc = NULL;
+        }
+    }
+
+    if (!zc) {
+        new = mk_mem_alloc(sizeof(struct mk_channel_zc));
+        if (!new) {
+            return mk_sched_conn_write(channel, in->buffer, in->bytes_total);
+        }
+    }
+
+    bytes = send(channel->fd, in->buffer, in->bytes_total,
+                 MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (bytes == -1 && errno == ENOBUFS) {
+        /* Out of socket option memory, copy this round */
+        bytes = mk_sched_conn_write(channel, in->buffer, in->bytes_total);
+    }
+    else if (bytes > 0) {
+        if (new) {
+            new->buf = buf;
+            mk_stream_buffer_get(buf);
+            mk_list_add(&new->_head, &channel->zc_pending);
+            zc = new;
+            new = NULL;
+        }
+        zc->seq = channel->zc_seq++;
+    }
+
+    if (new) {
+        mk_mem_free(new);
+    }
+
+    MK_TRACE("[CH %i] STREAM_BUFFER zerocopy, bytes=%zd/%lu",
+             channel->fd, bytes, in->bytes_total);
+    return bytes;
+}
+
+/* Drop the references of the sends completed up to 'seq' */
+static int channel_zerocopy_release(struct mk_channel *channel, uint32_t seq)
+{
+    int count = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_channel_zc *zc;
+
+    mk_list_foreach_safe(head, tmp, &channel->zc_pending) {
+        zc = mk_list_entry(head, struct mk_channel_zc, _head);
+        if ((int32_t) (zc->seq - seq) > 0) {
+            break;
+        }
+        mk_list_del(&zc->_head);
+        mk_stream_buffer_put(zc->buf);
+        mk_mem_free(zc);
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Read the completions from the socket error queue. TCP reports them in
+ * order, each one covers a range of send ids: everything up to the end of
+ * the range can be released.
+ */
+int mk_channel_zerocopy_reap(struct mk_channel *channel)
+{
+    int ret;
+    int count = 0;
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (mk_list_is_empty(&channel->zc_pending) != 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(channel->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (ret == -1) {
+            break;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) {
+            continue;
+        }
+
+        serr = (struct sock_extended_err *) CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+            continue;
+        }
+
+        /* The kernel had to copy the data anyway (e.g: loopback) */
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            channel->zerocopy = -1;
+        }
+
+        count += channel_zerocopy_release(channel, serr->ee_data);
+    }
+
+    return count;
+}
+#else
+int mk_channel_zerocopy_reap(struct mk_channel *channel)
+{
+    (void) channel;
+    return 0;
+}
+#endif
+
+/*
+ * Hand the zero copy sends in flight over to another channel on the same
+ * socket, so they can be reaped once the owner of 'from' is gone.
+ */
+void mk_channel_zerocopy_move(struct mk_channel *to, struct mk_channel *from)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+
+    to->zerocopy = from->zerocopy;
+    to->zc_seq   = from->zc_seq;
+    mk_list_init(&to->zc_pending);
+
+    mk_list_foreach_safe(head, tmp, &from->zc_pending) {
+        mk_list_del(head);
+        mk_list_add(head, &to->zc_pending);
+    }
+}
+
 static inline void consume_raw(struct mk_stream_input *in, size_t bytes)
 {
+    /*
+     * A raw buffer is owned by the caller, it can be a read-only string or
+     * a slice of a bigger buffer (e.g: a backend response kept in place by
+     * a plugin), so never touch its content: just move the reference.
+     */
     if (bytes == in->bytes_total) {
         in->buffer = NULL;
     }
     else {
-        memmove(in->buffer,
-                in->buffer + bytes,
-                in->bytes_total - bytes);
+        in->buffer = (char *) in->buffer + bytes;
     }
 }
 
@@ -79,7 +262,9 @@ static inline void consume_copybuf(struct mk_stream_input *in, size_t bytes)
      * on the caller mk_channel_write().
      */
     if (bytes == in->bytes_total) {
-        mk_mem_free(in->buffer);
+        if (!in->stream->arena) {
+            mk_mem_free(in->buffer);
+        }
         in->buffer = NULL;
     }
     else {
@@ -136,13 +321,50 @@ int mk_channel_flush(struct mk_channel *channel)
     return ret;
 }
 
+/* The caller owns the first reference */
+struct mk_stream_buffer *mk_stream_buffer_create(char *data, size_t size,
+                                                 void (*cb_release)(void *),
+                                                 void *context)
+{
+    struct mk_stream_buffer *buf;
+
+    buf = mk_mem_alloc(sizeof(struct mk_stream_buffer));
+    if (!buf) {
+        return NULL;
+    }
+    buf->refs       = 1;
+    buf->data       = data;
+    buf->size       = size;
+    buf->context    = context;
+    buf->cb_release = cb_release;
+
+    return buf;
+}
+
+void mk_stream_buffer_put(struct mk_stream_buffer *buf)
+{
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (buf->cb_release) {
+        buf->cb_release(buf->context);
+    }
+    mk_mem_free(buf);
+}
+
 int mk_stream_in_release(struct mk_stream_input *in)
 {
-    if (in->type == MK_STREAM_COPYBUF) {
+    /* Buffers taken from the request arena are released with it */
+    if (in->type == MK_STREAM_COPYBUF && !in->stream->arena) {
         if (in->buffer) {
             mk_mem_free(in->buffer);
         }
     }
+    else if (in->type == MK_STREAM_BUFFER) {
+        /* Sent or dropped, this input is done with the shared bytes */
+        mk_stream_buffer_put(in->context);
+    }
 
     mk_stream_input_unlink(in);
     if (in->dynamic == MK_TRUE) {
@@ -157,6 +379,8 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
 {
     ssize_t bytes = -1;
     struct mk_iov *iov;
+    struct mk_list *head;
+    struct mk_metrics *metrics;
     struct mk_stream *stream = NULL;
     struct mk_stream_input *input;
 
@@ -167,9 +391,19 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
         return MK_CHANNEL_EMPTY;
     }
 
-    /* Get the input source */
-    stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
-    if (mk_list_is_empty(&stream->inputs) == 0) {
+    /*
+     * Get the input source: a handler may append its own stream after the
+     * request one (e.g: FastCGI), skip streams that have nothing to send.
+     */
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            break;
+        }
+        stream = NULL;
+    }
+
+    if (!stream) {
         return MK_CHANNEL_EMPTY;
     }
     input = mk_list_entry_first(&stream->inputs, struct mk_stream_input, _head);
@@ -202,7 +436,18 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                 consume_copybuf(input, bytes);
             }
         }
-        else if (input->type == MK_STREAM_RAW) {
+#ifdef MK_HAVE_ZEROCOPY
+        else if (input->type == MK_STREAM_BUFFER &&
+                 channel->zc_threshold > 0 &&
+                 input->bytes_total >= channel->zc_threshold) {
+            bytes = channel_write_zerocopy(channel, input);
+            if (bytes > 0) {
+                consume_raw(input, bytes);
+            }
+        }
+#endif
+        else if (input->type == MK_STREAM_RAW ||
+                 input->type == MK_STREAM_BUFFER) {
             bytes = mk_sched_conn_write(channel,
                                         input->buffer, input->bytes_total);
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu",
@@ -223,6 +468,11 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
             *count = bytes;
             mk_stream_input_consume(input, bytes);
 
+            metrics = mk_sched_metrics();
+            if (metrics) {
+                metrics->bytes_out += bytes;
+            }
+
             /* notification callback, optional */
             if (stream->cb_bytes_consumed) {
                 stream->cb_bytes_consumed(stream, bytes);
@@ -296,5 +546,15 @@ int mk_channel_clean(struct mk_channel *channel)
         mk_stream_release(stream);
     }
 
+#ifdef MK_HAVE_ZEROCOPY
+    /*
+     * The kernel reads the pages of a send in flight until its completion,
+     * releasing them earlier lets the owner reuse memory still on the wire:
+     * callers hand the pending sends over (mk_channel_zerocopy_move()) or
+     * reset the connection first, which drops the data queued on it.
+     */
+    channel_zerocopy_release(channel, channel->zc_seq - 1);
+#endif
+
     return 0;
 }
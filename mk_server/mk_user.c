@@ -30,13 +30,12 @@
 #include <sys/types.h>
 #include <grp.h>
 
-int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
-                 struct mk_server *server)
+int mk_user_init(struct mk_http_request *sr, struct mk_server *server)
 {
     int limit;
     const int offset = 2; /* The user is defined after the '/~' string, so offset = 2 */
     const int user_len = 255;
-    char user[user_len], *user_uri;
+    char user[user_len];
     struct passwd *s_user;
 
     if (sr->uri_processed.len <= 2) {
@@ -61,30 +60,29 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     /* Check system user */
     if ((s_user = getpwnam(user)) == NULL) {
-        mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
         return -1;
     }
 
+    /* The path is request scoped, it lives in the request arena */
     if (sr->uri_processed.len > (unsigned int) (offset+limit)) {
-        user_uri = mk_mem_alloc(sr->uri_processed.len);
-        if (!user_uri) {
-            return -1;
-        }
-
-        memcpy(user_uri,
-               sr->uri_processed.data + (offset + limit),
-               sr->uri_processed.len - offset - limit);
-        user_uri[sr->uri_processed.len - offset - limit] = '\0';
-
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s%s",
-                        s_user->pw_dir, server->conf_user_pub, user_uri);
-        mk_mem_free(user_uri);
+        sr->real_path.data = mk_arena_printf(&sr->arena, "%s/%s%.*s",
+                                             s_user->pw_dir,
+                                             server->conf_user_pub,
+                                             (int) (sr->uri_processed.len -
+                                                    offset - limit),
+                                             sr->uri_processed.data +
+                                             (offset + limit));
     }
     else {
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s", s_user->pw_dir, server->conf_user_pub);
+        sr->real_path.data = mk_arena_printf(&sr->arena, "%s/%s",
+                                             s_user->pw_dir,
+                                             server->conf_user_pub);
+    }
+
+    if (!sr->real_path.data) {
+        return -1;
     }
+    sr->real_path.len = strlen(sr->real_path.data);
 
     sr->user_home = MK_TRUE;
     return 0;
@@ -21,7 +21,7 @@
 #include <monkey/monkey.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_vhost.h>
-#include <monkey/mk_vhost_tls.h>
+#include <monkey/mk_vhost_match.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_info.h>
@@ -30,9 +30,6 @@
 #include <dirent.h>
 #include <fcntl.h>
 
-/* Initialize Virtual Host FDT mutex */
-pthread_mutex_t mk_vhost_fdt_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 static int str_to_regex(char *str, regex_t *reg)
 {
     int ret;
@@ -54,262 +51,6 @@ static int str_to_regex(char *str, regex_t *reg)
     return 0;
 }
 
-/*
- * This function is triggered upon thread creation (inside the thread
- * context), here we configure per-thread data.
- */
-int mk_vhost_fdt_worker_init(struct mk_server *server)
-{
-    int i;
-    int j;
-    struct mk_vhost *h;
-    struct mk_list *list;
-    struct mk_list *head;
-    struct vhost_fdt_host *fdt;
-    struct vhost_fdt_hash_table *ht;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    /*
-     * We are under a thread context and the main configuration is
-     * already in place. Now for every existent virtual host we are
-     * going to create the File Descriptor Table (FDT) which aims to
-     * hold references of 'open and shared' file descriptors under
-     * the Virtual Host context.
-     */
-
-    /*
-     * Under an initialization context we need to protect this critical
-     * section
-     */
-    pthread_mutex_lock(&mk_vhost_fdt_mutex);
-
-    /*
-     * Initialize the thread FDT/Hosts list and create an entry per
-     * existent virtual host
-     */
-    list = mk_mem_alloc_z(sizeof(struct mk_list));
-    mk_list_init(list);
-
-    mk_list_foreach(head, &server->hosts) {
-        h = mk_list_entry(head, struct mk_vhost, _head);
-
-        fdt = mk_mem_alloc(sizeof(struct vhost_fdt_host));
-        fdt->host = h;
-
-        /* Initialize hash table */
-        for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
-            ht = &fdt->hash_table[i];
-            ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
-
-            /* for each chain under the hash table, set the fd */
-            for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
-                hc = &ht->chain[j];
-                hc->fd      = -1;
-                hc->hash    =  0;
-                hc->readers =  0;
-            }
-        }
-        mk_list_add(&fdt->_head, list);
-    }
-
-    MK_TLS_SET(mk_tls_vhost_fdt, list);
-    pthread_mutex_unlock(&mk_vhost_fdt_mutex);
-
-    return 0;
-}
-
-int mk_vhost_fdt_worker_exit(struct mk_server *server)
-{
-    struct mk_list *list;
-    struct mk_list *head;
-    struct mk_list *tmp;
-    struct vhost_fdt_host *fdt;
-
-    if (server->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach_safe(head, tmp, list) {
-        fdt = mk_list_entry(head, struct vhost_fdt_host, _head);
-        mk_list_del(&fdt->_head);
-        mk_mem_free(fdt);
-    }
-
-    mk_mem_free(list);
-    return 0;
-}
-
-
-static inline
-struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct mk_vhost *host)
-{
-    struct mk_list *head;
-    struct mk_list *list;
-    struct vhost_fdt_host *fdt_host;
-    struct vhost_fdt_hash_table *ht = NULL;
-
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach(head, list) {
-        fdt_host = mk_list_entry(head, struct vhost_fdt_host, _head);
-        if (fdt_host->host == host) {
-            ht = &fdt_host->hash_table[id];
-            return ht;
-        }
-    }
-
-    return ht;
-}
-
-static inline
-struct vhost_fdt_hash_chain
-*mk_vhost_fdt_chain_lookup(unsigned int hash, struct vhost_fdt_hash_table *ht)
-{
-    int i;
-    struct vhost_fdt_hash_chain *hc = NULL;
-
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->hash == hash) {
-            return hc;
-        }
-    }
-
-    return NULL;
-}
-
-
-static inline int mk_vhost_fdt_open(int id, unsigned int hash,
-                                    struct mk_http_request *sr,
-                                    struct mk_server *server)
-{
-    int i;
-    int fd = -1;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and return the shared FD */
-        hc->readers++;
-        sr->vhost_fdt_id      = id;
-        sr->vhost_fdt_hash    = hash;
-        sr->vhost_fdt_enabled = MK_TRUE;
-        return hc->fd;
-    }
-
-    /*
-     * Get here means that no entry exists in the hash table for the
-     * requested file descriptor and hash, we must try to open the file
-     * and register the entry in the table.
-     */
-    fd = open(sr->real_path.data, sr->file_info.flags_read_only);
-    if (fd == -1) {
-        return -1;
-    }
-
-    /* If chains are full, just return the new FD, bad luck... */
-    if (ht->av_slots <= 0) {
-        return fd;
-    }
-
-    /* Register the new entry in an available slot */
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->fd == -1) {
-            hc->fd   = fd;
-            hc->hash = hash;
-            hc->readers++;
-            ht->av_slots--;
-
-            sr->vhost_fdt_id      = id;
-            sr->vhost_fdt_hash    = hash;
-            sr->vhost_fdt_enabled = MK_TRUE;
-
-            return fd;
-        }
-    }
-
-    return fd;
-}
-
-static inline int mk_vhost_fdt_close(struct mk_http_request *sr,
-                                     struct mk_server *server)
-{
-    int id;
-    unsigned int hash;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE || sr->vhost_fdt_enabled == MK_FALSE) {
-        if (sr->in_file.fd > 0) {
-            return close(sr->in_file.fd);
-        }
-        return -1;
-    }
-
-    id   = sr->vhost_fdt_id;
-    hash = sr->vhost_fdt_hash;
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return close(sr->in_file.fd);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and check if we should close */
-        hc->readers--;
-        sr->vhost_fdt_enabled = MK_FALSE;
-
-        if (hc->readers == 0) {
-            hc->fd   = -1;
-            hc->hash = 0;
-            ht->av_slots++;
-            return close(sr->in_file.fd);
-        }
-        else {
-            return 0;
-        }
-    }
-    return close(sr->in_file.fd);
-}
-
-
-int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server)
-{
-    int id;
-    int off;
-    unsigned int hash;
-
-    off = sr->host_conf->documentroot.len;
-    hash = mk_utils_gen_hash(sr->real_path.data + off,
-                             sr->real_path.len - off);
-    id   = (hash % VHOST_FDT_HASHTABLE_SIZE);
-
-    return mk_vhost_fdt_open(id, hash, sr, server);
-}
-
-int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server)
-{
-    return mk_vhost_fdt_close(sr, server);
-}
-
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
@@ -325,6 +66,7 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     h->name = NULL;
     h->cb   = cb;
     h->data = data;
+    h->thread = MK_FALSE;
     mk_list_init(&h->params);
 
     ret = str_to_regex(match, &h->match);
@@ -332,10 +74,29 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
         mk_mem_free(h);
         return NULL;
     }
+    h->pattern = mk_string_dup(match);
 
     return h;
 }
 
+/* Find the pre-rendered response registered for an exact path */
+struct mk_vhost_static *mk_vhost_static_lookup(struct mk_vhost *host,
+                                               char *path, int len)
+{
+    struct mk_list *head;
+    struct mk_vhost_static *st;
+
+    mk_list_foreach(head, &host->statics) {
+        st = mk_list_entry(head, struct mk_vhost_static, _head);
+        if (st->path.len == (unsigned long) len &&
+            memcmp(st->path.data, path, len) == 0) {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * Open a virtual host configuration file and return a structure with
  * definitions.
@@ -386,6 +147,7 @@ struct mk_vhost *mk_vhost_read(char *path)
 
     /* Init list for content handlers */
     mk_list_init(&host->handlers);
+    mk_list_init(&host->statics);
 
     /* Lookup Servername */
     list = mk_rconf_section_get_key(section_host, "Servername", MK_RCONF_LIST);
@@ -513,6 +275,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                 exit(EXIT_FAILURE);
             }
             h_handler->cb = NULL;
+            h_handler->thread = MK_FALSE;
             mk_list_init(&h_handler->params);
 
             i = 0;
@@ -525,6 +288,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                     if (ret == -1) {
                         return NULL;
                     }
+                    h_handler->pattern = mk_string_dup(entry->val);
                     break;
                 case 1:
                     h_handler->name = mk_string_dup(entry->val);
@@ -569,6 +333,11 @@ int mk_vhost_map_handlers(struct mk_server *server)
             h_handler = mk_list_entry(head_handler,
                                       struct mk_vhost_handler, _head);
 
+            /* Library callbacks are not backed by a plugin */
+            if (h_handler->cb) {
+                continue;
+            }
+
             /* Lookup plugin by name */
             p = mk_plugin_lookup(h_handler->name, server);
             if (!p) {
@@ -620,6 +389,7 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
     }
     mk_list_add(&host->_head, &server->hosts);
     mk_list_init(&host->handlers);
+    mk_list_init(&host->statics);
 }
 
 /* Given a configuration directory, start reading the virtual host entries */
@@ -740,6 +510,7 @@ static void mk_vhost_handler_free(struct mk_vhost_handler *h)
     }
 
     regfree(&h->match);
+    mk_mem_free(h->pattern);
     mk_mem_free(h->name);
     mk_mem_free(h);
 }
@@ -750,6 +521,7 @@ void mk_vhost_free_all(struct mk_server *server)
     struct mk_vhost_alias *host_alias;
     struct mk_vhost_handler *host_handler;
     struct mk_vhost_error_page *ep;
+    struct mk_vhost_static *st;
     struct mk_list *head;
     struct mk_list *tmp;
     struct mk_list *head2;
@@ -767,11 +539,21 @@ void mk_vhost_free_all(struct mk_server *server)
         }
 
         /* Handlers */
+        mk_vhost_match_destroy(host);
         mk_list_foreach_safe(head2, tmp2, &host->handlers) {
             host_handler = mk_list_entry(head2, struct mk_vhost_handler, _head);
             mk_vhost_handler_free(host_handler);
         }
 
+        /* Pre-rendered responses */
+        mk_list_foreach_safe(head2, tmp2, &host->statics) {
+            st = mk_list_entry(head2, struct mk_vhost_static, _head);
+            mk_list_del(&st->_head);
+            mk_mem_free(st->path.data);
+            mk_mem_free(st->buf);
+            mk_mem_free(st);
+        }
+
         /* Free error pages */
         mk_list_foreach_safe(head2, tmp2, &host->error_pages) {
             ep = mk_list_entry(head2, struct mk_vhost_error_page, _head);
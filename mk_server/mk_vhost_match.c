@@ -0,0 +1,582 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ctype.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_match.h>
+
+/* Rules are compiled with REG_ICASE */
+#define lc(c)  tolower((unsigned char) (c))
+
+/* Characters with a special meaning in an extended regex */
+#define MK_VHOST_MATCH_META  "[](){}*+?|^$"
+
+/* Is the character at 'p' escaped by an odd number of backslashes ? */
+static int mk_vhost_match_escaped(const char *start, const char *p)
+{
+    int n = 0;
+
+    while (p > start && *(p - 1) == '\\') {
+        n++;
+        p--;
+    }
+
+    return (n & 1);
+}
+
+/*
+ * Parse one alternative of a rule, return NULL if it's not made of
+ * literals and '.*', then the handler regex is used.
+ */
+static struct mk_vhost_match_rule *mk_vhost_match_parse(const char *p,
+                                                        size_t len, int id)
+{
+    int i;
+    int n;
+    char c;
+    char *buf;
+    size_t pos = 0;
+    size_t end = len;
+    struct mk_vhost_match_rule *r;
+
+    /* Rule, segments and the literals in a single chunk */
+    r = mk_mem_alloc_z(sizeof(struct mk_vhost_match_rule) +
+                       (len + 1) * sizeof(mk_ptr_t) + len + 1);
+    if (!r) {
+        return NULL;
+    }
+    r->id   = id;
+    r->segs = (mk_ptr_t *) (r + 1);
+    buf     = (char *) (r->segs + len + 1);
+
+    if (pos < end && p[pos] == '^') {
+        r->anchor_start = MK_TRUE;
+        pos++;
+    }
+    if (end > pos && p[end - 1] == '$' &&
+        !mk_vhost_match_escaped(p + pos, p + end - 1)) {
+        r->anchor_end = MK_TRUE;
+        end--;
+    }
+
+    r->n_segs = 1;
+    r->segs[0].data = buf;
+    r->segs[0].len  = 0;
+
+    while (pos < end) {
+        c = p[pos];
+        if (c == '.') {
+            if (pos + 1 < end && p[pos + 1] == '*') {
+                /* New segment */
+                r->segs[r->n_segs].data = buf;
+                r->segs[r->n_segs].len  = 0;
+                r->n_segs++;
+                pos += 2;
+                continue;
+            }
+            goto slow;
+        }
+        else if (c == '\\') {
+            /* Escaped punctuation is a literal, classes are not */
+            if (pos + 1 >= end || isalnum((unsigned char) p[pos + 1])) {
+                goto slow;
+            }
+            c = p[pos + 1];
+            pos++;
+        }
+        else if (strchr(MK_VHOST_MATCH_META, c)) {
+            goto slow;
+        }
+
+        *buf++ = lc(c);
+        r->segs[r->n_segs - 1].len++;
+        pos++;
+    }
+
+    /* '^$' only matches an empty URI, leave it to regexec */
+    if (r->n_segs == 1 && r->segs[0].len == 0 &&
+        r->anchor_start && r->anchor_end) {
+        goto slow;
+    }
+
+    /* An empty segment at one side means that side is not anchored */
+    if (r->segs[0].len == 0) {
+        r->anchor_start = MK_FALSE;
+    }
+    if (r->segs[r->n_segs - 1].len == 0) {
+        r->anchor_end = MK_FALSE;
+    }
+
+    /* Drop empty segments: 'a.*.*b' is 'a.*b' */
+    n = 0;
+    for (i = 0; i < r->n_segs; i++) {
+        if (r->segs[i].len > 0) {
+            r->segs[n++] = r->segs[i];
+        }
+    }
+    r->n_segs = n;
+
+    return r;
+
+ slow:
+    mk_mem_free(r);
+    return NULL;
+}
+
+static inline int mk_vhost_match_eq(const char *p, mk_ptr_t *seg)
+{
+    size_t i;
+
+    for (i = 0; i < seg->len; i++) {
+        if (lc(p[i]) != (unsigned char) seg->data[i]) {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/* Leftmost occurrence of a segment in the first 'len' bytes of 'p' */
+static const char *mk_vhost_match_find(const char *p, size_t len,
+                                       mk_ptr_t *seg)
+{
+    size_t i;
+
+    if (seg->len > len) {
+        return NULL;
+    }
+
+    for (i = 0; i <= len - seg->len; i++) {
+        if (lc(p[i]) == (unsigned char) seg->data[0] &&
+            mk_vhost_match_eq(p + i, seg)) {
+            return p + i;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Match a rule against the URI: anchored segments are compared in place
+ * and the others are searched from left to right, which is enough since
+ * they are only separated by '.*'.
+ */
+static int mk_vhost_match_rule(struct mk_vhost_match_rule *r,
+                               const char *uri, size_t len)
+{
+    int i;
+    int first = 0;
+    int last = r->n_segs - 1;
+    size_t pos = 0;
+    size_t lim = len;
+    mk_ptr_t *seg;
+    const char *found;
+
+    if (r->anchor_start) {
+        seg = &r->segs[0];
+        if (seg->len > len || !mk_vhost_match_eq(uri, seg)) {
+            return MK_FALSE;
+        }
+        pos = seg->len;
+        first = 1;
+    }
+
+    if (r->anchor_end) {
+        if (first > last) {
+            /* Exact match */
+            return (pos == len);
+        }
+
+        seg = &r->segs[last];
+        if (seg->len > len - pos) {
+            return MK_FALSE;
+        }
+        lim = len - seg->len;
+        if (!mk_vhost_match_eq(uri + lim, seg)) {
+            return MK_FALSE;
+        }
+        last--;
+    }
+
+    for (i = first; i <= last; i++) {
+        seg = &r->segs[i];
+        found = mk_vhost_match_find(uri + pos, lim - pos, seg);
+        if (!found) {
+            return MK_FALSE;
+        }
+        pos = (found - uri) + seg->len;
+    }
+
+    return MK_TRUE;
+}
+
+static struct mk_vhost_match_node *mk_vhost_match_child(struct mk_vhost_match_node *node,
+                                                        unsigned char c)
+{
+    struct mk_vhost_match_node *n;
+
+    for (n = node->child; n; n = n->sibling) {
+        if (n->c == c) {
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
+static int mk_vhost_match_insert(struct mk_vhost_match_node *root,
+                                 mk_ptr_t *key, int reverse,
+                                 struct mk_vhost_match_rule *r)
+{
+    size_t i;
+    unsigned char c;
+    struct mk_vhost_match_node *node = root;
+    struct mk_vhost_match_node *n;
+    struct mk_vhost_match_rule **tail;
+
+    for (i = 0; i < key->len; i++) {
+        if (reverse) {
+            c = key->data[key->len - i - 1];
+        }
+        else {
+            c = key->data[i];
+        }
+
+        n = mk_vhost_match_child(node, c);
+        if (!n) {
+            n = mk_mem_alloc_z(sizeof(struct mk_vhost_match_node));
+            if (!n) {
+                return -1;
+            }
+            n->c = c;
+            n->sibling = node->child;
+            node->child = n;
+        }
+        node = n;
+    }
+
+    /* Keep the configuration order */
+    tail = &node->rules;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = r;
+
+    return 0;
+}
+
+static void mk_vhost_match_node_free(struct mk_vhost_match_node *node)
+{
+    struct mk_vhost_match_node *n;
+    struct mk_vhost_match_node *next;
+
+    for (n = node->child; n; n = next) {
+        next = n->sibling;
+        mk_vhost_match_node_free(n);
+        mk_mem_free(n);
+    }
+    node->child = NULL;
+}
+
+/* Place a rule in the prefix trie, the suffix trie or the slow list */
+static int mk_vhost_match_add(struct mk_vhost_matcher *m,
+                              struct mk_vhost_match_rule *r)
+{
+    mk_list_add(&r->_head, &m->rules);
+
+    if (r->anchor_start) {
+        return mk_vhost_match_insert(&m->prefix, &r->segs[0], MK_FALSE, r);
+    }
+    else if (r->anchor_end) {
+        return mk_vhost_match_insert(&m->suffix, &r->segs[r->n_segs - 1],
+                                     MK_TRUE, r);
+    }
+
+    m->slow[m->n_slow].id   = r->id;
+    m->slow[m->n_slow].rule = r;
+    m->n_slow++;
+
+    return 0;
+}
+
+/* Compile the rules of one handler */
+static int mk_vhost_match_handler(struct mk_vhost_matcher *m, int id,
+                                  struct mk_vhost_handler *h)
+{
+    int ret;
+    char *p;
+    char *alt;
+    struct mk_list tmp;
+    struct mk_list *head;
+    struct mk_list *htmp;
+    struct mk_vhost_match_rule *r;
+
+    mk_list_init(&tmp);
+
+    /* Groups, classes and intervals always go through regexec */
+    if (!h->pattern || strpbrk(h->pattern, "([{")) {
+        goto slow;
+    }
+
+    /* Without groups every '|' splits the rule in alternatives */
+    alt = h->pattern;
+    p = alt;
+    while (1) {
+        if (*p != '\0' &&
+            (*p != '|' || mk_vhost_match_escaped(h->pattern, p))) {
+            p++;
+            continue;
+        }
+
+        r = mk_vhost_match_parse(alt, p - alt, id);
+        if (!r) {
+            goto slow;
+        }
+        mk_list_add(&r->_head, &tmp);
+
+        if (*p == '\0') {
+            break;
+        }
+        alt = ++p;
+    }
+
+    mk_list_foreach_safe(head, htmp, &tmp) {
+        r = mk_list_entry(head, struct mk_vhost_match_rule, _head);
+        mk_list_del(&r->_head);
+        ret = mk_vhost_match_add(m, r);
+        if (ret == -1) {
+            return -1;
+        }
+    }
+    return 0;
+
+ slow:
+    mk_list_foreach_safe(head, htmp, &tmp) {
+        r = mk_list_entry(head, struct mk_vhost_match_rule, _head);
+        mk_list_del(&r->_head);
+        mk_mem_free(r);
+    }
+
+    m->slow[m->n_slow].id   = id;
+    m->slow[m->n_slow].rule = NULL;
+    m->n_slow++;
+
+    return 0;
+}
+
+int mk_vhost_match_create(struct mk_vhost *host)
+{
+    int id = 0;
+    int alts = 0;
+    char *p;
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+    struct mk_vhost_matcher *m;
+
+    mk_vhost_match_destroy(host);
+
+    mk_list_foreach(head, &host->handlers) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+        alts++;
+        for (p = h->pattern; p && *p; p++) {
+            if (*p == '|') {
+                alts++;
+            }
+        }
+        id++;
+    }
+
+    if (id == 0) {
+        return 0;
+    }
+
+    m = mk_mem_alloc_z(sizeof(struct mk_vhost_matcher));
+    if (!m) {
+        return -1;
+    }
+    mk_list_init(&m->rules);
+    host->matcher = m;
+
+    m->handlers = mk_mem_alloc(sizeof(struct mk_vhost_handler *) * id);
+    m->slow = mk_mem_alloc(sizeof(struct mk_vhost_match_slow) * alts);
+    if (!m->handlers || !m->slow) {
+        mk_vhost_match_destroy(host);
+        return -1;
+    }
+
+    mk_list_foreach(head, &host->handlers) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+        m->handlers[m->n_handlers] = h;
+        if (mk_vhost_match_handler(m, m->n_handlers, h) == -1) {
+            mk_vhost_match_destroy(host);
+            return -1;
+        }
+        m->n_handlers++;
+    }
+
+    return 0;
+}
+
+void mk_vhost_match_destroy(struct mk_vhost *host)
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_vhost_match_rule *r;
+    struct mk_vhost_matcher *m = host->matcher;
+
+    if (!m) {
+        return;
+    }
+
+    mk_vhost_match_node_free(&m->prefix);
+    mk_vhost_match_node_free(&m->suffix);
+
+    mk_list_foreach_safe(head, tmp, &m->rules) {
+        r = mk_list_entry(head, struct mk_vhost_match_rule, _head);
+        mk_list_del(&r->_head);
+        mk_mem_free(r);
+    }
+
+    mk_mem_free(m->handlers);
+    mk_mem_free(m->slow);
+    mk_mem_free(m);
+    host->matcher = NULL;
+}
+
+int mk_vhost_match_init(struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_vhost *host;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (mk_vhost_match_create(host) == -1) {
+            mk_err("[vhost] cannot compile the handlers matcher");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Without a matcher every rule is evaluated in order */
+static struct mk_vhost_handler *mk_vhost_handler_next_regex(struct mk_vhost *host,
+                                                            const char *uri,
+                                                            int *id)
+{
+    int i = 0;
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+
+    mk_list_foreach(head, &host->handlers) {
+        if (i++ <= *id) {
+            continue;
+        }
+
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+        if (regexec(&h->match, uri, 0, NULL, 0) == 0) {
+            *id = i - 1;
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the first handler after the position '*id' whose rule matches
+ * the URI and update '*id', start with '*id = -1'. The URI must be NULL
+ * terminated in case a rule needs regexec(3).
+ */
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               const char *uri, size_t len,
+                                               int *id)
+{
+    int i;
+    int best;
+    int from = *id + 1;
+    struct mk_vhost_match_slow *s;
+    struct mk_vhost_match_rule *r;
+    struct mk_vhost_match_node *node;
+    struct mk_vhost_matcher *m = host->matcher;
+
+    if (!m) {
+        return mk_vhost_handler_next_regex(host, uri, id);
+    }
+
+    best = m->n_handlers;
+
+    /* Rules anchored at the start */
+    node = &m->prefix;
+    for (i = 0; i < (int) len && node->child; i++) {
+        node = mk_vhost_match_child(node, lc(uri[i]));
+        if (!node) {
+            break;
+        }
+        for (r = node->rules; r; r = r->next) {
+            if (r->id >= from && r->id < best &&
+                mk_vhost_match_rule(r, uri, len)) {
+                best = r->id;
+            }
+        }
+    }
+
+    /* Rules anchored at the end */
+    node = &m->suffix;
+    for (i = len - 1; i >= 0 && node->child; i--) {
+        node = mk_vhost_match_child(node, lc(uri[i]));
+        if (!node) {
+            break;
+        }
+        for (r = node->rules; r; r = r->next) {
+            if (r->id >= from && r->id < best &&
+                mk_vhost_match_rule(r, uri, len)) {
+                best = r->id;
+            }
+        }
+    }
+
+    /* The rest, only if they come before the best candidate */
+    for (i = 0; i < m->n_slow && m->slow[i].id < best; i++) {
+        s = &m->slow[i];
+        if (s->id < from) {
+            continue;
+        }
+
+        if (s->rule) {
+            if (mk_vhost_match_rule(s->rule, uri, len)) {
+                best = s->id;
+                break;
+            }
+        }
+        else if (regexec(&m->handlers[s->id]->match, uri, 0, NULL, 0) == 0) {
+            best = s->id;
+            break;
+        }
+    }
+
+    if (best == m->n_handlers) {
+        return NULL;
+    }
+
+    *id = best;
+    return m->handlers[best];
+}
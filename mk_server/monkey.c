@@ -24,6 +24,8 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_vhost_match.h>
+#include <monkey/mk_ratelimit.h>
 
 void mk_server_info(struct mk_server *server)
 {
@@ -139,21 +141,34 @@ int mk_server_setup(struct mk_server *server)
     mk_config_start_configure(server);
     mk_config_signature(server);
 
+    /* Embedded mode: a single worker running on the caller thread */
+    if (server->lib_embedded == MK_TRUE) {
+        server->workers = 1;
+    }
+
     mk_sched_init(server);
 
     /* Clock init that must happen before starting threads */
     mk_clock_sequential_init(server);
 
     /* Load plugins */
-    mk_plugin_api_init();
+    mk_plugin_api_init(server);
     mk_plugin_load_all(server);
 
+    /* Compile the handlers rules of every virtual host */
+    if (mk_vhost_match_init(server) == -1) {
+        return -1;
+    }
+
     /* Workers: logger and clock */
     ret = mk_utils_worker_spawn((void *) mk_clock_worker_init, server, &tid);
     if (ret != 0) {
         return -1;
     }
 
+    /* Known before the thread runs, an early mk_stop() cancels it */
+    mk_clock_tid = tid;
+
     /* Init thread keys */
     mk_thread_keys_init();
 
@@ -163,8 +178,21 @@ int mk_server_setup(struct mk_server *server)
     /* Invoke Plugin PRCTX hooks */
     mk_plugin_core_process(server);
 
+    /* Blocking I/O threads for the open file cache */
+    if (mk_file_cache_pool_create(server) != 0) {
+        mk_warn("Could not create the file cache threads, disabled");
+    }
+
+    /* Per client rate limiting tables, shared by the workers */
+    if (mk_ratelimit_create(server) != 0) {
+        mk_warn("Could not allocate the rate limiting tables, disabled");
+    }
+
     /* Launch monkey http workers */
     MK_TLS_INIT();
+    if (server->lib_embedded == MK_TRUE) {
+        return mk_sched_worker_embed(server);
+    }
     mk_server_launch_workers(server);
 
     return 0;
@@ -182,14 +210,22 @@ void mk_exit_all(struct mk_server *server)
 {
     uint64_t val;
 
-    /* Distribute worker signals to stop working */
-    val = MK_SCHED_SIGNAL_FREE_ALL;
-    mk_sched_send_signal(server, val);
+    if (server->lib_embedded == MK_TRUE) {
+        /* The caller runs the worker */
+        mk_server_worker_stop(server);
+    }
+    else {
+        /* Distribute worker signals to stop working */
+        val = MK_SCHED_SIGNAL_FREE_ALL;
+        mk_sched_send_signal(server, val);
 
-    /* Wait for all workers to finish */
-    mk_sched_workers_join(server);
+        /* Wait for all workers to finish */
+        mk_sched_workers_join(server);
+    }
 
     /* Continue exiting */
+    mk_file_cache_pool_destroy(server);
+    mk_ratelimit_destroy(server);
     mk_plugin_exit_all(server);
     mk_clock_exit();
     mk_config_free_all(server);
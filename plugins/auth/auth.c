@@ -25,11 +25,13 @@
 #include "conf.h"
 #include "sha1.h"
 #include "base64.h"
+#include "cache.h"
 
 static int mk_auth_validate_user(struct users_file *users,
                                  const char *credentials, unsigned int len)
 {
     int sep;
+    unsigned int hash;
     size_t auth_len;
     unsigned char *decoded = NULL;
     unsigned char digest[SHA1_DIGEST_LEN];
@@ -72,10 +74,11 @@ static int mk_auth_validate_user(struct users_file *users,
     SHA1_Update(&sha, (unsigned char *) decoded + sep + 1, auth_len - (sep + 1));
     SHA1_Final(digest, &sha);
 
-    mk_list_foreach(head, &users->_users) {
-        entry = mk_list_entry(head, struct user, _head);
+    hash = mk_auth_hash((char *) decoded, sep);
+    mk_list_foreach(head, &users->table[hash & users->mask]) {
+        entry = mk_list_entry(head, struct user, _hash);
         /* match user */
-        if (strlen(entry->user) != (unsigned int) sep) {
+        if (entry->hash != hash || entry->len != sep) {
             continue;
         }
         if (strncmp(entry->user, (char *) decoded, sep) != 0) {
@@ -112,6 +115,11 @@ int mk_auth_plugin_init(struct plugin_api **api, char *confdir)
     mk_list_init(&users_file_list);
     mk_auth_conf_init_users_list();
 
+    if (mk_auth_cache_init() != 0) {
+        mk_warn("Auth: could not create the credentials cache key");
+        return -1;
+    }
+
     /* Set HTTP headers key */
     auth_header_basic.data = MK_AUTH_HEADER_BASIC;
     auth_header_basic.len  = sizeof(MK_AUTH_HEADER_BASIC) - 1;
@@ -126,11 +134,8 @@ int mk_auth_plugin_exit()
 
 void mk_auth_worker_init()
 {
-    char *user;
-
-    /* Init thread buffer for given credentials */
-    user = mk_api->mem_alloc(MK_AUTH_CREDENTIALS_LEN - 1);
-    pthread_setspecific(_mkp_data, (void *) user);
+    /* Recently validated credentials of this worker */
+    mk_auth_cache_worker_init();
 }
 
 /* Object handler */
@@ -141,10 +146,9 @@ int mk_auth_stage30(struct mk_plugin *plugin,
                     struct mk_list *params)
 {
     int val;
-    short int is_restricted = MK_FALSE;
     struct mk_list *vh_head;
-    struct mk_list *loc_head;
     struct vhost *vh_entry = NULL;
+    struct vhost *vh_tmp;
     struct location *loc_entry;
     struct mk_http_header *header;
     (void) plugin;
@@ -155,11 +159,12 @@ int mk_auth_stage30(struct mk_plugin *plugin,
 
     /* Match auth_vhost with global vhost */
     mk_list_foreach(vh_head, &vhosts_list) {
-        vh_entry = mk_list_entry(vh_head, struct vhost, _head);
-        if (vh_entry->host == sr->host_conf) {
+        vh_tmp = mk_list_entry(vh_head, struct vhost, _head);
+        if (vh_tmp->host == sr->host_conf) {
             PLUGIN_TRACE("[FD %i] host matched %s",
                          cs->socket,
                          mk_api->config->server_signature);
+            vh_entry = vh_tmp;
             break;
         }
     }
@@ -169,37 +174,37 @@ int mk_auth_stage30(struct mk_plugin *plugin,
     }
 
     /* Check vhost locations */
-    mk_list_foreach(loc_head, &vh_entry->locations) {
-        loc_entry = mk_list_entry(loc_head, struct location, _head);
-        if (sr->uri_processed.len < loc_entry->path.len) {
-            continue;
-        }
-        if (strncmp(sr->uri_processed.data,
-                    loc_entry->path.data, loc_entry->path.len) == 0) {
-            is_restricted = MK_TRUE;
-            PLUGIN_TRACE("[FD %i] Location matched %s",
-                         cs->socket,
-                         loc_entry->path.data);
-            break;
-        }
-    }
+    loc_entry = mk_auth_prefix_match(&vh_entry->index,
+                                     sr->uri_processed.data,
+                                     sr->uri_processed.len);
 
     /* For non-restricted location do not take any action, just returns */
-    if (is_restricted == MK_FALSE) {
+    if (!loc_entry) {
         return MK_PLUGIN_RET_NOT_ME;
     }
+    PLUGIN_TRACE("[FD %i] Location matched %s",
+                 cs->socket, loc_entry->path.data);
 
     /* Check authorization header */
     header = mk_api->header_get(MK_HEADER_AUTHORIZATION,
                                 sr, NULL, 0);
 
     if (header) {
+        /* Same credentials validated a moment ago */
+        if (mk_auth_cache_lookup(loc_entry->users,
+                                 header->val.data, header->val.len)) {
+            PLUGIN_TRACE("[FD %i] user validated (cached)", cs->socket);
+            return MK_PLUGIN_RET_NOT_ME;
+        }
+
         /* Validate user */
         val = mk_auth_validate_user(loc_entry->users,
                                     header->val.data, header->val.len);
         if (val == 0) {
             /* user validated, success */
             PLUGIN_TRACE("[FD %i] user validated!", cs->socket);
+            mk_auth_cache_add(loc_entry->users,
+                              header->val.data, header->val.len);
             return MK_PLUGIN_RET_NOT_ME;
         }
     }
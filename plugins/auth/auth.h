@@ -22,6 +22,8 @@
 
 #include <monkey/mk_api.h>
 
+#include "prefix.h"
+
 /* Header stuff */
 #define MK_AUTH_HEADER_BASIC     "Basic "
 #define MK_AUTH_HEADER_TITLE     "WWW-Authenticate: Basic realm=\"%s\""
@@ -53,6 +55,7 @@ struct mk_list vhosts_list;
 struct vhost {
     struct mk_vhost *host;
     struct mk_list locations;
+    struct auth_prefix index;
     struct mk_list _head;
 };
 
@@ -80,6 +83,8 @@ struct users_file {
     time_t last_updated;   /* last time this entry was modified */
     char *path;            /* file path */
     struct mk_list _users; /* list of users */
+    struct mk_list *table; /* users hashed by name */
+    unsigned int mask;     /* table size - 1 */
     struct mk_list _head;  /* head for main mk_list users_file_list */
 };
 
@@ -89,9 +94,12 @@ struct users_file {
  */
 struct user {
     char user[128];
+    int len;
+    unsigned int hash;
     char passwd_raw[256];
     unsigned char *passwd_decoded;
 
+    struct mk_list _hash;
     struct mk_list _head;
 };
 
@@ -103,4 +111,18 @@ mk_ptr_t auth_header_basic;
 
 #define SHA1_DIGEST_LEN 20
 
+/* FNV-1a, used to hash user names and credentials */
+static inline unsigned int mk_auth_hash(const char *s, unsigned int len)
+{
+    unsigned int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 #endif
@@ -0,0 +1,106 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "auth.h"
+#include "cache.h"
+
+static pthread_key_t cache_key;
+
+int mk_auth_cache_init()
+{
+    return pthread_key_create(&cache_key, NULL);
+}
+
+void mk_auth_cache_worker_init()
+{
+    struct auth_cache *cache;
+
+    cache = mk_api->mem_alloc_z(sizeof(struct auth_cache));
+    if (!cache) {
+        mk_warn("Auth: could not allocate the credentials cache");
+        return;
+    }
+    pthread_setspecific(cache_key, (void *) cache);
+}
+
+/* Compare without leaking how many bytes of a cached value matched */
+static inline int mk_auth_cache_equal(const char *a, const char *b,
+                                      unsigned int len)
+{
+    unsigned int i;
+    unsigned char diff = 0;
+
+    for (i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+
+    return diff == 0;
+}
+
+/* Return MK_TRUE if the value was validated for 'users' recently */
+int mk_auth_cache_lookup(struct users_file *users,
+                         const char *value, unsigned int len)
+{
+    unsigned int hash;
+    struct auth_cache *cache;
+    struct auth_cache_entry *e;
+
+    cache = pthread_getspecific(cache_key);
+    if (!cache || len > MK_AUTH_CREDENTIALS_LEN) {
+        return MK_FALSE;
+    }
+
+    hash = mk_auth_hash(value, len);
+    e = &cache->entries[hash & (MK_AUTH_CACHE_SIZE - 1)];
+
+    if (e->users != users || e->hash != hash || e->len != len) {
+        return MK_FALSE;
+    }
+
+    if (e->expire <= mk_api->time_unix()) {
+        e->users = NULL;
+        return MK_FALSE;
+    }
+
+    return mk_auth_cache_equal(e->value, value, len);
+}
+
+void mk_auth_cache_add(struct users_file *users,
+                       const char *value, unsigned int len)
+{
+    unsigned int hash;
+    struct auth_cache *cache;
+    struct auth_cache_entry *e;
+
+    cache = pthread_getspecific(cache_key);
+    if (!cache || len > MK_AUTH_CREDENTIALS_LEN) {
+        return;
+    }
+
+    hash = mk_auth_hash(value, len);
+    e = &cache->entries[hash & (MK_AUTH_CACHE_SIZE - 1)];
+
+    e->expire = mk_api->time_unix() + MK_AUTH_CACHE_TTL;
+    e->hash   = hash;
+    e->len    = len;
+    e->users  = users;
+    memcpy(e->value, value, len);
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_AUTH_CACHE_H
+#define MK_AUTH_CACHE_H
+
+#include <time.h>
+
+/*
+ * Per worker cache of the Authorization header values that passed the
+ * validation, a keep-alive client sends the same value on every request
+ * and gets it checked without decoding or hashing it again. The cache is
+ * direct mapped and only stores good credentials, entries expire after
+ * MK_AUTH_CACHE_TTL seconds.
+ */
+
+#define MK_AUTH_CACHE_SIZE     64     /* entries per worker, power of 2 */
+#define MK_AUTH_CACHE_TTL      60     /* seconds                        */
+
+struct users_file;
+
+struct auth_cache_entry {
+    time_t expire;
+    unsigned int hash;
+    unsigned int len;
+    struct users_file *users;
+    char value[MK_AUTH_CREDENTIALS_LEN];
+};
+
+struct auth_cache {
+    struct auth_cache_entry entries[MK_AUTH_CACHE_SIZE];
+};
+
+int mk_auth_cache_init();
+void mk_auth_cache_worker_init();
+int mk_auth_cache_lookup(struct users_file *users,
+                         const char *value, unsigned int len);
+void mk_auth_cache_add(struct users_file *users,
+                       const char *value, unsigned int len);
+
+#endif
@@ -22,6 +22,40 @@
 #include "auth.h"
 #include "conf.h"
 
+/* Index the users of a file by name */
+static int mk_auth_conf_hash_users(struct users_file *entry)
+{
+    unsigned int i;
+    unsigned int count = 0;
+    unsigned int size = 16;
+    struct mk_list *head;
+    struct user *cred;
+
+    mk_list_foreach(head, &entry->_users) {
+        count++;
+    }
+    while (size < count) {
+        size *= 2;
+    }
+
+    entry->table = mk_api->mem_alloc(sizeof(struct mk_list) * size);
+    if (!entry->table) {
+        return -1;
+    }
+    entry->mask = size - 1;
+
+    for (i = 0; i < size; i++) {
+        mk_list_init(&entry->table[i]);
+    }
+
+    mk_list_foreach(head, &entry->_users) {
+        cred = mk_list_entry(head, struct user, _head);
+        mk_list_add(&cred->_hash, &entry->table[cred->hash & entry->mask]);
+    }
+
+    return 0;
+}
+
 /*
  * Register a users file into the main list, if the users
  * file already exists it just return the node in question,
@@ -98,6 +132,8 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
             /* Copy username */
             strncpy(cred->user, buf + offset, sep);
             cred->user[sep] = '\0';
+            cred->len  = sep;
+            cred->hash = mk_auth_hash(cred->user, sep);
 
             /* Copy raw password */
             offset += sep + 1 + 5;
@@ -124,6 +160,11 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
     }
     mk_api->mem_free(buf);
 
+    if (mk_auth_conf_hash_users(entry) != 0) {
+        mk_warn("Auth: could not index users of '%s'", users_path);
+        return NULL;
+    }
+
     /* Link node to global list */
     mk_list_add(&entry->_head, &users_file_list);
 
@@ -168,6 +209,10 @@ int mk_auth_conf_init_users_list()
         auth_vhost = mk_api->mem_alloc(sizeof(struct vhost));
         auth_vhost->host = entry_host;        /* link virtual host entry */
         mk_list_init(&auth_vhost->locations); /* init locations list */
+        if (mk_auth_prefix_init(&auth_vhost->index) != 0) {
+            mk_api->mem_free(auth_vhost);
+            return -1;
+        }
 
         /*
          * check vhost 'config' and look for [AUTH] sections, we don't use
@@ -194,6 +239,11 @@ int mk_auth_conf_init_users_list()
                                                             "Users",
                                                             MK_RCONF_STR);
 
+                if (!location || !users_path) {
+                    mk_warn("Auth: [AUTH] section requires Location and Users");
+                    continue;
+                }
+
                 /* get or create users file entry */
                 uf = mk_auth_conf_add_users(users_path);
                 if (!uf) {
@@ -214,6 +264,10 @@ int mk_auth_conf_init_users_list()
 
                 /* Add new location to auth_vhost node */
                 mk_list_add(&loc->_head, &auth_vhost->locations);
+                if (mk_auth_prefix_add(&auth_vhost->index, loc,
+                                       loc->path.data, loc->path.len) != 0) {
+                    return -1;
+                }
             }
         }
 
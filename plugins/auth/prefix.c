@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "auth.h"
+#include "prefix.h"
+
+#define PREFIX_ROOT    0
+#define PREFIX_NONE   -1
+
+static int mk_auth_prefix_node_new(struct auth_prefix *index, unsigned char c)
+{
+    int size;
+    struct auth_prefix_node *tmp;
+    struct auth_prefix_node *node;
+
+    if (index->size == index->capacity) {
+        size = index->capacity * 2;
+        tmp = mk_api->mem_realloc(index->nodes,
+                                  sizeof(struct auth_prefix_node) * size);
+        if (!tmp) {
+            return PREFIX_NONE;
+        }
+        index->nodes    = tmp;
+        index->capacity = size;
+    }
+
+    node = &index->nodes[index->size];
+    node->child   = PREFIX_NONE;
+    node->sibling = PREFIX_NONE;
+    node->order   = -1;
+    node->c       = c;
+    node->loc     = NULL;
+
+    return index->size++;
+}
+
+int mk_auth_prefix_init(struct auth_prefix *index)
+{
+    memset(index, '\0', sizeof(struct auth_prefix));
+
+    index->capacity = 32;
+    index->nodes = mk_api->mem_alloc(sizeof(struct auth_prefix_node) *
+                                     index->capacity);
+    if (!index->nodes) {
+        return -1;
+    }
+
+    /* Root node, an empty path restricts everything */
+    mk_auth_prefix_node_new(index, 0);
+
+    return 0;
+}
+
+static inline int mk_auth_prefix_child(struct auth_prefix *index,
+                                       int node, unsigned char c)
+{
+    int n;
+
+    for (n = index->nodes[node].child; n != PREFIX_NONE;
+         n = index->nodes[n].sibling) {
+        if (index->nodes[n].c == c) {
+            return n;
+        }
+    }
+
+    return PREFIX_NONE;
+}
+
+int mk_auth_prefix_add(struct auth_prefix *index, struct location *loc,
+                       const char *path, unsigned int len)
+{
+    int n;
+    int node = PREFIX_ROOT;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        n = mk_auth_prefix_child(index, node, path[i]);
+        if (n == PREFIX_NONE) {
+            n = mk_auth_prefix_node_new(index, path[i]);
+            if (n == PREFIX_NONE) {
+                return -1;
+            }
+            index->nodes[n].sibling = index->nodes[node].child;
+            index->nodes[node].child = n;
+        }
+        node = n;
+    }
+
+    /* A duplicated path keeps the location configured first */
+    if (!index->nodes[node].loc) {
+        index->nodes[node].loc   = loc;
+        index->nodes[node].order = index->count;
+    }
+    index->count++;
+
+    return 0;
+}
+
+struct location *mk_auth_prefix_match(struct auth_prefix *index,
+                                      const char *uri, unsigned int len)
+{
+    int node = PREFIX_ROOT;
+    int order = -1;
+    unsigned int i;
+    struct location *loc = NULL;
+    struct auth_prefix_node *n;
+
+    if (index->count == 0) {
+        return NULL;
+    }
+
+    /* Every node on the path is a prefix of the URI */
+    i = 0;
+    while (1) {
+        n = &index->nodes[node];
+        if (n->loc && (!loc || n->order < order)) {
+            loc   = n->loc;
+            order = n->order;
+        }
+
+        if (i == len) {
+            break;
+        }
+
+        node = mk_auth_prefix_child(index, node, uri[i++]);
+        if (node == PREFIX_NONE) {
+            break;
+        }
+    }
+
+    return loc;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_AUTH_PREFIX_H
+#define MK_AUTH_PREFIX_H
+
+/*
+ * Byte trie of the locations paths of a virtual host: a request URI walks
+ * it once and gets the first configured location that is a prefix of it,
+ * the same answer of checking the locations one by one in order.
+ */
+
+struct location;
+
+struct auth_prefix_node {
+    int child;             /* first child node, -1 if none            */
+    int sibling;           /* next node with the same parent          */
+    int order;             /* configuration order of 'loc'            */
+    unsigned char c;
+    struct location *loc;  /* a location path ends here              */
+};
+
+struct auth_prefix {
+    int size;
+    int capacity;
+    int count;             /* locations added                         */
+    struct auth_prefix_node *nodes;
+};
+
+int mk_auth_prefix_init(struct auth_prefix *index);
+int mk_auth_prefix_add(struct auth_prefix *index, struct location *loc,
+                       const char *path, unsigned int len);
+struct location *mk_auth_prefix_match(struct auth_prefix *index,
+                                      const char *uri, unsigned int len);
+
+#endif
@@ -34,9 +34,18 @@ void cgi_finish(struct cgi_request *r)
      */
     mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
     close(r->fd);
+
+    /* Nobody must reference our buffer once the request is gone */
+    if (r->relay_pending > 0) {
+        cgi_relay_purge(r);
+    }
+
     if (r->chunked && r->active == MK_TRUE) {
         PLUGIN_TRACE("CGI sending Chunked EOF");
-        channel_write(r, "0\r\n\r\n", 5);
+        mk_stream_in_raw(&r->sr->stream, NULL,
+                         "0\r\n\r\n", 5,
+                         NULL, NULL);
+        mk_api->channel_flush(r->cs->channel);
     }
 
     /* Try to kill any child process */
@@ -69,6 +78,56 @@ int swrite(const int fd, const void *buf, const size_t count)
     return count;
 }
 
+/*
+ * Callback invoked when a stream input that references in_buf have been
+ * written. Once the last one is done, the CGI pipe is read again.
+ */
+static void cgi_relay_done(struct mk_stream_input *in)
+{
+    int ret;
+    struct cgi_request *r;
+
+    r = cgi_req_get(in->stream->channel->fd);
+    if (!r) {
+        return;
+    }
+
+    r->relay_pending--;
+    if (r->relay_pending > 0 || r->relay_paused == MK_FALSE) {
+        return;
+    }
+    r->relay_paused = MK_FALSE;
+
+    if (r->active == MK_FALSE) {
+        return;
+    }
+
+    PLUGIN_TRACE("[FD %i] client drained, resume CGI reads", r->fd);
+    ret = mk_api->ev_add(mk_api->sched_loop(), r->fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, r);
+    if (ret == -1) {
+        cgi_finish(r);
+    }
+}
+
+/* Drop any pending stream input that still references in_buf */
+void cgi_relay_purge(struct cgi_request *r)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream_input *in;
+
+    mk_list_foreach_safe(head, tmp, &r->sr->stream.inputs) {
+        in = mk_list_entry(head, struct mk_stream_input, _head);
+        if (in->cb_finished == cgi_relay_done) {
+            mk_api->stream_in_release(in);
+        }
+    }
+    r->relay_pending = 0;
+    r->relay_paused = MK_FALSE;
+}
+
+/* Enqueue data from in_buf, it's not copied */
 int channel_write(struct cgi_request *r, void *buf, size_t count)
 {
     int ret;
@@ -78,15 +137,36 @@ int channel_write(struct cgi_request *r, void *buf, size_t count)
     }
 
     MK_TRACE("channel write: %d bytes", count);
-    mk_stream_in_cbuf(&r->sr->stream,
-                      NULL,
-                      buf, count,
-                      NULL, NULL);
+    ret = mk_stream_in_raw(&r->sr->stream,
+                           NULL,
+                           buf, count,
+                           NULL, cgi_relay_done);
+    if (ret == -1) {
+        return -1;
+    }
+    r->relay_pending++;
+    return 0;
+}
+
+/*
+ * Flush the client channel, if it cannot take everything stop reading
+ * from the CGI pipe until cgi_relay_done() is invoked.
+ */
+int channel_flush(struct cgi_request *r)
+{
+    int ret;
 
     ret = mk_api->channel_flush(r->sr->session->channel);
     if (ret & MK_CHANNEL_ERROR) {
         r->active = MK_FALSE;
         cgi_finish(r);
+        return -1;
+    }
+
+    if (r->relay_pending > 0 && r->relay_paused == MK_FALSE) {
+        PLUGIN_TRACE("[FD %i] client busy, pause CGI reads", r->fd);
+        mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
+        r->relay_paused = MK_TRUE;
     }
     return 0;
 }
@@ -83,6 +83,14 @@ struct cgi_request {
     unsigned char status_done;
     unsigned char all_headers_done;
     unsigned char chunked;
+
+    /*
+     * The output is not copied: the client stream references in_buf and
+     * the pipe is not read again until those inputs are flushed.
+     */
+    int relay_pending;  /* inputs referencing in_buf */
+    int relay_paused;   /* pipe read event removed ? */
+    char chunk_hdr[16]; /* chunk size line           */
 };
 
 /* Global list per worker */
@@ -91,9 +99,11 @@ pthread_key_t cgi_request_list;
 extern struct cgi_request **requests_by_socket;
 
 void cgi_finish(struct cgi_request *r);
+void cgi_relay_purge(struct cgi_request *r);
 
 int swrite(const int fd, const void *buf, const size_t count);
 int channel_write(struct cgi_request *r, void *buf, size_t count);
+int channel_flush(struct cgi_request *r);
 
 struct cgi_request *cgi_req_create(int fd, int socket,
                                    struct mk_plugin *plugin,
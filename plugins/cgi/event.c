@@ -118,14 +118,13 @@ int process_cgi_data(struct cgi_request *r)
 
         r->all_headers_done = 1;
         if (r->in_len == 0) {
-            return MK_PLUGIN_RET_EVENT_OWNED;
+            goto flush;
         }
     }
 
     if (r->chunked) {
-        char tmp[16];
-        len = snprintf(tmp, 16, "%x\r\n", r->in_len);
-        ret = channel_write(r, tmp, len);
+        len = snprintf(r->chunk_hdr, sizeof(r->chunk_hdr), "%x\r\n", r->in_len);
+        ret = channel_write(r, r->chunk_hdr, len);
         if (ret < 0)
             return MK_PLUGIN_RET_EVENT_CLOSE;
     }
@@ -135,9 +134,19 @@ int process_cgi_data(struct cgi_request *r)
         return MK_PLUGIN_RET_EVENT_CLOSE;
     }
 
+    /*
+     * The content stays on in_buf until it's flushed, the pipe is not read
+     * again in the meanwhile so it's safe to reset the length now.
+     */
     r->in_len = 0;
     if (r->chunked) {
-        channel_write(r, MK_CRLF, 2);
+        mk_stream_in_raw(&r->sr->stream, NULL, MK_CRLF, 2, NULL, NULL);
+    }
+
+ flush:
+    ret = channel_flush(r);
+    if (ret < 0) {
+        return MK_PLUGIN_RET_EVENT_CLOSE;
     }
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
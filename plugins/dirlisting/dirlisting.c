@@ -30,117 +30,52 @@
 #include "dirlisting.h"
 
 #include <time.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 const mk_ptr_t mk_dirhtml_default_mime = mk_ptr_init(MK_DIRHTML_DEFAULT_MIME);
 const mk_ptr_t mk_dir_iov_dash  = mk_ptr_init("-");
 const mk_ptr_t mk_dir_iov_none  = mk_ptr_init("");
 const mk_ptr_t mk_dir_iov_slash = mk_ptr_init("/");
 
-void mk_dirhtml_cb_body_rows(struct mk_stream_input *in);
+static struct mk_dirhtml_cache dirhtml_cache;
+static struct mk_dirhtml_builder dirhtml_builder;
+static pthread_key_t dirhtml_worker_key;
 
 /* Function wrote by Max (Felipe Astroza), thanks! */
-static char *mk_dirhtml_human_readable_size(char *buf, size_t size, int len)
+static char *mk_dirhtml_human_readable_size(char *buf, size_t size, off_t len)
 {
-    unsigned long u = 1024, i;
+    int i;
+    double fsize = (double) len;
     static const char *__units[] = {
         "b", "K", "M", "G",
         "T", "P", "E", "Z", "Y", NULL
     };
 
-    for (i = 0; __units[i] != NULL; i++) {
-        if ((size / u) == 0) {
-            break;
-        }
-        u *= 1024;
+    for (i = 0; __units[i + 1] != NULL && fsize >= 1024; i++) {
+        fsize /= 1024;
     }
+
     if (!i) {
         snprintf(buf, size, "%lu%s", (long unsigned int) len, __units[0]);
     }
     else {
-        float fsize = (float) ((double) len / (u / 1024));
         snprintf(buf, size, "%.1f%s", fsize, __units[i]);
     }
 
     return buf;
 }
 
-static struct mk_f_list *mk_dirhtml_create_element(char *file,
-                                                   unsigned char type,
-                                                   char *full_path,
-                                                   unsigned long *list_len)
-{
-    int n;
-    struct tm *st_time;
-    struct mk_f_list *entry;
-
-    entry = mk_api->mem_alloc_z(sizeof(struct mk_f_list));
-
-    if (mk_api->file_get_info(full_path, &entry->info, MK_FILE_READ) != 0) {
-        mk_api->mem_free(entry);
-        return NULL;
-    }
-
-    strcpy(entry->name, file);
-    entry->type = type;
-
-    st_time = localtime((time_t *) & entry->info.last_modification);
-    n = strftime(entry->ft_modif, MK_DIRHTML_FMOD_LEN, "%d-%b-%G %H:%M", st_time);
-    if (n == 0) {
-        mk_mem_free(entry);
-        return NULL;
-    }
-
-    if (type != DT_DIR) {
-        mk_dirhtml_human_readable_size(entry->size,
-                                       sizeof(entry->size),
-                                       entry->info.size);
-    }
-    else {
-        entry->size[0] = '-';
-        entry->size[1] = '\0';
-    }
-
-    *list_len = *list_len + 1;
-
-    return entry;
-}
-
-static struct mk_list *mk_dirhtml_create_list(DIR * dir, char *path,
-                                              unsigned long *list_len)
-{
-    char full_path[PATH_MAX];
-    struct mk_list *list;
-    struct dirent *ent;
-    struct mk_f_list *entry = 0;
-
-    list = mk_api->mem_alloc(sizeof(struct mk_list));
-    mk_list_init(list);
-
-    while ((ent = readdir(dir)) != NULL) {
-        if ((ent->d_name[0] == '.') && (strcmp(ent->d_name, "..") != 0))
-            continue;
-
-        /* Look just for files and dirs */
-        if (ent->d_type != DT_REG && ent->d_type != DT_DIR
-            && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) {
-            continue;
-        }
-
-        snprintf(full_path, PATH_MAX, "%s%s", path, ent->d_name);
-        entry = mk_dirhtml_create_element(ent->d_name,
-                                          ent->d_type, full_path, list_len);
-        if (!entry) {
-            continue;
-        }
-
-        mk_list_add(&entry->_head, list);
-    }
-
-    return list;
-}
-
 /* Read dirhtml config and themes */
 int mk_dirhtml_conf(char *confdir)
 {
@@ -164,6 +99,28 @@ int mk_dirhtml_conf(char *confdir)
     return mk_dirhtml_theme_load();
 }
 
+/* Numeric key, the default is used if it's missing or not valid */
+static int mk_dirhtml_config_num(struct mk_rconf_section *section,
+                                 char *key, int def)
+{
+    int val;
+    char *str;
+
+    str = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!str) {
+        return def;
+    }
+
+    val = atoi(str);
+    if (val < 0) {
+        mk_warn("Dirlisting: invalid value for %s, using %i", key, def);
+        val = def;
+    }
+    mk_api->mem_free(str);
+
+    return val;
+}
+
 /*
  * Read the main configuration file for dirhtml: dirhtml.conf,
  * it will alloc the dirhtml_conf struct
@@ -198,6 +155,18 @@ int mk_dirhtml_read_config(char *path)
                       "%sthemes/%s/", path, dirhtml_conf->theme);
     mk_api->mem_free(default_file);
 
+    /* Listing cache */
+    dirhtml_conf->cache_entries = mk_dirhtml_config_num(section,
+                                                        "CacheEntries",
+                                                        MK_DIRHTML_CACHE_ENTRIES);
+    dirhtml_conf->cache_size = (size_t) mk_dirhtml_config_num(section,
+                                                              "CacheSize",
+                                                              MK_DIRHTML_CACHE_SIZE);
+    dirhtml_conf->cache_size *= (1024 * 1024);
+    dirhtml_conf->cache_ttl = mk_dirhtml_config_num(section, "CacheTTL",
+                                                    MK_DIRHTML_CACHE_TTL);
+    dirhtml_conf->entry_stat = MK_FALSE;
+
     if (mk_api->file_get_info(dirhtml_conf->theme_path,
                               &finfo, MK_FILE_READ) != 0) {
         mk_warn("Dirlisting: cannot load theme from '%s'", dirhtml_conf->theme_path);
@@ -213,6 +182,7 @@ int mk_dirhtml_theme_load()
 {
     /* Data */
     char *header, *entry, *footer;
+    struct dirhtml_template *tpl;
 
     /* Load theme files */
     header = mk_dirhtml_load_file(MK_DIRHTML_FILE_HEADER);
@@ -231,6 +201,15 @@ int mk_dirhtml_theme_load()
     mk_dirhtml_tpl_entry = mk_dirhtml_template_create(entry);
     mk_dirhtml_tpl_footer = mk_dirhtml_template_create(footer);
 
+    /* Files are only stat(2)'ed if their time or size is printed */
+    for (tpl = mk_dirhtml_tpl_entry; tpl; tpl = tpl->next) {
+        if (!tpl->buf && tpl->tags == (char **) _tags_entry &&
+            (tpl->tag_id == MK_DIRHTML_TAG_TIME ||
+             tpl->tag_id == MK_DIRHTML_TAG_SIZE)) {
+            dirhtml_conf->entry_stat = MK_TRUE;
+        }
+    }
+
 #ifdef DEBUG_THEME
     /* Debug data */
     mk_dirhtml_theme_debug(&mk_dirhtml_tpl_header);
@@ -398,195 +377,581 @@ struct dirhtml_template *mk_dirhtml_template_list_add(struct dirhtml_template **
     return (struct dirhtml_template *) node;
 }
 
-static int mk_dirhtml_template_len(struct dirhtml_template *tpl)
+char *mk_dirhtml_load_file(char *filename)
 {
-    int len = 0;
-    struct dirhtml_template *aux;
+    char *tmp = 0, *data = 0;
+    unsigned long len;
 
-    aux = tpl;
-    while (aux) {
-        len++;
-        aux = aux->next;
+    mk_api->str_build(&tmp, &len, "%s%s", dirhtml_conf->theme_path, filename);
+
+    if (!tmp) {
+        return NULL;
+    }
+
+    data = mk_api->file_to_buffer(tmp);
+    mk_api->mem_free(tmp);
+
+    if (!data) {
+        return NULL;
     }
 
-    return len;
+    return (char *) data;
 }
 
-static struct mk_iov *mk_dirhtml_theme_compose(struct dirhtml_template *template,
-                                               struct mk_list *list)
+static int mk_dirhtml_entry_cmp(const void *a, const void *b)
 {
-    /*
-     * template = struct { char buf ; int len, int tag }
-     * values = struct {int tag, char *value, struct *next}
-     */
-    struct mk_iov *iov;
-    struct dirhtml_template *tpl = template;
-    struct dirhtml_value *val;
-    struct mk_list *head;
+    const struct mk_f_list *f_a = a;
+    const struct mk_f_list *f_b = b;
+
+    return strcasecmp(f_a->name, f_b->name);
+}
+
+static int mk_dirhtml_buf_add(struct mk_dirhtml_buf *buf,
+                              const char *data, size_t len)
+{
+    size_t size;
+    char *tmp;
+
+    if (buf->len + len > buf->size) {
+        size = buf->size ? buf->size : 4096;
+        while (size < buf->len + len) {
+            size *= 2;
+        }
+
+        tmp = mk_api->mem_realloc(buf->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
 
-    int tpl_len;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
 
-    tpl_len = mk_dirhtml_template_len(template);
+    return 0;
+}
 
-    /* we duplicate the lenght in case we get separators */
-    iov = mk_api->iov_create(1 + tpl_len * 2, 1);
-    tpl = template;
+/*
+ * Append a template to the page, the tags of the given set are replaced
+ * by their values (and separators), tags of any other set are skipped.
+ */
+static int mk_dirhtml_render(struct mk_dirhtml_buf *buf,
+                             struct dirhtml_template *tpl, char **tags,
+                             const mk_ptr_t *values, const mk_ptr_t *seps)
+{
+    int ret;
 
     while (tpl) {
-        /* check for dynamic value */
         if (!tpl->buf && tpl->tag_id >= 0) {
-            mk_list_foreach(head, list) {
-                val = mk_list_entry(head, struct dirhtml_value, _head);
-                if (val->tags == tpl->tags && val->tag_id == tpl->tag_id) {
-                    mk_api->iov_add(iov,
-                                    val->value, val->len,
-                                    MK_FALSE);
-                    mk_api->iov_add(iov,
-                                    val->sep.data, val->sep.len,
-                                    MK_FALSE);
-                    break;
+            ret = 0;
+            if (tpl->tags == tags) {
+                ret = mk_dirhtml_buf_add(buf, values[tpl->tag_id].data,
+                                         values[tpl->tag_id].len);
+                if (ret == 0 && seps) {
+                    ret = mk_dirhtml_buf_add(buf, seps[tpl->tag_id].data,
+                                             seps[tpl->tag_id].len);
                 }
             }
         }
-        /* static */
         else {
-            mk_api->iov_add(iov,
-                            tpl->buf, tpl->len,
-                            MK_FALSE);
+            ret = mk_dirhtml_buf_add(buf, tpl->buf, tpl->len);
+        }
+
+        if (ret != 0) {
+            return -1;
         }
         tpl = tpl->next;
     }
 
-    return iov;
+    return 0;
 }
 
-struct dirhtml_value *mk_dirhtml_tag_assign(struct mk_list *list,
-                                            int tag_id, mk_ptr_t sep,
-                                            char *value, char **tags)
+static int mk_dirhtml_render_row(struct mk_dirhtml_buf *buf,
+                                 struct mk_f_list *file)
 {
-    struct dirhtml_value *aux = NULL;
+    int n;
+    char ft_modif[MK_DIRHTML_FMOD_LEN];
+    char size[16];
+    struct tm tm;
+    mk_ptr_t sep;
+    mk_ptr_t values[MK_DIRHTML_TAG_ENTRIES];
+    mk_ptr_t seps[MK_DIRHTML_TAG_ENTRIES];
 
-    aux = mk_api->mem_alloc(sizeof(struct dirhtml_value));
-    if (!aux) {
-        return NULL;
+    if (file->type == DT_DIR) {
+        sep = mk_dir_iov_slash;
+    }
+    else {
+        sep = mk_dir_iov_none;
+    }
+
+    values[MK_DIRHTML_TAG_TITLE].data = file->name;
+    values[MK_DIRHTML_TAG_TITLE].len  = file->name_len;
+    values[MK_DIRHTML_TAG_URL]        = values[MK_DIRHTML_TAG_TITLE];
+    values[MK_DIRHTML_TAG_NAME]       = values[MK_DIRHTML_TAG_TITLE];
+    seps[MK_DIRHTML_TAG_TITLE]        = sep;
+    seps[MK_DIRHTML_TAG_URL]          = sep;
+    seps[MK_DIRHTML_TAG_NAME]         = sep;
+    seps[MK_DIRHTML_TAG_TIME]         = mk_dir_iov_none;
+    seps[MK_DIRHTML_TAG_SIZE]         = mk_dir_iov_none;
+    values[MK_DIRHTML_TAG_TIME]       = mk_dir_iov_none;
+    values[MK_DIRHTML_TAG_SIZE]       = mk_dir_iov_none;
+
+    /* Time and size are only known if the theme print them */
+    if (dirhtml_conf->entry_stat == MK_TRUE) {
+        if (!localtime_r(&file->mtime, &tm)) {
+            return 0;
+        }
+        n = strftime(ft_modif, sizeof(ft_modif), "%d-%b-%G %H:%M", &tm);
+        if (n == 0) {
+            return 0;
+        }
+        values[MK_DIRHTML_TAG_TIME].data = ft_modif;
+        values[MK_DIRHTML_TAG_TIME].len  = n;
+
+        if (file->type != DT_DIR) {
+            mk_dirhtml_human_readable_size(size, sizeof(size), file->size);
+            values[MK_DIRHTML_TAG_SIZE].data = size;
+            values[MK_DIRHTML_TAG_SIZE].len  = strlen(size);
+        }
+        else {
+            values[MK_DIRHTML_TAG_SIZE] = mk_dir_iov_dash;
+        }
+    }
+
+    return mk_dirhtml_render(buf, mk_dirhtml_tpl_entry,
+                             (char **) _tags_entry, values, seps);
+}
+
+static int mk_dirhtml_list_add(struct mk_dirhtml_list *list,
+                               const char *name, int len, unsigned char type)
+{
+    int size;
+    char *names;
+    struct stat st;
+    struct mk_f_list *file;
+    struct mk_f_list *files;
+
+    if ((name[0] == '.') && (strcmp(name, "..") != 0)) {
+        return 0;
     }
 
-    aux->tag_id = tag_id;
-    aux->value = value;
-    aux->sep = sep;
-    aux->tags = tags;
+    /* Look just for files and dirs */
+    if (type != DT_REG && type != DT_DIR &&
+        type != DT_LNK && type != DT_UNKNOWN) {
+        return 0;
+    }
 
-    if (value) {
-        aux->len = strlen(value);
+    /*
+     * The directory entry type is enough to list names, the inode is only
+     * read if the theme needs it or the type must be resolved. Links are
+     * followed, a broken one is not listed.
+     */
+    if (dirhtml_conf->entry_stat == MK_TRUE ||
+        type == DT_LNK || type == DT_UNKNOWN) {
+        if (fstatat(list->fd, name, &st, 0) == -1) {
+            return 0;
+        }
+        if (type == DT_UNKNOWN) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
     }
     else {
-        aux->len = -1;
+        st.st_size  = 0;
+        st.st_mtime = 0;
+    }
+
+    if (list->count == list->size) {
+        size = list->size ? list->size * 2 : 64;
+        files = mk_api->mem_realloc(list->files,
+                                    sizeof(struct mk_f_list) * size);
+        if (!files) {
+            return -1;
+        }
+        list->files = files;
+        list->size = size;
+    }
+
+    if (list->names_len + len + 1 > list->names_size) {
+        size = list->names_size ? list->names_size : 4096;
+        while (size < list->names_len + len + 1) {
+            size *= 2;
+        }
+        names = mk_api->mem_realloc(list->names, size);
+        if (!names) {
+            return -1;
+        }
+        list->names = names;
+        list->names_size = size;
     }
 
-    mk_list_add(&aux->_head, list);
-    return (struct dirhtml_value *) aux;
+    file = &list->files[list->count++];
+    file->name_off = list->names_len;
+    file->name_len = len;
+    file->type     = type;
+    file->size     = st.st_size;
+    file->mtime    = st.st_mtime;
+
+    memcpy(list->names + list->names_len, name, len + 1);
+    list->names_len += len + 1;
+
+    return 0;
 }
 
-static void mk_dirhtml_tag_free_list(struct mk_list *list)
+#if defined(__linux__) && defined(SYS_getdents64)
+struct mk_dirhtml_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+/* Read the entries in big batches, readdir(3) fetches a few at a time */
+static int mk_dirhtml_scan(struct mk_dirhtml_list *list)
 {
-    struct mk_list *head;
-    struct mk_list *tmp;
-    struct dirhtml_value *target;
+    long n;
+    long pos;
+    char *buf;
+    struct mk_dirhtml_dirent64 *d;
 
-    mk_list_foreach_safe(head, tmp, list) {
-        target = mk_list_entry(head, struct dirhtml_value, _head);
-        mk_list_del(&target->_head);
-        mk_api->mem_free(target);
+    buf = mk_api->mem_alloc(MK_DIRHTML_DENTS_SIZE);
+    if (!buf) {
+        return -1;
     }
+
+    while (1) {
+        n = syscall(SYS_getdents64, list->fd, buf, MK_DIRHTML_DENTS_SIZE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (n <= 0) {
+            break;
+        }
+
+        for (pos = 0; pos < n; pos += d->d_reclen) {
+            d = (struct mk_dirhtml_dirent64 *) (buf + pos);
+            if (mk_dirhtml_list_add(list, d->d_name, strlen(d->d_name),
+                                    d->d_type) != 0) {
+                n = -1;
+                break;
+            }
+        }
+        if (n == -1) {
+            break;
+        }
+    }
+
+    mk_api->mem_free(buf);
+    return (n == 0) ? 0 : -1;
 }
+#else
+static int mk_dirhtml_scan(struct mk_dirhtml_list *list)
+{
+    int fd;
+    int ret = 0;
+    DIR *dir;
+    struct dirent *ent;
 
-char *mk_dirhtml_load_file(char *filename)
+    fd = dup(list->fd);
+    if (fd == -1) {
+        return -1;
+    }
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        ret = mk_dirhtml_list_add(list, ent->d_name, strlen(ent->d_name),
+                                  ent->d_type);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+#endif
+
+static inline unsigned int mk_dirhtml_hash(const char *key, int len)
 {
-    char *tmp = 0, *data = 0;
-    unsigned long len;
+    int i;
+    unsigned int hash = 2166136261u;
 
-    mk_api->str_build(&tmp, &len, "%s%s", dirhtml_conf->theme_path, filename);
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
 
-    if (!tmp) {
+    return hash;
+}
+
+static void mk_dirhtml_page_free(struct mk_dirhtml_page *page)
+{
+    mk_api->mem_free(page->key);
+    mk_api->mem_free(page->html);
+    mk_api->mem_free(page);
+}
+
+/*
+ * Read a directory and render its listing. The key holds the directory
+ * path and the request URI (used as title), on success the page owns it.
+ */
+static struct mk_dirhtml_page *mk_dirhtml_page_build(char *key, int path_len,
+                                                     int uri_len)
+{
+    int i;
+    int fd;
+    int ret;
+    struct stat st;
+    mk_ptr_t values[2];
+    struct mk_dirhtml_buf buf;
+    struct mk_dirhtml_list list;
+    struct mk_dirhtml_page *page;
+
+    fd = open(key, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
         return NULL;
     }
 
-    data = mk_api->file_to_buffer(tmp);
-    mk_api->mem_free(tmp);
-
-    if (!data) {
+    /* Identity is taken before reading, a change meanwhile means a rebuild */
+    if (fstat(fd, &st) == -1) {
+        close(fd);
         return NULL;
     }
 
-    return (char *) data;
+    memset(&list, '\0', sizeof(list));
+    list.fd = fd;
+
+    ret = mk_dirhtml_scan(&list);
+    close(fd);
+    if (ret != 0) {
+        goto error;
+    }
+
+    for (i = 0; i < list.count; i++) {
+        list.files[i].name = list.names + list.files[i].name_off;
+    }
+    qsort(list.files, list.count, sizeof(struct mk_f_list),
+          mk_dirhtml_entry_cmp);
+
+    /* %_html_title_% and %_theme_path_% */
+    values[0].data = key + path_len + 1;
+    values[0].len  = uri_len;
+    values[1].data = dirhtml_conf->theme_path;
+    values[1].len  = strlen(dirhtml_conf->theme_path);
+
+    memset(&buf, '\0', sizeof(buf));
+    ret = mk_dirhtml_render(&buf, mk_dirhtml_tpl_header,
+                            (char **) _tags_global, values, NULL);
+    for (i = 0; ret == 0 && i < list.count; i++) {
+        ret = mk_dirhtml_render_row(&buf, &list.files[i]);
+    }
+    if (ret == 0) {
+        ret = mk_dirhtml_render(&buf, mk_dirhtml_tpl_footer,
+                                (char **) _tags_global, values, NULL);
+    }
+    if (ret != 0) {
+        mk_api->mem_free(buf.data);
+        goto error;
+    }
+
+    page = mk_api->mem_alloc_z(sizeof(struct mk_dirhtml_page));
+    if (!page) {
+        mk_api->mem_free(buf.data);
+        goto error;
+    }
+
+    page->key_len = path_len + 1 + uri_len;
+    page->key     = key;
+    page->hash    = mk_dirhtml_hash(key, page->key_len);
+    page->dev     = st.st_dev;
+    page->ino     = st.st_ino;
+    page->mtime   = st.st_mtim;
+    page->built   = time(NULL);
+    page->files   = list.count;
+    page->refs    = 1;
+    page->html    = buf.data;
+    page->len     = buf.len;
+
+    PLUGIN_TRACE("listing built: %s, %i entries, %lu bytes",
+                 key, list.count, buf.len);
+
+    mk_api->mem_free(list.files);
+    mk_api->mem_free(list.names);
+    return page;
+
+ error:
+    mk_api->mem_free(list.files);
+    mk_api->mem_free(list.names);
+    return NULL;
 }
 
-static int mk_dirhtml_entry_cmp(const void *a, const void *b)
+static int mk_dirhtml_cache_init()
 {
-    struct mk_f_list *const *f_a = a;
-    struct mk_f_list *const *f_b = b;
+    int i;
+    int size = 16;
+
+    while (size < dirhtml_conf->cache_entries * 2) {
+        size <<= 1;
+    }
+
+    dirhtml_cache.table = mk_api->mem_alloc(sizeof(struct mk_list) * size);
+    if (!dirhtml_cache.table) {
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        mk_list_init(&dirhtml_cache.table[i]);
+    }
+    dirhtml_cache.mask = size - 1;
+    mk_list_init(&dirhtml_cache.lru);
+    pthread_mutex_init(&dirhtml_cache.lock, NULL);
 
-    return strcasecmp((*f_a)->name, (*f_b)->name);
+    return 0;
 }
 
-static void mk_dirhtml_free_list(struct mk_dirhtml_request *request)
+/* Take a page out of the cache, the lock must be held */
+static void mk_dirhtml_cache_unlink(struct mk_dirhtml_page *page)
 {
-    struct mk_list *tmp;
+    mk_list_del(&page->_hash);
+    mk_list_del(&page->_lru);
+    dirhtml_cache.count--;
+    dirhtml_cache.size -= page->len;
+
+    page->stale = MK_TRUE;
+    if (page->refs == 0) {
+        mk_dirhtml_page_free(page);
+    }
+}
+
+/*
+ * Look for the listing of a directory, it must be rendered from the same
+ * inode and modification time. If the entry template prints the files size
+ * or time the page also expires after CacheTTL, those changes do not touch
+ * the directory. On a miss, 'files' is set to the rows of the expired page.
+ */
+static struct mk_dirhtml_page *mk_dirhtml_cache_get(const char *key,
+                                                    int key_len,
+                                                    struct stat *st,
+                                                    int *files)
+{
+    unsigned int hash;
+    time_t now;
     struct mk_list *head;
-    struct mk_f_list *entry;
+    struct mk_dirhtml_page *page;
 
-    mk_list_foreach_safe(head, tmp, request->file_list) {
-        entry = mk_list_entry(head, struct mk_f_list, _head);
-        mk_list_del(&entry->_head);
-        mk_api->mem_free(entry);
+    *files = 0;
+    if (dirhtml_conf->cache_entries <= 0) {
+        return NULL;
+    }
+
+    now = time(NULL);
+    hash = mk_dirhtml_hash(key, key_len);
+
+    pthread_mutex_lock(&dirhtml_cache.lock);
+    mk_list_foreach(head, &dirhtml_cache.table[hash & dirhtml_cache.mask]) {
+        page = mk_list_entry(head, struct mk_dirhtml_page, _hash);
+        if (page->hash != hash || page->key_len != key_len ||
+            memcmp(page->key, key, key_len) != 0) {
+            continue;
+        }
+
+        if (page->dev == st->st_dev && page->ino == st->st_ino &&
+            page->mtime.tv_sec == st->st_mtim.tv_sec &&
+            page->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            (dirhtml_conf->entry_stat == MK_FALSE ||
+             now - page->built < dirhtml_conf->cache_ttl)) {
+            page->refs++;
+            mk_list_del(&page->_lru);
+            mk_list_add(&page->_lru, &dirhtml_cache.lru);
+            pthread_mutex_unlock(&dirhtml_cache.lock);
+            return page;
+        }
+
+        *files = page->files;
+        break;
     }
+    pthread_mutex_unlock(&dirhtml_cache.lock);
 
-    mk_api->mem_free(request->file_list);
-    mk_api->mem_free(request->toc);
+    return NULL;
 }
 
-static inline struct mk_iov *enqueue_row(int i, struct mk_dirhtml_request *request)
+/* Store a new page, it replaces an older listing of the same key */
+static void mk_dirhtml_cache_put(struct mk_dirhtml_page *page)
 {
-    mk_ptr_t sep;
-    struct mk_list list;
-    struct mk_iov *iov_entry;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_list *bucket;
+    struct mk_dirhtml_page *entry;
 
-    /* %_target_title_% */
-    if (request->toc[i]->type == DT_DIR) {
-        sep = mk_dir_iov_slash;
-    }
-    else {
-        sep = mk_dir_iov_none;
+    pthread_mutex_lock(&dirhtml_cache.lock);
+
+    if (dirhtml_conf->cache_entries <= 0 ||
+        page->len > dirhtml_conf->cache_size) {
+        page->stale = MK_TRUE;
+        pthread_mutex_unlock(&dirhtml_cache.lock);
+        return;
     }
 
-    mk_list_init(&list);
+    bucket = &dirhtml_cache.table[page->hash & dirhtml_cache.mask];
+    mk_list_foreach_safe(head, tmp, bucket) {
+        entry = mk_list_entry(head, struct mk_dirhtml_page, _hash);
+        if (entry->hash == page->hash && entry->key_len == page->key_len &&
+            memcmp(entry->key, page->key, page->key_len) == 0) {
+            mk_dirhtml_cache_unlink(entry);
+            break;
+        }
+    }
 
-    /* target title */
-    mk_dirhtml_tag_assign(&list, 0, sep,
-                          request->toc[i]->name,
-                          (char **) _tags_entry);
+    /* Evict the least recently used pages */
+    while (mk_list_is_empty(&dirhtml_cache.lru) != 0 &&
+           (dirhtml_cache.count >= dirhtml_conf->cache_entries ||
+            dirhtml_cache.size + page->len > dirhtml_conf->cache_size)) {
+        entry = mk_list_entry_first(&dirhtml_cache.lru,
+                                    struct mk_dirhtml_page, _lru);
+        mk_dirhtml_cache_unlink(entry);
+    }
 
-    /* target url */
-    mk_dirhtml_tag_assign(&list, 1, sep,
-                          request->toc[i]->name, (char **) _tags_entry);
+    mk_list_add(&page->_hash, bucket);
+    mk_list_add(&page->_lru, &dirhtml_cache.lru);
+    dirhtml_cache.count++;
+    dirhtml_cache.size += page->len;
 
-    /* target name */
-    mk_dirhtml_tag_assign(&list, 2, sep,
-                          request->toc[i]->name, (char **) _tags_entry);
+    pthread_mutex_unlock(&dirhtml_cache.lock);
+}
 
-    /* target modification time */
-    mk_dirhtml_tag_assign(&list, 3, mk_dir_iov_none,
-                          request->toc[i]->ft_modif, (char **) _tags_entry);
+static void mk_dirhtml_page_release(struct mk_dirhtml_page *page)
+{
+    pthread_mutex_lock(&dirhtml_cache.lock);
+    page->refs--;
+    if (page->refs == 0 && page->stale == MK_TRUE) {
+        mk_dirhtml_page_free(page);
+    }
+    pthread_mutex_unlock(&dirhtml_cache.lock);
+}
 
-    /* target size */
-    mk_dirhtml_tag_assign(&list, 4, mk_dir_iov_none,
-                          request->toc[i]->size, (char **) _tags_entry);
+static void mk_dirhtml_cache_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_dirhtml_page *page;
 
-    iov_entry = mk_dirhtml_theme_compose(mk_dirhtml_tpl_entry, &list);
+    if (!dirhtml_cache.table) {
+        return;
+    }
 
-    /* free entry list */
-    mk_dirhtml_tag_free_list(&list);
-    return iov_entry;
+    mk_list_foreach_safe(head, tmp, &dirhtml_cache.lru) {
+        page = mk_list_entry(head, struct mk_dirhtml_page, _lru);
+        mk_list_del(&page->_lru);
+        mk_dirhtml_page_free(page);
+    }
+    mk_api->mem_free(dirhtml_cache.table);
+    dirhtml_cache.table = NULL;
 }
 
 /* Release all resources for a given Request context */
@@ -594,284 +959,453 @@ void mk_dirhtml_cleanup(struct mk_dirhtml_request *req)
 {
     PLUGIN_TRACE("release resources");
 
-    if (req->iov_header) {
-        mk_api->iov_free(req->iov_header);
-        req->iov_header = NULL;
-    }
-    if (req->iov_entry) {
-        mk_api->iov_free(req->iov_entry);
-        req->iov_entry = NULL;
+    if (req->page) {
+        mk_dirhtml_page_release(req->page);
     }
-    if (req->iov_footer) {
-        mk_api->iov_free(req->iov_footer);
-        req->iov_footer = NULL;
-    }
-    mk_dirhtml_free_list(req);
-    closedir(req->dir);
 
     req->sr->handler_data = NULL;
     mk_api->mem_free(req);
-    req = NULL;
 }
 
 void mk_dirhtml_cb_complete(struct mk_stream_input *in)
 {
-    struct mk_stream *stream;
-    struct mk_dirhtml_request *req;
+    struct mk_http_request *sr;
 
-    stream = in->stream;
-    req = stream->context;
-    if (req) {
-        mk_dirhtml_cleanup(req);
+    sr = mk_list_entry(in->stream, struct mk_http_request, stream);
+    if (sr->handler_data) {
+        mk_dirhtml_cleanup(sr->handler_data);
     }
 }
 
-void mk_dirhtml_cb_error(struct mk_stream *stream, int status)
+/* Queue the response, the page body goes out straight from the cache */
+static int mk_dirhtml_send(struct mk_dirhtml_request *req)
 {
-#ifndef TRACE
-    (void) status;
-#endif
-    struct mk_dirhtml_request *req = stream->context;
+    int ret;
+    struct mk_http_request *sr = req->sr;
+    struct mk_dirhtml_page *page = req->page;
 
-    PLUGIN_TRACE("exception: %i", status);
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.cgi = SH_CGI;
+    sr->headers.breakline = MK_HEADER_BREAKLINE;
+    sr->headers.content_type = mk_dirhtml_default_mime;
+    sr->headers.content_length = page->len;
+    mk_api->header_prepare(req->plugin, req->cs, sr);
+
+    if (sr->method == MK_METHOD_HEAD || page->len == 0) {
+        mk_dirhtml_cleanup(req);
+        return 0;
+    }
 
-    if (req) {
+    ret = mk_stream_in_raw(&sr->stream, NULL, page->html, page->len,
+                           NULL, mk_dirhtml_cb_complete);
+    if (ret != 0) {
         mk_dirhtml_cleanup(req);
+        return -1;
     }
+    req->in = mk_list_entry_last(&sr->stream.inputs,
+                                 struct mk_stream_input, _head);
+    sr->handler_data = req;
+
+    return 0;
 }
 
-void mk_dirhtml_cb_chunk_body_rows(struct mk_stream_input *in, long bytes)
+/* Release a job nobody is waiting for */
+static void mk_dirhtml_job_free(struct mk_dirhtml_job *job)
 {
-    (void) bytes;
-
-    mk_dirhtml_cb_body_rows(in);
+    if (job->page) {
+        mk_dirhtml_page_release(job->page);
+    }
+    mk_api->mem_free(job->key);
+    mk_api->mem_free(job);
 }
 
-void mk_dirhtml_cb_body_rows(struct mk_stream_input *in)
+/* Worker side: the builder thread finished some listings */
+static int mk_dirhtml_notify(void *data)
 {
-    int len;
-    char tmp[16];
-    struct mk_stream *stream = in->stream;
-    struct mk_dirhtml_request *req = stream->context;
-    void (*cb_ok)(struct mk_stream_input *) = NULL;
+    int ret;
+    uint64_t val;
+    struct mk_list jobs;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_event *event = data;
+    struct mk_dirhtml_job *job;
+    struct mk_dirhtml_worker *worker;
+    struct mk_dirhtml_request *req;
+    struct mk_sched_conn *conn;
 
-    if (req->iov_entry) {
-        mk_api->iov_free(req->iov_entry);
-        req->iov_entry = NULL;
+    worker = mk_list_entry(event, struct mk_dirhtml_worker, event);
+
+    ret = read(worker->ch_r, &val, sizeof(val));
+    if (ret <= 0) {
+        return 0;
     }
 
-    if (req->toc_idx >= req->toc_len) {
-        if (req->chunked) {
-            len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                           (int) req->iov_footer->total_len);
-            mk_stream_in_cbuf(req->stream,
-                              NULL,
-                              tmp, len,
-                              NULL, NULL);
-            cb_ok  = NULL;
-        }
-        else {
-            cb_ok  = mk_dirhtml_cb_complete;
+    mk_list_init(&jobs);
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        job = mk_list_entry(head, struct mk_dirhtml_job, _head);
+        mk_list_del(&job->_head);
+        mk_list_add(&job->_head, &jobs);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    mk_list_foreach_safe(head, tmp, &jobs) {
+        job = mk_list_entry(head, struct mk_dirhtml_job, _head);
+        mk_list_del(&job->_head);
+
+        req = job->request;
+        if (!req) {
+            /* The client went away while the listing was built */
+            mk_dirhtml_job_free(job);
+            continue;
         }
 
-        mk_stream_in_iov(req->stream,
-                         NULL,
-                         req->iov_footer,
-                         NULL, NULL);
-        if (req->chunked) {
-            mk_stream_in_cbuf(req->stream,
-                              NULL,
-                              "\r\n0\r\n\r\n", 7,
-                              NULL, mk_dirhtml_cb_complete);
+        req->job = NULL;
+        req->page = job->page;
+        req->sr->stage30_async = MK_FALSE;
+        conn = req->cs->conn;
+
+        if (req->page) {
+            ret = mk_dirhtml_send(req);
+        }
+        else {
+            ret = -1;
+            req->sr->handler_data = NULL;
+            mk_api->http_request_error(MK_SERVER_INTERNAL_ERROR,
+                                       req->cs, req->sr, req->plugin);
+            mk_api->mem_free(req);
         }
+        mk_api->mem_free(job->key);
+        mk_api->mem_free(job);
 
-        return;
+        /* Flush the response from the write handler */
+        mk_api->ev_add(mk_api->sched_loop(), conn->event.fd,
+                       MK_EVENT_CONNECTION, MK_EVENT_WRITE, conn);
     }
 
-    req->iov_entry = enqueue_row(req->toc_idx, req);
-    if (req->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) req->iov_entry->total_len);
-        mk_stream_in_cbuf(req->stream,
-                          NULL,
-                          tmp, len,
-                          NULL, NULL);
-        cb_ok = NULL;
-    }
-    else {
-        cb_ok = mk_dirhtml_cb_body_rows;
-    }
+    return 0;
+}
 
-    mk_stream_in_iov(req->stream,
-                     NULL,
-                     req->iov_entry,
-                     NULL, cb_ok);
+/* Builder thread: read and render the big directories */
+static void mk_dirhtml_builder_loop(void *data)
+{
+    int files;
+    uint64_t val = 1;
+    struct stat st;
+    struct mk_dirhtml_builder *builder = data;
+    struct mk_dirhtml_job *job;
+    struct mk_dirhtml_worker *worker;
+
+    mk_api->worker_rename("monkey: dirlisting");
+
+    while (1) {
+        pthread_mutex_lock(&builder->lock);
+        while (builder->stop == MK_FALSE &&
+               mk_list_is_empty(&builder->queue) == 0) {
+            pthread_cond_wait(&builder->cond, &builder->lock);
+        }
+        if (builder->stop == MK_TRUE) {
+            pthread_mutex_unlock(&builder->lock);
+            break;
+        }
+        job = mk_list_entry_first(&builder->queue,
+                                  struct mk_dirhtml_job, _head);
+        mk_list_del(&job->_head);
+        builder->current = job;
+        pthread_mutex_unlock(&builder->lock);
+
+        /* Requests for the same directory queued behind the first one */
+        if (stat(job->key, &st) == 0) {
+            job->page = mk_dirhtml_cache_get(job->key,
+                                             job->path_len + 1 + job->uri_len,
+                                             &st, &files);
+        }
 
-    if (req->chunked) {
-        mk_stream_in_cbuf(req->stream,
-                          NULL,
-                          "\r\n", 2,
-                          mk_dirhtml_cb_chunk_body_rows, NULL);
+        if (!job->page) {
+            job->page = mk_dirhtml_page_build(job->key, job->path_len,
+                                              job->uri_len);
+            if (job->page) {
+                job->key = NULL;
+                mk_dirhtml_cache_put(job->page);
+            }
+        }
+
+        /* Deliver it, unless the worker exited in the meantime */
+        pthread_mutex_lock(&builder->lock);
+        builder->current = NULL;
+        worker = job->worker;
+        if (worker) {
+            pthread_mutex_lock(&worker->lock);
+            mk_list_add(&job->_head, &worker->done);
+            if (write(worker->ch_w, &val, sizeof(val)) == -1 &&
+                errno != EAGAIN) {
+                mk_libc_error("write");
+            }
+            pthread_mutex_unlock(&worker->lock);
+        }
+        pthread_mutex_unlock(&builder->lock);
+
+        if (!worker) {
+            mk_dirhtml_job_free(job);
+        }
     }
-    req->toc_idx++;
 }
 
-/*
- * The HTTP Headers were sent, now start registering the
- * rows for each directory entry.
- */
-void cb_header_finish(struct mk_stream_input *in)
+/* Hand a listing to the builder thread, it's started on first use */
+static int mk_dirhtml_job_queue(struct mk_dirhtml_request *req,
+                                struct mk_dirhtml_worker *worker,
+                                char *key, int path_len, int uri_len)
 {
-    struct mk_stream *stream = in->stream;
-    struct mk_dirhtml_request *req;
+    int ret;
+    struct mk_dirhtml_job *job;
+
+    job = mk_api->mem_alloc_z(sizeof(struct mk_dirhtml_job));
+    if (!job) {
+        return -1;
+    }
 
-    req = stream->context;
-    if (req->iov_header) {
-        mk_api->iov_free(req->iov_header);
-        req->iov_header = NULL;
+    job->key      = key;
+    job->path_len = path_len;
+    job->uri_len  = uri_len;
+    job->request  = req;
+    job->worker   = worker;
+
+    pthread_mutex_lock(&dirhtml_builder.lock);
+    if (dirhtml_builder.started == MK_FALSE) {
+        ret = mk_api->worker_spawn(mk_dirhtml_builder_loop, &dirhtml_builder,
+                                   &dirhtml_builder.tid);
+        if (ret != 0) {
+            pthread_mutex_unlock(&dirhtml_builder.lock);
+            mk_api->mem_free(job);
+            return -1;
+        }
+        dirhtml_builder.started = MK_TRUE;
     }
-    mk_dirhtml_cb_body_rows(in);
+    mk_list_add(&job->_head, &dirhtml_builder.queue);
+    pthread_cond_signal(&dirhtml_builder.cond);
+    pthread_mutex_unlock(&dirhtml_builder.lock);
+
+    req->job = job;
+    return 0;
 }
 
+/*
+ * Returns 0 if the response was queued, 1 if the listing is being built
+ * by the builder thread and -1 on error.
+ */
 static int mk_dirhtml_init(struct mk_plugin *plugin,
                            struct mk_http_session *cs, struct mk_http_request *sr)
 {
-    DIR *dir;
-    int len;
-    char tmp[16];
-    unsigned int i = 0;
-    struct mk_list *head;
-    struct mk_list list;
-    struct mk_f_list *entry;
+    int ret;
+    int files;
+    int key_len;
+    int path_len;
+    int uri_len;
+    char *key;
+    struct stat st;
+    struct mk_dirhtml_page *page;
+    struct mk_dirhtml_worker *worker;
     struct mk_dirhtml_request *request;
-    struct mk_stream *stream;
 
-    if (!(dir = opendir(sr->real_path.data))) {
+    if (stat(sr->real_path.data, &st) == -1) {
+        return -1;
+    }
+
+    /* The key is the directory and the URI, the title of the page */
+    path_len = strlen(sr->real_path.data);
+    uri_len = sr->uri_processed.len;
+    key_len = path_len + 1 + uri_len;
+
+    key = mk_api->mem_alloc(key_len + 1);
+    if (!key) {
         return -1;
     }
+    memcpy(key, sr->real_path.data, path_len + 1);
+    memcpy(key + path_len + 1, sr->uri_processed.data, uri_len);
+    key[key_len] = '\0';
 
     /* Create the main context */
-    request = mk_api->mem_alloc(sizeof(struct mk_dirhtml_request));
+    request = mk_api->mem_alloc_z(sizeof(struct mk_dirhtml_request));
     if (!request) {
-        closedir(dir);
+        mk_api->mem_free(key);
         return -1;
     }
+    request->plugin = plugin;
+    request->cs = cs;
+    request->sr = sr;
+
+    page = mk_dirhtml_cache_get(key, key_len, &st, &files);
+    if (page) {
+        mk_api->mem_free(key);
+        request->page = page;
+        return mk_dirhtml_send(request);
+    }
 
-    stream = mk_stream_set(NULL, cs->channel, request,
-                           NULL, NULL, mk_dirhtml_cb_error);
-    if (!stream) {
-        closedir(dir);
-        free(request);
-        return -1;
+    /* Big directories are read out of the event loop */
+    worker = pthread_getspecific(dirhtml_worker_key);
+    if (worker && (st.st_size >= MK_DIRHTML_ASYNC_DIR_SIZE ||
+                   files >= MK_DIRHTML_ASYNC_ENTRIES)) {
+        ret = mk_dirhtml_job_queue(request, worker, key, path_len, uri_len);
+        if (ret == 0) {
+            PLUGIN_TRACE("listing of %s deferred", sr->real_path.data);
+            sr->handler_data = request;
+            return 1;
+        }
     }
 
-    request->stream  = stream;
-    request->state   = MK_DIRHTML_STATE_HTTP_HEADER;
-    request->dir     = dir;
-    request->toc_idx = 0;
-    request->cs      = cs;
-    request->sr      = sr;
-    request->toc_len = 0;
-    request->chunked = MK_FALSE;
-    request->iov_header = NULL;
-    request->iov_entry = NULL;
-    request->iov_footer = NULL;
+    page = mk_dirhtml_page_build(key, path_len, uri_len);
+    if (!page) {
+        mk_api->mem_free(key);
+        mk_api->mem_free(request);
+        return -1;
+    }
+    mk_dirhtml_cache_put(page);
 
-    sr->handler_data = request;
+    request->page = page;
+    return mk_dirhtml_send(request);
+}
 
-    request->file_list = mk_dirhtml_create_list(dir, sr->real_path.data,
-                                                &request->toc_len);
+int mk_dirlisting_plugin_init(struct plugin_api **api, char *confdir)
+{
+    int ret;
 
-    /* Building headers */
-    mk_api->header_set_http_status(sr, MK_HTTP_OK);
-    sr->headers.cgi = SH_CGI;
-    sr->headers.breakline = MK_HEADER_BREAKLINE;
-    sr->headers.content_type = mk_dirhtml_default_mime;
-    sr->headers.content_length = -1;
+    mk_api = *api;
 
-    if (sr->protocol >= MK_HTTP_PROTOCOL_11) {
-        sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-        request->chunked = MK_TRUE;
+    ret = mk_dirhtml_conf(confdir);
+    if (ret != 0) {
+        return ret;
     }
 
-    /*
-     * Creating response template
-     */
+    mk_list_init(&dirhtml_builder.queue);
+    pthread_mutex_init(&dirhtml_builder.lock, NULL);
+    pthread_cond_init(&dirhtml_builder.cond, NULL);
+    pthread_key_create(&dirhtml_worker_key, NULL);
 
-    mk_list_init(&list);
+    return mk_dirhtml_cache_init();
+}
 
-    /* Set %_html_title_% */
-    mk_dirhtml_tag_assign(&list, 0, mk_dir_iov_none,
-                          sr->uri_processed.data,
-                          (char **) _tags_global);
+int mk_dirlisting_plugin_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_dirhtml_job *job;
 
-    /* Set %_theme_path_% */
-    mk_dirhtml_tag_assign(&list, 1, mk_dir_iov_none,
-                          dirhtml_conf->theme_path, (char **) _tags_global);
+    pthread_mutex_lock(&dirhtml_builder.lock);
+    dirhtml_builder.stop = MK_TRUE;
+    pthread_cond_broadcast(&dirhtml_builder.cond);
+    pthread_mutex_unlock(&dirhtml_builder.lock);
 
-    /* HTML Header */
-    request->iov_header = mk_dirhtml_theme_compose(mk_dirhtml_tpl_header,
-                                                   &list);
+    if (dirhtml_builder.started == MK_TRUE) {
+        pthread_join(dirhtml_builder.tid, NULL);
+    }
 
-    /* HTML Footer */
-    request->iov_footer = mk_dirhtml_theme_compose(mk_dirhtml_tpl_footer,
-                                                   &list);
-    mk_dirhtml_tag_free_list(&list);
+    mk_list_foreach_safe(head, tmp, &dirhtml_builder.queue) {
+        job = mk_list_entry(head, struct mk_dirhtml_job, _head);
+        mk_list_del(&job->_head);
+        mk_api->mem_free(job->key);
+        mk_api->mem_free(job);
+    }
 
-    /* Creating table of contents and sorting */
-    request->toc = mk_api->mem_alloc(sizeof(struct mk_f_list *) * request->toc_len);
+    mk_dirhtml_cache_exit();
 
-    i = 0;
-    mk_list_foreach(head, request->file_list) {
-        entry = mk_list_entry(head, struct mk_f_list, _head);
-        request->toc[i] = entry;
-        i++;
-    }
+    mk_api->mem_free(dirhtml_conf->theme);
+    mk_api->mem_free(dirhtml_conf->theme_path);
+    mk_api->mem_free(dirhtml_conf);
+    return 0;
+}
 
-    qsort(request->toc,
-          request->toc_len,
-          sizeof(*request->toc),
-          mk_dirhtml_entry_cmp);
+static void mk_dirhtml_worker_destroy(struct mk_dirhtml_worker *worker)
+{
+    pthread_mutex_destroy(&worker->lock);
+    close(worker->ch_r);
+    if (worker->ch_w != worker->ch_r) {
+        close(worker->ch_w);
+    }
+    mk_api->mem_free(worker);
+}
 
-    /* Prepare HTTP response headers */
-    mk_api->header_prepare(plugin, cs, sr);
+/* Register the channel used by the builder thread to wake up the worker */
+void mk_dirlisting_worker_init()
+{
+    int ret;
+    int fd[2];
+    struct mk_dirhtml_worker *worker;
 
-    if (request->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) request->iov_header->total_len);
-        mk_stream_in_cbuf(request->stream,
-                          NULL,
-                          tmp, len,
-                          NULL, mk_dirhtml_cb_complete);
+    worker = mk_api->mem_alloc_z(sizeof(struct mk_dirhtml_worker));
+    if (!worker) {
+        return;
     }
 
-    mk_stream_in_iov(request->stream,
-                     NULL,
-                     request->iov_header,
-                     NULL, cb_header_finish);
+#ifdef MK_HAVE_EVENTFD
+    fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd[0] == -1) {
+        mk_libc_error("eventfd");
+        mk_api->mem_free(worker);
+        return;
+    }
+    fd[1] = fd[0];
+#else
+    if (pipe(fd) == -1) {
+        mk_libc_error("pipe");
+        mk_api->mem_free(worker);
+        return;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+#endif
 
-    if (request->chunked) {
-        mk_stream_in_cbuf(request->stream,
-                          NULL,
-                          "\r\n", 2,
-                          NULL, NULL);
+    worker->ch_r = fd[0];
+    worker->ch_w = fd[1];
+    pthread_mutex_init(&worker->lock, NULL);
+    mk_list_init(&worker->done);
+
+    MK_EVENT_INIT(&worker->event, worker->ch_r, worker, mk_dirhtml_notify);
+    ret = mk_api->ev_add(mk_api->sched_loop(), worker->ch_r,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, &worker->event);
+    if (ret != 0) {
+        mk_warn("Dirlisting: big directories will block the worker");
+        mk_dirhtml_worker_destroy(worker);
+        return;
     }
-    return 0;
+
+    pthread_setspecific(dirhtml_worker_key, (void *) worker);
 }
 
-int mk_dirlisting_plugin_init(struct plugin_api **api, char *confdir)
+/* Detach the worker from the builder thread and release its channel */
+void mk_dirlisting_worker_exit()
 {
-    mk_api = *api;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_dirhtml_job *job;
+    struct mk_dirhtml_worker *worker;
 
-    return mk_dirhtml_conf(confdir);
-}
+    worker = pthread_getspecific(dirhtml_worker_key);
+    if (!worker) {
+        return;
+    }
 
-int mk_dirlisting_plugin_exit()
-{
-    mk_api->mem_free(dirhtml_conf->theme);
-    mk_api->mem_free(dirhtml_conf->theme_path);
-    mk_api->mem_free(dirhtml_conf);
-    return 0;
+    /* Listings queued or being built for it are dropped by the builder */
+    pthread_mutex_lock(&dirhtml_builder.lock);
+    mk_list_foreach(head, &dirhtml_builder.queue) {
+        job = mk_list_entry(head, struct mk_dirhtml_job, _head);
+        if (job->worker == worker) {
+            job->worker = NULL;
+        }
+    }
+    if (dirhtml_builder.current &&
+        dirhtml_builder.current->worker == worker) {
+        dirhtml_builder.current->worker = NULL;
+    }
+    pthread_mutex_unlock(&dirhtml_builder.lock);
+
+    /* Listings delivered after the last wake up */
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        job = mk_list_entry(head, struct mk_dirhtml_job, _head);
+        mk_list_del(&job->_head);
+        mk_dirhtml_job_free(job);
+    }
+
+    mk_dirhtml_worker_destroy(worker);
+    pthread_setspecific(dirhtml_worker_key, NULL);
 }
 
 int mk_dirlisting_stage30(struct mk_plugin *plugin,
@@ -880,7 +1414,7 @@ int mk_dirlisting_stage30(struct mk_plugin *plugin,
                           int n_param,
                           struct mk_list *params)
 {
-    (void) plugin;
+    int ret;
     (void) n_param;
     (void) params;
 
@@ -895,7 +1429,8 @@ int mk_dirlisting_stage30(struct mk_plugin *plugin,
     }
 
     PLUGIN_TRACE("Dirlisting attending socket %i", cs->socket);
-    if (mk_dirhtml_init(plugin, cs, sr)) {
+    ret = mk_dirhtml_init(plugin, cs, sr);
+    if (ret == -1) {
         /*
          * If we failed here, we cannot return RET_END - that causes a mk_bug.
          * dirhtml_init only fails if opendir fails. Usually we're at full
@@ -903,6 +1438,9 @@ int mk_dirlisting_stage30(struct mk_plugin *plugin,
          */
         return MK_PLUGIN_RET_CLOSE_CONX;
     }
+    else if (ret == 1) {
+        return MK_PLUGIN_RET_CONTINUE;
+    }
 
     return MK_PLUGIN_RET_END;
 }
@@ -911,12 +1449,25 @@ int mk_dirlisting_stage30_hangup(struct mk_plugin *plugin,
                                  struct mk_http_session *cs,
                                  struct mk_http_request *sr)
 {
+    struct mk_dirhtml_request *req = sr->handler_data;
     (void) cs;
     (void) plugin;
 
-    if (sr->handler_data) {
-        mk_dirhtml_cleanup(sr->handler_data);
+    if (!req) {
+        return 0;
     }
+
+    /* A pending job comes back to the worker, it's released there */
+    if (req->job) {
+        req->job->request = NULL;
+    }
+
+    /* The body is not sent, it must not call us back */
+    if (req->in) {
+        req->in->cb_finished = NULL;
+    }
+
+    mk_dirhtml_cleanup(req);
     return 0;
 }
 
@@ -938,7 +1489,8 @@ struct mk_plugin mk_plugin_dirlisting = {
 
     /* Init Levels */
     .master_init   = NULL,
-    .worker_init   = NULL,
+    .worker_init   = mk_dirlisting_worker_init,
+    .worker_exit   = mk_dirlisting_worker_exit,
 
     /* Type */
     .stage         = &mk_plugin_stage_dirlisting
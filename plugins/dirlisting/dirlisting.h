@@ -23,17 +23,12 @@
 
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define MK_DIRHTML_URL "/_mktheme"
 #define MK_DIRHTML_DEFAULT_MIME "Content-Type: text/html\r\n"
 
-/* For every directory requested, don't send more than
- * this limit of entries.
- */
-#define MK_DIRHTML_BUFFER_LIMIT 30
-#define MK_DIRHTML_BUFFER_GROW 5
-
-#define MK_HEADER_CHUNKED "Transfer-Encoding: Chunked\r\n\r\n"
 #define MK_DIRHTML_FMOD_LEN 24
 
 /* Theme files */
@@ -45,11 +40,29 @@
 #define MK_DIRHTML_TAG_END "_%"
 #define MK_DIRHTML_SIZE_DIR "-"
 
-/* Stream state */
-#define MK_DIRHTML_STATE_HTTP_HEADER   0
-#define MK_DIRHTML_STATE_TPL_HEADER    1
-#define MK_DIRHTML_STATE_BODY          2
-#define MK_DIRHTML_STATE_FOOTER        3
+/* Entry tags index */
+#define MK_DIRHTML_TAG_TITLE           0
+#define MK_DIRHTML_TAG_URL             1
+#define MK_DIRHTML_TAG_NAME            2
+#define MK_DIRHTML_TAG_TIME            3
+#define MK_DIRHTML_TAG_SIZE            4
+#define MK_DIRHTML_TAG_ENTRIES         5
+
+/* Listing cache defaults, see dirhtml.conf */
+#define MK_DIRHTML_CACHE_ENTRIES       128
+#define MK_DIRHTML_CACHE_SIZE          32      /* MB      */
+#define MK_DIRHTML_CACHE_TTL           60      /* seconds */
+
+/*
+ * Directories bigger than this (the size reported by stat(2) for the
+ * directory itself) or that had this many entries the last time, are
+ * read and rendered by the builder thread so the worker is not blocked.
+ */
+#define MK_DIRHTML_ASYNC_DIR_SIZE      (256 * 1024)
+#define MK_DIRHTML_ASYNC_ENTRIES       4096
+
+/* Buffer for getdents64(2) */
+#define MK_DIRHTML_DENTS_SIZE          32768
 
 char *_tags_global[] = { "%_html_title_%",
                          "%_theme_path_%",
@@ -66,15 +79,37 @@ char *_tags_entry[] = { "%_target_title_%",
 
 struct plugin_api *mk_api;
 
+/* A directory entry while the listing is built */
 struct mk_f_list
 {
-    char ft_modif[MK_DIRHTML_FMOD_LEN];
-    struct file_info info;
-    char name[NAME_MAX + 1]; /* The name can be up to NAME_MAX long; include NULL. */
-    char size[16];
+    char *name;
+    int name_off;               /* offset in the names buffer */
+    int name_len;
     unsigned char type;
+    off_t size;
+    time_t mtime;
+};
 
-    struct mk_list _head;
+/* Entries read from a directory */
+struct mk_dirhtml_list
+{
+    int fd;
+    int count;
+    int size;
+    struct mk_f_list *files;
+
+    /* File names, NULL terminated one after the other */
+    char *names;
+    int names_len;
+    int names_size;
+};
+
+/* Growing buffer where a page is rendered */
+struct mk_dirhtml_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
 };
 
 /* Main configuration of dirhtml module */
@@ -82,40 +117,102 @@ struct dirhtml_config
 {
     char *theme;
     char *theme_path;
+
+    /* Listing cache */
+    int cache_entries;
+    size_t cache_size;
+    int cache_ttl;
+
+    /* The entry template prints the time or the size of the files */
+    int entry_stat;
 };
 
-/* Represent a request context */
-struct mk_dirhtml_request
+/*
+ * A rendered listing, the full HTML body for a directory and request URI.
+ * Pages are shared by all workers: a request holds a reference while the
+ * body is being sent, a page replaced or evicted from the cache is marked
+ * as stale and released with the last reference.
+ */
+struct mk_dirhtml_page
 {
-    /* State */
-    int state;
-    int chunked;
+    unsigned int hash;
+    char *key;                  /* real path + '\0' + URI */
+    int key_len;
 
-    /* Target directory */
-    DIR *dir;
+    /* Directory identity when it was read */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t built;
 
-    /* Table of Content */
-    unsigned int toc_idx;
-    unsigned long toc_len;
-    struct mk_f_list **toc;
-    struct mk_list *file_list;
+    int files;                  /* number of rows */
+    int refs;
+    int stale;
+
+    char *html;
+    size_t len;
+
+    struct mk_list _hash;
+    struct mk_list _lru;
+};
 
-    /* Stream handler */
-    struct mk_stream *stream;
+struct mk_dirhtml_cache
+{
+    int count;
+    size_t size;
+    unsigned int mask;
+    struct mk_list *table;
+    struct mk_list lru;         /* least recently used first */
+    pthread_mutex_t lock;
+};
 
-    /* Reference IOV stuff */
-    struct mk_iov *iov_header;
-    struct mk_iov *iov_entry;
-    struct mk_iov *iov_footer;
+/* Worker end of the builder thread */
+struct mk_dirhtml_worker
+{
+    struct mk_event event;
+    int ch_r;
+    int ch_w;
+    pthread_mutex_t lock;
+    struct mk_list done;
+};
+
+/* A listing handed to the builder thread */
+struct mk_dirhtml_job
+{
+    char *key;
+    int path_len;
+    int uri_len;
+    struct mk_dirhtml_page *page;       /* result, NULL on error       */
+    struct mk_dirhtml_request *request; /* NULL if the client is gone  */
+    struct mk_dirhtml_worker *worker;
+    struct mk_list _head;
+};
+
+struct mk_dirhtml_builder
+{
+    int started;
+    int stop;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;
+    struct mk_dirhtml_job *current;     /* job being built             */
+};
+
+/* Represent a request context */
+struct mk_dirhtml_request
+{
+    struct mk_dirhtml_page *page;
+    struct mk_dirhtml_job *job;
+    struct mk_stream_input *in;
 
     /* Session data */
+    struct mk_plugin *plugin;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
 };
 
-
 extern const mk_ptr_t mk_dirhtml_default_mime;
-extern const mk_ptr_t mk_iov_dash;
 
 /* Global config */
 struct dirhtml_config *dirhtml_conf;
@@ -135,23 +232,6 @@ struct dirhtml_template *mk_dirhtml_tpl_header;
 struct dirhtml_template *mk_dirhtml_tpl_entry;
 struct dirhtml_template *mk_dirhtml_tpl_footer;
 
-struct dirhtml_value
-{
-    int tag_id;
-    mk_ptr_t sep;             /* separator code after value */
-
-    /* string data */
-    int len;
-    char *value;
-
-    /* next node */
-    struct mk_list _head;
-
-    char **tags;                /* array of tags which values correspond */
-};
-
-struct dirhtml_value *mk_dirhtml_value_global;
-
 /* Configuration struct */
 struct mk_config *conf;
 
@@ -171,11 +251,4 @@ int mk_dirhtml_read_config(char *path);
 int mk_dirhtml_theme_load();
 int mk_dirhtml_theme_debug(struct dirhtml_template **st_tpl);
 
-struct dirhtml_value *mk_dirhtml_tag_assign(struct mk_list *list,
-                                            int tag_id, mk_ptr_t sep,
-                                            char *value, char **tags);
-
-struct f_list *get_dir_content(struct mk_http_request *sr, char *path);
-
-
 #endif
@@ -447,7 +447,7 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
     }
 
     /* Content Length */
-    header = &handler->cs->parser.headers[MK_HEADER_CONTENT_TYPE];
+    header = &handler->cs->parser->headers[MK_HEADER_CONTENT_TYPE];
     if (header->type == MK_HEADER_CONTENT_TYPE) {
         fcgi_add_param(handler,
                        FCGI_PARAM_CONST("CONTENT_TYPE"),
@@ -458,7 +458,7 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
     /* Append HTTP request headers */
     struct mk_list *head;
     struct mk_http_header *http_header;
-    mk_list_foreach(head, &handler->cs->parser.header_list) {
+    mk_list_foreach(head, &handler->cs->parser->header_list) {
         http_header = mk_list_entry(head, struct mk_http_header, _head);
         fcgi_add_param_http_header(handler, http_header);
     }
@@ -481,17 +481,27 @@ size_t fcgi_read_header(void *p, struct fcgi_record_header *h)
 	return sizeof(*h);
 }
 
-static inline int fcgi_buffer_consume(struct fcgi_handler *handler, size_t bytes)
+/*
+ * Discard the records already parsed, keeping any partial record at the
+ * beginning of the buffer. It must only be called when no stream input
+ * references buf_data.
+ */
+static inline void fcgi_buffer_compact(struct fcgi_handler *handler)
 {
-    if (bytes >= handler->buf_len) {
+    if (handler->buf_offset == 0) {
+        return;
+    }
+
+    if (handler->buf_offset >= handler->buf_len) {
         handler->buf_len = 0;
-        return 0;
+        handler->buf_offset = 0;
+        return;
     }
 
-    memmove(handler->buf_data, handler->buf_data + bytes,
-            handler->buf_len - bytes);
-    handler->buf_len -= bytes;
-    return 0;
+    memmove(handler->buf_data, handler->buf_data + handler->buf_offset,
+            handler->buf_len - handler->buf_offset);
+    handler->buf_len -= handler->buf_offset;
+    handler->buf_offset = 0;
 }
 
 static char *getearliestbreak(const char buf[], const unsigned bufsize,
@@ -522,32 +532,73 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
+/*
+ * Callback invoked once a stream input that references buf_data have been
+ * fully written to the client. When the last one is done, the buffer can
+ * be reused and the backend is read again.
+ */
+static void fcgi_relay_done(struct mk_stream_input *in)
+{
+    int ret;
+    struct fcgi_handler *handler;
+
+    handler = in->stream->context;
+    handler->relay_pending--;
+    if (handler->relay_pending > 0) {
+        return;
+    }
+
+    fcgi_buffer_compact(handler);
+
+    if (handler->relay_paused == MK_FALSE) {
+        return;
+    }
+    handler->relay_paused = MK_FALSE;
+
+    if (handler->active == MK_FALSE || handler->server_fd <= 0) {
+        return;
+    }
+
+    MK_TRACE("[fastcgi=%i] client drained, resume backend reads",
+             handler->server_fd);
+    ret = mk_api->ev_add(mk_api->sched_loop(),
+                         handler->server_fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, handler);
+    if (ret == -1) {
+        fcgi_exit(handler);
+    }
+}
+
+/* Enqueue a chunk of buf_data as is, no copies */
 static int fcgi_write(struct fcgi_handler *handler, char *buf, size_t len)
 {
-    mk_stream_in_cbuf(handler->stream,
-                      NULL,
-                      buf, len,
-                      NULL, NULL);
+    int ret;
 
-    if (handler->headers_set == MK_TRUE) {
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          "\r\n", 2,
-                          NULL, NULL);
+    ret = mk_stream_in_raw(handler->stream,
+                           NULL,
+                           buf, len,
+                           NULL, fcgi_relay_done);
+    if (ret == -1) {
+        return -1;
+    }
+    handler->relay_pending++;
+
+    if (handler->headers_set == MK_TRUE && handler->chunked == MK_TRUE) {
+        mk_stream_in_raw(handler->stream,
+                         NULL,
+                         MK_CRLF, 2,
+                         NULL, NULL);
     }
     return 0;
 }
 
+/* The whole response reached the client, finish the request */
 void fcgi_stream_eof(struct mk_stream_input *in)
 {
-    (void) in;
-    // FIXME
-    //struct fcgi_handler *handler;
-
-    //handler = stream->data;
-    //if (handler->hangup == MK_FALSE) {
-    //    fcgi_exit(handler);
-    //}
+    struct fcgi_handler *handler;
+
+    handler = in->stream->context;
+    fcgi_exit(handler);
 }
 
 int fcgi_exit(struct fcgi_handler *handler)
@@ -576,6 +627,7 @@ int fcgi_exit(struct fcgi_handler *handler)
                          NULL,
                          fcgi_stream_eof);
         handler->eof = MK_TRUE;
+        mk_api->channel_flush(handler->cs->channel);
         return 1;
     }
 
@@ -621,11 +673,10 @@ static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
 
     if (len == 0 && handler->chunked && handler->headers_set == MK_TRUE) {
         MK_TRACE("[fastcgi=%i] sending EOF", handler->server_fd);
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          "0\r\n\r\n", 5,
-                          NULL, NULL);
-        mk_api->channel_flush(handler->cs->channel);
+        mk_stream_in_raw(handler->stream,
+                         NULL,
+                         "0\r\n\r\n", 5,
+                         NULL, NULL);
         return 0;
     }
 
@@ -669,14 +720,33 @@ static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
         handler->headers_set = MK_TRUE;
     }
 
-    if (p_len > 0) {
-        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
-        mk_stream_in_cbuf(handler->stream,
-                          NULL,
-                          tmp, xlen,
-                          NULL, NULL);
+    if (p_len > 0 && handler->chunked == MK_FALSE) {
         fcgi_write(handler, p, p_len);
     }
+    else if (p_len > 0) {
+        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
+
+        /*
+         * The record header that precedes the content was already decoded,
+         * reuse that room for the chunk size so both goes out on the same
+         * input. If the headers were sent from this record, the space in
+         * front of the content is taken.
+         */
+        if (p == buf) {
+            p -= xlen;
+            memcpy(p, tmp, xlen);
+            fcgi_write(handler, p, p_len + xlen);
+        }
+        else {
+            memcpy(handler->chunk_hdr, tmp, xlen);
+            mk_stream_in_raw(handler->stream,
+                             NULL,
+                             handler->chunk_hdr, xlen,
+                             NULL, fcgi_relay_done);
+            handler->relay_pending++;
+            fcgi_write(handler, p, p_len);
+        }
+    }
 
     return 0;
 }
@@ -688,6 +758,7 @@ int cb_fastcgi_on_read(void *data)
     int avail;
     char *body;
     size_t offset;
+    size_t available;
     struct fcgi_handler *handler = data;
     struct fcgi_record_header header;
 
@@ -708,14 +779,15 @@ int cb_fastcgi_on_read(void *data)
         handler->buf_len += n;
     }
 
-    if ((unsigned) handler->buf_len < FCGI_RECORD_HEADER_SIZE) {
-        /* wait for more data */
-        return n;
-    }
-
     while (1) {
+        available = handler->buf_len - handler->buf_offset;
+        if (available < FCGI_RECORD_HEADER_SIZE) {
+            /* wait for more data */
+            break;
+        }
+
         /* decode the header */
-        fcgi_read_header(&handler->buf_data, &header);
+        fcgi_read_header(handler->buf_data + handler->buf_offset, &header);
 
         if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
             header.type != FCGI_END_REQUEST) {
@@ -724,12 +796,14 @@ int cb_fastcgi_on_read(void *data)
         }
 
         /* Check if the package is complete */
-        if (handler->buf_len < (FCGI_RECORD_HEADER_SIZE + header.content_length)) {
+        offset = FCGI_RECORD_HEADER_SIZE +
+            header.content_length + header.padding_length;
+        if (available < offset) {
             /* we need more data */
-            return n;
+            break;
         }
 
-        body = handler->buf_data + FCGI_RECORD_HEADER_SIZE;
+        body = handler->buf_data + handler->buf_offset + FCGI_RECORD_HEADER_SIZE;
         switch (header.type) {
         case FCGI_STDOUT:
             MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%i",
@@ -766,15 +840,35 @@ int cb_fastcgi_on_read(void *data)
 
         if (ret == -1) {
             /* Missing header breaklines ? */
-            return n;
+            break;
         }
 
-        /* adjust buffer content */
-        offset = FCGI_RECORD_HEADER_SIZE +
-            header.content_length + header.padding_length;
+        /* skip the record, its content may still be referenced */
+        handler->buf_offset += offset;
+    }
 
-        fcgi_buffer_consume(handler, offset);
+    /*
+     * Records content is referenced by the client stream, try to send it
+     * right away. If the client cannot take it all, stop reading from the
+     * backend until the channel drains (fcgi_relay_done).
+     */
+    if (mk_channel_is_empty(handler->cs->channel) != 0) {
+        ret = mk_api->channel_flush(handler->cs->channel);
+        if (ret & MK_CHANNEL_ERROR) {
+            return -1;
+        }
+    }
+
+    if (handler->relay_pending == 0) {
+        fcgi_buffer_compact(handler);
     }
+    else if (handler->relay_paused == MK_FALSE) {
+        MK_TRACE("[fastcgi=%i] client busy, pause backend reads",
+                 handler->server_fd);
+        mk_api->ev_del(mk_api->sched_loop(), &handler->event);
+        handler->relay_paused = MK_TRUE;
+    }
+
     return n;
 }
 
@@ -796,18 +890,16 @@ int cb_fastcgi_request_flush(void *data)
             handler->iov = mk_api->iov_create(64, 0);
             fcgi_stdin_chunk(handler);
 
-            mk_api->stream_set(&handler->fcgi_stream,
-                               MK_STREAM_IOV,
-                               &handler->fcgi_channel,
-                               handler->iov,
-                               -1,
-                               handler,
-                               NULL, NULL, NULL);
+            mk_stream_in_iov(&handler->fcgi_stream,
+                             NULL,
+                             handler->iov,
+                             NULL, NULL);
             return MK_CHANNEL_FLUSH;
         }
 
         /* Request done, switch the event side to receive the FCGI response */
         handler->buf_len = 0;
+        handler->buf_offset = 0;
         handler->event.handler = cb_fastcgi_on_read;
         ret = mk_api->ev_add(mk_api->sched_loop(),
                              handler->server_fd,
@@ -878,13 +970,14 @@ int cb_fastcgi_on_connect(void *data)
     channel->io   = pio->network;
 
     mk_list_init(&channel->streams);
-    mk_api->stream_set(&handler->fcgi_stream,
-                       MK_STREAM_IOV,
-                       &handler->fcgi_channel,
-                       handler->iov,
-                       -1,
-                       handler,
-                       NULL, NULL, NULL);
+    mk_stream_set(&handler->fcgi_stream,
+                  &handler->fcgi_channel,
+                  handler,
+                  NULL, NULL, NULL);
+    mk_stream_in_iov(&handler->fcgi_stream,
+                     NULL,
+                     handler->iov,
+                     NULL, NULL);
 
     handler->event.handler = cb_fastcgi_request_flush;
     handler->event.data = handler;
@@ -932,7 +1025,7 @@ struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
     h->stdin_buffer = NULL;
 
     /* Allocate enough space for our data */
-    entries = 128 + (cs->parser.header_count * 3);
+    entries = 128 + (cs->parser->header_count * 3);
     h->iov = mk_api->iov_create(entries, 0);
 
     /* Associate the handler with the Session Request */
@@ -51,7 +51,9 @@ struct fcgi_begin_request_record {
 #define FCGI_VERSION_1               1
 #define FCGI_RECORD_MAX_SIZE         65535
 #define FCGI_RECORD_HEADER_SIZE      sizeof(struct fcgi_record_header)
-#define FCGI_BUF_SIZE                FCGI_RECORD_MAX_SIZE + FCGI_RECORD_HEADER_SIZE
+#define FCGI_PADDING_MAX_SIZE        255
+#define FCGI_BUF_SIZE                FCGI_RECORD_MAX_SIZE + FCGI_RECORD_HEADER_SIZE \
+                                     + FCGI_PADDING_MAX_SIZE
 #define FCGI_BEGIN_REQUEST_BODY_SIZE sizeof(struct fcgi_begin_request_body)
 #define FCGI_RESPONDER  1
 #define FCGI_AUTHORIZER 2
@@ -98,8 +100,18 @@ struct fcgi_handler {
 
     uint64_t write_rounds;
     unsigned int buf_len;
+    unsigned int buf_offset;     /* bytes already parsed from buf  */
     char buf_data[FCGI_BUF_SIZE];
 
+    /*
+     * Response relay: STDOUT records are not copied, the client stream
+     * references them in place on buf_data. While some of these inputs
+     * are pending, the backend is not read (backpressure).
+     */
+    int relay_pending;           /* inputs referencing buf_data    */
+    int relay_paused;            /* backend read event removed ?   */
+    char chunk_hdr[16];          /* chunk size after the headers   */
+
     /* Channel to stream request to the FCGI server */
     struct mk_channel fcgi_channel;
     struct mk_stream  fcgi_stream;
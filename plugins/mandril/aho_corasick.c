@@ -0,0 +1,214 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ctype.h>
+
+#include <monkey/mk_api.h>
+
+#include "aho_corasick.h"
+
+#define AC_ROOT       0
+#define AC_NONE      -1
+
+#define ac_lower(c)  tolower((unsigned char) (c))
+
+static int ac_state_new(struct mandril_ac *ac, unsigned char c)
+{
+    int size;
+    struct mandril_ac_state *tmp;
+    struct mandril_ac_state *s;
+
+    if (ac->size == ac->capacity) {
+        size = ac->capacity * 2;
+        tmp = mk_api->mem_realloc(ac->states,
+                                  sizeof(struct mandril_ac_state) * size);
+        if (!tmp) {
+            return AC_NONE;
+        }
+        ac->states   = tmp;
+        ac->capacity = size;
+    }
+
+    s = &ac->states[ac->size];
+    s->child   = AC_NONE;
+    s->sibling = AC_NONE;
+    s->fail    = AC_ROOT;
+    s->c       = c;
+    s->match   = MK_FALSE;
+
+    return ac->size++;
+}
+
+int mandril_ac_init(struct mandril_ac *ac)
+{
+    memset(ac, '\0', sizeof(struct mandril_ac));
+
+    ac->capacity = 64;
+    ac->states = mk_api->mem_alloc(sizeof(struct mandril_ac_state) *
+                                   ac->capacity);
+    if (!ac->states) {
+        return -1;
+    }
+
+    /* Root state, a zero in the root table means 'stay in the root' */
+    ac_state_new(ac, 0);
+
+    return 0;
+}
+
+/* Transition of a state, following the failure links if needed */
+static inline int ac_next(struct mandril_ac *ac, int s, unsigned char c)
+{
+    int t;
+
+    while (1) {
+        if (s == AC_ROOT) {
+            return ac->root[c];
+        }
+
+        for (t = ac->states[s].child; t != AC_NONE; t = ac->states[t].sibling) {
+            if (ac->states[t].c == c) {
+                return t;
+            }
+        }
+        s = ac->states[s].fail;
+    }
+}
+
+int mandril_ac_add(struct mandril_ac *ac, const char *pattern, int len)
+{
+    int i;
+    int s = AC_ROOT;
+    int t;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = ac_lower(pattern[i]);
+
+        if (s == AC_ROOT) {
+            t = ac->root[c];
+        }
+        else {
+            for (t = ac->states[s].child; t != AC_NONE;
+                 t = ac->states[t].sibling) {
+                if (ac->states[t].c == c) {
+                    break;
+                }
+            }
+        }
+
+        if (t == AC_ROOT || t == AC_NONE) {
+            t = ac_state_new(ac, c);
+            if (t == AC_NONE) {
+                return -1;
+            }
+
+            if (s == AC_ROOT) {
+                ac->root[c] = t;
+            }
+            else {
+                ac->states[t].sibling = ac->states[s].child;
+                ac->states[s].child = t;
+            }
+        }
+        s = t;
+    }
+
+    /* End of the pattern, if it's empty the root matches any text */
+    ac->states[s].match = MK_TRUE;
+    ac->count++;
+
+    return 0;
+}
+
+/* Compute the failure links, breadth first */
+int mandril_ac_build(struct mandril_ac *ac)
+{
+    int c;
+    int r;
+    int t;
+    int head = 0;
+    int tail = 0;
+    int *queue;
+    struct mandril_ac_state *st;
+
+    queue = mk_api->mem_alloc(sizeof(int) * ac->size);
+    if (!queue) {
+        return -1;
+    }
+
+    for (c = 0; c < 256; c++) {
+        t = ac->root[c];
+        if (t != AC_ROOT) {
+            ac->states[t].fail = AC_ROOT;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        r = queue[head++];
+        for (t = ac->states[r].child; t != AC_NONE; t = ac->states[t].sibling) {
+            st = &ac->states[t];
+            st->fail = ac_next(ac, ac->states[r].fail, st->c);
+
+            /* Reaching this state also means reaching its suffix */
+            if (ac->states[st->fail].match) {
+                st->match = MK_TRUE;
+            }
+            queue[tail++] = t;
+        }
+    }
+
+    mk_api->mem_free(queue);
+
+    return 0;
+}
+
+/* Return MK_TRUE if any pattern is found in the text */
+int mandril_ac_search(struct mandril_ac *ac, const char *text, int len)
+{
+    int i;
+    int s = AC_ROOT;
+
+    if (ac->count == 0) {
+        return MK_FALSE;
+    }
+
+    if (ac->states[AC_ROOT].match) {
+        return MK_TRUE;
+    }
+
+    for (i = 0; i < len; i++) {
+        s = ac_next(ac, s, ac_lower(text[i]));
+        if (ac->states[s].match) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+void mandril_ac_free(struct mandril_ac *ac)
+{
+    mk_api->mem_free(ac->states);
+    ac->states   = NULL;
+    ac->size     = 0;
+    ac->capacity = 0;
+    ac->count    = 0;
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MANDRIL_AHO_CORASICK_H
+#define MANDRIL_AHO_CORASICK_H
+
+/*
+ * Case insensitive Aho-Corasick automaton: every pattern is searched in
+ * a single pass over the text, whatever the number of patterns is.
+ *
+ * States live in one array and their transitions are kept as sibling
+ * lists, the root state has a full table since most of the bytes of the
+ * text go through it.
+ */
+
+struct mandril_ac_state {
+    int child;                    /* first transition                 */
+    int sibling;                  /* next transition of the parent    */
+    int fail;                     /* longest proper suffix state      */
+    unsigned char c;              /* byte of the transition           */
+    unsigned char match;          /* a pattern ends here or in 'fail' */
+};
+
+struct mandril_ac {
+    int count;                    /* number of patterns               */
+    int size;                     /* states in use                    */
+    int capacity;
+    struct mandril_ac_state *states;
+    int root[256];                /* transitions of the root state    */
+};
+
+int mandril_ac_init(struct mandril_ac *ac);
+int mandril_ac_add(struct mandril_ac *ac, const char *pattern, int len);
+int mandril_ac_build(struct mandril_ac *ac);
+int mandril_ac_search(struct mandril_ac *ac, const char *text, int len);
+void mandril_ac_free(struct mandril_ac *ac);
+
+#endif
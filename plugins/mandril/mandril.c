@@ -32,16 +32,60 @@
 
 static struct mk_rconf *conf;
 
+/* Parse an 'IP' rule: an address or a network in CIDR notation */
+static int mk_security_add_ip(char *val)
+{
+    int bits;
+    int max;
+    size_t len;
+    char *end;
+    char *mask;
+    char addr[INET6_ADDRSTRLEN];
+    uint8_t key[MANDRIL_RADIX_KEY] = {0};
+    struct in_addr in4;
+    struct mandril_radix *tree;
+
+    mask = strchr(val, '/');
+    len = mask ? (size_t) (mask - val) : strlen(val);
+    if (len == 0 || len >= sizeof(addr)) {
+        return -1;
+    }
+    memcpy(addr, val, len);
+    addr[len] = '\0';
+
+    if (strchr(addr, ':')) {
+        if (inet_pton(AF_INET6, addr, key) != 1) {
+            return -1;
+        }
+        tree = &mk_secure_ip6;
+    }
+    else {
+        if (inet_aton(addr, &in4) == 0) {
+            return -1;
+        }
+        memcpy(key, &in4.s_addr, 4);
+        tree = &mk_secure_ip4;
+    }
+
+    max = tree->max_bits;
+    bits = max;
+    if (mask) {
+        bits = strtol(mask + 1, &end, 10);
+        if (end == mask + 1 || *end != '\0' || bits < 0 || bits > max) {
+            return -1;
+        }
+    }
+
+    return mandril_radix_insert(tree, key, bits);
+}
+
 /* Read database configuration parameters */
 static int mk_security_conf(char *confdir)
 {
-    int n;
     int ret = 0;
     unsigned long len;
     char *conf_path = NULL;
-    char *_net, *_mask;
 
-    struct mk_secure_ip_t *new_ip;
     struct mk_secure_url_t *new_url;
     struct mk_secure_deny_hotlink_t *new_deny_hotlink;
 
@@ -66,71 +110,9 @@ static int mk_security_conf(char *confdir)
 
         /* Passing to internal struct */
         if (strcasecmp(entry->key, "IP") == 0) {
-            new_ip = mk_api->mem_alloc(sizeof(struct mk_secure_ip_t));
-            n = mk_api->str_search(entry->val, "/", 1);
-
-            /* subnet */
-            if (n > 0) {
-                /* split network addr and netmask */
-                _net  = mk_api->str_copy_substr(entry->val, 0, n);
-                _mask = mk_api->str_copy_substr(entry->val,
-                                                n + 1,
-                                                strlen(entry->val));
-
-                /* validations... */
-                if (!_net ||  !_mask) {
-                    mk_warn("Mandril: cannot parse entry '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* convert ip string to network address */
-                if (inet_aton(_net, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* parse mask */
-                new_ip->netmask = strtol(_mask, (char **) NULL, 10);
-                if (new_ip->netmask <= 0 || new_ip->netmask >= 32) {
-                    mk_warn("Mandril: invalid mask value '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* complete struct data */
-                new_ip->is_subnet = MK_TRUE;
-                new_ip->network = MK_NET_NETWORK(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmin = MK_NET_HOSTMIN(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmax = MK_NET_HOSTMAX(new_ip->ip.s_addr, new_ip->netmask);
-
-                /* link node with main list */
-                mk_list_add(&new_ip->_head, &mk_secure_ip);
-
-            /*
-             * I know, you were instructed to hate 'goto' statements!, ok, show this
-             * code to your teacher and let him blame :P
-             */
-            ip_next:
-                if (_net) {
-                    mk_api->mem_free(_net);
-                }
-                if (_mask) {
-                    mk_api->mem_free(_mask);
-                }
-            }
-            else { /* normal IP address */
-
-                /* convert ip string to network address */
-                if (inet_aton(entry->val, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                }
-                else {
-                    new_ip->is_subnet = MK_FALSE;
-                    mk_list_add(&new_ip->_head, &mk_secure_ip);
-                }
+            if (mk_security_add_ip(entry->val) != 0) {
+                mk_warn("Mandril: invalid IP rule '%s' in RULES section",
+                        entry->val);
             }
         }
         else if (strcasecmp(entry->key, "URL") == 0) {
@@ -140,6 +122,12 @@ static int mk_security_conf(char *confdir)
 
             /* link node with main list */
             mk_list_add(&new_url->_head, &mk_secure_url);
+            if (mandril_ac_add(&mk_secure_url_ac, entry->val,
+                               strlen(entry->val)) != 0) {
+                mk_err("Mandril: could not add URL rule '%s'", entry->val);
+                ret = -1;
+                break;
+            }
         }
         else if (strcasecmp(entry->key, "deny_hotlink") == 0) {
             new_deny_hotlink = mk_api->mem_alloc(sizeof(*new_deny_hotlink));
@@ -149,65 +137,67 @@ static int mk_security_conf(char *confdir)
         }
     }
 
+    /* Compile the URL rules */
+    if (ret == 0 && mandril_ac_build(&mk_secure_url_ac) != 0) {
+        mk_err("Mandril: could not compile the URL rules");
+        ret = -1;
+    }
+
     mk_api->mem_free(conf_path);
     return ret;
 }
 
 static int mk_security_check_ip(int socket)
 {
-    int network;
-    struct mk_secure_ip_t *entry;
-    struct mk_list *head;
-    struct in_addr *addr;
-    struct sockaddr_in addr_t = {0};
+    uint8_t *addr;
+    struct mandril_radix *tree;
+    struct sockaddr_in6 *in6;
+    struct sockaddr_storage addr_t = {0};
     socklen_t len = sizeof(addr_t);
 
+    /* No rules, no need to ask for the peer address */
+    if (mk_secure_ip4.count == 0 && mk_secure_ip6.count == 0) {
+        return 0;
+    }
+
     if (getpeername(socket, (struct sockaddr *) &addr_t, &len) != 0) {
         perror("getpeername");
         return -1;
     }
 
-    addr = &(addr_t).sin_addr;
+    if (addr_t.ss_family == AF_INET) {
+        addr = (uint8_t *) &((struct sockaddr_in *) &addr_t)->sin_addr;
+        tree = &mk_secure_ip4;
+    }
+    else if (addr_t.ss_family == AF_INET6) {
+        in6 = (struct sockaddr_in6 *) &addr_t;
+        addr = (uint8_t *) &in6->sin6_addr;
+        tree = &mk_secure_ip6;
+
+        /* IPv4 clients of a dual stack socket: ::ffff:a.b.c.d */
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            addr += 12;
+            tree = &mk_secure_ip4;
+        }
+    }
+    else {
+        return 0;
+    }
 
     PLUGIN_TRACE("[FD %i] Mandril validating IP address", socket);
-    mk_list_foreach(head, &mk_secure_ip) {
-        entry = mk_list_entry(head, struct mk_secure_ip_t, _head);
-
-        if (entry->is_subnet == MK_TRUE) {
-            /* Validate network */
-            network = MK_NET_NETWORK(addr->s_addr, entry->netmask);
-            if (network != entry->network) {
-                continue;
-            }
-            /* Validate host range */
-            if (addr->s_addr <= entry->hostmax && addr->s_addr >= entry->hostmin) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in ranges", socket);
-                return -1;
-            }
-        }
-        else {
-            if (addr->s_addr == entry->ip.s_addr) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in IP match", socket);
-                return -1;
-            }
-        }
+    if (mandril_radix_lookup(tree, addr) >= 0) {
+        PLUGIN_TRACE("[FD %i] Mandril closing by IP rule", socket);
+        return -1;
     }
+
     return 0;
 }
 
 /* Check if the incoming URL is restricted for some rule */
 static int mk_security_check_url(mk_ptr_t url)
 {
-    int n;
-    struct mk_list *head;
-    struct mk_secure_url_t *entry;
-
-    mk_list_foreach(head, &mk_secure_url) {
-        entry = mk_list_entry(head, struct mk_secure_url_t, _head);
-        n = mk_api->str_search_n(url.data, entry->criteria, MK_STR_INSENSITIVE, url.len);
-        if (n >= 0) {
-            return -1;
-        }
+    if (mandril_ac_search(&mk_secure_url_ac, url.data, url.len) == MK_TRUE) {
+        return -1;
     }
 
     return 0;
@@ -315,17 +305,29 @@ int mk_mandril_plugin_init(struct plugin_api **api, char *confdir)
     mk_api = *api;
 
     /* Init security lists */
-    mk_list_init(&mk_secure_ip);
+    mandril_radix_init(&mk_secure_ip4, 32);
+    mandril_radix_init(&mk_secure_ip6, 128);
     mk_list_init(&mk_secure_url);
     mk_list_init(&mk_secure_deny_hotlink);
+    if (mandril_ac_init(&mk_secure_url_ac) != 0) {
+        return -1;
+    }
 
-    /* Read configuration */
-    mk_security_conf(confdir);
+    /* Read configuration, URL rules that can't be loaded fail the plugin */
+    if (mk_security_conf(confdir) != 0) {
+        mandril_radix_free(&mk_secure_ip4);
+        mandril_radix_free(&mk_secure_ip6);
+        mandril_ac_free(&mk_secure_url_ac);
+        return -1;
+    }
     return 0;
 }
 
 int mk_mandril_plugin_exit()
 {
+    mandril_radix_free(&mk_secure_ip4);
+    mandril_radix_free(&mk_secure_ip6);
+    mandril_ac_free(&mk_secure_url_ac);
     return 0;
 }
 
@@ -22,21 +22,8 @@
 #ifndef MK_SECURITY_H
 #define MK_SECURITY_H
 
-struct mk_secure_ip_t
-{
-    struct in_addr ip;
-
-    /* if subnet is true, next fields are populated */
-    int is_subnet;
-
-    int network;
-    int netmask;
-    unsigned int hostmin;
-    unsigned int hostmax;
-
-    /* list head linker */
-    struct mk_list _head;
-};
+#include "radix.h"
+#include "aho_corasick.h"
 
 struct mk_secure_url_t
 {
@@ -50,8 +37,14 @@ struct mk_secure_deny_hotlink_t
     struct mk_list _head;
 };
 
-struct mk_list mk_secure_ip;
+/* IP and network rules, looked up by longest prefix */
+struct mandril_radix mk_secure_ip4;
+struct mandril_radix mk_secure_ip6;
+
+/* URL rules, the automaton matches all of them in one pass */
 struct mk_list mk_secure_url;
+struct mandril_ac mk_secure_url_ac;
+
 struct mk_list mk_secure_deny_hotlink;
 
 #endif
@@ -0,0 +1,182 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "radix.h"
+
+/* Bit 'n' of a key, the most significant bit comes first */
+static inline int radix_bit(const uint8_t *key, int n)
+{
+    return (key[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Number of leading bits shared by two keys, up to 'max' */
+static int radix_common(const uint8_t *a, const uint8_t *b, int max)
+{
+    int i = 0;
+    uint8_t x;
+
+    while (i + 8 <= max && a[i >> 3] == b[i >> 3]) {
+        i += 8;
+    }
+
+    if (i < max) {
+        x = a[i >> 3] ^ b[i >> 3];
+        while (i < max && !(x & (0x80 >> (i & 7)))) {
+            i++;
+        }
+    }
+
+    return i;
+}
+
+static struct mandril_radix_node *radix_node(const uint8_t *key, int bits,
+                                             int rule)
+{
+    int i;
+    struct mandril_radix_node *n;
+
+    n = mk_api->mem_alloc_z(sizeof(struct mandril_radix_node));
+    if (!n) {
+        return NULL;
+    }
+
+    /* Keep only the prefix bits so lookups can compare whole bytes */
+    for (i = 0; i < bits; i++) {
+        if (radix_bit(key, i)) {
+            n->key[i >> 3] |= (0x80 >> (i & 7));
+        }
+    }
+    n->bits = bits;
+    n->rule = rule;
+
+    return n;
+}
+
+void mandril_radix_init(struct mandril_radix *tree, int max_bits)
+{
+    tree->max_bits = max_bits;
+    tree->count    = 0;
+    tree->root     = NULL;
+}
+
+int mandril_radix_insert(struct mandril_radix *tree,
+                         const uint8_t *key, int bits)
+{
+    int common;
+    struct mandril_radix_node *n;
+    struct mandril_radix_node *split;
+    struct mandril_radix_node *leaf;
+    struct mandril_radix_node **np = &tree->root;
+
+    if (bits < 0 || bits > tree->max_bits) {
+        return -1;
+    }
+
+    while (*np) {
+        n = *np;
+        common = radix_common(n->key, key, bits < n->bits ? bits : n->bits);
+
+        if (common < n->bits) {
+            /* The new prefix diverges inside this node: split it */
+            if (common == bits) {
+                split = radix_node(key, bits, MK_TRUE);
+                if (!split) {
+                    return -1;
+                }
+                split->child[radix_bit(n->key, bits)] = n;
+                *np = split;
+                tree->count++;
+                return 0;
+            }
+
+            split = radix_node(key, common, MK_FALSE);
+            leaf  = radix_node(key, bits, MK_TRUE);
+            if (!split || !leaf) {
+                mk_api->mem_free(split);
+                mk_api->mem_free(leaf);
+                return -1;
+            }
+            split->child[radix_bit(n->key, common)] = n;
+            split->child[radix_bit(key, common)] = leaf;
+            *np = split;
+            tree->count++;
+            return 0;
+        }
+
+        if (n->bits == bits) {
+            if (!n->rule) {
+                n->rule = MK_TRUE;
+                tree->count++;
+            }
+            return 0;
+        }
+
+        np = &n->child[radix_bit(key, n->bits)];
+    }
+
+    *np = radix_node(key, bits, MK_TRUE);
+    if (!*np) {
+        return -1;
+    }
+    tree->count++;
+
+    return 0;
+}
+
+/* Return the length of the longest prefix containing 'addr', or -1 */
+int mandril_radix_lookup(struct mandril_radix *tree, const uint8_t *addr)
+{
+    int best = -1;
+    struct mandril_radix_node *n = tree->root;
+
+    while (n) {
+        if (radix_common(n->key, addr, n->bits) < n->bits) {
+            break;
+        }
+        if (n->rule) {
+            best = n->bits;
+        }
+        if (n->bits == tree->max_bits) {
+            break;
+        }
+        n = n->child[radix_bit(addr, n->bits)];
+    }
+
+    return best;
+}
+
+static void radix_node_free(struct mandril_radix_node *n)
+{
+    if (!n) {
+        return;
+    }
+
+    radix_node_free(n->child[0]);
+    radix_node_free(n->child[1]);
+    mk_api->mem_free(n);
+}
+
+void mandril_radix_free(struct mandril_radix *tree)
+{
+    radix_node_free(tree->root);
+    tree->root  = NULL;
+    tree->count = 0;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MANDRIL_RADIX_H
+#define MANDRIL_RADIX_H
+
+#include <stdint.h>
+
+/*
+ * Path compressed binary trie of network prefixes (IPv4 or IPv6), a
+ * lookup walks at most one node per distinct prefix length on the path
+ * of the address and returns the longest prefix that contains it.
+ */
+
+#define MANDRIL_RADIX_KEY  16     /* bytes, enough for an IPv6 address */
+
+struct mandril_radix_node {
+    uint8_t key[MANDRIL_RADIX_KEY];
+    int bits;                     /* prefix length of this node       */
+    int rule;                     /* a rule ends here                 */
+    struct mandril_radix_node *child[2];
+};
+
+struct mandril_radix {
+    int max_bits;                 /* 32 or 128                        */
+    int count;                    /* number of rules                  */
+    struct mandril_radix_node *root;
+};
+
+void mandril_radix_init(struct mandril_radix *tree, int max_bits);
+int mandril_radix_insert(struct mandril_radix *tree,
+                         const uint8_t *key, int bits);
+int mandril_radix_lookup(struct mandril_radix *tree, const uint8_t *addr);
+void mandril_radix_free(struct mandril_radix *tree);
+
+#endif
@@ -21,8 +21,10 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -34,6 +36,7 @@
 #include <mbedtls/error.h>
 #include <mbedtls/net.h>
 #include <mbedtls/ssl.h>
+#include <mbedtls/ssl_internal.h>
 #include <mbedtls/bignum.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
@@ -44,10 +47,57 @@
 #include <mbedtls/dhm.h>
 #include <monkey/mk_api.h>
 
+/* Kernel TLS: records of the write direction are built by the kernel */
+#if defined(MK_HAVE_KTLS) && defined(MBEDTLS_SSL_EXPORT_KEYS)
+#define POLAR_KTLS
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define POLAR_KTLS_NONE  0      /* keys not exported (yet)          */
+#define POLAR_KTLS_KEYS  1      /* keys exported, handshake running */
+#define POLAR_KTLS_ON    2      /* the kernel writes the records    */
+#endif
+
+/* Handshake steps offloaded to the crypto threads (HandshakeThreads) */
+#define POLAR_CRYPTO_IDLE    0      /* the worker owns the context      */
+#define POLAR_CRYPTO_BUSY    1      /* a step is queued or running      */
+#define POLAR_CRYPTO_CLOSED  2      /* busy, the connection went away   */
+
+/* polar_handshake() result when the connection got parked */
+#define POLAR_CRYPTO_PARKED  1
+
+/* Steps waiting for a crypto thread, per thread */
+#define POLAR_CRYPTO_BACKLOG 64
+
 #ifndef SENDFILE_BUF_SIZE
 #define SENDFILE_BUF_SIZE MBEDTLS_SSL_MAX_CONTENT_LEN
 #endif
 
+/*
+ * Dynamic record sizing: until this much data went out, after connecting
+ * or being idle, records fit in one TCP segment (1500 bytes MTU minus the
+ * IP/TCP headers and the record overhead), so the client can process the
+ * first bytes as they arrive. Then full size records are used.
+ */
+#define POLAR_RECORD_SMALL   1369
+#define POLAR_RECORD_BOOST   (128 * 1024)
+#define POLAR_RECORD_IDLE    1000      /* msec, default DynamicRecordIdle */
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define POLAR_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define POLAR_CLOCK CLOCK_MONOTONIC
+#endif
+
 #ifndef POLAR_DEBUG_LEVEL
 #define POLAR_DEBUG_LEVEL 0
 #endif
@@ -65,6 +115,10 @@ struct polar_config {
     char *key_file;
     char *dh_param_file;
     int8_t check_client_cert;
+    int8_t kernel_tls;
+    int8_t dynamic_records;
+    int record_idle;
+    int handshake_threads;
 };
 
 #if defined(MBEDTLS_SSL_CACHE_C)
@@ -82,19 +136,58 @@ static struct polar_sessions global_sessions = {
 struct polar_context_head {
     mbedtls_ssl_context context;
     int fd;
+#ifdef POLAR_KTLS
+    int ktls;                          /* POLAR_KTLS_*                 */
+    size_t ktls_keylen;
+    unsigned char ktls_key[32];        /* server write key             */
+    unsigned char ktls_salt[4];        /* server write IV, fixed part  */
+#endif
+    int rec_blocked;                   /* a record waits for a flush   */
+    size_t rec_sent;                   /* bytes since the last reset   */
+    uint64_t rec_last;                 /* msec of the last write       */
+    int crypto;                        /* POLAR_CRYPTO_*               */
+    int crypto_ret;                    /* result of the offloaded step */
+    struct polar_thread_context *owner;
+    struct mk_list _crypto_head;       /* crypto queue or done list    */
     struct polar_context_head *_next;
 };
 
 struct polar_thread_context {
 
     struct polar_context_head *contexts;
+    struct polar_context_head *current;  /* connection inside mbedtls */
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_pk_context pkey;
     mbedtls_ssl_config conf;
 
+    /* Crypto threads run handshake steps of this thread connections */
+    pthread_mutex_t done_lock;
+    struct mk_list crypto_done;        /* steps finished by the pool   */
+    int ch_r;
+    int ch_w;
+    struct mk_event crypto_event;
+
     struct mk_list _head;
 };
 
+/* Crypto threads own a key and RNG, steps don't share worker state */
+struct polar_crypto_thread {
+    pthread_t tid;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_pk_context pkey;
+};
+
+struct polar_crypto_pool {
+    int stop;
+    int threads;
+    int queued;
+    int max_queued;
+    struct polar_crypto_thread *crypto;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list queue;
+};
+
 struct polar_server_context {
 
     struct polar_config config;
@@ -112,6 +205,22 @@ static const char *my_dhm_G = MBEDTLS_DHM_RFC5114_MODP_2048_G;
 
 static pthread_key_t local_context;
 
+/* Connection whose handshake step runs on the calling crypto thread */
+static pthread_key_t local_step;
+
+/* Context of the calling crypto thread, NULL on the workers */
+static pthread_key_t local_crypto;
+
+static struct polar_crypto_pool crypto_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+#ifdef POLAR_KTLS
+/* Cleared once the kernel reports it has no TLS support */
+static int polar_ktls_available = MK_TRUE;
+#endif
+
 /*
  * The following function is taken from PolarSSL sources to get
  * the number of available bytes to read from a buffer.
@@ -204,6 +313,8 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     char *cert_chain_file = NULL;
     char *key_file = NULL;
     char *dh_param_file = NULL;
+    char *kernel_tls = NULL;
+    char *dynamic_records = NULL;
     int8_t check_client_cert = MK_FALSE;
     struct mk_rconf_section *section;
     struct mk_rconf *conf_head;
@@ -237,6 +348,21 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     check_client_cert = mk_api->config_section_get_key(section,
                                                    "CheckClientCert",
                                                    MK_RCONF_BOOL);
+    kernel_tls = mk_api->config_section_get_key(section,
+                                                "KernelTLS",
+                                                MK_RCONF_STR);
+    dynamic_records = mk_api->config_section_get_key(section,
+                                                     "DynamicRecordSize",
+                                                     MK_RCONF_STR);
+    conf->record_idle = (long) mk_api->config_section_get_key(section,
+                                                     "DynamicRecordIdle",
+                                                     MK_RCONF_NUM);
+    conf->handshake_threads = (long) mk_api->config_section_get_key(section,
+                                                          "HandshakeThreads",
+                                                          MK_RCONF_NUM);
+    if (conf->handshake_threads < 0) {
+        conf->handshake_threads = 0;
+    }
 fallback:
     /* Set default name if not specified */
     if (!cert_file) {
@@ -304,6 +430,29 @@ fallback:
     /* Set client cert check */
     conf->check_client_cert = check_client_cert;
 
+    /* Kernel TLS, used when available unless it's turned off */
+    conf->kernel_tls = MK_TRUE;
+    if (kernel_tls) {
+        if (strcasecmp(kernel_tls, "Off") == 0 ||
+            strcasecmp(kernel_tls, "No") == 0) {
+            conf->kernel_tls = MK_FALSE;
+        }
+        mk_api->mem_free(kernel_tls);
+    }
+
+    /* Dynamic record sizing, same as above */
+    conf->dynamic_records = MK_TRUE;
+    if (dynamic_records) {
+        if (strcasecmp(dynamic_records, "Off") == 0 ||
+            strcasecmp(dynamic_records, "No") == 0) {
+            conf->dynamic_records = MK_FALSE;
+        }
+        mk_api->mem_free(dynamic_records);
+    }
+    if (conf->record_idle <= 0) {
+        conf->record_idle = POLAR_RECORD_IDLE;
+    }
+
     if (conf_head) {
         mk_api->config_free(conf_head);
     }
@@ -328,7 +477,8 @@ static int polar_load_certs(const struct polar_config *conf)
                 "please set 'CertificateFile' in tls.conf");
 
         ret = mbedtls_x509_crt_parse(&server_context->cert,
-                             (unsigned char *)mbedtls_test_srv_crt, strlen(mbedtls_test_srv_crt));
+                             (unsigned char *)mbedtls_test_srv_crt,
+                             mbedtls_test_srv_crt_len);
 
         if (ret) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
@@ -356,7 +506,7 @@ static int polar_load_certs(const struct polar_config *conf)
     return 0;
 }
 
-static int polar_load_key(struct polar_thread_context *thread_context,
+static int polar_load_key(mbedtls_pk_context *pkey,
                           const struct polar_config *conf)
 {
     char err_buf[72];
@@ -364,7 +514,7 @@ static int polar_load_key(struct polar_thread_context *thread_context,
 
     assert(conf->key_file);
 
-    ret = mbedtls_pk_parse_keyfile(&thread_context->pkey, conf->key_file, NULL);
+    ret = mbedtls_pk_parse_keyfile(pkey, conf->key_file, NULL);
     if (ret < 0) {
         mbedtls_strerror(ret, err_buf, sizeof(err_buf));
         MK_TRACE("[tls] Load key '%s' failed: %s",
@@ -373,9 +523,9 @@ static int polar_load_key(struct polar_thread_context *thread_context,
 
 #if defined(MBEDTLS_CERTS_C)
 
-        ret = mbedtls_pk_parse_key(&thread_context->pkey,
+        ret = mbedtls_pk_parse_key(pkey,
                            (unsigned char *)mbedtls_test_srv_key,
-                           strlen(mbedtls_test_srv_key), NULL, 0);
+                           mbedtls_test_srv_key_len, NULL, 0);
         if (ret) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
             mk_err("[tls] Failed to load built-in RSA key: %s", err_buf);
@@ -419,6 +569,8 @@ static int polar_load_dh_param(const struct polar_config *conf)
 static int mk_tls_init()
 {
     pthread_key_create(&local_context, NULL);
+    pthread_key_create(&local_step, NULL);
+    pthread_key_create(&local_crypto, NULL);
 
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_init(&global_sessions.cache);
@@ -453,6 +605,18 @@ static int entropy_func_safe(void *data, unsigned char *output, size_t len)
     return ret;
 }
 
+/* Handshake steps run by a crypto thread draw from its own RNG */
+static int polar_rng(void *data, unsigned char *output, size_t len)
+{
+    struct polar_thread_context *thctx = data;
+    struct polar_crypto_thread *crypto = pthread_getspecific(local_crypto);
+
+    if (crypto) {
+        return mbedtls_ctr_drbg_random(&crypto->ctr_drbg, output, len);
+    }
+    return mbedtls_ctr_drbg_random(&thctx->ctr_drbg, output, len);
+}
+
 static void contexts_free(struct polar_context_head *ctx)
 {
     struct polar_context_head *cur, *next;
@@ -513,8 +677,9 @@ static mbedtls_ssl_context *context_new(int fd)
 
     assert(cur != NULL);
 
+    /* A context released while the pool works on it is not free yet */
     for (; *cur; cur = &(*cur)->_next) {
-        if ((*cur)->fd == -1) {
+        if ((*cur)->fd == -1 && (*cur)->crypto == POLAR_CRYPTO_IDLE) {
             break;
         }
     }
@@ -527,6 +692,12 @@ static mbedtls_ssl_context *context_new(int fd)
             return NULL;
         }
         (*cur)->_next = NULL;
+        (*cur)->crypto = POLAR_CRYPTO_IDLE;
+        (*cur)->crypto_ret = 0;
+        (*cur)->owner = thctx;
+#ifdef POLAR_KTLS
+        (*cur)->ktls = POLAR_KTLS_NONE;
+#endif
 
         ssl = &(*cur)->context;
 
@@ -541,8 +712,13 @@ static mbedtls_ssl_context *context_new(int fd)
         mbedtls_ssl_set_bio(ssl, &(*cur)->fd,
                             mbedtls_net_send, mbedtls_net_recv, NULL);
 
-        mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
-                             &thctx->ctr_drbg);
+        if (crypto_pool.threads > 0) {
+            mbedtls_ssl_conf_rng(&thctx->conf, polar_rng, thctx);
+        }
+        else {
+            mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
+                                 &thctx->ctr_drbg);
+        }
 
 #if (POLAR_DEBUG_LEVEL > 0)
         mbedtls_ssl_conf_dbg(ssl, polar_debug, 0);
@@ -561,10 +737,214 @@ static mbedtls_ssl_context *context_new(int fd)
     }
 
     (*cur)->fd = fd;
+    (*cur)->rec_blocked = MK_FALSE;
+    (*cur)->rec_sent = 0;
+    (*cur)->rec_last = 0;
 
     return ssl;
 }
 
+#ifdef POLAR_KTLS
+static void polar_wipe(void *buf, size_t len)
+{
+    volatile unsigned char *p = buf;
+
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+/*
+ * Key export callback, it runs inside mbedtls when the session keys are
+ * derived for the connection being processed by this thread. Only the
+ * AEAD suites are kept: no MAC keys and a 4 bytes fixed IV.
+ */
+static int polar_ktls_export_keys(void *p, const unsigned char *ms,
+                                  const unsigned char *kb,
+                                  size_t maclen, size_t keylen, size_t ivlen)
+{
+    struct polar_thread_context *thctx = p;
+    struct polar_context_head *head;
+
+    (void) ms;
+
+    head = pthread_getspecific(local_step);
+    if (!head) {
+        head = thctx->current;
+    }
+
+    if (!head || polar_ktls_available == MK_FALSE || maclen != 0 ||
+        ivlen != sizeof(head->ktls_salt) || keylen > sizeof(head->ktls_key)) {
+        return 0;
+    }
+
+    /* Key block: client key, server key, client IV, server IV */
+    memcpy(head->ktls_key, kb + keylen, keylen);
+    memcpy(head->ktls_salt, kb + (2 * keylen) + ivlen, ivlen);
+    head->ktls_keylen = keylen;
+    head->ktls = POLAR_KTLS_KEYS;
+
+    return 0;
+}
+
+/* Records can't be written by mbedtls anymore, renegotiations included */
+static int polar_ktls_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    (void) ctx;
+    (void) buf;
+    (void) len;
+
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+/*
+ * Hand the write direction to the kernel, the record sequence continues
+ * from the mbedtls one. Only TLS 1.2 with AES-GCM can be offloaded, on
+ * any failure the connection keeps going through mbedtls.
+ */
+static int polar_ktls_enable(struct polar_context_head *head)
+{
+    int ret = -1;
+    socklen_t len = 0;
+    mbedtls_ssl_context *ssl = &head->context;
+    const mbedtls_ssl_ciphersuite_t *suite;
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+    } info;
+
+    /* One attempt per connection */
+    head->ktls = POLAR_KTLS_NONE;
+    memset(&info, 0, sizeof(info));
+
+    suite = mbedtls_ssl_ciphersuite_from_id(ssl->session->ciphersuite);
+    if (!suite || ssl->minor_ver != MBEDTLS_SSL_MINOR_VERSION_3) {
+        goto out;
+    }
+
+    if (suite->cipher == MBEDTLS_CIPHER_AES_128_GCM &&
+        head->ktls_keylen == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+        info.gcm128.info.version = TLS_1_2_VERSION;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, head->ktls_key, head->ktls_keylen);
+        memcpy(info.gcm128.salt, head->ktls_salt, sizeof(head->ktls_salt));
+        memcpy(info.gcm128.iv, ssl->out_ctr, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(info.gcm128.rec_seq, ssl->out_ctr,
+               TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof(info.gcm128);
+    }
+#ifdef TLS_CIPHER_AES_GCM_256
+    else if (suite->cipher == MBEDTLS_CIPHER_AES_256_GCM &&
+             head->ktls_keylen == TLS_CIPHER_AES_GCM_256_KEY_SIZE) {
+        info.gcm256.info.version = TLS_1_2_VERSION;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, head->ktls_key, head->ktls_keylen);
+        memcpy(info.gcm256.salt, head->ktls_salt, sizeof(head->ktls_salt));
+        memcpy(info.gcm256.iv, ssl->out_ctr, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.gcm256.rec_seq, ssl->out_ctr,
+               TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof(info.gcm256);
+    }
+#endif
+    else {
+        goto out;
+    }
+
+    /* Handshakes in flight may have exported keys before it got disabled */
+    if (polar_ktls_available == MK_FALSE) {
+        goto out;
+    }
+
+    ret = setsockopt(head->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    if (ret == -1) {
+        if ((errno == ENOENT || errno == ENOPROTOOPT) &&
+            __sync_bool_compare_and_swap(&polar_ktls_available,
+                                         MK_TRUE, MK_FALSE)) {
+            mk_warn("[tls] Kernel TLS not available, disabled");
+        }
+        goto out;
+    }
+
+    /* Without TLS_TX the ULP just passes the data through */
+    ret = setsockopt(head->fd, SOL_TLS, TLS_TX, &info, len);
+    if (ret == -1) {
+        PLUGIN_TRACE("[fd %d] TLS_TX failed: %s", head->fd, strerror(errno));
+        goto out;
+    }
+
+    mbedtls_ssl_set_bio(ssl, &head->fd,
+                        polar_ktls_net_send, mbedtls_net_recv, NULL);
+    head->ktls = POLAR_KTLS_ON;
+    PLUGIN_TRACE("[fd %d] Kernel TLS enabled", head->fd);
+
+ out:
+    polar_wipe(&info, sizeof(info));
+    polar_wipe(head->ktls_key, sizeof(head->ktls_key));
+    return ret;
+}
+
+/*
+ * Runs before every mbedtls call on a connection: keys exported meanwhile
+ * belong to it. Returns MK_TRUE once the kernel writes the records, which
+ * happens at the first write after the handshake has been flushed.
+ */
+static inline int polar_ktls(mbedtls_ssl_context *ssl)
+{
+    struct polar_context_head *head;
+
+    head = container_of(ssl, struct polar_context_head, context);
+    if (head->ktls == POLAR_KTLS_ON) {
+        return MK_TRUE;
+    }
+
+    local_thread_context()->current = head;
+    if (head->ktls == POLAR_KTLS_KEYS &&
+        ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER && ssl->out_left == 0) {
+        if (polar_ktls_enable(head) == 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/* The alert is built by the kernel as well */
+static void polar_ktls_close_notify(int fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+    unsigned char alert[2] = {MBEDTLS_SSL_ALERT_LEVEL_WARNING,
+                              MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY};
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = alert;
+    iov.iov_len  = sizeof(alert);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = MBEDTLS_SSL_MSG_ALERT;
+
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#else
+static inline int polar_ktls(mbedtls_ssl_context *ssl)
+{
+    (void) ssl;
+
+    return MK_FALSE;
+}
+#endif
+
 static int context_unset(int fd, mbedtls_ssl_context *ssl)
 {
     struct polar_context_head *head;
@@ -573,6 +953,14 @@ static int context_unset(int fd, mbedtls_ssl_context *ssl)
 
     if (head->fd == fd) {
         head->fd = -1;
+#ifdef POLAR_KTLS
+        if (head->ktls == POLAR_KTLS_ON) {
+            mbedtls_ssl_set_bio(ssl, &head->fd,
+                                mbedtls_net_send, mbedtls_net_recv, NULL);
+        }
+        head->ktls = POLAR_KTLS_NONE;
+        polar_wipe(head->ktls_key, sizeof(head->ktls_key));
+#endif
         mbedtls_ssl_session_reset(ssl);
     }
     else {
@@ -582,8 +970,372 @@ static int context_unset(int fd, mbedtls_ssl_context *ssl)
     return 0;
 }
 
+/*
+ * Handshake offload
+ * -----------------
+ * The private key operations (signing the (EC)DHE parameters, decrypting
+ * the RSA premaster or computing the (EC)DH secret) are the expensive
+ * part of a handshake. With HandshakeThreads set, the handshake steps
+ * doing them run on the crypto threads while the connection is suspended
+ * from the worker loop, the worker resumes it once the step is done.
+ *
+ * The step runs without any I/O: its input record is buffered first and
+ * the record it writes is flushed later by the worker.
+ */
+static int polar_crypto_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    (void) ctx;
+    (void) buf;
+    (void) len;
+
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+static int polar_crypto_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    (void) ctx;
+    (void) buf;
+    (void) len;
+
+    return MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+/* Does the next handshake step use the private key or compute a secret ? */
+static int polar_crypto_step(mbedtls_ssl_context *ssl)
+{
+    const mbedtls_ssl_ciphersuite_t *suite;
+
+    switch (ssl->state) {
+    case MBEDTLS_SSL_SERVER_KEY_EXCHANGE:
+        suite = ssl->transform_negotiate->ciphersuite_info;
+        return (suite->key_exchange == MBEDTLS_KEY_EXCHANGE_DHE_RSA ||
+                suite->key_exchange == MBEDTLS_KEY_EXCHANGE_ECDHE_RSA ||
+                suite->key_exchange == MBEDTLS_KEY_EXCHANGE_ECDHE_ECDSA);
+    case MBEDTLS_SSL_CLIENT_KEY_EXCHANGE:
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* Buffer the whole ClientKeyExchange record before leaving the worker */
+static int polar_crypto_prefetch(mbedtls_ssl_context *ssl)
+{
+    int ret;
+    size_t len;
+    size_t hdr_len = mbedtls_ssl_hdr_len(ssl);
+
+    if (ssl->state != MBEDTLS_SSL_CLIENT_KEY_EXCHANGE) {
+        return 0;
+    }
+
+    /* It follows another handshake message in the current record */
+    if (ssl->in_hslen != 0 && ssl->in_hslen < ssl->in_msglen) {
+        return 0;
+    }
+
+    ret = mbedtls_ssl_fetch_input(ssl, hdr_len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    len = (ssl->in_len[0] << 8) | ssl->in_len[1];
+    return mbedtls_ssl_fetch_input(ssl, hdr_len + len);
+}
+
+static int polar_crypto_submit(struct polar_context_head *head)
+{
+    pthread_mutex_lock(&crypto_pool.lock);
+    if (crypto_pool.queued >= crypto_pool.max_queued) {
+        pthread_mutex_unlock(&crypto_pool.lock);
+        return -1;
+    }
+
+    head->crypto = POLAR_CRYPTO_BUSY;
+    head->crypto_ret = 0;
+    mk_list_add(&head->_crypto_head, &crypto_pool.queue);
+    crypto_pool.queued++;
+    pthread_cond_signal(&crypto_pool.cond);
+    pthread_mutex_unlock(&crypto_pool.lock);
+
+    return 0;
+}
+
+/*
+ * Crypto thread: run one step of a parked handshake. The step signs or
+ * decrypts with the key of this thread instead of the worker one, so
+ * the steps of the same worker connections run in parallel.
+ */
+static void polar_crypto_run(struct polar_crypto_thread *crypto,
+                             struct polar_context_head *head)
+{
+    char val = 1;
+    mbedtls_ssl_context *ssl = &head->context;
+    mbedtls_ssl_key_cert *own_key;
+    mbedtls_ssl_key_cert key_cert;
+    struct polar_thread_context *thctx = head->owner;
+
+    own_key = ssl->handshake->key_cert;
+    if (!own_key) {
+        own_key = ssl->conf->key_cert;
+    }
+    if (own_key) {
+        key_cert.cert = own_key->cert;
+        key_cert.key = &crypto->pkey;
+        key_cert.next = NULL;
+        ssl->handshake->key_cert = &key_cert;
+    }
+
+    pthread_setspecific(local_step, head);
+    mbedtls_ssl_set_bio(ssl, head, polar_crypto_send, polar_crypto_recv, NULL);
+
+    head->crypto_ret = mbedtls_ssl_handshake_step(ssl);
+
+    mbedtls_ssl_set_bio(ssl, &head->fd,
+                        mbedtls_net_send, mbedtls_net_recv, NULL);
+    pthread_setspecific(local_step, NULL);
+
+    /* The handshake may be over and its parameters freed */
+    if (own_key && ssl->handshake) {
+        ssl->handshake->key_cert = own_key;
+    }
+
+    pthread_mutex_lock(&thctx->done_lock);
+    mk_list_add(&head->_crypto_head, &thctx->crypto_done);
+    if (write(thctx->ch_w, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        mk_libc_error("write");
+    }
+    pthread_mutex_unlock(&thctx->done_lock);
+}
+
+static void polar_crypto_worker(void *data)
+{
+    struct polar_context_head *head;
+    struct polar_crypto_thread *crypto = data;
+
+    mk_api->worker_rename("monkey: tls");
+    pthread_setspecific(local_crypto, crypto);
+
+    while (1) {
+        pthread_mutex_lock(&crypto_pool.lock);
+        while (crypto_pool.stop == MK_FALSE &&
+               mk_list_is_empty(&crypto_pool.queue) == 0) {
+            pthread_cond_wait(&crypto_pool.cond, &crypto_pool.lock);
+        }
+        if (crypto_pool.stop == MK_TRUE) {
+            pthread_mutex_unlock(&crypto_pool.lock);
+            break;
+        }
+        head = mk_list_entry_first(&crypto_pool.queue,
+                                   struct polar_context_head, _crypto_head);
+        mk_list_del(&head->_crypto_head);
+        crypto_pool.queued--;
+        pthread_mutex_unlock(&crypto_pool.lock);
+
+        polar_crypto_run(crypto, head);
+    }
+}
+
+/* Worker side: resume the connections whose step is done */
+static int polar_crypto_done(void *data)
+{
+    char buf[64];
+    struct mk_list done;
+    struct mk_list *tmp;
+    struct mk_list *cur;
+    struct mk_event *event = data;
+    struct polar_context_head *head;
+    struct polar_thread_context *thctx;
+
+    thctx = container_of(event, struct polar_thread_context, crypto_event);
+
+    while (read(thctx->ch_r, buf, sizeof(buf)) > 0);
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&thctx->done_lock);
+    mk_list_foreach_safe(cur, tmp, &thctx->crypto_done) {
+        head = mk_list_entry(cur, struct polar_context_head, _crypto_head);
+        mk_list_del(&head->_crypto_head);
+        mk_list_add(&head->_crypto_head, &done);
+    }
+    pthread_mutex_unlock(&thctx->done_lock);
+
+    mk_list_foreach_safe(cur, tmp, &done) {
+        head = mk_list_entry(cur, struct polar_context_head, _crypto_head);
+        mk_list_del(&head->_crypto_head);
+
+        if (head->crypto == POLAR_CRYPTO_CLOSED) {
+            /* mk_tls_close() detached it already (fd = -1) */
+            head->crypto = POLAR_CRYPTO_IDLE;
+            context_unset(head->fd, &head->context);
+            continue;
+        }
+
+        head->crypto = POLAR_CRYPTO_IDLE;
+        mk_api->sched_conn_resume(head->fd);
+    }
+
+    return 0;
+}
+
+static int polar_crypto_worker_init(struct polar_thread_context *thctx)
+{
+    int fd[2];
+
+    pthread_mutex_init(&thctx->done_lock, NULL);
+    mk_list_init(&thctx->crypto_done);
+    thctx->ch_r = -1;
+    thctx->ch_w = -1;
+
+    if (crypto_pool.threads == 0) {
+        return 0;
+    }
+
+    if (pipe(fd) == -1) {
+        mk_libc_error("pipe");
+        return -1;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+    thctx->ch_r = fd[0];
+    thctx->ch_w = fd[1];
+
+    MK_EVENT_INIT(&thctx->crypto_event, thctx->ch_r, thctx, polar_crypto_done);
+    return mk_api->ev_add(mk_api->sched_loop(), thctx->ch_r,
+                          MK_EVENT_CUSTOM, MK_EVENT_READ,
+                          &thctx->crypto_event);
+}
+
+static void polar_crypto_thread_free(struct polar_crypto_thread *crypto)
+{
+    mbedtls_pk_free(&crypto->pkey);
+    mbedtls_ctr_drbg_free(&crypto->ctr_drbg);
+}
+
+/* Started by the first worker, under server_context->mutex */
+static int polar_crypto_pool_create(int threads)
+{
+    int i;
+    int ret;
+    const char *pers = "monkey-tls";
+    struct polar_crypto_thread *crypto;
+
+    crypto_pool.crypto = mk_api->mem_alloc_z(sizeof(struct polar_crypto_thread) *
+                                             threads);
+    if (!crypto_pool.crypto) {
+        return -1;
+    }
+    mk_list_init(&crypto_pool.queue);
+    crypto_pool.max_queued = threads * POLAR_CRYPTO_BACKLOG;
+
+    for (i = 0; i < threads; i++) {
+        crypto = &crypto_pool.crypto[i];
+
+        /* server_context->mutex is held, no entropy_func_safe() here */
+        mbedtls_ctr_drbg_init(&crypto->ctr_drbg);
+        mbedtls_pk_init(&crypto->pkey);
+        ret = mbedtls_ctr_drbg_seed(&crypto->ctr_drbg,
+                                    mbedtls_entropy_func,
+                                    &server_context->entropy,
+                                    (const unsigned char *) pers,
+                                    strlen(pers));
+        if (ret != 0 ||
+            polar_load_key(&crypto->pkey, &server_context->config) != 0 ||
+            mk_api->worker_spawn(polar_crypto_worker, crypto,
+                                 &crypto->tid) != 0) {
+            polar_crypto_thread_free(crypto);
+            break;
+        }
+        crypto_pool.threads++;
+    }
+
+    if (crypto_pool.threads == 0) {
+        mk_api->mem_free(crypto_pool.crypto);
+        crypto_pool.crypto = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void polar_crypto_pool_destroy()
+{
+    int i;
+
+    if (crypto_pool.threads == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&crypto_pool.lock);
+    crypto_pool.stop = MK_TRUE;
+    pthread_cond_broadcast(&crypto_pool.cond);
+    pthread_mutex_unlock(&crypto_pool.lock);
+
+    for (i = 0; i < crypto_pool.threads; i++) {
+        pthread_join(crypto_pool.crypto[i].tid, NULL);
+        polar_crypto_thread_free(&crypto_pool.crypto[i]);
+    }
+    mk_api->mem_free(crypto_pool.crypto);
+    crypto_pool.threads = 0;
+}
+
+/*
+ * Drive the handshake from the worker, the expensive steps go to the
+ * crypto threads unless they are saturated. Returns 0 once the handshake
+ * is over, POLAR_CRYPTO_PARKED if a step left or a mbedtls error.
+ */
+static int polar_handshake(struct polar_context_head *head)
+{
+    int ret;
+    mbedtls_ssl_context *ssl = &head->context;
+
+    if (head->crypto != POLAR_CRYPTO_IDLE) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    /* The record written by the last offloaded step is still pending */
+    ret = head->crypto_ret;
+    head->crypto_ret = 0;
+    if (ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return ret;
+    }
+
+    while (ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        if (polar_crypto_step(ssl) == MK_FALSE) {
+            ret = mbedtls_ssl_handshake_step(ssl);
+            if (ret != 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        ret = mbedtls_ssl_flush_output(ssl);
+        if (ret != 0) {
+            return ret;
+        }
+
+        ret = polar_crypto_prefetch(ssl);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+            return ret;
+        }
+
+        if (ret == 0 && polar_crypto_submit(head) == 0) {
+            return POLAR_CRYPTO_PARKED;
+        }
+
+        /* Saturated pool or a bogus record, run it here */
+        ret = mbedtls_ssl_handshake_step(ssl);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 int mk_tls_read(int fd, void *buf, int count)
 {
+    int ret;
     size_t avail;
     mbedtls_ssl_context *ssl = context_get(fd);
 
@@ -591,7 +1343,22 @@ int mk_tls_read(int fd, void *buf, int count)
         ssl = context_new(fd);
     }
 
-    int ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
+    /* Reads always go through mbedtls, kernel TLS only writes */
+    polar_ktls(ssl);
+
+    if (crypto_pool.threads > 0 && ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        ret = polar_handshake(container_of(ssl, struct polar_context_head,
+                                           context));
+        if (ret == POLAR_CRYPTO_PARKED) {
+            errno = EINPROGRESS;
+            return -1;
+        }
+        else if (ret != 0) {
+            return handle_return(ret);
+        }
+    }
+
+    ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
     PLUGIN_TRACE("IN: %i SSL READ: %i ; CORE COUNT: %i",
                  ssl->in_msglen,
                  ret, count);
@@ -611,6 +1378,67 @@ int mk_tls_read(int fd, void *buf, int count)
     return ret;
 }
 
+static inline uint64_t polar_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(POLAR_CLOCK, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * mbedtls_ssl_write() with dynamic record sizing. A WANT_WRITE leaves the
+ * record inside mbedtls, it expects the same length on the next call: the
+ * size only depends on rec_sent, which doesn't move until it's flushed,
+ * and the idle reset waits for it as well.
+ */
+static int polar_write(mbedtls_ssl_context *ssl,
+                       const unsigned char *buf, size_t len)
+{
+    int ret;
+    size_t chunk;
+    size_t total = 0;
+    uint64_t now;
+    struct polar_context_head *head;
+
+    if (server_context->config.dynamic_records == MK_FALSE) {
+        return mbedtls_ssl_write(ssl, buf, len);
+    }
+
+    head = container_of(ssl, struct polar_context_head, context);
+    if (head->rec_blocked == MK_FALSE) {
+        now = polar_msec();
+        if (now - head->rec_last >= (uint64_t) server_context->config.record_idle) {
+            head->rec_sent = 0;
+        }
+        head->rec_last = now;
+    }
+
+    /* Small records go out back to back, a full one per call */
+    do {
+        chunk = len - total;
+        if (head->rec_sent < POLAR_RECORD_BOOST && chunk > POLAR_RECORD_SMALL) {
+            chunk = POLAR_RECORD_SMALL;
+        }
+
+        ret = mbedtls_ssl_write(ssl, buf + total, chunk);
+        if (ret <= 0) {
+            if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                head->rec_blocked = MK_TRUE;
+            }
+            return total > 0 ? (int) total : ret;
+        }
+
+        head->rec_blocked = MK_FALSE;
+        if (head->rec_sent < POLAR_RECORD_BOOST) {
+            head->rec_sent += ret;
+        }
+        total += ret;
+    } while (total < len && chunk == POLAR_RECORD_SMALL);
+
+    return total;
+}
+
 int mk_tls_write(int fd, const void *buf, size_t count)
 {
     mbedtls_ssl_context *ssl = context_get(fd);
@@ -618,7 +1446,11 @@ int mk_tls_write(int fd, const void *buf, size_t count)
         ssl = context_new(fd);
     }
 
-    return handle_return(mbedtls_ssl_write(ssl, buf, count));
+    if (polar_ktls(ssl) == MK_TRUE) {
+        return write(fd, buf, count);
+    }
+
+    return handle_return(polar_write(ssl, buf, count));
 }
 
 int mk_tls_writev(int fd, struct mk_iov *mk_io)
@@ -635,6 +1467,10 @@ int mk_tls_writev(int fd, struct mk_iov *mk_io)
         ssl = context_new(fd);
     }
 
+    if (polar_ktls(ssl) == MK_TRUE) {
+        return mk_api->iov_send(fd, mk_io);
+    }
+
     buf = mk_api->mem_alloc(len);
     if (buf == NULL) {
         mk_err("malloc failed: %s", strerror(errno));
@@ -647,7 +1483,7 @@ int mk_tls_writev(int fd, struct mk_iov *mk_io)
     }
 
     assert(used == len);
-    ret = mbedtls_ssl_write(ssl, buf, len);
+    ret = polar_write(ssl, buf, len);
     mk_api->mem_free(buf);
 
     return handle_return(ret);
@@ -665,6 +1501,12 @@ int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
         ssl = context_new(fd);
     }
 
+#ifdef POLAR_KTLS
+    if (polar_ktls(ssl) == MK_TRUE) {
+        return sendfile(fd, file_fd, file_offset, file_count);
+    }
+#endif
+
     buf = mk_api->mem_alloc(SENDFILE_BUF_SIZE);
     if (buf == NULL) {
         return -1;
@@ -680,10 +1522,10 @@ int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
             ret = -1;
         }
         else if (remain > 0) {
-            ret = mbedtls_ssl_write(ssl, buf, used < remain ? used : remain);
+            ret = polar_write(ssl, buf, used < remain ? used : remain);
         }
         else {
-            ret = mbedtls_ssl_write(ssl, buf, used);
+            ret = polar_write(ssl, buf, used);
         }
 
         if (ret > 0) {
@@ -707,12 +1549,32 @@ int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
 
 int mk_tls_close(int fd)
 {
+    struct polar_context_head *head;
     mbedtls_ssl_context *ssl = context_get(fd);
 
     PLUGIN_TRACE("[fd %d] Closing connection", fd);
 
     if (ssl) {
+        head = container_of(ssl, struct polar_context_head, context);
+
+        /* A crypto thread owns it, it's released once the step is done */
+        if (head->crypto == POLAR_CRYPTO_BUSY) {
+            head->crypto = POLAR_CRYPTO_CLOSED;
+            head->fd = -1;
+            close(fd);
+            return 0;
+        }
+
+#ifdef POLAR_KTLS
+        if (head->ktls == POLAR_KTLS_ON) {
+            polar_ktls_close_notify(fd);
+        }
+        else {
+            mbedtls_ssl_close_notify(ssl);
+        }
+#else
         mbedtls_ssl_close_notify(ssl);
+#endif
         context_unset(fd, ssl);
     }
 
@@ -764,6 +1626,7 @@ void mk_tls_worker_init(void)
         goto error;
     }
     thctx->contexts = NULL;
+    thctx->current = NULL;
     mk_list_init(&thctx->_head);
 
 
@@ -789,8 +1652,29 @@ void mk_tls_worker_init(void)
 
     mbedtls_pk_init(&thctx->pkey);
 
+    /* The first worker starts the crypto threads */
+    if (server_context->config.handshake_threads > 0) {
+        pthread_mutex_lock(&server_context->mutex);
+        if (crypto_pool.threads == 0 &&
+            polar_crypto_pool_create(server_context->config.handshake_threads)) {
+            mk_warn("[tls] Could not start the handshake threads");
+        }
+        pthread_mutex_unlock(&server_context->mutex);
+    }
+
+    if (polar_crypto_worker_init(thctx) != 0) {
+        goto error;
+    }
+
+#ifdef POLAR_KTLS
+    if (server_context->config.kernel_tls == MK_TRUE) {
+        mbedtls_ssl_conf_export_keys_cb(&thctx->conf,
+                                        polar_ktls_export_keys, thctx);
+    }
+#endif
+
     PLUGIN_TRACE("[tls] Load RSA key.");
-    if (polar_load_key(thctx, &server_context->config)) {
+    if (polar_load_key(&thctx->pkey, &server_context->config)) {
         goto error;
     }
 
@@ -808,6 +1692,8 @@ int mk_tls_plugin_exit()
     struct mk_list *cur, *tmp;
     struct polar_thread_context *thctx;
 
+    polar_crypto_pool_destroy();
+
     mbedtls_x509_crt_free(&server_context->cert);
     mbedtls_x509_crt_free(&server_context->ca_cert);
     mbedtls_dhm_free(&server_context->dhm);